@@ -21,81 +21,150 @@
 
 #include <libopencm3/usb/usbd.h>
 #include <libopencm3/usb/cdc.h>
+#include <libopencm3/cm3/cortex.h>
 
 #include "composite_usb_conf.h"
+#include "usb_pma.h"
 #include "cdc.h"
 
 #include "console.h"
+#include "capture.h"
+#include "profile.h"
+#include "ramfunc.h"
+#include "selftest.h"
 #include "tick.h"
 
 _Static_assert((CONSOLE_TX_BUFFER_SIZE >= USB_CDC_MAX_PACKET_SIZE),
                "TX buffer too small");
 
+/* Only the first port has a break timer */
+#if CONSOLE_BREAK_AVAILABLE
+#define CDC_ACM_CAPABILITIES(port) \
+    ((port) == 0 ? (CDC_ACM_CAP_LINE | CDC_ACM_CAP_SEND_BREAK) : CDC_ACM_CAP_LINE)
+#else
+#define CDC_ACM_CAPABILITIES(port) CDC_ACM_CAP_LINE
+#endif
+
 /* Descriptors */
-const struct cdc_acm_functional_descriptors cdc_acm_functional_descriptors = {
-    .header = {
-        .bFunctionLength = sizeof(struct usb_cdc_header_descriptor),
-        .bDescriptorType = CS_INTERFACE,
-        .bDescriptorSubtype = USB_CDC_TYPE_HEADER,
-        .bcdCDC = 0x0110,
-    },
-    .call_mgmt = {
-        .bFunctionLength =
-        sizeof(struct usb_cdc_call_management_descriptor),
-        .bDescriptorType = CS_INTERFACE,
-        .bDescriptorSubtype = USB_CDC_TYPE_CALL_MANAGEMENT,
-        .bmCapabilities = 0,
-        .bDataInterface = INTF_CDC_DATA,
-    },
-    .acm = {
-        .bFunctionLength = sizeof(struct usb_cdc_acm_descriptor),
-        .bDescriptorType = CS_INTERFACE,
-        .bDescriptorSubtype = USB_CDC_TYPE_ACM,
-        .bmCapabilities = (1 << 1),
-    },
-    .cdc_union = {
-        .bFunctionLength = sizeof(struct usb_cdc_union_descriptor),
-        .bDescriptorType = CS_INTERFACE,
-        .bDescriptorSubtype = USB_CDC_TYPE_UNION,
-        .bControlInterface = INTF_CDC_COMM,
-        .bSubordinateInterface0 = INTF_CDC_DATA,
-    }
+#define CDC_ACM_FUNCTIONAL_DESCRIPTORS(port) {                          \
+    .header = {                                                         \
+        .bFunctionLength = sizeof(struct usb_cdc_header_descriptor),    \
+        .bDescriptorType = CS_INTERFACE,                                \
+        .bDescriptorSubtype = USB_CDC_TYPE_HEADER,                      \
+        .bcdCDC = 0x0110,                                               \
+    },                                                                  \
+    .call_mgmt = {                                                      \
+        .bFunctionLength =                                              \
+        sizeof(struct usb_cdc_call_management_descriptor),              \
+        .bDescriptorType = CS_INTERFACE,                                \
+        .bDescriptorSubtype = USB_CDC_TYPE_CALL_MANAGEMENT,             \
+        .bmCapabilities = 0,                                            \
+        .bDataInterface = INTF_CDC_DATA(port),                          \
+    },                                                                  \
+    .acm = {                                                            \
+        .bFunctionLength = sizeof(struct usb_cdc_acm_descriptor),       \
+        .bDescriptorType = CS_INTERFACE,                                \
+        .bDescriptorSubtype = USB_CDC_TYPE_ACM,                         \
+        /* Line coding, control line state and SERIAL_STATE */          \
+        .bmCapabilities = CDC_ACM_CAPABILITIES(port),                   \
+    },                                                                  \
+    .cdc_union = {                                                      \
+        .bFunctionLength = sizeof(struct usb_cdc_union_descriptor),     \
+        .bDescriptorType = CS_INTERFACE,                                \
+        .bDescriptorSubtype = USB_CDC_TYPE_UNION,                       \
+        .bControlInterface = INTF_CDC_COMM(port),                       \
+        .bSubordinateInterface0 = INTF_CDC_DATA(port),                  \
+    }                                                                   \
+},
+
+const struct cdc_acm_functional_descriptors cdc_acm_functional_descriptors[CDC_NUM_PORTS] = {
+    CDC_FOR_EACH_PORT(CDC_ACM_FUNCTIONAL_DESCRIPTORS)
 };
 
 /* User callbacks */
-static HostOutFunction cdc_rx_callback = NULL;
+static CdcRxReserveFunction cdc_rx_reserve_callback = NULL;
+static CdcRxCommitFunction cdc_rx_commit_callback = NULL;
 static SetControlLineStateFunction cdc_set_control_line_state_callback = NULL;
 static SetLineCodingFunction cdc_set_line_coding_callback = NULL;
 static GetLineCodingFunction cdc_get_line_coding_callback = NULL;
+static SendBreakFunction cdc_send_break_callback = NULL;
 
 static usbd_device* cdc_usbd_dev;
 
+/* Endpoint state for each port */
+struct cdc_port {
+    /* The data OUT endpoint is NAKing until cdc_rx_resume() */
+    bool rx_stalled;
+    /* A SERIAL_STATE notification hasn't been collected yet */
+    bool notify_busy;
+};
+
+static struct cdc_port cdc_ports[CDC_NUM_PORTS];
+
 static void cdc_set_config(usbd_device *usbd_dev, uint16_t wValue);
 
 void cdc_setup(usbd_device* usbd_dev,
-               HostOutFunction cdc_rx_cb,
+               CdcRxReserveFunction cdc_rx_reserve_cb,
+               CdcRxCommitFunction cdc_rx_commit_cb,
                SetControlLineStateFunction set_control_line_state_cb,
                SetLineCodingFunction set_line_coding_cb,
-               GetLineCodingFunction get_line_coding_cb) {
+               GetLineCodingFunction get_line_coding_cb,
+               SendBreakFunction send_break_cb) {
     cdc_usbd_dev = usbd_dev;
-    cdc_rx_callback = cdc_rx_cb;
+    cdc_rx_reserve_callback = cdc_rx_reserve_cb;
+    cdc_rx_commit_callback = cdc_rx_commit_cb;
     cdc_set_control_line_state_callback = set_control_line_state_cb,
     cdc_set_line_coding_callback = set_line_coding_cb;
     cdc_get_line_coding_callback = get_line_coding_cb;
+    cdc_send_break_callback = send_break_cb;
 
     cmp_usb_register_set_config_callback(cdc_set_config);
 }
 
 /* Generic CDC-ACM functionality */
 
-bool cdc_send_data(const uint8_t* data, size_t len) {
+/*
+ * Queue one packet, which may be zero-length, on the port's data IN
+ * endpoint. The caller must ensure that a buffer is free
+ * (CDC_DATA_IN_BUFFERS packets in flight at most), since a busy
+ * single-buffered endpoint can't be distinguished from a successful ZLP.
+ */
+RAMFUNC bool cdc_send_data(uint8_t port, const uint8_t* data, size_t len) {
     if (!cmp_usb_configured()) {
         return false;
     }
-    uint16_t sent = usbd_ep_write_packet(cdc_usbd_dev, ENDP_CDC_DATA_IN,
+#if USB_DOUBLE_BUFFERED_BULK
+    return usb_dbl_ep_write_packet(ENDP_CDC_DATA_IN(port), (const void*)data,
+                                   (uint16_t)len);
+#else
+    uint16_t sent = usbd_ep_write_packet(cdc_usbd_dev, ENDP_CDC_DATA_IN(port),
                                          (const void*)data,
                                          (uint16_t)len);
-    return (sent != 0);
+    return (sent == len);
+#endif
+}
+
+/*
+ * As cdc_send_data(), taking the first len bytes of a ring buffer's
+ * spans. With double-buffering, they are copied straight into packet
+ * memory.
+ */
+RAMFUNC bool cdc_send_data_spans(uint8_t port, const struct ring_span spans[2], size_t len) {
+    uint16_t len0 = (len < spans[0].len) ? len : spans[0].len;
+    uint16_t len1 = len - len0;
+#if USB_DOUBLE_BUFFERED_BULK
+    if (!cmp_usb_configured()) {
+        return false;
+    }
+    return usb_dbl_ep_write_packet_split(ENDP_CDC_DATA_IN(port),
+                                         spans[0].data, len0,
+                                         spans[1].data, len1);
+#else
+    uint8_t buf[USB_CDC_MAX_PACKET_SIZE];
+    ring_copy(buf, spans[0].data, len0);
+    ring_copy(&buf[len0], spans[1].data, len1);
+    return cdc_send_data(port, buf, len0 + len1);
+#endif
 }
 
 static int cdc_control_class_request(usbd_device *usbd_dev,
@@ -105,7 +174,8 @@ static int cdc_control_class_request(usbd_device *usbd_dev,
     (void)complete;
     (void)usbd_dev;
 
-    if (req->wIndex != INTF_CDC_DATA && req->wIndex != INTF_CDC_COMM) {
+    uint8_t port = CDC_INTF_PORT(req->wIndex);
+    if (port >= CDC_NUM_PORTS) {
         return USBD_REQ_NEXT_CALLBACK;
     }
     int status = USBD_REQ_NOTSUPP;
@@ -113,16 +183,15 @@ static int cdc_control_class_request(usbd_device *usbd_dev,
     switch (req->bRequest) {
         case USB_CDC_REQ_SET_CONTROL_LINE_STATE: {
             /*
-             * This Linux cdc_acm driver requires this to be implemented
-             * even though it's optional in the CDC spec, and we don't
-             * advertise it in the ACM functional descriptor.
+             * The Linux cdc_acm driver requires this to be implemented
+             * even though nothing here uses DTR or RTS.
              */
 
             bool dtr = (req->wValue & (1 << 0)) != 0;
             bool rts = (req->wValue & (1 << 1)) != 0;
 
             if (cdc_set_control_line_state_callback) {
-                cdc_set_control_line_state_callback(dtr, rts);
+                cdc_set_control_line_state_callback(port, dtr, rts);
             }
 
             status = USBD_REQ_HANDLED;
@@ -135,7 +204,7 @@ static int cdc_control_class_request(usbd_device *usbd_dev,
                 status = USBD_REQ_NOTSUPP;
             } else if (cdc_set_line_coding_callback) {
                 coding = (const struct usb_cdc_line_coding *)(*buf);
-                if (cdc_set_line_coding_callback(coding)) {
+                if (cdc_set_line_coding_callback(port, coding)) {
                     status = USBD_REQ_HANDLED;
                 } else {
                     status = USBD_REQ_NOTSUPP;
@@ -152,7 +221,7 @@ static int cdc_control_class_request(usbd_device *usbd_dev,
             coding = (struct usb_cdc_line_coding*)(*buf);
 
             if (cdc_get_line_coding_callback) {
-                if (cdc_get_line_coding_callback(coding)) {
+                if (cdc_get_line_coding_callback(port, coding)) {
                     *len = sizeof(struct usb_cdc_line_coding);
                     status = USBD_REQ_HANDLED;
                 } else {
@@ -163,6 +232,14 @@ static int cdc_control_class_request(usbd_device *usbd_dev,
             }
             break;
         }
+        case USB_CDC_REQ_SEND_BREAK: {
+            if (cdc_send_break_callback && cdc_send_break_callback(port, req->wValue)) {
+                status = USBD_REQ_HANDLED;
+            } else {
+                status = USBD_REQ_NOTSUPP;
+            }
+            break;
+        }
         default: {
             status = USBD_REQ_NOTSUPP;
             break;
@@ -172,56 +249,173 @@ static int cdc_control_class_request(usbd_device *usbd_dev,
     return status;
 }
 
-/* CDC-ACM RX flow control */
-static bool cdc_rx_stalled = false;
-static void cdc_set_nak(void) {
-    if (!cdc_rx_stalled) {
-        usbd_ep_nak_set(cdc_usbd_dev, ENDP_CDC_DATA_OUT, true);
-        cdc_rx_stalled = true;
+/*
+ * SERIAL_STATE notifications. One notification per port is in flight at
+ * most; the endpoint callback marks it done once the host has polled it.
+ */
+static void cdc_comm_in(usbd_device *usbd_dev, uint8_t ep) {
+    (void)usbd_dev;
+    cdc_ports[CDC_ENDP_PORT(ep)].notify_busy = false;
+}
+
+/*
+ * Send the UART state bitmap to the host. Returns false if not
+ * configured or the previous notification hasn't been collected yet.
+ */
+bool cdc_notify_serial_state(uint8_t port, uint16_t state) {
+    if (!cmp_usb_configured() || cdc_ports[port].notify_busy) {
+        return false;
+    }
+
+    struct cdc_serial_state_notification notification = {
+        .header = {
+            .bmRequestType = USB_REQ_TYPE_IN | USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+            .bNotification = USB_CDC_NOTIFY_SERIAL_STATE,
+            .wValue = 0,
+            .wIndex = INTF_CDC_COMM(port),
+            .wLength = sizeof(notification.bmUartState),
+        },
+        .bmUartState = state,
+    };
+
+    uint16_t sent = usbd_ep_write_packet(cdc_usbd_dev, ENDP_CDC_COMM_IN(port),
+                                         (const void*)&notification,
+                                         sizeof(notification));
+    if (sent != sizeof(notification)) {
+        return false;
+    }
+
+    cdc_ports[port].notify_busy = true;
+    return true;
+}
+
+/*
+ * CDC-ACM RX flow control. The data OUT endpoint is left open while the
+ * receiver has room for the packet being processed and the next one.
+ * Otherwise it's closed until the receiver either accepts more packets
+ * or calls cdc_rx_resume() once it has made room.
+ *
+ * A double-buffered endpoint NAKs by itself after each packet until the
+ * application releases a buffer, so only the single-buffered endpoint
+ * needs an explicit NAK.
+ */
+#define CDC_RX_OPEN_SPACE(port) (2 * CDC_PACKET_SIZE(port))
+
+static RAMFUNC void cdc_set_nak(uint8_t port) {
+    if (!cdc_ports[port].rx_stalled) {
+#if !USB_DOUBLE_BUFFERED_BULK
+        usbd_ep_nak_set(cdc_usbd_dev, ENDP_CDC_DATA_OUT(port), true);
+#endif
+        cdc_ports[port].rx_stalled = true;
     }
 }
 
-static void cdc_clear_nak(void) {
-    if (cdc_rx_stalled) {
-        usbd_ep_nak_set(cdc_usbd_dev, ENDP_CDC_DATA_OUT, false);
-        cdc_rx_stalled = false;
+static RAMFUNC void cdc_clear_nak(uint8_t port) {
+    if (cdc_ports[port].rx_stalled) {
+#if USB_DOUBLE_BUFFERED_BULK
+        usb_dbl_ep_release_rx(ENDP_CDC_DATA_OUT(port));
+#else
+        usbd_ep_nak_set(cdc_usbd_dev, ENDP_CDC_DATA_OUT(port), false);
+#endif
+        cdc_ports[port].rx_stalled = false;
     }
 }
 
-/* Receive data from the host */
-static void cdc_bulk_data_out(usbd_device *usbd_dev, uint8_t ep) {
-    // Force NAK to prevent the USB controller from accepting a second
-    // packet before we've processed this one to decide if have space
-    // to accept more packets.
-    cdc_set_nak();
+/* Re-open the data OUT endpoint; may be called from interrupt context */
+RAMFUNC void cdc_rx_resume(uint8_t port) {
+    uint32_t masked = cm_mask_interrupts(1);
+    cdc_clear_nak(port);
+    cm_mask_interrupts(masked);
+}
+
+/* Receive data from the host, straight into the receiver's buffer */
+static RAMFUNC void cdc_bulk_data_out(usbd_device *usbd_dev, uint8_t ep) {
+    PROFILE_BEGIN(PROFILE_BULK_OUT);
+    uint8_t port = CDC_ENDP_PORT(ep);
+    struct ring_span spans[2] = {{NULL, 0}, {NULL, 0}};
+    size_t space = 0;
+    if (cdc_rx_reserve_callback != NULL) {
+        space = cdc_rx_reserve_callback(port, spans);
+    }
+
+    bool keep_open = (space >= CDC_RX_OPEN_SPACE(port));
 
+    // Hold off cdc_rx_resume() until the packet has been taken out of
+    // the endpoint buffer
+    uint32_t masked = cm_mask_interrupts(1);
+    if (!keep_open) {
+        cdc_set_nak(port);
+    }
+#if USB_DOUBLE_BUFFERED_BULK
+    (void)usbd_dev;
+    uint16_t len = usb_dbl_ep_read_packet_split(ep,
+                                                spans[0].data, spans[0].len,
+                                                spans[1].data, spans[1].len,
+                                                keep_open);
+#else
     uint8_t buf[USB_CDC_MAX_PACKET_SIZE];
     uint16_t len = usbd_ep_read_packet(usbd_dev, ep, (void*)buf, sizeof(buf));
+    if (len > space) {
+        len = space;
+    }
+    uint16_t len0 = (len < spans[0].len) ? len : spans[0].len;
+    ring_copy(spans[0].data, buf, len0);
+    ring_copy(spans[1].data, &buf[len0], len - len0);
+#endif
+    cm_mask_interrupts(masked);
+
     bool accept_more_packets = true;
-    if (len > 0 && (cdc_rx_callback != NULL)) {
-        accept_more_packets = cdc_rx_callback(buf, len);
+    if (len > 0 && (cdc_rx_commit_callback != NULL)) {
+        accept_more_packets = cdc_rx_commit_callback(port, len);
     }
 
     // Handle flow control
-    if (accept_more_packets) {
-        cdc_clear_nak();
+    if (!keep_open && accept_more_packets) {
+        cdc_rx_resume(port);
     }
+    PROFILE_END(PROFILE_BULK_OUT);
 }
 
 static void cdc_bulk_data_in(usbd_device *usbd_dev, uint8_t ep);
-static void cdc_start_in_transfer(void);
+static void cdc_start_in_transfers(void);
+static void cdc_uart_in_reset(uint8_t port);
+static void cdc_uart_serial_state_reset(uint8_t port);
+static void cdc_uart_update_serial_state(void);
+static int cdc_uart_control_vendor_request(usbd_device *usbd_dev,
+                                           struct usb_setup_data *req,
+                                           uint8_t **buf, uint16_t *len,
+                                           usbd_control_complete_callback* complete);
 
 static void cdc_set_config(usbd_device *usbd_dev, uint16_t wValue) {
     (void)wValue;
 
-    usbd_ep_setup(usbd_dev, ENDP_CDC_DATA_OUT, USB_ENDPOINT_ATTR_BULK, 64,
-                  cdc_bulk_data_out);
-    usbd_ep_setup(usbd_dev, ENDP_CDC_DATA_IN, USB_ENDPOINT_ATTR_BULK, 64, cdc_bulk_data_in);
-    usbd_ep_setup(usbd_dev, ENDP_CDC_COMM_IN, USB_ENDPOINT_ATTR_INTERRUPT, 16, NULL);
+    for (uint8_t port = 0; port < CDC_NUM_PORTS; port++) {
+#if USB_DOUBLE_BUFFERED_BULK
+        usb_dbl_ep_setup(usbd_dev, ENDP_CDC_DATA_OUT(port), CDC_PACKET_SIZE(port),
+                         cdc_bulk_data_out);
+        usb_dbl_ep_setup(usbd_dev, ENDP_CDC_DATA_IN(port), CDC_PACKET_SIZE(port),
+                         cdc_bulk_data_in);
+#else
+        usbd_ep_setup(usbd_dev, ENDP_CDC_DATA_OUT(port), USB_ENDPOINT_ATTR_BULK,
+                      CDC_PACKET_SIZE(port), cdc_bulk_data_out);
+        usbd_ep_setup(usbd_dev, ENDP_CDC_DATA_IN(port), USB_ENDPOINT_ATTR_BULK,
+                      CDC_PACKET_SIZE(port), cdc_bulk_data_in);
+#endif
+        usbd_ep_setup(usbd_dev, ENDP_CDC_COMM_IN(port), USB_ENDPOINT_ATTR_INTERRUPT, 16,
+                      cdc_comm_in);
+        cdc_ports[port].rx_stalled = false;
+        cdc_ports[port].notify_busy = false;
+        cdc_uart_in_reset(port);
+        cdc_uart_serial_state_reset(port);
 
-    cmp_usb_register_control_class_callback(INTF_CDC_DATA, cdc_control_class_request);
-    cmp_usb_register_control_class_callback(INTF_CDC_COMM, cdc_control_class_request);
-    cmp_usb_register_sof_callback(cdc_start_in_transfer);
+        cmp_usb_register_control_class_callback(INTF_CDC_DATA(port), cdc_control_class_request);
+        cmp_usb_register_control_class_callback(INTF_CDC_COMM(port), cdc_control_class_request);
+        cmp_usb_register_control_vendor_callback(INTF_CDC_COMM(port),
+                                                 cdc_uart_control_vendor_request);
+    }
+
+    cmp_usb_register_sof_callback(cdc_start_in_transfers);
+    cmp_usb_register_sof_callback(cdc_uart_update_serial_state);
 }
 
 /* CDC-ACM USB UART bridge functionality */
@@ -230,22 +424,75 @@ static void cdc_set_config(usbd_device *usbd_dev, uint16_t wValue) {
 static GenericCallback cdc_uart_rx_callback = NULL;
 static GenericCallback cdc_uart_tx_callback = NULL;
 
-static struct usb_cdc_line_coding current_line_coding = {
-    .dwDTERate = DEFAULT_BAUDRATE,
-    .bCharFormat = USB_CDC_1_STOP_BITS,
-    .bParityType = USB_CDC_NO_PARITY,
-    .bDataBits = 8
+/* Bridge state for each port */
+struct cdc_uart_port {
+    struct console* console;
+    struct usb_cdc_line_coding line_coding;
+
+    /* Bytes of the next IN packet waiting in the console RX ring */
+    uint16_t packet_len;
+    /* Latency timer length in milliseconds, and when it started in microseconds */
+    uint32_t packet_timeout;
+    uint32_t packet_timestamp;
+    bool need_zlp;
+    /* The console flagged the end of a burst; send what's queued now */
+    bool flush;
+    uint8_t in_queued;
+
+    /*
+     * Line state as last reported to the host, and line events that
+     * haven't been reported yet because a notification was still in
+     * flight.
+     */
+    uint16_t serial_state;
+    uint16_t serial_events;
+
+    /* The console is lent to another interface, see cdc_uart_app_claim() */
+    bool claimed;
+
+    /* Timestamped capture of the RX stream, see capture.h */
+    struct capture capture;
+};
+
+#define CDC_UART_PORT_INIT(port) {               \
+    .line_coding = {                             \
+        .dwDTERate = DEFAULT_BAUDRATE,           \
+        .bCharFormat = USB_CDC_1_STOP_BITS,      \
+        .bParityType = USB_CDC_NO_PARITY,        \
+        .bDataBits = 8                           \
+    },                                           \
+    .packet_timeout = CDC_LATENCY_TIMER_DEFAULT, \
+},
+
+static struct cdc_uart_port cdc_uart_ports[CDC_NUM_PORTS] = {
+    CDC_FOR_EACH_PORT(CDC_UART_PORT_INIT)
 };
 
 void cdc_uart_app_reset(void);
+static void cdc_uart_port_reset(uint8_t port);
+
+/* Time on the wire for one character with the port's line coding */
+static uint32_t cdc_uart_frame_ns(const struct usb_cdc_line_coding* line_coding) {
+    uint32_t bits = 1 + line_coding->bDataBits
+                    + (line_coding->bParityType != USB_CDC_NO_PARITY ? 1 : 0)
+                    + (line_coding->bCharFormat == USB_CDC_2_STOP_BITS ? 2 : 1);
+    return (uint32_t)(((uint64_t)bits * 1000000000U) / line_coding->dwDTERate);
+}
+
+static bool cdc_uart_set_line_coding(uint8_t port,
+                                     const struct usb_cdc_line_coding* line_coding) {
+    struct cdc_uart_port* uart = &cdc_uart_ports[port];
+    if (selftest_running(uart->console)) {
+        // The self-test sets the rate itself until it finishes
+        return false;
+    }
 
-static bool cdc_uart_set_line_coding(const struct usb_cdc_line_coding* line_coding) {
     uint32_t databits;
     if (line_coding->bDataBits == 7 || line_coding->bDataBits == 8) {
         databits = line_coding->bDataBits;
     } else if (line_coding->bDataBits == 0) {
         // Work-around for PuTTY on Windows
-        databits = current_line_coding.bDataBits;
+        databits = uart->line_coding.bDataBits;
     } else {
         return false;
     }
@@ -277,43 +524,145 @@ static bool cdc_uart_set_line_coding(const struct usb_cdc_line_coding* line_codi
             return false;
     }
 
+    // Refuse rates the USARTs can't produce accurately enough
+    struct console_baud_plan plan;
+    if (!console_plan_baudrate(uart->console, line_coding->dwDTERate, &plan)) {
+        return false;
+    }
+
     // Reset the output packet buffer
-    cdc_uart_app_reset();
+    cdc_uart_port_reset(port);
 
-    console_reconfigure(line_coding->dwDTERate, databits, stopbits, parity);
-    memcpy(&current_line_coding, (const void*)line_coding, sizeof(current_line_coding));
+    console_reconfigure(uart->console, line_coding->dwDTERate, databits, stopbits, parity);
+    memcpy(&uart->line_coding, (const void*)line_coding, sizeof(uart->line_coding));
 
     if (line_coding->bDataBits == 0) {
-        current_line_coding.bDataBits = databits;
+        uart->line_coding.bDataBits = databits;
     }
+
+    // Report the rate actually achieved through GET_LINE_CODING
+    uart->line_coding.dwDTERate = console_baud_plan_rate(&plan);
+    capture_set_frame_time(&uart->capture, cdc_uart_frame_ns(&uart->line_coding));
     return true;
 }
 
-static bool cdc_uart_get_line_coding(struct usb_cdc_line_coding* line_coding) {
-    memcpy(line_coding, (const void*)&current_line_coding, sizeof(current_line_coding));
+static bool cdc_uart_get_line_coding(uint8_t port, struct usb_cdc_line_coding* line_coding) {
+    memcpy(line_coding, (const void*)&cdc_uart_ports[port].line_coding,
+           sizeof(cdc_uart_ports[port].line_coding));
     return true;
 }
 
-static bool cdc_uart_on_host_tx(uint8_t* data, uint16_t len) {
-    console_send_buffered(data, (size_t)len);
+/* For other interfaces that configure the port, so both report the same */
+bool cdc_uart_app_set_line_coding(uint8_t port, const struct usb_cdc_line_coding* line_coding) {
+    return cdc_uart_set_line_coding(port, line_coding);
+}
+
+bool cdc_uart_app_get_line_coding(uint8_t port, struct usb_cdc_line_coding* line_coding) {
+    return cdc_uart_get_line_coding(port, line_coding);
+}
+
+static bool cdc_uart_send_break(uint8_t port, uint16_t duration_ms) {
+    return console_send_break(cdc_uart_ports[port].console, duration_ms);
+}
+
+/*
+ * Once a port's TX ring fills past the high watermark, its OUT endpoint
+ * stays closed until the TX drain path empties it below the low
+ * watermark.
+ */
+#define CDC_UART_TX_HIGH_WATERMARK(size, port) ((size) - CDC_RX_OPEN_SPACE(port))
+#define CDC_UART_TX_LOW_WATERMARK(size)        ((size) / 2)
+
+_Static_assert((CDC_UART_TX_LOW_WATERMARK(CONSOLE_TX_BUFFER_SIZE)
+                <= CDC_UART_TX_HIGH_WATERMARK(CONSOLE_TX_BUFFER_SIZE, 0)),
+               "TX buffer too small for OUT flow control watermarks");
+#if CDC_NUM_PORTS > 1
+_Static_assert((CDC_UART_TX_LOW_WATERMARK(CONSOLE_PORT1_TX_BUFFER_SIZE)
+                <= CDC_UART_TX_HIGH_WATERMARK(CONSOLE_PORT1_TX_BUFFER_SIZE, 1)),
+               "Port 1 TX buffer too small for OUT flow control watermarks");
+#endif
+#if CDC_NUM_PORTS > 2
+_Static_assert((CDC_UART_TX_LOW_WATERMARK(CONSOLE_PORT2_TX_BUFFER_SIZE)
+                <= CDC_UART_TX_HIGH_WATERMARK(CONSOLE_PORT2_TX_BUFFER_SIZE, 2)),
+               "Port 2 TX buffer too small for OUT flow control watermarks");
+#endif
+
+static RAMFUNC size_t cdc_uart_host_tx_reserve(uint8_t port, struct ring_span spans[2]) {
+    if (cdc_uart_ports[port].claimed) {
+        /* Discard the packet but keep the endpoint open */
+        return 0;
+    }
+    return console_send_reserve(cdc_uart_ports[port].console, spans);
+}
+
+/* Called from the console TX drain path once the ring has emptied enough */
+static RAMFUNC void cdc_uart_on_tx_space(struct console* con) {
+    cdc_rx_resume(console_port_index(con));
+}
+
+static RAMFUNC bool cdc_uart_on_host_tx(uint8_t port, size_t len) {
+    struct console* con = cdc_uart_ports[port].console;
+    console_send_commit(con, len);
     if (cdc_uart_rx_callback) {
         cdc_uart_rx_callback();
     }
 
-    return (console_send_buffer_space() >= USB_CDC_MAX_PACKET_SIZE);
+    size_t size = console_send_buffer_size(con);
+    if (console_send_buffer_space(con) >= size - CDC_UART_TX_HIGH_WATERMARK(size, port)) {
+        return true;
+    }
+
+    return console_notify_tx_space(con, size - CDC_UART_TX_LOW_WATERMARK(size),
+                                   cdc_uart_on_tx_space);
 }
 
-static uint16_t packet_len = 0;
-static uint8_t packet_buffer[USB_CDC_MAX_PACKET_SIZE];
-static uint32_t packet_timeout = 0;
-static uint32_t packet_timestamp = 0;
-static bool need_zlp = false;
+static void cdc_uart_port_reset(uint8_t port) {
+    cdc_uart_ports[port].packet_len = 0;
+    cdc_uart_ports[port].packet_timestamp = get_micros();
+    cdc_rx_resume(port);
+}
+
+/* The port lent to the self-test, or CDC_NUM_PORTS if none */
+static uint8_t cdc_selftest_port = CDC_NUM_PORTS;
+
+/* Hand a port back from the self-test, with the host's line coding */
+static void cdc_uart_selftest_end(void) {
+    uint8_t port = cdc_selftest_port;
+    cdc_selftest_port = CDC_NUM_PORTS;
+
+    struct usb_cdc_line_coding line_coding;
+    memcpy(&line_coding, &cdc_uart_ports[port].line_coding, sizeof(line_coding));
+    cdc_uart_set_line_coding(port, &line_coding);
+    cdc_uart_app_claim(port, false);
+}
 
 void cdc_uart_app_reset(void) {
-    packet_len = 0;
-    packet_timestamp = get_ticks();
-    need_zlp = false;
-    cdc_clear_nak();
+    if (cdc_selftest_port < CDC_NUM_PORTS) {
+        selftest_stop();
+        cdc_uart_selftest_end();
+    }
+    for (uint8_t port = 0; port < CDC_NUM_PORTS; port++) {
+        capture_stop(&cdc_uart_ports[port].capture);
+        cdc_uart_port_reset(port);
+    }
+}
+
+/* Switch a port's IN stream between raw data and the capture modes */
+static void cdc_uart_set_capture(uint8_t port, uint8_t mode) {
+    struct cdc_uart_port* uart = &cdc_uart_ports[port];
+    capture_stop(&uart->capture);
+    if (mode != CAPTURE_OFF) {
+        capture_start(&uart->capture, uart->console, mode,
+                      cdc_uart_frame_ns(&uart->line_coding));
+    }
+    uart->packet_len = 0;
+}
+
+/* Reset the IN transfer state when the endpoint is (re)configured */
+static void cdc_uart_in_reset(uint8_t port) {
+    cdc_uart_ports[port].in_queued = 0;
+    cdc_uart_ports[port].need_zlp = false;
+    cdc_uart_ports[port].flush = false;
 }
 
 void cdc_uart_app_setup(usbd_device* usbd_dev,
@@ -322,53 +671,273 @@ void cdc_uart_app_setup(usbd_device* usbd_dev,
     cdc_uart_tx_callback = cdc_tx_cb;
     cdc_uart_rx_callback = cdc_rx_cb;
 
+    for (uint8_t port = 0; port < CDC_NUM_PORTS; port++) {
+        cdc_uart_ports[port].console = console_port(port);
+    }
+
     cdc_setup(usbd_dev,
+              &cdc_uart_host_tx_reserve,
               &cdc_uart_on_host_tx,
               NULL,
-              &cdc_uart_set_line_coding, &cdc_uart_get_line_coding);
+              &cdc_uart_set_line_coding, &cdc_uart_get_line_coding,
+              &cdc_uart_send_break);
     cmp_usb_register_reset_callback(cdc_uart_app_reset);
 }
 
-void cdc_uart_app_set_timeout(uint32_t timeout_ms) {
-    packet_timeout = timeout_ms;
+void cdc_uart_app_set_timeout(uint8_t port, uint32_t timeout_ms) {
+    cdc_uart_ports[port].packet_timeout = timeout_ms;
 }
 
-static bool transfer_complete = false;
-static void cdc_start_in_transfer(void) {
-    transfer_complete = false;
-    if (packet_len < USB_CDC_MAX_PACKET_SIZE) {
-        uint16_t max_bytes = (USB_CDC_MAX_PACKET_SIZE- packet_len);
-        packet_len += console_recv_buffered(&packet_buffer[packet_len], max_bytes);
-    }
+/*
+ * Lend a port's console to another interface, or take it back. While
+ * claimed, received data is left in the console for the other interface
+ * and data the host writes to the CDC port is discarded.
+ */
+void cdc_uart_app_claim(uint8_t port, bool claimed) {
+    cdc_uart_ports[port].claimed = claimed;
+    cdc_uart_ports[port].packet_len = 0;
+    cdc_rx_resume(port);
+}
+
+static int cdc_uart_control_vendor_request(usbd_device *usbd_dev,
+                                           struct usb_setup_data *req,
+                                           uint8_t **buf, uint16_t *len,
+                                           usbd_control_complete_callback* complete) {
+    (void)complete;
+    (void)usbd_dev;
+
+    uint8_t port = CDC_INTF_PORT(req->wIndex);
+    struct cdc_uart_port* uart = &cdc_uart_ports[port];
+    int status = USBD_REQ_NOTSUPP;
 
-    if (packet_len > 0) {
-        if (cdc_send_data(packet_buffer, packet_len)) {
-            transfer_complete = (packet_len < USB_CDC_MAX_PACKET_SIZE);
-            packet_len = console_recv_buffered(packet_buffer, USB_CDC_MAX_PACKET_SIZE);
-            if (cdc_uart_tx_callback) {
-                cdc_uart_tx_callback();
+    switch (req->bRequest) {
+        case CDC_VENDOR_REQ_SET_LATENCY_TIMER: {
+            /* wValue holds the new timeout in milliseconds */
+            cdc_uart_app_set_timeout(port, req->wValue);
+            status = USBD_REQ_HANDLED;
+            break;
+        }
+        case CDC_VENDOR_REQ_SET_FLOW_CONTROL: {
+            bool enable = (req->wValue == CDC_FLOW_CONTROL_RTS_CTS);
+            if (req->wValue != CDC_FLOW_CONTROL_NONE && !enable) {
+                status = USBD_REQ_NOTSUPP;
+            } else if (console_set_flow_control(uart->console, enable)) {
+                status = USBD_REQ_HANDLED;
+            } else {
+                status = USBD_REQ_NOTSUPP;
             }
+            break;
+        }
+        case CDC_VENDOR_REQ_SET_CAPTURE: {
+            if (req->wValue > CAPTURE_TEXT) {
+                status = USBD_REQ_NOTSUPP;
+            } else {
+                cdc_uart_set_capture(port, (uint8_t)req->wValue);
+                status = USBD_REQ_HANDLED;
+            }
+            break;
+        }
+        case CDC_VENDOR_REQ_GET_LATENCY_TIMER: {
+            if (*len < 2) {
+                status = USBD_REQ_NOTSUPP;
+            } else {
+                uint16_t timeout = (uart->packet_timeout > 0xFFFF) ? 0xFFFF : uart->packet_timeout;
+                (*buf)[0] = timeout & 0xFF;
+                (*buf)[1] = (timeout >> 8) & 0xFF;
+                *len = 2;
+                status = USBD_REQ_HANDLED;
+            }
+            break;
+        }
+        case CDC_VENDOR_REQ_GET_RX_STATS: {
+            /* The counters as little-endian 32-bit words */
+            struct console_rx_stats stats;
+            console_get_rx_stats(uart->console, &stats);
+            const uint32_t counters[] = {
+                stats.overruns, stats.dropped, stats.overrun_errors,
+                stats.framing_errors, stats.parity_errors,
+            };
+            uint16_t size = sizeof(counters);
+            if (*len < size) {
+                size = *len;
+            }
+            for (uint16_t i = 0; i < size; i++) {
+                (*buf)[i] = (uint8_t)(counters[i / 4] >> (8 * (i % 4)));
+            }
+            *len = size;
+            status = USBD_REQ_HANDLED;
+            break;
+        }
+        case CDC_VENDOR_REQ_SET_SELFTEST: {
+            /* A struct selftest_params; mode 0 stops the test */
+            struct selftest_params params;
+            if (*len < sizeof(params)) {
+                status = USBD_REQ_NOTSUPP;
+                break;
+            }
+            memcpy(&params, *buf, sizeof(params));
+
+            if (params.mode == 0) {
+                if (cdc_selftest_port == port) {
+                    selftest_stop();
+                    cdc_uart_selftest_end();
+                }
+                status = USBD_REQ_HANDLED;
+            } else if (cdc_selftest_port < CDC_NUM_PORTS || uart->claimed) {
+                status = USBD_REQ_NOTSUPP;
+            } else {
+                // Take the port from the host first, so none of the
+                // test's data reaches it
+                cdc_uart_app_claim(port, true);
+                if (selftest_start(uart->console, &params)) {
+                    cdc_selftest_port = port;
+                    status = USBD_REQ_HANDLED;
+                } else {
+                    cdc_uart_app_claim(port, false);
+                    status = USBD_REQ_NOTSUPP;
+                }
+            }
+            break;
+        }
+        case CDC_VENDOR_REQ_GET_SELFTEST: {
+            /* A struct selftest_report for the step in wValue */
+            struct selftest_report report;
+            if (req->wValue > 0xFF || !selftest_get_report((uint8_t)req->wValue, &report)) {
+                status = USBD_REQ_NOTSUPP;
+                break;
+            }
+            uint16_t size = sizeof(report);
+            if (*len < size) {
+                size = *len;
+            }
+            memcpy(*buf, &report, size);
+            *len = size;
+            status = USBD_REQ_HANDLED;
+            break;
+        }
+#if PROFILE_ENABLED
+        case CDC_VENDOR_REQ_GET_PROFILE: {
+            /* The point selected by wValue, as a struct profile_report */
+            struct profile_report report;
+            if (!profile_get(req->wValue, &report)) {
+                status = USBD_REQ_NOTSUPP;
+                break;
+            }
+            uint16_t size = sizeof(report);
+            if (*len < size) {
+                size = *len;
+            }
+            memcpy(*buf, &report, size);
+            *len = size;
+            status = USBD_REQ_HANDLED;
+            break;
+        }
+        case CDC_VENDOR_REQ_RESET_PROFILE: {
+            profile_reset();
+            status = USBD_REQ_HANDLED;
+            break;
+        }
+#endif
+        default: {
+            status = USBD_REQ_NOTSUPP;
+            break;
         }
-    } else {
-        transfer_complete = true;
     }
+
+    return status;
 }
 
-static void cdc_bulk_data_in(usbd_device *usbd_dev, uint8_t ep) {
-    (void)usbd_dev;
-    (void)ep;
+/*
+ * Find the next packet's worth of received data in place in the RX ring,
+ * noting when it started filling.
+ */
+static RAMFUNC void cdc_uart_fill_packet(struct cdc_uart_port* uart, uint16_t packet_size,
+                                         struct ring_span spans[2]) {
+    size_t available = console_recv_peek(uart->console, spans);
+    if (uart->packet_len == 0 && available > 0) {
+        uart->packet_timestamp = get_micros();
+    }
+    uart->packet_len = (available < packet_size) ? available : packet_size;
+}
+
+static RAMFUNC bool cdc_uart_timer_expired(const struct cdc_uart_port* uart) {
+    return (uint32_t)(get_micros() - uart->packet_timestamp) >= uart->packet_timeout * 1000U;
+}
+
+/*
+ * Full packets are always ready to send. Partial packets are held back
+ * until the latency timer expires or the console flags the end of a
+ * burst, so that slow streams are aggregated into fewer, larger packets.
+ * If the last packet was full, the transfer must be ended with a
+ * zero-length packet at that point, or the host won't see the data until
+ * the next short packet.
+ */
+static RAMFUNC bool cdc_uart_packet_ready(struct cdc_uart_port* uart, uint16_t packet_size) {
+    if (uart->packet_len >= packet_size) {
+        return true;
+    } else if (uart->packet_len == 0 && !uart->need_zlp) {
+        uart->flush = false;
+        return false;
+    }
+
+    return uart->flush || cdc_uart_timer_expired(uart);
+}
+
+/*
+ * In capture mode, the packet is built from the capture stream instead.
+ * Records are sent as soon as they are complete, so only the ZLP after a
+ * full packet waits for the latency timer.
+ */
+static void cdc_start_capture_transfer(uint8_t port) {
+    struct cdc_uart_port* uart = &cdc_uart_ports[port];
+    uint16_t packet_size = CDC_PACKET_SIZE(port);
+    if (!cmp_usb_configured()) {
+        return;
+    }
+
+    uint8_t buf[USB_CDC_MAX_PACKET_SIZE];
+    size_t len = capture_fill(&uart->capture, buf, packet_size);
+    if (len == 0 && !(uart->need_zlp && (uart->flush || cdc_uart_timer_expired(uart)))) {
+        uart->flush = false;
+        return;
+    }
+
+    // A free endpoint buffer was checked for, so this only fails on reset
+    if (cdc_send_data(port, buf, len)) {
+        uart->in_queued++;
+        uart->need_zlp = (len == packet_size);
+        if (uart->need_zlp) {
+            uart->packet_timestamp = get_micros();
+        } else {
+            uart->flush = false;
+        }
 
-    if (packet_len < USB_CDC_MAX_PACKET_SIZE) {
-        uint16_t max_bytes = (USB_CDC_MAX_PACKET_SIZE- packet_len);
-        packet_len += console_recv_buffered(&packet_buffer[packet_len], max_bytes);
+        if (cdc_uart_tx_callback) {
+            cdc_uart_tx_callback();
+        }
     }
+}
+
+/* Send the next packet of raw received data, once it is ready */
+static RAMFUNC void cdc_start_data_transfer(uint8_t port) {
+    struct cdc_uart_port* uart = &cdc_uart_ports[port];
+    uint16_t packet_size = CDC_PACKET_SIZE(port);
+    struct ring_span spans[2];
+    cdc_uart_fill_packet(uart, packet_size, spans);
 
-    if (!transfer_complete) {
-        cdc_send_data(packet_buffer, packet_len);
-        if (packet_len < USB_CDC_MAX_PACKET_SIZE) {
-            transfer_complete = true;
+    if (cdc_uart_packet_ready(uart, packet_size)
+        && cdc_send_data_spans(port, spans, uart->packet_len)) {
+        console_recv_consume(uart->console, uart->packet_len);
+        uart->in_queued++;
+        uart->need_zlp = (uart->packet_len == packet_size);
+        if (uart->need_zlp) {
+            /* Restart the latency timer for the terminating ZLP */
+            uart->packet_timestamp = get_micros();
+        } else {
+            /* A short packet ends the transfer, and with it the flush */
+            uart->flush = false;
         }
-        packet_len = 0;
+        uart->packet_len = 0;
 
         if (cdc_uart_tx_callback) {
             cdc_uart_tx_callback();
@@ -376,12 +945,137 @@ static void cdc_bulk_data_in(usbd_device *usbd_dev, uint8_t ep) {
     }
 }
 
+/*
+ * Send the next packet of a port's IN transfer if an endpoint buffer is
+ * free. Called on every SOF, when a packet has been sent, and when the
+ * console flags an RX event, so that full packets are streamed back to
+ * back for as long as the RX ring has data. With double-buffering, the
+ * next packet is queued while the previous one is still in flight.
+ */
+static RAMFUNC void cdc_start_in_transfer(uint8_t port) {
+    struct cdc_uart_port* uart = &cdc_uart_ports[port];
+    if (uart->claimed || uart->in_queued >= CDC_DATA_IN_BUFFERS) {
+        return;
+    }
+
+    PROFILE_BEGIN(PROFILE_IN_TRANSFER);
+    if (uart->capture.mode != CAPTURE_OFF) {
+        cdc_start_capture_transfer(port);
+    } else {
+        cdc_start_data_transfer(port);
+    }
+    PROFILE_END(PROFILE_IN_TRANSFER);
+}
+
+/*
+ * The IN scheduler is fair across ports: each port has at most
+ * CDC_DATA_IN_BUFFERS packets in flight, a completed packet only refills
+ * its own endpoint, and the passes that visit every port start from a
+ * different port each time, so a port with a busy RX ring can't hold the
+ * others off.
+ */
+static uint8_t cdc_in_first_port = 0;
+
+static RAMFUNC uint8_t cdc_next_port(uint8_t port) {
+    return (port + 1 < CDC_NUM_PORTS) ? port + 1 : 0;
+}
+
+static RAMFUNC void cdc_start_in_transfers(void) {
+    uint8_t port = cdc_in_first_port;
+    for (uint8_t i = 0; i < CDC_NUM_PORTS; i++) {
+        cdc_start_in_transfer(port);
+        port = cdc_next_port(port);
+    }
+    cdc_in_first_port = cdc_next_port(cdc_in_first_port);
+}
+
+static RAMFUNC void cdc_bulk_data_in(usbd_device *usbd_dev, uint8_t ep) {
+    (void)usbd_dev;
+    PROFILE_BEGIN(PROFILE_BULK_IN);
+
+    uint8_t port = CDC_ENDP_PORT(ep);
+#if USB_DOUBLE_BUFFERED_BULK
+    usb_dbl_ep_tx_complete(ep);
+#endif
+    if (cdc_uart_ports[port].in_queued > 0) {
+        cdc_uart_ports[port].in_queued--;
+    }
+    cdc_start_in_transfer(port);
+    PROFILE_END(PROFILE_BULK_IN);
+}
+
+static void cdc_uart_serial_state_reset(uint8_t port) {
+    cdc_uart_ports[port].serial_state = 0;
+    cdc_uart_ports[port].serial_events = 0;
+}
+
+/*
+ * Once per frame, fold everything that happened on the port's line since
+ * the last frame into at most one SERIAL_STATE notification. Errors and
+ * breaks are sent once; DCD, DSR and RI are sent when they change.
+ */
+static void cdc_uart_update_port_serial_state(uint8_t port) {
+    struct cdc_uart_port* uart = &cdc_uart_ports[port];
+    uint16_t events = console_take_line_events(uart->console);
+    if (events & CONSOLE_LINE_BREAK) {
+        uart->serial_events |= CDC_SERIAL_STATE_BREAK;
+    }
+    if (events & CONSOLE_LINE_FRAMING) {
+        uart->serial_events |= CDC_SERIAL_STATE_FRAMING;
+    }
+    if (events & CONSOLE_LINE_PARITY) {
+        uart->serial_events |= CDC_SERIAL_STATE_PARITY;
+    }
+    if (events & CONSOLE_LINE_OVERRUN) {
+        uart->serial_events |= CDC_SERIAL_STATE_OVERRUN;
+    }
+
+    uint16_t modem = console_get_modem_status(uart->console);
+    uint16_t state = 0;
+    if (modem & CONSOLE_MODEM_DCD) {
+        state |= CDC_SERIAL_STATE_DCD;
+    }
+    if (modem & CONSOLE_MODEM_DSR) {
+        state |= CDC_SERIAL_STATE_DSR;
+    }
+    if (modem & CONSOLE_MODEM_RI) {
+        state |= CDC_SERIAL_STATE_RI;
+    }
+
+    if (uart->serial_events == 0 && state == uart->serial_state) {
+        return;
+    }
+
+    if (cdc_notify_serial_state(port, state | uart->serial_events)) {
+        uart->serial_state = state;
+        uart->serial_events = 0;
+    }
+}
+
+static void cdc_uart_update_serial_state(void) {
+    for (uint8_t port = 0; port < CDC_NUM_PORTS; port++) {
+        cdc_uart_update_port_serial_state(port);
+    }
+}
+
 bool cdc_uart_app_update() {
     bool active = false;
 
-    // Handle flow control for data received from the host
-    if (console_send_buffer_space() >= USB_CDC_MAX_PACKET_SIZE) {
-        cdc_clear_nak();
+    if (cdc_selftest_port < CDC_NUM_PORTS && !selftest_update()) {
+        cdc_uart_selftest_end();
+    }
+
+    // Flush data to the host early if a UART signalled the end of a
+    // burst or a half-full ring, rather than waiting for the next SOF
+    uint8_t port = cdc_in_first_port;
+    for (uint8_t i = 0; i < CDC_NUM_PORTS; i++) {
+        if (!cdc_uart_ports[port].claimed
+            && console_rx_poll_event(cdc_uart_ports[port].console)
+            && cmp_usb_configured()) {
+            cdc_uart_ports[port].flush = true;
+            cdc_start_in_transfer(port);
+        }
+        port = cdc_next_port(port);
     }
 
     return active;
@@ -22,21 +22,36 @@
 #include "usb_common.h"
 #include <libopencm3/usb/cdc.h>
 #include "cdc_defs.h"
+#include "ring.h"
 
-typedef void (*SetControlLineStateFunction)(bool dtr, bool rts);
+/* Callbacks and functions take the index of the CDC-ACM port */
+typedef void (*SetControlLineStateFunction)(uint8_t port, bool dtr, bool rts);
 
-typedef bool (*SetLineCodingFunction)(const struct usb_cdc_line_coding* line_coding);
-typedef bool (*GetLineCodingFunction)(struct usb_cdc_line_coding* line_coding);
+typedef bool (*SetLineCodingFunction)(uint8_t port, const struct usb_cdc_line_coding* line_coding);
+typedef bool (*GetLineCodingFunction)(uint8_t port, struct usb_cdc_line_coding* line_coding);
+/* Duration in ms, 0xFFFF until cleared, 0 to end a break */
+typedef bool (*SendBreakFunction)(uint8_t port, uint16_t duration_ms);
 
-extern const struct cdc_acm_functional_descriptors cdc_acm_functional_descriptors;
+/* Provide space to receive host data into in place; returns the total */
+typedef size_t (*CdcRxReserveFunction)(uint8_t port, struct ring_span spans[2]);
+/* Accept received data; returns false to hold off further packets */
+typedef bool (*CdcRxCommitFunction)(uint8_t port, size_t len);
+
+/* Indexed by port, since they name the port's interfaces */
+extern const struct cdc_acm_functional_descriptors cdc_acm_functional_descriptors[];
 
 extern void cdc_setup(usbd_device* usbd_dev,
-                      HostOutFunction cdc_rx_cb,
+                      CdcRxReserveFunction cdc_rx_reserve_cb,
+                      CdcRxCommitFunction cdc_rx_commit_cb,
                       SetControlLineStateFunction set_control_line_state_cb,
                       SetLineCodingFunction set_line_coding_cb,
-                      GetLineCodingFunction get_line_coding_cb);
+                      GetLineCodingFunction get_line_coding_cb,
+                      SendBreakFunction send_break_cb);
 
-extern bool cdc_send_data(const uint8_t* data, size_t len);
+extern bool cdc_send_data(uint8_t port, const uint8_t* data, size_t len);
+extern bool cdc_send_data_spans(uint8_t port, const struct ring_span spans[2], size_t len);
+extern void cdc_rx_resume(uint8_t port);
+extern bool cdc_notify_serial_state(uint8_t port, uint16_t state);
 
 extern void cdc_uart_app_setup(usbd_device* usbd_dev,
                                GenericCallback cdc_tx_cb,
@@ -44,6 +59,11 @@ extern void cdc_uart_app_setup(usbd_device* usbd_dev,
 
 extern bool cdc_uart_app_update(void);
 
-extern void cdc_uart_app_set_timeout(uint32_t timeout_ms);
+extern void cdc_uart_app_set_timeout(uint8_t port, uint32_t timeout_ms);
+extern void cdc_uart_app_claim(uint8_t port, bool claimed);
+extern bool cdc_uart_app_set_line_coding(uint8_t port,
+                                         const struct usb_cdc_line_coding* line_coding);
+extern bool cdc_uart_app_get_line_coding(uint8_t port,
+                                         struct usb_cdc_line_coding* line_coding);
 
 #endif
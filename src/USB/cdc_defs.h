@@ -23,6 +23,69 @@
 
 #define USB_CDC_REQ_GET_LINE_CODING 0xA0
 
+#ifndef USB_CDC_REQ_SEND_BREAK
+#define USB_CDC_REQ_SEND_BREAK 0x23
+#endif
+
+/* ACM functional descriptor capabilities */
+#define CDC_ACM_CAP_COMM_FEATURE (1 << 0)
+#define CDC_ACM_CAP_LINE         (1 << 1)
+#define CDC_ACM_CAP_SEND_BREAK   (1 << 2)
+
+/* SERIAL_STATE notification UART state bitmap */
+#define CDC_SERIAL_STATE_DCD     (1 << 0)
+#define CDC_SERIAL_STATE_DSR     (1 << 1)
+#define CDC_SERIAL_STATE_BREAK   (1 << 2)
+#define CDC_SERIAL_STATE_RI      (1 << 3)
+#define CDC_SERIAL_STATE_FRAMING (1 << 4)
+#define CDC_SERIAL_STATE_PARITY  (1 << 5)
+#define CDC_SERIAL_STATE_OVERRUN (1 << 6)
+
+/* The transient bits, which are sent once per event */
+#define CDC_SERIAL_STATE_EVENTS \
+    (CDC_SERIAL_STATE_BREAK | CDC_SERIAL_STATE_FRAMING | \
+     CDC_SERIAL_STATE_PARITY | CDC_SERIAL_STATE_OVERRUN)
+
+struct cdc_serial_state_notification {
+    struct usb_cdc_notification header;
+    uint16_t bmUartState;
+} __attribute__ ((packed));
+
+/*
+ * Vendor-specific requests to the CDC control interface.
+ * The latency timer requests use the same numbers as FTDI's.
+ */
+#define CDC_VENDOR_REQ_SET_LATENCY_TIMER 0x09
+#define CDC_VENDOR_REQ_GET_LATENCY_TIMER 0x0A
+
+/* Latency timer at power-up in milliseconds; FTDI's default */
+#ifndef CDC_LATENCY_TIMER_DEFAULT
+#define CDC_LATENCY_TIMER_DEFAULT 16
+#endif
+
+/*
+ * Flow control also uses FTDI's request number, but takes the mode in
+ * wValue, since wIndex selects the interface here.
+ */
+#define CDC_VENDOR_REQ_SET_FLOW_CONTROL 0x02
+
+#define CDC_FLOW_CONTROL_NONE    0x0000
+#define CDC_FLOW_CONTROL_RTS_CTS 0x0001
+
+/* termlink's own requests are numbered from 0x20, clear of FTDI's */
+#define CDC_VENDOR_REQ_GET_RX_STATS 0x20
+
+/* wValue selects the capture mode, see capture.h */
+#define CDC_VENDOR_REQ_SET_CAPTURE 0x21
+
+/* Cycle profiles, when built with PROFILE=1; see profile.h */
+#define CDC_VENDOR_REQ_GET_PROFILE   0x22
+#define CDC_VENDOR_REQ_RESET_PROFILE 0x23
+
+/* Link self-test on the port; see selftest.h */
+#define CDC_VENDOR_REQ_SET_SELFTEST 0x24
+#define CDC_VENDOR_REQ_GET_SELFTEST 0x25
+
 struct cdc_acm_functional_descriptors {
     struct usb_cdc_header_descriptor header;
     struct usb_cdc_call_management_descriptor call_mgmt;
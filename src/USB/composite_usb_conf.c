@@ -25,20 +25,33 @@
 
 #include "composite_usb_conf.h"
 #include "usb_setup.h"
+#include "usb_pma.h"
 
 #include "misc_defs.h"
 
 #include "dfu.h"
 #include "cdc.h"
+#include "raw.h"
 
 #include "config.h"
-
-#define NUM_OUT_ENDPOINTS (HIGHEST_OUT_ENDPOINT - 1)
-#define NUM_IN_ENDPOINTS (HIGHEST_IN_ENDPOINT - 0x80 - 1)
-#define TOTAL_NUM_ENDPOINTS (NUM_OUT_ENDPOINTS + NUM_IN_ENDPOINTS + 1)
-
-_Static_assert((1 + NUM_IN_ENDPOINTS <= 8), "Too many IN endpoints for USB core (max 8)");
-_Static_assert((1 + NUM_OUT_ENDPOINTS <= 8), "Too many OUT endpoints for USB core (max 8)");
+#include "profile.h"
+
+_Static_assert((HIGHEST_ENDPOINT < 8), "Too many endpoints for USB core (max 8)");
+
+/* Packet memory for the buffer table, control endpoint and CDC endpoints */
+#define USB_PMA_BTABLE_SIZE (8 * 8)
+#define USB_PMA_CONTROL_SIZE (2 * 64)
+#define USB_PMA_CDC_PORT_SIZE(packet_size) \
+    ((1 + USB_DOUBLE_BUFFERED_BULK) * 2 * (packet_size) + 16)
+#define USB_PMA_CDC_SIZE (USB_PMA_CDC_PORT_SIZE(USB_CDC_MAX_PACKET_SIZE) + \
+                          (CDC_NUM_PORTS - 1) * USB_PMA_CDC_PORT_SIZE(USB_CDC_AUX_PACKET_SIZE))
+#define USB_PMA_RAW_SIZE (USB_RAW_AVAILABLE * (1 + USB_DOUBLE_BUFFERED_BULK) * 2 * USB_RAW_PACKET_SIZE)
+
+#ifdef USB_PMA_SIZE
+_Static_assert((USB_PMA_BTABLE_SIZE + USB_PMA_CONTROL_SIZE + USB_PMA_CDC_SIZE
+                + USB_PMA_RAW_SIZE <= USB_PMA_SIZE),
+               "Endpoint buffers don't fit in USB packet memory");
+#endif
 
 
 static const struct usb_device_descriptor dev = {
@@ -59,80 +72,100 @@ static const struct usb_device_descriptor dev = {
 };
 
 /*
- * This notification endpoint isn't implemented. According to CDC spec it's
- * optional, but its absence causes a NULL pointer dereference in the
- * Linux cdc_acm driver.
+ * Notification endpoint for SERIAL_STATE. The CDC spec makes it optional,
+ * but its absence causes a NULL pointer dereference in the Linux cdc_acm
+ * driver anyway.
  */
-static const struct usb_endpoint_descriptor comm_endpoints[] = {
-    {
-        .bLength = USB_DT_ENDPOINT_SIZE,
-        .bDescriptorType = USB_DT_ENDPOINT,
-        .bEndpointAddress = ENDP_CDC_COMM_IN,
-        .bmAttributes = USB_ENDPOINT_ATTR_INTERRUPT,
-        .wMaxPacketSize = 16,
-        .bInterval = 1,
-    }
+#define CDC_COMM_ENDPOINTS(port) {                          \
+    {                                                       \
+        .bLength = USB_DT_ENDPOINT_SIZE,                    \
+        .bDescriptorType = USB_DT_ENDPOINT,                 \
+        .bEndpointAddress = ENDP_CDC_COMM_IN(port),         \
+        .bmAttributes = USB_ENDPOINT_ATTR_INTERRUPT,        \
+        .wMaxPacketSize = 16,                               \
+        .bInterval = 1,                                     \
+    }                                                       \
+},
+
+static const struct usb_endpoint_descriptor comm_endpoints[CDC_NUM_PORTS][1] = {
+    CDC_FOR_EACH_PORT(CDC_COMM_ENDPOINTS)
 };
 
-static const struct usb_endpoint_descriptor data_endpoints[] = {
-    {
-        .bLength = USB_DT_ENDPOINT_SIZE,
-        .bDescriptorType = USB_DT_ENDPOINT,
-        .bEndpointAddress = ENDP_CDC_DATA_OUT,
-        .bmAttributes = USB_ENDPOINT_ATTR_BULK,
-        .wMaxPacketSize = USB_CDC_MAX_PACKET_SIZE,
-        .bInterval = 1,
-    },
-    {
-        .bLength = USB_DT_ENDPOINT_SIZE,
-        .bDescriptorType = USB_DT_ENDPOINT,
-        .bEndpointAddress = ENDP_CDC_DATA_IN,
-        .bmAttributes = USB_ENDPOINT_ATTR_BULK,
-        .wMaxPacketSize = USB_CDC_MAX_PACKET_SIZE,
-        .bInterval = 1,
-    }
+#define CDC_DATA_ENDPOINTS(port) {                          \
+    {                                                       \
+        .bLength = USB_DT_ENDPOINT_SIZE,                    \
+        .bDescriptorType = USB_DT_ENDPOINT,                 \
+        .bEndpointAddress = ENDP_CDC_DATA_OUT(port),        \
+        .bmAttributes = USB_ENDPOINT_ATTR_BULK,             \
+        .wMaxPacketSize = CDC_PACKET_SIZE(port),            \
+        .bInterval = 1,                                     \
+    },                                                      \
+    {                                                       \
+        .bLength = USB_DT_ENDPOINT_SIZE,                    \
+        .bDescriptorType = USB_DT_ENDPOINT,                 \
+        .bEndpointAddress = ENDP_CDC_DATA_IN(port),         \
+        .bmAttributes = USB_ENDPOINT_ATTR_BULK,             \
+        .wMaxPacketSize = CDC_PACKET_SIZE(port),            \
+        .bInterval = 1,                                     \
+    }                                                       \
+},
+
+static const struct usb_endpoint_descriptor data_endpoints[CDC_NUM_PORTS][2] = {
+    CDC_FOR_EACH_PORT(CDC_DATA_ENDPOINTS)
 };
 
-static const struct usb_iface_assoc_descriptor iface_assoc = {
-    .bLength = USB_DT_INTERFACE_ASSOCIATION_SIZE,
-    .bDescriptorType = USB_DT_INTERFACE_ASSOCIATION,
-    .bFirstInterface = INTF_CDC_COMM,
-    .bInterfaceCount = 2,
-    .bFunctionClass = USB_CLASS_CDC,
-    .bFunctionSubClass = USB_CDC_SUBCLASS_ACM,
-    .bFunctionProtocol = USB_CDC_PROTOCOL_NONE,
-    .iFunction = STR_CDC_INTF_ASSOC_DESC,
+#define CDC_IFACE_ASSOC(port) {                             \
+    .bLength = USB_DT_INTERFACE_ASSOCIATION_SIZE,           \
+    .bDescriptorType = USB_DT_INTERFACE_ASSOCIATION,        \
+    .bFirstInterface = INTF_CDC_COMM(port),                 \
+    .bInterfaceCount = 2,                                   \
+    .bFunctionClass = USB_CLASS_CDC,                        \
+    .bFunctionSubClass = USB_CDC_SUBCLASS_ACM,              \
+    .bFunctionProtocol = USB_CDC_PROTOCOL_NONE,             \
+    .iFunction = STR_CDC_INTF_ASSOC_DESC + (port),          \
+},
+
+static const struct usb_iface_assoc_descriptor iface_assoc[CDC_NUM_PORTS] = {
+    CDC_FOR_EACH_PORT(CDC_IFACE_ASSOC)
 };
 
-static const struct usb_interface_descriptor comm_iface = {
-    .bLength = USB_DT_INTERFACE_SIZE,
-    .bDescriptorType = USB_DT_INTERFACE,
-    .bInterfaceNumber = INTF_CDC_COMM,
-    .bAlternateSetting = 0,
-    .bNumEndpoints = 1,
-    .bInterfaceClass = USB_CLASS_CDC,
-    .bInterfaceSubClass = USB_CDC_SUBCLASS_ACM,
-    .bInterfaceProtocol = USB_CDC_PROTOCOL_NONE,
-    .iInterface = STR_CDC_CONTROL_INTF,
-
-    .endpoint = comm_endpoints,
-
-    .extra = &cdc_acm_functional_descriptors,
-    .extralen = sizeof(cdc_acm_functional_descriptors)
+#define CDC_COMM_IFACE(port) {                                          \
+    .bLength = USB_DT_INTERFACE_SIZE,                                   \
+    .bDescriptorType = USB_DT_INTERFACE,                                \
+    .bInterfaceNumber = INTF_CDC_COMM(port),                            \
+    .bAlternateSetting = 0,                                             \
+    .bNumEndpoints = 1,                                                 \
+    .bInterfaceClass = USB_CLASS_CDC,                                   \
+    .bInterfaceSubClass = USB_CDC_SUBCLASS_ACM,                         \
+    .bInterfaceProtocol = USB_CDC_PROTOCOL_NONE,                        \
+    .iInterface = STR_CDC_CONTROL_INTF,                                 \
+                                                                        \
+    .endpoint = comm_endpoints[port],                                   \
+                                                                        \
+    .extra = &cdc_acm_functional_descriptors[port],                     \
+    .extralen = sizeof(cdc_acm_functional_descriptors[port])            \
+},
+
+static const struct usb_interface_descriptor comm_iface[CDC_NUM_PORTS] = {
+    CDC_FOR_EACH_PORT(CDC_COMM_IFACE)
 };
 
-static const struct usb_interface_descriptor data_iface = {
-    .bLength = USB_DT_INTERFACE_SIZE,
-    .bDescriptorType = USB_DT_INTERFACE,
-    .bInterfaceNumber = INTF_CDC_DATA,
-    .bAlternateSetting = 0,
-    .bNumEndpoints = 2,
-    .bInterfaceClass = USB_CLASS_DATA,
-    .bInterfaceSubClass = 0,
-    .bInterfaceProtocol = 0,
-    .iInterface = STR_CDC_DATA_INTF,
-
-    .endpoint = data_endpoints,
+#define CDC_DATA_IFACE(port) {                              \
+    .bLength = USB_DT_INTERFACE_SIZE,                       \
+    .bDescriptorType = USB_DT_INTERFACE,                    \
+    .bInterfaceNumber = INTF_CDC_DATA(port),                \
+    .bAlternateSetting = 0,                                 \
+    .bNumEndpoints = 2,                                     \
+    .bInterfaceClass = USB_CLASS_DATA,                      \
+    .bInterfaceSubClass = 0,                                \
+    .bInterfaceProtocol = 0,                                \
+    .iInterface = STR_CDC_DATA_INTF,                        \
+                                                            \
+    .endpoint = data_endpoints[port],                       \
+},
+
+static const struct usb_interface_descriptor data_iface[CDC_NUM_PORTS] = {
+    CDC_FOR_EACH_PORT(CDC_DATA_IFACE)
 };
 
 #if DFU_AVAILABLE
@@ -156,24 +189,70 @@ static const struct usb_interface_descriptor dfu_iface = {
 
 #endif
 
-static const struct usb_interface interfaces[] = {
-    /* CDC Control Interface */
+#if USB_RAW_AVAILABLE
+
+static const struct usb_endpoint_descriptor raw_endpoints[] = {
     {
-        .num_altsetting = 1,
-        .altsetting = &comm_iface,
-        .iface_assoc = &iface_assoc
+        .bLength = USB_DT_ENDPOINT_SIZE,
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = ENDP_RAW_DATA_OUT,
+        .bmAttributes = USB_ENDPOINT_ATTR_BULK,
+        .wMaxPacketSize = USB_RAW_PACKET_SIZE,
+        .bInterval = 1,
     },
-    /* CDC Data Interface */
     {
-        .num_altsetting = 1,
-        .altsetting = &data_iface,
+        .bLength = USB_DT_ENDPOINT_SIZE,
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = ENDP_RAW_DATA_IN,
+        .bmAttributes = USB_ENDPOINT_ATTR_BULK,
+        .wMaxPacketSize = USB_RAW_PACKET_SIZE,
+        .bInterval = 1,
+    }
+};
+
+static const struct usb_interface_descriptor raw_iface = {
+    .bLength = USB_DT_INTERFACE_SIZE,
+    .bDescriptorType = USB_DT_INTERFACE,
+    .bInterfaceNumber = INTF_RAW,
+    .bAlternateSetting = 0,
+    .bNumEndpoints = 2,
+    .bInterfaceClass = USB_CLASS_VENDOR,
+    .bInterfaceSubClass = RAW_INTERFACE_SUBCLASS,
+    .bInterfaceProtocol = RAW_INTERFACE_PROTOCOL,
+    .iInterface = STR_RAW_INTF,
+
+    .endpoint = raw_endpoints,
+};
+
+#endif
+
+/* CDC Control and Data Interfaces for one port */
+#define CDC_INTERFACES(port)                \
+    {                                       \
+        .num_altsetting = 1,                \
+        .altsetting = &comm_iface[port],    \
+        .iface_assoc = &iface_assoc[port]   \
+    },                                      \
+    {                                       \
+        .num_altsetting = 1,                \
+        .altsetting = &data_iface[port],    \
     },
+
+static const struct usb_interface interfaces[] = {
+    CDC_FOR_EACH_PORT(CDC_INTERFACES)
 #if DFU_AVAILABLE
     /* DFU interface */
     {
         .num_altsetting = 1,
         .altsetting = &dfu_iface,
-    }
+    },
+#endif
+#if USB_RAW_AVAILABLE
+    /* Raw bulk interface */
+    {
+        .num_altsetting = 1,
+        .altsetting = &raw_iface,
+    },
 #endif
 };
 
@@ -196,12 +275,21 @@ static const char *usb_strings[] = {
     [STR_MANUFACTURER-1]        = "Devanarchy",
     [STR_PRODUCT-1]             = (PRODUCT_NAME " USB-Serial"),
     [STR_SERIAL-1]              = serial_number,
-    [STR_CDC_INTF_ASSOC_DESC-1] = (PRODUCT_NAME " CDC-ACM Serial"),
     [STR_CDC_CONTROL_INTF-1]    = "CDC Control",
     [STR_CDC_DATA_INTF-1]       = "CDC Data",
 #if DFU_AVAILABLE
     [STR_DFU_INTF-1]            = (PRODUCT_NAME " DFU"),
 #endif
+#if USB_RAW_AVAILABLE
+    [STR_RAW_INTF-1]            = (PRODUCT_NAME " Raw Bulk"),
+#endif
+    [STR_CDC_INTF_ASSOC_DESC-1] = (PRODUCT_NAME " CDC-ACM Serial"),
+#if CDC_NUM_PORTS > 1
+    [STR_CDC_INTF_ASSOC_DESC]   = (PRODUCT_NAME " CDC-ACM Serial 2"),
+#endif
+#if CDC_NUM_PORTS > 2
+    [STR_CDC_INTF_ASSOC_DESC+1] = (PRODUCT_NAME " CDC-ACM Serial 3"),
+#endif
 };
 
 void cmp_set_usb_serial_number(const char* serial) {
@@ -234,10 +322,12 @@ void cmp_usb_register_sof_callback(GenericCallback callback) {
 }
 
 static void cmp_usb_handle_sof(void) {
+    PROFILE_BEGIN(PROFILE_SOF);
     uint8_t i;
     for (i=0; i < num_sof_callbacks; i++) {
         (*sof_callbacks[i])();
     }
+    PROFILE_END(PROFILE_SOF);
 }
 
 /* Configuration status */
@@ -262,10 +352,11 @@ static void cmp_usb_handle_reset(void) {
     num_sof_callbacks = 0;
 }
 
-/* Class-specific control request handlers */
+/* Class-specific and vendor-specific control request handlers */
 struct callback_entry {
     usbd_control_callback callback;
     uint16_t interface;
+    uint8_t type;
 };
 
 static struct callback_entry control_class_callbacks[USB_MAX_CONTROL_CLASS_CALLBACKS];
@@ -275,15 +366,26 @@ static uint8_t num_control_class_callbacks;
 static usbd_set_config_callback set_config_callbacks[USB_MAX_SET_CONFIG_CALLBACKS];
 static uint8_t num_set_config_callbacks;
 
-void cmp_usb_register_control_class_callback(uint16_t interface,
-                                             usbd_control_callback callback) {
+static void cmp_usb_register_control_callback(uint8_t type, uint16_t interface,
+                                              usbd_control_callback callback) {
     if (num_control_class_callbacks < USB_MAX_CONTROL_CLASS_CALLBACKS) {
         control_class_callbacks[num_control_class_callbacks].interface = interface;
         control_class_callbacks[num_control_class_callbacks].callback = callback;
+        control_class_callbacks[num_control_class_callbacks].type = type;
         num_control_class_callbacks++;
     }
 }
 
+void cmp_usb_register_control_class_callback(uint16_t interface,
+                                             usbd_control_callback callback) {
+    cmp_usb_register_control_callback(USB_REQ_TYPE_CLASS, interface, callback);
+}
+
+void cmp_usb_register_control_vendor_callback(uint16_t interface,
+                                              usbd_control_callback callback) {
+    cmp_usb_register_control_callback(USB_REQ_TYPE_VENDOR, interface, callback);
+}
+
 static int cmp_usb_dispatch_control_class_request(usbd_device *usbd_dev,
                                                   struct usb_setup_data *req,
                                                   uint8_t **buf, uint16_t *len,
@@ -293,8 +395,10 @@ static int cmp_usb_dispatch_control_class_request(usbd_device *usbd_dev,
 
     uint8_t i;
     uint16_t interface = req->wIndex;
+    uint8_t type = req->bmRequestType & USB_REQ_TYPE_TYPE;
     for (i=0; i < num_control_class_callbacks; i++) {
-        if (interface == control_class_callbacks[i].interface) {
+        if (interface == control_class_callbacks[i].interface
+            && type == control_class_callbacks[i].type) {
             usbd_control_callback callback = control_class_callbacks[i].callback;
             result = callback(usbd_dev, req, buf, len, complete);
             if (result == USBD_REQ_HANDLED || result == USBD_REQ_NOTSUPP) {
@@ -319,16 +423,27 @@ static void cmp_usb_set_config(usbd_device* usbd_dev, uint16_t wValue) {
     for (i=0; i < USB_MAX_CONTROL_CLASS_CALLBACKS; i++) {
         control_class_callbacks[i].interface = 0;
         control_class_callbacks[i].callback = NULL;
+        control_class_callbacks[i].type = 0;
     }
 
     num_control_class_callbacks = 0;
 
-    /* Register our class-specific control request dispatcher */
+#if USB_DOUBLE_BUFFERED_BULK
+    /* Endpoints are re-allocated by the set-config callbacks below */
+    usb_dbl_buf_reset();
+#endif
+
+    /* Register our class-specific and vendor-specific control request dispatcher */
     usbd_register_control_callback(
         usbd_dev,
         USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
         USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
         cmp_usb_dispatch_control_class_request);
+    usbd_register_control_callback(
+        usbd_dev,
+        USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE,
+        USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+        cmp_usb_dispatch_control_class_request);
 
     /* Record that we're configured */
     configured = true;
@@ -21,47 +21,134 @@
 
 #include "usb_common.h"
 #include "config.h"
+#include "console.h"
 
 #define USB_CDC_MAX_PACKET_SIZE 64
 #define USB_SERIAL_NUM_LENGTH   24
 
-enum {
-    ENDP_CONTROL_OUT = 0x00,
-    ENDP_CDC_DATA_OUT,
+/*
+ * Bulk packet size for the ports after the first, which can be made
+ * smaller to fit more ports into the USB packet memory.
+ */
+#ifndef USB_CDC_AUX_PACKET_SIZE
+#define USB_CDC_AUX_PACKET_SIZE USB_CDC_MAX_PACKET_SIZE
+#endif
 
-    HIGHEST_OUT_ENDPOINT
-};
+_Static_assert((USB_CDC_AUX_PACKET_SIZE <= USB_CDC_MAX_PACKET_SIZE),
+               "Extra CDC ports can't use packets larger than the first");
+
+/* Use ping-pong packet buffers for the CDC data endpoints */
+#ifndef USB_DOUBLE_BUFFERED_BULK
+#define USB_DOUBLE_BUFFERED_BULK 0
+#endif
+
+/* Vendor-specific bulk pipe to the first console port, next to CDC-ACM */
+#ifndef USB_RAW_AVAILABLE
+#define USB_RAW_AVAILABLE 0
+#endif
+
+#define USB_RAW_PACKET_SIZE 64
+
+/* Service USB from its interrupt handler instead of polling from main() */
+#ifndef USB_INTERRUPT_DRIVEN
+#define USB_INTERRUPT_DRIVEN 0
+#endif
+
+#if USB_DOUBLE_BUFFERED_BULK
+#define CDC_DATA_IN_BUFFERS 2
+#else
+#define CDC_DATA_IN_BUFFERS 1
+#endif
+
+/* One CDC-ACM function for each console port */
+#define CDC_NUM_PORTS CONSOLE_NUM_PORTS
+
+/* Expand X(port) for each CDC port, to build per-port tables */
+#if CDC_NUM_PORTS == 1
+#define CDC_FOR_EACH_PORT(X) X(0)
+#elif CDC_NUM_PORTS == 2
+#define CDC_FOR_EACH_PORT(X) X(0) X(1)
+#else
+#define CDC_FOR_EACH_PORT(X) X(0) X(1) X(2)
+#endif
+
+#define CDC_PACKET_SIZE(port) \
+    ((port) == 0 ? USB_CDC_MAX_PACKET_SIZE : USB_CDC_AUX_PACKET_SIZE)
 
 enum {
+    ENDP_CONTROL_OUT = 0x00,
     ENDP_CONTROL_IN = 0x80,
-    ENDP_CDC_DATA_IN,
-    ENDP_CDC_COMM_IN,
-
-    HIGHEST_IN_ENDPOINT,
 };
 
-enum {
-    INTF_CDC_COMM,
-    INTF_CDC_DATA,
+/*
+ * Each port takes consecutive endpoint numbers. The data OUT and IN
+ * endpoints share a number unless they are double-buffered, since a
+ * double-buffered endpoint uses both halves of its buffer table entry.
+ */
+#if USB_DOUBLE_BUFFERED_BULK
+#define CDC_PORT_ENDPOINTS 3
+#define ENDP_CDC_DATA_OUT(port) (1 + CDC_PORT_ENDPOINTS * (port))
+#define ENDP_CDC_DATA_IN(port)  (0x80 | (2 + CDC_PORT_ENDPOINTS * (port)))
+#define ENDP_CDC_COMM_IN(port)  (0x80 | (3 + CDC_PORT_ENDPOINTS * (port)))
+#else
+#define CDC_PORT_ENDPOINTS 2
+#define ENDP_CDC_DATA_OUT(port) (1 + CDC_PORT_ENDPOINTS * (port))
+#define ENDP_CDC_DATA_IN(port)  (0x80 | (1 + CDC_PORT_ENDPOINTS * (port)))
+#define ENDP_CDC_COMM_IN(port)  (0x80 | (2 + CDC_PORT_ENDPOINTS * (port)))
+#endif
+
+/* The port that a CDC endpoint address belongs to */
+#define CDC_ENDP_PORT(ep) ((uint8_t)((((ep) & 0x7F) - 1) / CDC_PORT_ENDPOINTS))
+
+#define CDC_HIGHEST_ENDPOINT (CDC_PORT_ENDPOINTS * CDC_NUM_PORTS)
+
+/* The raw bulk pair follows the CDC ports, numbered the same way */
+#if !USB_RAW_AVAILABLE
+#define RAW_ENDPOINTS 0
+#elif USB_DOUBLE_BUFFERED_BULK
+#define RAW_ENDPOINTS 2
+#define ENDP_RAW_DATA_OUT (CDC_HIGHEST_ENDPOINT + 1)
+#define ENDP_RAW_DATA_IN  (0x80 | (CDC_HIGHEST_ENDPOINT + 2))
+#else
+#define RAW_ENDPOINTS 1
+#define ENDP_RAW_DATA_OUT (CDC_HIGHEST_ENDPOINT + 1)
+#define ENDP_RAW_DATA_IN  (0x80 | (CDC_HIGHEST_ENDPOINT + 1))
+#endif
+
+/* Highest endpoint number in use */
+#define HIGHEST_ENDPOINT (CDC_HIGHEST_ENDPOINT + RAW_ENDPOINTS)
+
+#define INTF_CDC_COMM(port) (2 * (port))
+#define INTF_CDC_DATA(port) (2 * (port) + 1)
 #if DFU_AVAILABLE
-    INTF_DFU,
+#define INTF_DFU (2 * CDC_NUM_PORTS)
+#define INTF_RAW (INTF_DFU + 1)
+#else
+#define INTF_RAW (2 * CDC_NUM_PORTS)
 #endif
-};
+
+/* The port that a CDC interface number belongs to */
+#define CDC_INTF_PORT(intf) ((uint8_t)((intf) / 2))
 
 enum {
     STR_NONE = 0,
     STR_MANUFACTURER,
     STR_PRODUCT,
     STR_SERIAL,
-    STR_CDC_INTF_ASSOC_DESC,
     STR_CDC_CONTROL_INTF,
     STR_CDC_DATA_INTF,
 #if DFU_AVAILABLE
     STR_DFU_INTF,
 #endif
+#if USB_RAW_AVAILABLE
+    STR_RAW_INTF,
+#endif
+    /* One function name per port */
+    STR_CDC_INTF_ASSOC_DESC,
 };
 
-#define USB_MAX_CONTROL_CLASS_CALLBACKS 8
+/* Three per CDC port, plus DFU and the raw interface */
+#define USB_MAX_CONTROL_CLASS_CALLBACKS 16
 #define USB_MAX_SET_CONFIG_CALLBACKS    8
 #define USB_MAX_RESET_CALLBACKS 8
 #define USB_MAX_SOF_CALLBACKS 8
@@ -71,6 +158,8 @@ extern usbd_device* cmp_usb_setup(void);
 extern bool cmp_usb_configured(void);
 extern void cmp_usb_register_control_class_callback(uint16_t interface,
                                                     usbd_control_callback callback);
+extern void cmp_usb_register_control_vendor_callback(uint16_t interface,
+                                                     usbd_control_callback callback);
 extern void cmp_usb_register_set_config_callback(usbd_set_config_callback callback);
 extern void cmp_usb_register_reset_callback(GenericCallback callback);
 extern void cmp_usb_register_sof_callback(GenericCallback callback);
@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/cdc.h>
+#include <libopencm3/cm3/cortex.h>
+
+#include "composite_usb_conf.h"
+#include "usb_pma.h"
+#include "cdc.h"
+#include "raw.h"
+
+#include "console.h"
+#include "ramfunc.h"
+#include "tick.h"
+
+#if USB_RAW_AVAILABLE
+
+/* The console port that the raw pipe takes over */
+#define RAW_CONSOLE_PORT 0
+
+_Static_assert((CONSOLE_TX_BUFFER_SIZE >= 2 * USB_RAW_PACKET_SIZE),
+               "TX buffer too small for the raw pipe");
+
+/*
+ * As with CDC-ACM, the OUT endpoint stays open while there is room for
+ * the packet being processed and the next one, and once closed, stays
+ * closed until the TX ring has drained to half full.
+ */
+#define RAW_RX_OPEN_SPACE (2 * USB_RAW_PACKET_SIZE)
+#define RAW_TX_LOW_WATERMARK(size) ((size) / 2)
+
+struct raw_stats {
+    uint32_t in_bytes;
+    uint32_t in_packets;
+    uint32_t out_bytes;
+    uint32_t out_packets;
+    uint32_t out_stalls;
+};
+
+static struct {
+    struct console* console;
+    bool open;
+    bool rx_stalled;
+
+    /* IN transfer state, as in cdc.c */
+    uint16_t packet_len;
+    uint32_t packet_timeout;
+    uint32_t packet_timestamp;
+    bool need_zlp;
+    uint8_t in_queued;
+
+    struct raw_stats stats;
+} raw;
+
+static usbd_device* raw_usbd_dev;
+static GenericCallback raw_activity_callback = NULL;
+
+static RAMFUNC void raw_set_nak(void) {
+    if (!raw.rx_stalled) {
+#if !USB_DOUBLE_BUFFERED_BULK
+        usbd_ep_nak_set(raw_usbd_dev, ENDP_RAW_DATA_OUT, true);
+#endif
+        raw.rx_stalled = true;
+        raw.stats.out_stalls++;
+    }
+}
+
+static RAMFUNC void raw_clear_nak(void) {
+    if (raw.rx_stalled) {
+#if USB_DOUBLE_BUFFERED_BULK
+        usb_dbl_ep_release_rx(ENDP_RAW_DATA_OUT);
+#else
+        usbd_ep_nak_set(raw_usbd_dev, ENDP_RAW_DATA_OUT, false);
+#endif
+        raw.rx_stalled = false;
+    }
+}
+
+/* Re-open the OUT endpoint; called from the console TX drain path */
+static RAMFUNC void raw_rx_resume(struct console* con) {
+    (void)con;
+    uint32_t masked = cm_mask_interrupts(1);
+    raw_clear_nak();
+    cm_mask_interrupts(masked);
+}
+
+static RAMFUNC void raw_bulk_data_out(usbd_device *usbd_dev, uint8_t ep) {
+    struct ring_span spans[2] = {{NULL, 0}, {NULL, 0}};
+    size_t space = 0;
+    if (raw.open) {
+        space = console_send_reserve(raw.console, spans);
+    }
+
+    bool keep_open = (space >= RAW_RX_OPEN_SPACE);
+
+    // Hold off raw_rx_resume() until the packet has been taken out of
+    // the endpoint buffer
+    uint32_t masked = cm_mask_interrupts(1);
+    if (!keep_open) {
+        raw_set_nak();
+    }
+#if USB_DOUBLE_BUFFERED_BULK
+    (void)usbd_dev;
+    uint16_t len = usb_dbl_ep_read_packet_split(ep,
+                                                spans[0].data, spans[0].len,
+                                                spans[1].data, spans[1].len,
+                                                keep_open);
+#else
+    uint8_t buf[USB_RAW_PACKET_SIZE];
+    uint16_t len = usbd_ep_read_packet(usbd_dev, ep, (void*)buf, sizeof(buf));
+    if (len > space) {
+        len = space;
+    }
+    uint16_t len0 = (len < spans[0].len) ? len : spans[0].len;
+    ring_copy(spans[0].data, buf, len0);
+    ring_copy(spans[1].data, &buf[len0], len - len0);
+#endif
+    cm_mask_interrupts(masked);
+
+    bool accept_more_packets = true;
+    if (len > 0) {
+        console_send_commit(raw.console, len);
+        raw.stats.out_bytes += len;
+        raw.stats.out_packets++;
+        if (raw_activity_callback) {
+            raw_activity_callback();
+        }
+
+        if (!keep_open) {
+            size_t size = console_send_buffer_size(raw.console);
+            accept_more_packets = console_notify_tx_space(raw.console,
+                                                          size - RAW_TX_LOW_WATERMARK(size),
+                                                          raw_rx_resume);
+        }
+    }
+
+    // Packets received while closed are discarded; don't hold those off
+    if (!keep_open && accept_more_packets) {
+        raw_rx_resume(raw.console);
+    }
+}
+
+static RAMFUNC bool raw_send_spans(const struct ring_span spans[2], uint16_t len) {
+    uint16_t len0 = (len < spans[0].len) ? len : spans[0].len;
+    uint16_t len1 = len - len0;
+#if USB_DOUBLE_BUFFERED_BULK
+    return usb_dbl_ep_write_packet_split(ENDP_RAW_DATA_IN,
+                                         spans[0].data, len0,
+                                         spans[1].data, len1);
+#else
+    uint8_t buf[USB_RAW_PACKET_SIZE];
+    ring_copy(buf, spans[0].data, len0);
+    ring_copy(&buf[len0], spans[1].data, len1);
+    uint16_t sent = usbd_ep_write_packet(raw_usbd_dev, ENDP_RAW_DATA_IN,
+                                         (const void*)buf, len);
+    return (sent == len);
+#endif
+}
+
+/*
+ * Send the next packet if an endpoint buffer is free, with the same
+ * latency timer and zero-length packet handling as the CDC IN path.
+ */
+static RAMFUNC void raw_start_in_transfer(void) {
+    if (!raw.open || !cmp_usb_configured() || raw.in_queued >= CDC_DATA_IN_BUFFERS) {
+        return;
+    }
+
+    struct ring_span spans[2];
+    size_t available = console_recv_peek(raw.console, spans);
+    if (raw.packet_len == 0 && available > 0) {
+        raw.packet_timestamp = get_micros();
+    }
+    raw.packet_len = (available < USB_RAW_PACKET_SIZE) ? available : USB_RAW_PACKET_SIZE;
+
+    bool ready;
+    if (raw.packet_len >= USB_RAW_PACKET_SIZE) {
+        ready = true;
+    } else if (raw.packet_len == 0 && !raw.need_zlp) {
+        ready = false;
+    } else {
+        ready = (uint32_t)(get_micros() - raw.packet_timestamp) >= raw.packet_timeout * 1000U;
+    }
+
+    if (ready && raw_send_spans(spans, raw.packet_len)) {
+        console_recv_consume(raw.console, raw.packet_len);
+        raw.stats.in_bytes += raw.packet_len;
+        raw.stats.in_packets++;
+        raw.in_queued++;
+        raw.need_zlp = (raw.packet_len == USB_RAW_PACKET_SIZE);
+        if (raw.need_zlp) {
+            raw.packet_timestamp = get_micros();
+        }
+        raw.packet_len = 0;
+
+        if (raw_activity_callback) {
+            raw_activity_callback();
+        }
+    }
+}
+
+static RAMFUNC void raw_bulk_data_in(usbd_device *usbd_dev, uint8_t ep) {
+    (void)usbd_dev;
+#if USB_DOUBLE_BUFFERED_BULK
+    usb_dbl_ep_tx_complete(ep);
+#else
+    (void)ep;
+#endif
+    if (raw.in_queued > 0) {
+        raw.in_queued--;
+    }
+    raw_start_in_transfer();
+}
+
+static void raw_set_open(bool open, bool flush) {
+    if (open == raw.open) {
+        return;
+    }
+
+    raw.open = open;
+    raw.packet_len = 0;
+    raw.need_zlp = false;
+    cdc_uart_app_claim(RAW_CONSOLE_PORT, open);
+
+    if (open && flush) {
+        struct ring_span spans[2];
+        console_recv_consume(raw.console, console_recv_peek(raw.console, spans));
+    }
+    if (open) {
+        memset(&raw.stats, 0, sizeof(raw.stats));
+    }
+}
+
+/* Write 32-bit counters little-endian, truncated to the host's length */
+static void raw_write_counters(const uint32_t* counters, uint16_t count,
+                               uint8_t **buf, uint16_t *len) {
+    uint16_t size = 4 * count;
+    if (*len < size) {
+        size = *len;
+    }
+    for (uint16_t i = 0; i < size; i++) {
+        (*buf)[i] = (uint8_t)(counters[i / 4] >> (8 * (i % 4)));
+    }
+    *len = size;
+}
+
+static int raw_control_vendor_request(usbd_device *usbd_dev,
+                                      struct usb_setup_data *req,
+                                      uint8_t **buf, uint16_t *len,
+                                      usbd_control_complete_callback* complete) {
+    (void)complete;
+    (void)usbd_dev;
+
+    int status = USBD_REQ_NOTSUPP;
+
+    switch (req->bRequest) {
+        case RAW_REQ_SET_OPEN: {
+            raw_set_open((req->wValue & RAW_OPEN) != 0,
+                         (req->wValue & RAW_OPEN_FLUSH) != 0);
+            status = USBD_REQ_HANDLED;
+            break;
+        }
+        case RAW_REQ_SET_LINE_CODING: {
+            if (*len >= sizeof(struct usb_cdc_line_coding)
+                && cdc_uart_app_set_line_coding(RAW_CONSOLE_PORT,
+                                                (const struct usb_cdc_line_coding*)*buf)) {
+                status = USBD_REQ_HANDLED;
+            }
+            break;
+        }
+        case RAW_REQ_GET_LINE_CODING: {
+            if (*len >= sizeof(struct usb_cdc_line_coding)
+                && cdc_uart_app_get_line_coding(RAW_CONSOLE_PORT,
+                                                (struct usb_cdc_line_coding*)*buf)) {
+                *len = sizeof(struct usb_cdc_line_coding);
+                status = USBD_REQ_HANDLED;
+            }
+            break;
+        }
+        case RAW_REQ_SET_LATENCY_TIMER: {
+            raw.packet_timeout = req->wValue;
+            status = USBD_REQ_HANDLED;
+            break;
+        }
+        case RAW_REQ_GET_LATENCY_TIMER: {
+            if (*len >= 2) {
+                uint16_t timeout = (raw.packet_timeout > 0xFFFF) ? 0xFFFF : raw.packet_timeout;
+                (*buf)[0] = timeout & 0xFF;
+                (*buf)[1] = (timeout >> 8) & 0xFF;
+                *len = 2;
+                status = USBD_REQ_HANDLED;
+            }
+            break;
+        }
+        case RAW_REQ_GET_RX_STATS: {
+            struct console_rx_stats stats;
+            console_get_rx_stats(raw.console, &stats);
+            const uint32_t counters[] = {
+                stats.overruns, stats.dropped, stats.overrun_errors,
+                stats.framing_errors, stats.parity_errors,
+            };
+            raw_write_counters(counters, sizeof(counters) / sizeof(counters[0]), buf, len);
+            status = USBD_REQ_HANDLED;
+            break;
+        }
+        case RAW_REQ_GET_STATS: {
+            const uint32_t counters[] = {
+                raw.stats.in_bytes, raw.stats.in_packets,
+                raw.stats.out_bytes, raw.stats.out_packets,
+                raw.stats.out_stalls,
+            };
+            raw_write_counters(counters, sizeof(counters) / sizeof(counters[0]), buf, len);
+            status = USBD_REQ_HANDLED;
+            break;
+        }
+        default: {
+            status = USBD_REQ_NOTSUPP;
+            break;
+        }
+    }
+
+    return status;
+}
+
+static void raw_reset(void) {
+    raw_set_open(false, false);
+}
+
+static void raw_set_config(usbd_device *usbd_dev, uint16_t wValue) {
+    (void)wValue;
+
+#if USB_DOUBLE_BUFFERED_BULK
+    usb_dbl_ep_setup(usbd_dev, ENDP_RAW_DATA_OUT, USB_RAW_PACKET_SIZE, raw_bulk_data_out);
+    usb_dbl_ep_setup(usbd_dev, ENDP_RAW_DATA_IN, USB_RAW_PACKET_SIZE, raw_bulk_data_in);
+#else
+    usbd_ep_setup(usbd_dev, ENDP_RAW_DATA_OUT, USB_ENDPOINT_ATTR_BULK,
+                  USB_RAW_PACKET_SIZE, raw_bulk_data_out);
+    usbd_ep_setup(usbd_dev, ENDP_RAW_DATA_IN, USB_ENDPOINT_ATTR_BULK,
+                  USB_RAW_PACKET_SIZE, raw_bulk_data_in);
+#endif
+    raw_set_open(false, false);
+    raw.rx_stalled = false;
+    raw.in_queued = 0;
+
+    cmp_usb_register_control_vendor_callback(INTF_RAW, raw_control_vendor_request);
+    cmp_usb_register_sof_callback(raw_start_in_transfer);
+}
+
+void raw_setup(usbd_device* usbd_dev, GenericCallback activity_cb) {
+    raw_usbd_dev = usbd_dev;
+    raw_activity_callback = activity_cb;
+    raw.console = console_port(RAW_CONSOLE_PORT);
+
+    cmp_usb_register_set_config_callback(raw_set_config);
+    cmp_usb_register_reset_callback(raw_reset);
+}
+
+/* Flush received data early on a console RX event, as cdc_uart_app_update() */
+bool raw_update(void) {
+    if (raw.open && console_rx_poll_event(raw.console)) {
+        raw_start_in_transfer();
+    }
+    return false;
+}
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef USB_RAW_H_INCLUDED
+#define USB_RAW_H_INCLUDED
+
+#include "usb_common.h"
+
+/*
+ * Vendor-specific interface with a bulk IN/OUT pair carrying the first
+ * console port's data as a plain byte stream, for host tools that talk
+ * to it through libusb instead of the tty layer. The pipe is closed
+ * until the host opens it, which takes the console port over from the
+ * CDC-ACM function until it's closed again.
+ */
+#define RAW_INTERFACE_SUBCLASS 0x54
+#define RAW_INTERFACE_PROTOCOL 0x01
+
+/* Vendor requests to the raw interface */
+
+/* wValue: RAW_OPEN_* flags to open the pipe, 0 to close it */
+#define RAW_REQ_SET_OPEN 0x01
+#define RAW_OPEN         (1 << 0)
+#define RAW_OPEN_FLUSH   (1 << 1)
+
+/* A struct usb_cdc_line_coding in the data stage, as with CDC-ACM */
+#define RAW_REQ_SET_LINE_CODING 0x03
+#define RAW_REQ_GET_LINE_CODING 0x04
+
+/* The same latency timer and receive statistics as the CDC interface */
+#define RAW_REQ_SET_LATENCY_TIMER 0x09
+#define RAW_REQ_GET_LATENCY_TIMER 0x0A
+#define RAW_REQ_GET_RX_STATS      0x20
+
+/*
+ * The pipe's own counters as little-endian 32-bit words: bytes and
+ * packets sent to the host, bytes and packets received from it, and the
+ * number of times the OUT endpoint was held off for lack of TX space.
+ */
+#define RAW_REQ_GET_STATS 0x21
+
+extern void raw_setup(usbd_device* usbd_dev, GenericCallback activity_cb);
+extern bool raw_update(void);
+
+#endif
@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/stm32/st_usbfs.h>
+
+#include "composite_usb_conf.h"
+#include "usb_pma.h"
+#include "ramfunc.h"
+
+#if USB_DOUBLE_BUFFERED_BULK
+
+/*
+ * In double-buffered mode, the hardware uses the buffer selected by the
+ * endpoint's DTOG bit and the application owns the buffer selected by
+ * SW_BUF, which is the DTOG bit of the unused direction. Whenever both
+ * bits select the same buffer, the hardware NAKs.
+ *
+ * Buffer 0 is described by the TX half of the buffer table entry and
+ * buffer 1 by the RX half, regardless of the endpoint direction.
+ */
+#define EP_RW_BITS (USB_EP_TYPE | USB_EP_KIND | USB_EP_ADDR)
+#define EP_CTR_BITS (USB_EP_RX_CTR | USB_EP_TX_CTR)
+
+#define BTABLE_ENTRY(ep) ((uint16_t)(*USB_BTABLE_REG + (ep) * 8))
+#define BTABLE_ADDR_0(ep)  (BTABLE_ENTRY(ep) + 0)
+#define BTABLE_COUNT_0(ep) (BTABLE_ENTRY(ep) + 2)
+#define BTABLE_ADDR_1(ep)  (BTABLE_ENTRY(ep) + 4)
+#define BTABLE_COUNT_1(ep) (BTABLE_ENTRY(ep) + 6)
+
+#define COUNT_MASK 0x03FF
+
+#define NUM_ENDPOINTS 8
+
+static uint16_t pma_top;
+
+/* IN endpoints with a packet written to the application's buffer */
+static bool tx_pending[NUM_ENDPOINTS];
+
+/* Write toggle bits without disturbing the other fields */
+static RAMFUNC void ep_toggle(uint8_t ep, uint16_t toggle_bits) {
+    uint16_t reg = *USB_EP_REG(ep) & EP_RW_BITS;
+    *USB_EP_REG(ep) = reg | EP_CTR_BITS | toggle_bits;
+}
+
+/* Set the read-write fields, leaving the toggle bits alone */
+static RAMFUNC void ep_set_rw(uint8_t ep, uint16_t rw_bits) {
+    *USB_EP_REG(ep) = (rw_bits & EP_RW_BITS) | EP_CTR_BITS;
+}
+
+static RAMFUNC void ep_set_toggle(uint8_t ep, uint16_t mask, uint16_t value) {
+    uint16_t reg = *USB_EP_REG(ep);
+    ep_toggle(ep, (reg & mask) ^ (value & mask));
+}
+
+static uint16_t pma_alloc(uint16_t size) {
+    pma_top -= (size + 1) & ~1U;
+    return pma_top;
+}
+
+/*
+ * Copy a buffer split into two segments to or from packet memory. The
+ * target copy routines work in half-words, so a half-word that straddles
+ * the two segments is assembled separately.
+ */
+static RAMFUNC void pma_copy_to_split(uint16_t offset,
+                                      const uint8_t* buf0, uint16_t len0,
+                                      const uint8_t* buf1, uint16_t len1) {
+    if (len0 & 1) {
+        usb_pma_copy_to(offset, buf0, len0 - 1);
+        offset += len0 - 1;
+        uint16_t value = buf0[len0 - 1];
+        if (len1 > 0) {
+            value |= (uint16_t)buf1[0] << 8;
+            buf1++;
+            len1--;
+        }
+        usb_pma_write16(offset, value);
+        offset += 2;
+    } else {
+        usb_pma_copy_to(offset, buf0, len0);
+        offset += len0;
+    }
+    usb_pma_copy_to(offset, buf1, len1);
+}
+
+static RAMFUNC void pma_copy_from_split(uint16_t offset,
+                                        uint8_t* buf0, uint16_t len0,
+                                        uint8_t* buf1, uint16_t len1) {
+    if (len0 & 1) {
+        usb_pma_copy_from(buf0, offset, len0 - 1);
+        offset += len0 - 1;
+        uint16_t value = usb_pma_read16(offset);
+        buf0[len0 - 1] = value & 0xFF;
+        if (len1 > 0) {
+            buf1[0] = value >> 8;
+            buf1++;
+            len1--;
+        }
+        offset += 2;
+    } else {
+        usb_pma_copy_from(buf0, offset, len0);
+        offset += len0;
+    }
+    usb_pma_copy_from(buf1, offset, len1);
+}
+
+void usb_dbl_buf_reset(void) {
+    uint8_t i;
+    pma_top = USB_PMA_SIZE;
+    for (i=0; i < NUM_ENDPOINTS; i++) {
+        tx_pending[i] = false;
+    }
+}
+
+void usb_dbl_ep_setup(usbd_device* usbd_dev, uint8_t addr,
+                      uint16_t max_size, usbd_endpoint_callback callback) {
+    uint8_t ep = addr & 0x7F;
+    usbd_ep_setup(usbd_dev, addr, USB_ENDPOINT_ATTR_BULK, max_size, callback);
+
+    uint16_t reg = *USB_EP_REG(ep);
+    ep_set_rw(ep, reg | USB_EP_KIND);
+
+    if (addr & 0x80) {
+        /* usbd_ep_setup() allocated buffer 0; add buffer 1 */
+        usb_pma_write16(BTABLE_ADDR_1(ep), pma_alloc(max_size));
+        usb_pma_write16(BTABLE_COUNT_1(ep), 0);
+        usb_pma_write16(BTABLE_COUNT_0(ep), 0);
+
+        /* Both flags select buffer 0, which the application fills first */
+        ep_set_toggle(ep, USB_EP_TX_DTOG | USB_EP_RX_DTOG, 0);
+        ep_set_toggle(ep, USB_EP_TX_STAT, USB_EP_TX_STAT_VALID);
+        tx_pending[ep] = false;
+    } else {
+        /*
+         * usbd_ep_setup() allocated buffer 1; add buffer 0, which
+         * takes the same block size encoding in its count field
+         */
+        usb_pma_write16(BTABLE_ADDR_0(ep), pma_alloc(max_size));
+        usb_pma_write16(BTABLE_COUNT_0(ep), usb_pma_read16(BTABLE_COUNT_1(ep)));
+
+        /* Receive into buffer 0 while the application owns buffer 1 */
+        ep_set_toggle(ep, USB_EP_RX_DTOG | USB_EP_TX_DTOG, USB_EP_TX_DTOG);
+        ep_set_toggle(ep, USB_EP_RX_STAT, USB_EP_RX_STAT_VALID);
+    }
+}
+
+RAMFUNC uint16_t usb_dbl_ep_read_packet_split(uint8_t addr,
+                                              uint8_t* buf0, uint16_t len0,
+                                              uint8_t* buf1, uint16_t len1,
+                                              bool release) {
+    uint8_t ep = addr & 0x7F;
+    uint16_t reg = *USB_EP_REG(ep);
+
+    /* Clear CTR_RX, and take over the received buffer if releasing */
+    *USB_EP_REG(ep) = (reg & EP_RW_BITS) | USB_EP_TX_CTR
+                      | (release ? USB_EP_TX_DTOG : 0);
+
+    /* The packet was received into the buffer not owned by the application */
+    bool buf1_used = (reg & USB_EP_TX_DTOG) == 0;
+    uint16_t count = usb_pma_read16(buf1_used ? BTABLE_COUNT_1(ep) : BTABLE_COUNT_0(ep)) & COUNT_MASK;
+    if (count > len0 + len1) {
+        count = len0 + len1;
+    }
+    if (len0 > count) {
+        len0 = count;
+    }
+    len1 = count - len0;
+
+    uint16_t offset = usb_pma_read16(buf1_used ? BTABLE_ADDR_1(ep) : BTABLE_ADDR_0(ep));
+    pma_copy_from_split(offset, buf0, len0, buf1, len1);
+    return count;
+}
+
+RAMFUNC uint16_t usb_dbl_ep_read_packet(uint8_t addr, void* buf, uint16_t len,
+                                        bool release) {
+    return usb_dbl_ep_read_packet_split(addr, (uint8_t*)buf, len, NULL, 0, release);
+}
+
+RAMFUNC void usb_dbl_ep_release_rx(uint8_t addr) {
+    ep_toggle(addr & 0x7F, USB_EP_TX_DTOG);
+}
+
+RAMFUNC bool usb_dbl_ep_write_packet_split(uint8_t addr,
+                                           const uint8_t* buf0, uint16_t len0,
+                                           const uint8_t* buf1, uint16_t len1) {
+    uint8_t ep = addr & 0x7F;
+    if (tx_pending[ep]) {
+        return false;
+    }
+
+    uint16_t reg = *USB_EP_REG(ep);
+    bool buf1_used = (reg & USB_EP_RX_DTOG) != 0;
+    pma_copy_to_split(usb_pma_read16(buf1_used ? BTABLE_ADDR_1(ep) : BTABLE_ADDR_0(ep)),
+                      buf0, len0, buf1, len1);
+    usb_pma_write16(buf1_used ? BTABLE_COUNT_1(ep) : BTABLE_COUNT_0(ep), len0 + len1);
+
+    bool hw_idle = ((reg & USB_EP_TX_DTOG) != 0) == buf1_used;
+    if (hw_idle) {
+        /* Hand the buffer over immediately */
+        ep_toggle(ep, USB_EP_RX_DTOG);
+    } else {
+        /* Hand it over once the hardware finishes the other buffer */
+        tx_pending[ep] = true;
+    }
+    return true;
+}
+
+RAMFUNC bool usb_dbl_ep_write_packet(uint8_t addr, const void* buf, uint16_t len) {
+    return usb_dbl_ep_write_packet_split(addr, (const uint8_t*)buf, len, NULL, 0);
+}
+
+RAMFUNC void usb_dbl_ep_tx_complete(uint8_t addr) {
+    uint8_t ep = addr & 0x7F;
+    if (tx_pending[ep]) {
+        tx_pending[ep] = false;
+        ep_toggle(ep, USB_EP_RX_DTOG);
+    }
+}
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef USB_PMA_H_INCLUDED
+#define USB_PMA_H_INCLUDED
+
+#include "usb_common.h"
+
+/*
+ * Target-specific USB packet memory access, implemented per family in
+ * $(TARGET_COMMON_DIR)/USB/usb_pma.c. Offsets are in bytes, as used in
+ * the buffer descriptor table.
+ */
+extern uint16_t usb_pma_read16(uint16_t offset);
+extern void usb_pma_write16(uint16_t offset, uint16_t value);
+extern void usb_pma_copy_to(uint16_t offset, const uint8_t* src, uint16_t len);
+extern void usb_pma_copy_from(uint8_t* dst, uint16_t offset, uint16_t len);
+
+/*
+ * Double-buffered bulk endpoints, which the libopencm3 st_usbfs driver
+ * doesn't support. The endpoint is first set up by usbd_ep_setup() to
+ * register the callback and allocate one buffer, then switched over to
+ * double-buffered mode with a second buffer from the top of packet memory.
+ */
+extern void usb_dbl_buf_reset(void);
+extern void usb_dbl_ep_setup(usbd_device* usbd_dev, uint8_t addr,
+                             uint16_t max_size, usbd_endpoint_callback callback);
+
+/*
+ * Copy out a received packet. If release is set, the other buffer is
+ * handed to the hardware first so the next packet can be received while
+ * this one is copied; otherwise the endpoint NAKs until released.
+ */
+extern uint16_t usb_dbl_ep_read_packet(uint8_t addr, void* buf, uint16_t len,
+                                       bool release);
+/* As above, scattering the packet across two buffers, such as ring spans */
+extern uint16_t usb_dbl_ep_read_packet_split(uint8_t addr,
+                                             uint8_t* buf0, uint16_t len0,
+                                             uint8_t* buf1, uint16_t len1,
+                                             bool release);
+/* Hand the application's buffer back to the hardware for the next packet */
+extern void usb_dbl_ep_release_rx(uint8_t addr);
+
+/* Queue a packet; returns false if both buffers are in use */
+extern bool usb_dbl_ep_write_packet(uint8_t addr, const void* buf, uint16_t len);
+/* As above, gathering the packet from two buffers */
+extern bool usb_dbl_ep_write_packet_split(uint8_t addr,
+                                          const uint8_t* buf0, uint16_t len0,
+                                          const uint8_t* buf1, uint16_t len1);
+/* Pass any queued packet on to the hardware, from the IN callback */
+extern void usb_dbl_ep_tx_complete(uint8_t addr);
+
+#endif
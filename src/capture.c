@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "capture.h"
+#include "console.h"
+#include "tick.h"
+
+_Static_assert(CAPTURE_LINE_BREAK == CONSOLE_LINE_BREAK
+               && CAPTURE_LINE_FRAMING == CONSOLE_LINE_FRAMING
+               && CAPTURE_LINE_PARITY == CONSOLE_LINE_PARITY
+               && CAPTURE_LINE_OVERRUN == CONSOLE_LINE_OVERRUN,
+               "Capture line events must match the console's");
+
+/* Type byte and timestamp */
+#define CAPTURE_HEADER_SIZE 5
+#define CAPTURE_SYNC_SIZE (CAPTURE_HEADER_SIZE + 4)
+#define CAPTURE_RUN_MAX 255
+
+/* "[ssss.uuuuuu] " */
+#define CAPTURE_PREFIX_SIZE 14
+
+void capture_start(struct capture* cap, struct console* con, uint8_t mode,
+                   uint32_t frame_ns) {
+    cap->console = con;
+    cap->mode = mode;
+    cap->frame_ns = frame_ns;
+    cap->sync_pending = (mode == CAPTURE_FRAMED);
+    cap->line_start = true;
+    cap->lost = 0;
+
+    /* Bytes already queued have no marks to time them by */
+    console_set_rx_marks(con, true);
+    struct ring_span spans[2];
+    console_recv_consume(con, console_recv_peek(con, spans));
+}
+
+void capture_stop(struct capture* cap) {
+    if (cap->mode != CAPTURE_OFF) {
+        console_set_rx_marks(cap->console, false);
+        cap->mode = CAPTURE_OFF;
+    }
+}
+
+void capture_set_frame_time(struct capture* cap, uint32_t frame_ns) {
+    cap->frame_ns = frame_ns;
+}
+
+static size_t capture_put_header(uint8_t* buf, uint8_t type, uint32_t time_us) {
+    buf[0] = type;
+    buf[1] = (uint8_t)time_us;
+    buf[2] = (uint8_t)(time_us >> 8);
+    buf[3] = (uint8_t)(time_us >> 16);
+    buf[4] = (uint8_t)(time_us >> 24);
+    return CAPTURE_HEADER_SIZE;
+}
+
+/*
+ * When the byte at position finished arriving, working back from the
+ * mark one frame per byte after it, plus the idle frame for idle marks.
+ * This assumes the bytes arrived back to back, which holds between marks
+ * since any longer gap would have raised an idle mark.
+ */
+static uint32_t capture_byte_time(const struct capture* cap,
+                                  const struct console_rx_mark* mark,
+                                  uint32_t position) {
+    uint32_t frames = mark->position - position - 1;
+    if (mark->kind == CONSOLE_RX_MARK_IDLE) {
+        frames++;
+    }
+    return mark->time_us - (uint32_t)(((uint64_t)frames * cap->frame_ns) / 1000);
+}
+
+static uint8_t capture_span_byte(const struct ring_span spans[2], size_t index) {
+    if (index < spans[0].len) {
+        return spans[0].data[index];
+    }
+    return spans[1].data[index - spans[0].len];
+}
+
+/*
+ * Write the record for a mark whose bytes have all been sent; returns
+ * false if it doesn't fit. Only idle and line marks have records, and
+ * only in framed mode.
+ */
+static bool capture_put_mark(const struct capture* cap, const struct console_rx_mark* mark,
+                             uint8_t* buf, size_t size, size_t* len) {
+    if (cap->mode != CAPTURE_FRAMED) {
+        return true;
+    }
+
+    if (mark->kind == CONSOLE_RX_MARK_IDLE) {
+        if (size - *len < CAPTURE_HEADER_SIZE) {
+            return false;
+        }
+        *len += capture_put_header(&buf[*len], CAPTURE_REC_IDLE,
+                                   mark->time_us - cap->frame_ns / 1000);
+    } else if (mark->kind == CONSOLE_RX_MARK_LINE) {
+        if (size - *len < CAPTURE_HEADER_SIZE + 1) {
+            return false;
+        }
+        *len += capture_put_header(&buf[*len], CAPTURE_REC_LINE, mark->time_us);
+        buf[(*len)++] = mark->events;
+    }
+    return true;
+}
+
+/* Write up to count bytes as one RUN record; returns the bytes consumed */
+static size_t capture_put_run(const struct capture* cap, const struct console_rx_mark* mark,
+                              uint32_t position, const struct ring_span spans[2],
+                              size_t count, uint8_t* buf, size_t size, size_t* len) {
+    size_t space = size - *len;
+    if (space < CAPTURE_HEADER_SIZE + 2) {
+        return 0;
+    }
+
+    size_t n = space - CAPTURE_HEADER_SIZE - 1;
+    if (n > count) {
+        n = count;
+    }
+    if (n > CAPTURE_RUN_MAX) {
+        n = CAPTURE_RUN_MAX;
+    }
+
+    *len += capture_put_header(&buf[*len], CAPTURE_REC_RUN,
+                               capture_byte_time(cap, mark, position));
+    buf[(*len)++] = (uint8_t)n;
+    for (size_t i = 0; i < n; i++) {
+        buf[(*len)++] = capture_span_byte(spans, i);
+    }
+    return n;
+}
+
+static size_t capture_put_prefix(uint8_t* buf, uint32_t time_us) {
+    uint32_t seconds = time_us / 1000000;
+    uint32_t micros = time_us % 1000000;
+
+    buf[0] = '[';
+    for (int i = 4; i >= 1; i--) {
+        buf[i] = (seconds > 0 || i == 4) ? (uint8_t)('0' + seconds % 10) : ' ';
+        seconds /= 10;
+    }
+    buf[5] = '.';
+    for (int i = 11; i >= 6; i--) {
+        buf[i] = (uint8_t)('0' + micros % 10);
+        micros /= 10;
+    }
+    buf[12] = ']';
+    buf[13] = ' ';
+    return CAPTURE_PREFIX_SIZE;
+}
+
+/* Copy up to count bytes, prefixing each line; returns the bytes consumed */
+static size_t capture_put_text(struct capture* cap, const struct console_rx_mark* mark,
+                               uint32_t position, const struct ring_span spans[2],
+                               size_t count, uint8_t* buf, size_t size, size_t* len) {
+    size_t n = 0;
+    while (n < count) {
+        if (cap->line_start) {
+            if (size - *len < CAPTURE_PREFIX_SIZE + 1) {
+                break;
+            }
+            *len += capture_put_prefix(&buf[*len],
+                                       capture_byte_time(cap, mark, position + n));
+            cap->line_start = false;
+        } else if (size - *len < 1) {
+            break;
+        }
+
+        uint8_t c = capture_span_byte(spans, n++);
+        buf[(*len)++] = c;
+        cap->line_start = (c == '\n');
+    }
+    return n;
+}
+
+/*
+ * Fill buf with up to size bytes of the capture stream, consuming the
+ * RX bytes that went into it. Bytes after the last mark are left until
+ * the next one arrives.
+ */
+size_t capture_fill(struct capture* cap, uint8_t* buf, size_t size) {
+    struct console* con = cap->console;
+    size_t len = 0;
+
+    if (cap->sync_pending) {
+        if (size < CAPTURE_SYNC_SIZE) {
+            return 0;
+        }
+        len += capture_put_header(buf, CAPTURE_REC_SYNC, get_micros());
+        buf[len++] = 'T';
+        buf[len++] = 'L';
+        buf[len++] = 'C';
+        buf[len++] = CAPTURE_VERSION;
+        cap->sync_pending = false;
+    }
+
+    cap->lost += console_take_rx_marks_lost(con);
+
+    while (true) {
+        if (cap->lost > 0 && cap->mode == CAPTURE_FRAMED) {
+            if (size - len < CAPTURE_HEADER_SIZE + 1) {
+                break;
+            }
+            len += capture_put_header(&buf[len], CAPTURE_REC_LOST, get_micros());
+            buf[len++] = (cap->lost > 0xFF) ? 0xFF : (uint8_t)cap->lost;
+            cap->lost = 0;
+        }
+
+        struct console_rx_mark mark;
+        if (!console_peek_rx_mark(con, &mark)) {
+            break;
+        }
+
+        struct ring_span spans[2];
+        size_t available = console_recv_peek(con, spans);
+        uint32_t position = console_recv_position(con);
+        uint32_t ahead = mark.position - position;
+
+        if (ahead == 0 || ahead > 0x80000000U) {
+            /* Everything before the mark has been sent */
+            if (!capture_put_mark(cap, &mark, buf, size, &len)) {
+                break;
+            }
+            console_drop_rx_mark(con);
+            continue;
+        }
+
+        size_t count = (ahead < available) ? ahead : available;
+        if (count == 0) {
+            break;
+        }
+
+        size_t consumed;
+        if (cap->mode == CAPTURE_FRAMED) {
+            consumed = capture_put_run(cap, &mark, position, spans, count, buf, size, &len);
+        } else {
+            consumed = capture_put_text(cap, &mark, position, spans, count, buf, size, &len);
+        }
+        if (consumed == 0) {
+            break;
+        }
+        console_recv_consume(con, consumed);
+    }
+
+    return len;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CAPTURE_H_INCLUDED
+#define CAPTURE_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Capture mode: instead of the raw RX bytes, the host is sent the bytes
+ * with device timestamps, which are free of USB and host scheduling
+ * jitter. Timestamps are in microseconds and wrap every 71 minutes.
+ *
+ * In framed mode, the stream is a sequence of records, each a type byte
+ * and a little-endian 32-bit timestamp, followed by:
+ *
+ *   SYNC   'T' 'L' 'C' version; sent first, so decoders can check the mode
+ *   RUN    length byte and data; the time the first byte was received
+ *   IDLE   nothing; the time the line went idle after the last byte
+ *   LINE   CAPTURE_LINE_* event bits, when the USART reported them
+ *   LOST   count of timing marks lost; nearby timestamps may be off
+ *
+ * In text mode, each line is prefixed with the time its first byte was
+ * received as "[seconds.micros] ", and idle gaps and line events are not
+ * shown.
+ *
+ * Byte times are worked back from the next mark, one frame time per
+ * byte, so bytes are only sent once the line goes idle or the RX DMA
+ * passes a half-ring boundary.
+ */
+enum capture_mode {
+    CAPTURE_OFF = 0,
+    CAPTURE_FRAMED = 1,
+    CAPTURE_TEXT = 2,
+};
+
+#define CAPTURE_REC_SYNC 0x01
+#define CAPTURE_REC_RUN  0x02
+#define CAPTURE_REC_IDLE 0x03
+#define CAPTURE_REC_LINE 0x04
+#define CAPTURE_REC_LOST 0x05
+
+#define CAPTURE_VERSION 1
+
+/* Same bits as CONSOLE_LINE_* */
+#define CAPTURE_LINE_BREAK   (1 << 0)
+#define CAPTURE_LINE_FRAMING (1 << 1)
+#define CAPTURE_LINE_PARITY  (1 << 2)
+#define CAPTURE_LINE_OVERRUN (1 << 3)
+
+struct console;
+
+struct capture {
+    struct console* console;
+    uint8_t mode;
+    uint32_t frame_ns;
+    bool sync_pending;
+    bool line_start;
+    uint32_t lost;
+};
+
+extern void capture_start(struct capture* cap, struct console* con, uint8_t mode,
+                          uint32_t frame_ns);
+extern void capture_stop(struct capture* cap);
+extern void capture_set_frame_time(struct capture* cap, uint32_t frame_ns);
+extern size_t capture_fill(struct capture* cap, uint8_t* buf, size_t size);
+
+#endif
@@ -16,227 +16,1380 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <libopencm3/cm3/cortex.h>
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/exti.h>
+#include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
 
 #include "console.h"
+#include "irq_priority.h"
 #include "target.h"
+#include "console_regs.h"
+#include "profile.h"
+#include "ramfunc.h"
+#include "tick.h"
+
+/* The TX USART interrupt drives TXE without TX DMA, and starts breaks */
+#define CONSOLE_TX_USART_IRQ_USED (!CONSOLE_TX_DMA_AVAILABLE || CONSOLE_BREAK_AVAILABLE)
+
+/* Peripherals used by one port; TX and RX share a USART except when split */
+struct console_hw {
+    uint32_t tx_usart;
+    uint32_t rx_usart;
+    const uint32_t* tx_clock_freq;
+    const uint32_t* rx_clock_freq;
+    uint8_t tx_usart_irq;
+    uint8_t rx_usart_irq;
+
+    uint32_t rx_dma;
+    uint8_t rx_dma_channel;
+    uint8_t rx_dma_irq;
+    enum rcc_periph_clken rx_dma_clock;
+
+    uint32_t tx_dma;
+    uint8_t tx_dma_channel;
+    uint8_t tx_dma_irq;
+    enum rcc_periph_clken tx_dma_clock;
+};
+
+/*
+ * Per-port state. The TX ring is filled from USB and drained by DMA or
+ * the TXE interrupt. The RX ring is filled by circular DMA, so its tail
+ * is caught up from the DMA counter before reading.
+ */
+struct console {
+    const struct console_hw* hw;
+    struct ring* tx_ring;
+    struct ring* rx_ring;
+
+    /* Number of bytes in the TX DMA transfer in progress, or 0 if idle */
+    volatile uint16_t tx_dma_len;
+    /* TX interrupt statistics, for comparing the DMA and TXE drivers */
+    volatile struct console_isr_stats tx_isr_stats;
+
+    /* Armed notification for when the TX ring has drained */
+    volatile size_t tx_notify_space;
+    console_callback tx_notify_callback;
+
+    /* Set from the RX ISRs when buffered data should be flushed to the host */
+    volatile bool rx_event;
+    console_callback rx_event_callback;
+
+    /*
+     * The RX DMA channel only reports its offset within the ring, so the
+     * half/full interrupts count how many half-rings it has written.
+     * Together with the consumer's running total, that shows when the
+     * DMA has lapped the reader and overwritten data that was never read.
+     */
+    volatile uint32_t rx_dma_halves;
+    volatile uint32_t rx_consumed;
+    volatile struct console_rx_stats rx_stats;
+    volatile uint16_t line_events;
+
+    /* Fullest the rings have been, for the self-test */
+    volatile uint16_t tx_high_water;
+    volatile uint16_t rx_high_water;
+
+    /* Half-duplex internal loopback, applied by console_reconfigure() */
+    bool loopback;
+
+    /* RX timing marks for capture mode, queued by the RX ISRs */
+    volatile bool rx_marks_enabled;
+    volatile uint8_t rx_mark_head;
+    volatile uint8_t rx_mark_tail;
+    volatile uint32_t rx_marks_lost;
+    struct console_rx_mark rx_marks[CONSOLE_RX_MARKS];
+};
+
+/* Extra ports are always one USART with a pair of DMA channels */
+#define CONSOLE_PORT_HW(n) {                                    \
+        .tx_usart = CONSOLE_PORT##n##_USART,                    \
+        .rx_usart = CONSOLE_PORT##n##_USART,                    \
+        .tx_clock_freq = &CONSOLE_PORT##n##_USART_CLOCK_FREQ,   \
+        .rx_clock_freq = &CONSOLE_PORT##n##_USART_CLOCK_FREQ,   \
+        .tx_usart_irq = CONSOLE_PORT##n##_USART_NVIC_LINE,      \
+        .rx_usart_irq = CONSOLE_PORT##n##_USART_NVIC_LINE,      \
+        .rx_dma = CONSOLE_PORT##n##_DMA_CONTROLLER,             \
+        .rx_dma_channel = CONSOLE_PORT##n##_RX_DMA_CHANNEL,     \
+        .rx_dma_irq = CONSOLE_PORT##n##_RX_DMA_NVIC_LINE,       \
+        .rx_dma_clock = CONSOLE_PORT##n##_DMA_CLOCK,            \
+        .tx_dma = CONSOLE_PORT##n##_DMA_CONTROLLER,             \
+        .tx_dma_channel = CONSOLE_PORT##n##_TX_DMA_CHANNEL,     \
+        .tx_dma_irq = CONSOLE_PORT##n##_TX_DMA_NVIC_LINE,       \
+        .tx_dma_clock = CONSOLE_PORT##n##_DMA_CLOCK,            \
+    }
+
+static const struct console_hw console_hw[CONSOLE_NUM_PORTS] = {
+    {
+        .tx_usart = CONSOLE_TX_USART,
+        .rx_usart = CONSOLE_RX_USART,
+        .tx_clock_freq = &CONSOLE_TX_USART_CLOCK_FREQ,
+        .rx_clock_freq = &CONSOLE_RX_USART_CLOCK_FREQ,
+        .tx_usart_irq = CONSOLE_TX_USART_NVIC_LINE,
+        .rx_usart_irq = CONSOLE_RX_USART_NVIC_LINE,
+        .rx_dma = CONSOLE_RX_DMA_CONTROLLER,
+        .rx_dma_channel = CONSOLE_RX_DMA_CHANNEL,
+        .rx_dma_irq = CONSOLE_RX_DMA_NVIC_LINE,
+        .rx_dma_clock = CONSOLE_RX_DMA_CLOCK,
+#if CONSOLE_TX_DMA_AVAILABLE
+        .tx_dma = CONSOLE_TX_DMA_CONTROLLER,
+        .tx_dma_channel = CONSOLE_TX_DMA_CHANNEL,
+        .tx_dma_irq = CONSOLE_TX_DMA_NVIC_LINE,
+        .tx_dma_clock = CONSOLE_TX_DMA_CLOCK,
+#endif
+    },
+#if CONSOLE_NUM_PORTS > 1
+    CONSOLE_PORT_HW(1),
+#endif
+#if CONSOLE_NUM_PORTS > 2
+    CONSOLE_PORT_HW(2),
+#endif
+};
+
+RING_DEFINE(console_tx_ring0, CONSOLE_TX_BUFFER_SIZE);
+RING_DEFINE(console_rx_ring0, CONSOLE_RX_BUFFER_SIZE);
+#if CONSOLE_NUM_PORTS > 1
+RING_DEFINE(console_tx_ring1, CONSOLE_PORT1_TX_BUFFER_SIZE);
+RING_DEFINE(console_rx_ring1, CONSOLE_PORT1_RX_BUFFER_SIZE);
+#endif
+#if CONSOLE_NUM_PORTS > 2
+RING_DEFINE(console_tx_ring2, CONSOLE_PORT2_TX_BUFFER_SIZE);
+RING_DEFINE(console_rx_ring2, CONSOLE_PORT2_RX_BUFFER_SIZE);
+#endif
+
+static struct console console_ports[CONSOLE_NUM_PORTS] = {
+    { .hw = &console_hw[0], .tx_ring = &console_tx_ring0, .rx_ring = &console_rx_ring0 },
+#if CONSOLE_NUM_PORTS > 1
+    { .hw = &console_hw[1], .tx_ring = &console_tx_ring1, .rx_ring = &console_rx_ring1 },
+#endif
+#if CONSOLE_NUM_PORTS > 2
+    { .hw = &console_hw[2], .tx_ring = &console_tx_ring2, .rx_ring = &console_rx_ring2 },
+#endif
+};
+
+/* The port that owns the handshake lines, break timer and modem inputs */
+#define CONSOLE_PRIMARY (&console_ports[0])
+
+struct console* console_port(uint8_t index) {
+    return (index < CONSOLE_NUM_PORTS) ? &console_ports[index] : NULL;
+}
+
+uint8_t console_port_index(const struct console* con) {
+    return (uint8_t)(con - console_ports);
+}
+
+static void console_tx_dma_setup(struct console* con);
+#if CONSOLE_BREAK_AVAILABLE
+static void console_break_timer_setup(void);
+static void console_break_end(void);
+#endif
+#if CONSOLE_FLOW_CONTROL_AVAILABLE
+static void console_flow_control_setup(void);
+static void console_cts_update(void);
+#endif
+
+/*
+ * Find the divider for one USART. The USART clock is fixed by the bus it
+ * sits on, so the only choice is between 16x and, where the peripheral
+ * has it, 8x oversampling. 16x is preferred when both are equally
+ * accurate, since it tolerates more noise and clock mismatch.
+ */
+static bool console_plan_usart_baudrate(uint32_t clock, uint32_t baudrate,
+                                        struct console_usart_baud* plan) {
+    plan->rate = 0;
+    plan->brr = 0;
+    plan->error_permille = UINT16_MAX;
+    plan->over8 = false;
+
+    if (baudrate == 0) {
+        return false;
+    }
+
+    uint32_t div16 = (clock + baudrate/2) / baudrate;
+    if (div16 >= 16 && div16 <= 0xFFFF) {
+        plan->rate = clock / div16;
+        plan->brr = (uint16_t)div16;
+    }
+
+#if CONSOLE_USART_OVER8_AVAILABLE
+    uint32_t div8 = (2 * clock + baudrate/2) / baudrate;
+    if (div8 >= 16 && div8 <= 0xFFFF) {
+        uint32_t rate8 = (2 * clock) / div8;
+        uint32_t error8 = (rate8 > baudrate) ? (rate8 - baudrate) : (baudrate - rate8);
+        uint32_t error16 = (plan->rate > baudrate) ? (plan->rate - baudrate) : (baudrate - plan->rate);
+        if (plan->rate == 0 || error8 < error16) {
+            plan->rate = rate8;
+            plan->brr = (uint16_t)((div8 & 0xFFF0) | ((div8 & 0x000F) >> 1));
+            plan->over8 = true;
+        }
+    }
+#endif
+
+    if (plan->rate == 0) {
+        return false;
+    }
+
+    uint32_t error = (plan->rate > baudrate) ? (plan->rate - baudrate) : (baudrate - plan->rate);
+    plan->error_permille = (uint16_t)((error * 1000 + baudrate/2) / baudrate);
+    return plan->error_permille <= CONSOLE_BAUD_MAX_ERROR_PERMILLE;
+}
+
+/*
+ * Work out the dividers for both directions, which may be on USARTs with
+ * different clocks. Returns false if either direction is unreachable or
+ * outside the error tolerance.
+ */
+bool console_plan_baudrate(const struct console* con, uint32_t baudrate,
+                           struct console_baud_plan* plan) {
+    const struct console_hw* hw = con->hw;
+    bool tx_ok = console_plan_usart_baudrate(*hw->tx_clock_freq, baudrate, &plan->tx);
+    bool rx_ok = tx_ok;
+    if (hw->rx_usart != hw->tx_usart) {
+        rx_ok = console_plan_usart_baudrate(*hw->rx_clock_freq, baudrate, &plan->rx);
+    } else {
+        plan->rx = plan->tx;
+    }
+    return tx_ok && rx_ok;
+}
+
+/* The achieved rate to report to the host: the less accurate direction */
+uint32_t console_baud_plan_rate(const struct console_baud_plan* plan) {
+    if (plan->rx.error_permille > plan->tx.error_permille) {
+        return plan->rx.rate;
+    }
+    return plan->tx.rate;
+}
+
+/* Program a planned divider; the USART must be disabled */
+static void console_apply_baudrate(uint32_t usart, const struct console_usart_baud* plan) {
+    if (plan->rate == 0) {
+        return;
+    }
+
+#if CONSOLE_USART_OVER8_AVAILABLE
+    if (plan->over8) {
+        USART_CR1(usart) |= USART_CR1_OVER8;
+    } else {
+        USART_CR1(usart) &= ~USART_CR1_OVER8;
+    }
+#endif
+    USART_BRR(usart) = plan->brr;
+}
+
+static void console_port_setup(struct console* con, uint32_t baudrate) {
+    const struct console_hw* hw = con->hw;
+    struct console_baud_plan plan;
+
+    console_plan_baudrate(con, baudrate, &plan);
+    console_apply_baudrate(hw->tx_usart, &plan.tx);
+    usart_set_databits(hw->tx_usart, 8);
+    usart_set_parity(hw->tx_usart, USART_PARITY_NONE);
+    usart_set_stopbits(hw->tx_usart, USART_STOPBITS_1);
+
+    // Only enable TX for logging by default
+    usart_set_mode(hw->tx_usart, CONSOLE_USART_MODE & ~USART_MODE_RX);
+    usart_set_flow_control(hw->tx_usart, USART_FLOWCONTROL_NONE);
+
+#if CONSOLE_RX_DMA_AVAILABLE
+    rcc_periph_clock_enable(hw->rx_dma_clock);
+    nvic_set_priority(hw->rx_dma_irq, IRQ_PRIORITY_CONSOLE_DMA);
+#endif
+    nvic_set_priority(hw->tx_usart_irq, IRQ_PRIORITY_CONSOLE_USART);
+    nvic_set_priority(hw->rx_usart_irq, IRQ_PRIORITY_CONSOLE_USART);
+
+#if CONSOLE_TX_DMA_AVAILABLE
+    rcc_periph_clock_enable(hw->tx_dma_clock);
+    nvic_set_priority(hw->tx_dma_irq, IRQ_PRIORITY_CONSOLE_DMA);
+    console_tx_dma_setup(con);
+#endif
+#if CONSOLE_TX_USART_IRQ_USED
+    nvic_enable_irq(hw->tx_usart_irq);
+#endif
+}
 
 void console_setup(uint32_t baudrate) {
-    /* Setup GPIO */
+    /* Setup GPIO for every port */
     target_console_init();
 
-    usart_set_baudrate(CONSOLE_TX_USART, baudrate);
-    usart_set_databits(CONSOLE_TX_USART, 8);
-    usart_set_parity(CONSOLE_TX_USART, USART_PARITY_NONE);
-    usart_set_stopbits(CONSOLE_TX_USART, USART_STOPBITS_1);
+    for (uint8_t i = 0; i < CONSOLE_NUM_PORTS; i++) {
+        console_port_setup(&console_ports[i], baudrate);
+    }
 
-    // Only enable TX for logging by default
-    usart_set_mode(CONSOLE_TX_USART, CONSOLE_USART_MODE & ~USART_MODE_RX);
-    usart_set_flow_control(CONSOLE_TX_USART, USART_FLOWCONTROL_NONE);
+#if CONSOLE_BREAK_AVAILABLE
+    console_break_timer_setup();
+#endif
 
-    usart_enable(CONSOLE_TX_USART);
+#if CONSOLE_FLOW_CONTROL_AVAILABLE
+    console_flow_control_setup();
+    console_cts_update();
+    nvic_enable_irq(CONSOLE_CTS_NVIC_LINE);
+#endif
 
-    nvic_enable_irq(CONSOLE_TX_USART_NVIC_LINE);
+    for (uint8_t i = 0; i < CONSOLE_NUM_PORTS; i++) {
+        usart_enable(console_ports[i].hw->tx_usart);
+    }
+}
 
-#if CONSOLE_RX_DMA_AVAILABLE
-    rcc_periph_clock_enable(CONSOLE_RX_DMA_CLOCK);
+#if CONSOLE_TX_DMA_AVAILABLE
+static void console_tx_dma_setup(struct console* con) {
+    const struct console_hw* hw = con->hw;
+    dma_channel_reset(hw->tx_dma, hw->tx_dma_channel);
+    con->tx_dma_len = 0;
+
+    dma_set_peripheral_address(hw->tx_dma, hw->tx_dma_channel, (uint32_t)&CONSOLE_USART_TDR(hw->tx_usart));
+    dma_set_read_from_memory(hw->tx_dma, hw->tx_dma_channel);
+    dma_enable_memory_increment_mode(hw->tx_dma, hw->tx_dma_channel);
+    dma_set_peripheral_size(hw->tx_dma, hw->tx_dma_channel, DMA_CCR_PSIZE_8BIT);
+    dma_set_memory_size(hw->tx_dma, hw->tx_dma_channel, DMA_CCR_MSIZE_8BIT);
+    dma_set_priority(hw->tx_dma, hw->tx_dma_channel, DMA_CCR_PL_MEDIUM);
+    dma_enable_transfer_complete_interrupt(hw->tx_dma, hw->tx_dma_channel);
+
+    usart_enable_tx_dma(hw->tx_usart);
+    nvic_enable_irq(hw->tx_dma_irq);
+}
+
+static void console_tx_dma_stop(struct console* con) {
+    const struct console_hw* hw = con->hw;
+    nvic_disable_irq(hw->tx_dma_irq);
+    usart_disable_tx_dma(hw->tx_usart);
+    dma_disable_channel(hw->tx_dma, hw->tx_dma_channel);
+    con->tx_dma_len = 0;
+}
+#endif
+
+#if CONSOLE_RX_EVENT_FLUSH
+static RAMFUNC void console_rx_signal_event(struct console* con) {
+    con->rx_event = true;
+    if (con->rx_event_callback) {
+        con->rx_event_callback(con);
+    }
+}
+#else
+static RAMFUNC void console_rx_signal_event(struct console* con) {
+    (void)con;
+}
+#endif
+
+static RAMFUNC void console_rx_error_irq(const struct console* con, bool enable) {
+    uint32_t usart = con->hw->rx_usart;
+    usart_reg_modify(&USART_CR1(usart), USART_CR1_PEIE, enable ? USART_CR1_PEIE : 0);
+    usart_reg_modify(&USART_CR3(usart), USART_CR3_EIE, enable ? USART_CR3_EIE : 0);
+}
+
+#if CONSOLE_USART_ERRORS_STICKY
+/*
+ * The error flags clear once the status register has been read and the
+ * DMA reads the next byte, so turn the error interrupts back on once
+ * that has happened. Errors in the meantime are counted as one.
+ */
+static RAMFUNC void console_rx_error_irq_rearm(const struct console* con) {
+    if (!usart_reg_get_flag(con->hw->rx_usart, USART_SR_ORE | USART_SR_FE | USART_SR_PE)) {
+        console_rx_error_irq(con, true);
+    }
+}
+#endif
+
+/* Also call callback from the RX ISRs whenever an RX event is flagged */
+void console_set_rx_event_callback(struct console* con, console_callback callback) {
+#if CONSOLE_RX_EVENT_FLUSH
+    con->rx_event_callback = callback;
+#else
+    (void)con;
+    (void)callback;
 #endif
 }
 
-void console_tx_buffer_clear(void);
-void console_rx_buffer_clear(void);
+/*
+ * Queue an RX timing mark if capture mode wants them. Called from RX
+ * ISRs of different priorities and from the consumer, so the queue is
+ * only touched with interrupts masked. Marks that don't fit are counted
+ * instead.
+ */
+static RAMFUNC void console_rx_mark(struct console* con, uint8_t kind, uint32_t position,
+                                    uint8_t events) {
+    if (!con->rx_marks_enabled) {
+        return;
+    }
 
-#define IS_POW_OF_TWO(X) (((X) & ((X)-1)) == 0)
-_Static_assert(IS_POW_OF_TWO(CONSOLE_TX_BUFFER_SIZE),
-               "Unmasked circular buffer size must be a power of two");
-_Static_assert(CONSOLE_TX_BUFFER_SIZE <= UINT16_MAX/2,
-               "Buffer size too big for unmasked circular buffer");
+    uint32_t masked = cm_mask_interrupts(1);
+    uint8_t head = con->rx_mark_head;
+    if ((uint8_t)(head - con->rx_mark_tail) < CONSOLE_RX_MARKS) {
+        struct console_rx_mark* mark = &con->rx_marks[head & (CONSOLE_RX_MARKS - 1)];
+        mark->position = position;
+        mark->time_us = get_micros();
+        mark->kind = kind;
+        mark->events = events;
+        con->rx_mark_head = head + 1;
+    } else {
+        con->rx_marks_lost++;
+    }
+    cm_mask_interrupts(masked);
+}
 
-static volatile uint8_t console_tx_buffer[CONSOLE_TX_BUFFER_SIZE];
-static volatile uint8_t console_rx_buffer[CONSOLE_RX_BUFFER_SIZE];
+static uint32_t console_rx_dma_position(const struct console* con);
 
-static volatile uint16_t console_tx_head = 0;
-static volatile uint16_t console_tx_tail = 0;
+/* Flag line events; called from both the RX ISRs and the consumer */
+static RAMFUNC void console_line_event(struct console* con, uint16_t events) {
+    uint32_t masked = cm_mask_interrupts(1);
+    con->line_events |= events;
+    cm_mask_interrupts(masked);
+    if (con->rx_marks_enabled) {
+        console_rx_mark(con, CONSOLE_RX_MARK_LINE, console_rx_dma_position(con), events);
+    }
+}
 
-static uint16_t console_rx_head = 0;
+/* Return and clear the line events seen since the last call */
+uint16_t console_take_line_events(struct console* con) {
+    uint32_t masked = cm_mask_interrupts(1);
+    uint16_t events = con->line_events;
+    con->line_events = 0;
+    cm_mask_interrupts(masked);
+    return events;
+}
 
-void console_reconfigure(uint32_t baudrate, uint32_t databits, uint32_t stopbits,
-                         uint32_t parity) {
-    // Disable the UART and clear buffers
-    usart_disable(CONSOLE_TX_USART);
-#if CONSOLE_SPLIT_USART
-    usart_disable(CONSOLE_RX_USART);
+/* Current level of the modem status inputs that the port has */
+uint16_t console_get_modem_status(struct console* con) {
+    uint16_t status = 0;
+    if (con != CONSOLE_PRIMARY) {
+        return status;
+    }
+#ifdef CONSOLE_DCD_GPIO_PORT
+    if (gpio_get(CONSOLE_DCD_GPIO_PORT, CONSOLE_DCD_GPIO_PIN) == 0) {
+        status |= CONSOLE_MODEM_DCD;
+    }
 #endif
+#ifdef CONSOLE_DSR_GPIO_PORT
+    if (gpio_get(CONSOLE_DSR_GPIO_PORT, CONSOLE_DSR_GPIO_PIN) == 0) {
+        status |= CONSOLE_MODEM_DSR;
+    }
+#endif
+#ifdef CONSOLE_RI_GPIO_PORT
+    if (gpio_get(CONSOLE_RI_GPIO_PORT, CONSOLE_RI_GPIO_PIN) == 0) {
+        status |= CONSOLE_MODEM_RI;
+    }
+#endif
+    return status;
+}
+
+/*
+ * Total bytes written by the RX DMA channel since RX was started. The
+ * half-ring count may trail the channel by one boundary if its interrupt
+ * is still pending, so the counter only picks the position within the
+ * ring ahead of the last boundary counted. That holds as long as the DMA
+ * handler, which has the highest priority, is never held off for more
+ * than half a ring.
+ */
+static RAMFUNC uint32_t console_rx_dma_position(const struct console* con) {
+    const struct console_hw* hw = con->hw;
+    uint32_t size = ring_size(con->rx_ring);
+    uint32_t halves;
+    uint32_t offset;
+    do {
+        halves = con->rx_dma_halves;
+        offset = size - DMA_CNDTR(hw->rx_dma, hw->rx_dma_channel);
+    } while (halves != con->rx_dma_halves);
 
-    usart_disable_rx_dma(CONSOLE_RX_USART);
-    usart_disable_tx_interrupt(CONSOLE_TX_USART);
-    nvic_disable_irq(CONSOLE_TX_USART_NVIC_LINE);
-#if CONSOLE_SPLIT_USART
-    nvic_disable_irq(CONSOLE_RX_DMA_NVIC_LINE);
+    uint32_t boundary = halves * (size / 2);
+    return boundary + ((offset - boundary) & (size - 1));
+}
+
+/*
+ * Check whether the DMA has overwritten anything from valid_from on,
+ * which is the oldest byte the consumer still holds or has just read.
+ * If it has, drop everything queued and restart from the DMA position.
+ * Bytes lost to the overwrite and bytes discarded unread both count as
+ * dropped. Returns the DMA position checked against. Called from the
+ * consumer side only.
+ */
+static RAMFUNC uint32_t console_rx_check_overrun(struct console* con, uint32_t valid_from) {
+    struct ring* ring = con->rx_ring;
+    uint32_t size = ring_size(ring);
+    uint32_t position = console_rx_dma_position(con);
+    uint32_t span = position - valid_from;
+    if (span <= size) {
+        return position;
+    }
+
+    uint32_t read = con->rx_consumed - valid_from;
+    uint32_t overwritten = span - size;
+    uint32_t dropped = (position - con->rx_consumed) + ((overwritten < read) ? overwritten : read);
+
+    ring_consume(ring, position - con->rx_consumed);
+    ring_reset_to_head(ring);
+    con->rx_consumed = position;
+
+    uint32_t masked = cm_mask_interrupts(1);
+    con->rx_stats.overruns++;
+    con->rx_stats.dropped += dropped;
+    cm_mask_interrupts(masked);
+    console_line_event(con, CONSOLE_LINE_OVERRUN);
+    return position;
+}
+
+void console_get_rx_stats(struct console* con, struct console_rx_stats* stats) {
+    uint32_t masked = cm_mask_interrupts(1);
+    stats->overruns = con->rx_stats.overruns;
+    stats->dropped = con->rx_stats.dropped;
+    stats->overrun_errors = con->rx_stats.overrun_errors;
+    stats->framing_errors = con->rx_stats.framing_errors;
+    stats->parity_errors = con->rx_stats.parity_errors;
+    cm_mask_interrupts(masked);
+}
+
+#if CONSOLE_FLOW_CONTROL_AVAILABLE
+static volatile bool console_flow_control = CONSOLE_FLOW_CONTROL_DEFAULT;
+static volatile bool console_rts_asserted = false;
+
+/* RTS and CTS are both active low */
+static void console_set_rts(bool asserted) {
+    console_rts_asserted = asserted;
+    if (asserted) {
+        gpio_clear(CONSOLE_RTS_GPIO_PORT, CONSOLE_RTS_GPIO_PIN);
+    } else {
+        gpio_set(CONSOLE_RTS_GPIO_PORT, CONSOLE_RTS_GPIO_PIN);
+    }
+}
+
+/* Only the primary port has handshake lines */
+static RAMFUNC bool console_tx_allowed(const struct console* con) {
+    return con != CONSOLE_PRIMARY
+        || !console_flow_control
+        || gpio_get(CONSOLE_CTS_GPIO_PORT, CONSOLE_CTS_GPIO_PIN) == 0;
+}
+
+/*
+ * Drop RTS once the RX ring passes the high watermark and raise it
+ * again after the consumer drains it to the low watermark. RTS stays
+ * raised while handshaking is off, and dropped while RX is stopped.
+ * Must be called from the RX ISRs or with interrupts masked.
+ */
+static RAMFUNC void console_rts_update(void) {
+    const struct console* con = CONSOLE_PRIMARY;
+    bool ready = console_rts_asserted;
+    if (!console_flow_control) {
+        ready = true;
+    } else if (!dma_reg_enabled(con->hw->rx_dma, con->hw->rx_dma_channel)) {
+        ready = false;
+    } else {
+        uint32_t fill = console_rx_dma_position(con) - con->rx_consumed;
+        if (fill > CONSOLE_RTS_HIGH_WATERMARK) {
+            ready = false;
+        } else if (fill <= CONSOLE_RTS_LOW_WATERMARK) {
+            ready = true;
+        }
+    }
+
+    if (ready != console_rts_asserted) {
+        console_set_rts(ready);
+    }
+}
+
+/*
+ * Pause or resume the transmitter to follow CTS. Clearing DMAT holds
+ * off the TX DMA channel mid-transfer; it picks up where it left off
+ * when the request is re-enabled. Without TX DMA, the TXE handler
+ * checks CTS itself, so this only needs to restart it.
+ */
+static RAMFUNC void console_cts_update(void) {
+    const struct console* con = CONSOLE_PRIMARY;
+#if CONSOLE_TX_DMA_AVAILABLE
+    usart_reg_set_tx_dma(con->hw->tx_usart, console_tx_allowed(con));
+#else
+    if (console_tx_allowed(con) && !ring_empty(con->tx_ring)) {
+        usart_reg_set_tx_interrupt(con->hw->tx_usart, true);
+    }
 #endif
+}
 
-    console_tx_buffer_clear();
-    console_rx_buffer_clear();
+static void console_flow_control_setup(void) {
+    console_set_rts(!console_flow_control);
 
-    if (parity != USART_PARITY_NONE) {
-        /* usart_set_databits counts parity bits as "data" bits */
-        databits += 1;
+    exti_select_source(CONSOLE_CTS_EXTI, CONSOLE_CTS_GPIO_PORT);
+    exti_set_trigger(CONSOLE_CTS_EXTI, EXTI_TRIGGER_BOTH);
+    exti_enable_request(CONSOLE_CTS_EXTI);
+    nvic_set_priority(CONSOLE_CTS_NVIC_LINE, IRQ_PRIORITY_CONSOLE_CTS);
+}
+
+/* Re-check RTS after the consumer has released data */
+static RAMFUNC void console_rx_flow_update(const struct console* con) {
+    if (con == CONSOLE_PRIMARY) {
+        uint32_t masked = cm_mask_interrupts(1);
+        console_rts_update();
+        cm_mask_interrupts(masked);
+    }
+}
+
+RAMFUNC void CONSOLE_CTS_IRQ_NAME(void) {
+    if (exti_get_flag_status(CONSOLE_CTS_EXTI)) {
+        exti_reset_request(CONSOLE_CTS_EXTI);
+        console_cts_update();
+    }
+}
+#else
+static RAMFUNC void console_rx_flow_update(const struct console* con) {
+    (void)con;
+}
+#endif
+
+/*
+ * Turn RTS/CTS handshaking on or off. Returns false if the port has
+ * no handshake lines and handshaking was requested.
+ */
+bool console_set_flow_control(struct console* con, bool enable) {
+#if CONSOLE_FLOW_CONTROL_AVAILABLE
+    if (con != CONSOLE_PRIMARY) {
+        return !enable;
+    }
+
+    uint32_t masked = cm_mask_interrupts(1);
+    console_flow_control = enable;
+    console_rts_update();
+    if (nvic_get_irq_enabled(CONSOLE_CTS_NVIC_LINE)) {
+        console_cts_update();
     }
-#if CONSOLE_SPLIT_USART
-    usart_set_mode(CONSOLE_TX_USART, CONSOLE_USART_MODE & ~USART_MODE_RX);
+    cm_mask_interrupts(masked);
+    return true;
 #else
-    usart_set_mode(CONSOLE_TX_USART, CONSOLE_USART_MODE);
+    (void)con;
+    return !enable;
 #endif
-    usart_set_baudrate(CONSOLE_TX_USART, baudrate);
-    usart_set_databits(CONSOLE_TX_USART, databits);
-    usart_set_stopbits(CONSOLE_TX_USART, stopbits);
-    usart_set_parity(CONSOLE_TX_USART, parity);
+}
+
+static void console_tx_buffer_clear(struct console* con);
+static void console_rx_buffer_clear(struct console* con);
 
-#if CONSOLE_SPLIT_USART
-    usart_set_mode(CONSOLE_RX_USART, CONSOLE_USART_MODE & ~USART_MODE_TX);
-    usart_set_flow_control(CONSOLE_RX_USART, USART_FLOWCONTROL_NONE);
-    usart_set_baudrate(CONSOLE_RX_USART, baudrate);
-    usart_set_databits(CONSOLE_RX_USART, databits);
-    usart_set_stopbits(CONSOLE_RX_USART, stopbits);
-    usart_set_parity(CONSOLE_RX_USART, parity);
+void console_reconfigure(struct console* con, uint32_t baudrate, uint32_t databits,
+                         uint32_t stopbits, uint32_t parity) {
+    const struct console_hw* hw = con->hw;
+    bool split = (hw->rx_usart != hw->tx_usart);
+    struct console_baud_plan plan;
+    console_plan_baudrate(con, baudrate, &plan);
+
+    // Disable the UART and clear buffers
+    usart_disable(hw->tx_usart);
+    if (split) {
+        usart_disable(hw->rx_usart);
+    }
+
+    usart_disable_rx_dma(hw->rx_usart);
+#if CONSOLE_FLOW_CONTROL_AVAILABLE
+    if (con == CONSOLE_PRIMARY) {
+        nvic_disable_irq(CONSOLE_CTS_NVIC_LINE);
+    }
 #endif
+#if CONSOLE_TX_DMA_AVAILABLE
+    console_tx_dma_stop(con);
+#else
+    usart_disable_tx_interrupt(hw->tx_usart);
+#endif
+#if CONSOLE_TX_USART_IRQ_USED
+    nvic_disable_irq(hw->tx_usart_irq);
+#endif
+#if CONSOLE_BREAK_AVAILABLE
+    if (con == CONSOLE_PRIMARY) {
+        // Drop any break along with the bytes it was queued behind
+        nvic_disable_irq(CONSOLE_BREAK_TIMER_NVIC_LINE);
+        console_break_end();
+    }
+#endif
+    USART_CR1(hw->rx_usart) &= ~USART_CR1_IDLEIE;
+    console_rx_error_irq(con, false);
+    nvic_disable_irq(hw->rx_usart_irq);
+    nvic_disable_irq(hw->rx_dma_irq);
 
-    dma_channel_reset(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL);
+    console_tx_buffer_clear(con);
+    console_rx_buffer_clear(con);
+
+    if (parity != USART_PARITY_NONE) {
+        /* usart_set_databits counts parity bits as "data" bits */
+        databits += 1;
+    }
+    if (split) {
+        usart_set_mode(hw->tx_usart, CONSOLE_USART_MODE & ~USART_MODE_RX);
+    } else {
+        usart_set_mode(hw->tx_usart, CONSOLE_USART_MODE);
+        if (con->loopback) {
+            USART_CR3(hw->tx_usart) |= USART_CR3_HDSEL;
+        } else {
+            USART_CR3(hw->tx_usart) &= ~USART_CR3_HDSEL;
+        }
+    }
+    console_apply_baudrate(hw->tx_usart, &plan.tx);
+    usart_set_databits(hw->tx_usart, databits);
+    usart_set_stopbits(hw->tx_usart, stopbits);
+    usart_set_parity(hw->tx_usart, parity);
+
+    if (split) {
+        usart_set_mode(hw->rx_usart, CONSOLE_USART_MODE & ~USART_MODE_TX);
+        usart_set_flow_control(hw->rx_usart, USART_FLOWCONTROL_NONE);
+        console_apply_baudrate(hw->rx_usart, &plan.rx);
+        usart_set_databits(hw->rx_usart, databits);
+        usart_set_stopbits(hw->rx_usart, stopbits);
+        usart_set_parity(hw->rx_usart, parity);
+    }
+
+    dma_channel_reset(hw->rx_dma, hw->rx_dma_channel);
 
     // Configure RX DMA...
-    dma_set_peripheral_address(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL, (uint32_t)&USART_DR(CONSOLE_RX_USART));
-    dma_set_memory_address(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL, (uint32_t)console_rx_buffer);
-    dma_set_number_of_data(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL, CONSOLE_RX_BUFFER_SIZE);
-    dma_set_read_from_peripheral(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL);
-    dma_enable_memory_increment_mode(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL);
-    dma_set_peripheral_size(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL, DMA_CCR_PSIZE_8BIT);
-    dma_set_memory_size(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL, DMA_CCR_MSIZE_8BIT);
-    dma_set_priority(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL, DMA_CCR_PL_HIGH);
-    dma_enable_circular_mode(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL);
+    dma_set_peripheral_address(hw->rx_dma, hw->rx_dma_channel, (uint32_t)&CONSOLE_USART_RDR(hw->rx_usart));
+    dma_set_memory_address(hw->rx_dma, hw->rx_dma_channel, (uint32_t)con->rx_ring->buffer);
+    dma_set_number_of_data(hw->rx_dma, hw->rx_dma_channel, ring_size(con->rx_ring));
+    dma_set_read_from_peripheral(hw->rx_dma, hw->rx_dma_channel);
+    dma_enable_memory_increment_mode(hw->rx_dma, hw->rx_dma_channel);
+    dma_set_peripheral_size(hw->rx_dma, hw->rx_dma_channel, DMA_CCR_PSIZE_8BIT);
+    dma_set_memory_size(hw->rx_dma, hw->rx_dma_channel, DMA_CCR_MSIZE_8BIT);
+    dma_set_priority(hw->rx_dma, hw->rx_dma_channel, DMA_CCR_PL_HIGH);
+    dma_enable_circular_mode(hw->rx_dma, hw->rx_dma_channel);
+
+    // Count half rings to catch overruns, and flag an RX event each time
+    dma_enable_half_transfer_interrupt(hw->rx_dma, hw->rx_dma_channel);
+    dma_enable_transfer_complete_interrupt(hw->rx_dma, hw->rx_dma_channel);
 
-    //dma_enable_transfer_complete_interrupt(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL);
+    dma_enable_channel(hw->rx_dma, hw->rx_dma_channel);
 
-    dma_enable_channel(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL);
+    usart_enable_rx_dma(hw->rx_usart);
 
-    usart_enable_rx_dma(CONSOLE_RX_USART);
-    nvic_enable_irq(CONSOLE_TX_USART_NVIC_LINE);
-#if CONSOLE_SPLIT_USART
-    nvic_enable_irq(CONSOLE_RX_DMA_NVIC_LINE);
+    // Configure TX DMA; transfers are started as data is queued
+#if CONSOLE_TX_DMA_AVAILABLE
+    console_tx_dma_setup(con);
+#endif
+#if CONSOLE_TX_USART_IRQ_USED
+    nvic_enable_irq(hw->tx_usart_irq);
+#endif
+#if CONSOLE_BREAK_AVAILABLE
+    if (con == CONSOLE_PRIMARY) {
+        nvic_enable_irq(CONSOLE_BREAK_TIMER_NVIC_LINE);
+    }
+#endif
+#if CONSOLE_RX_EVENT_FLUSH
+    // ...and flag an RX event when the line goes idle after a burst
+    con->rx_event = false;
+    USART_CR1(hw->rx_usart) |= USART_CR1_IDLEIE;
+#endif
+    // Count framing, parity and overrun errors
+    console_rx_error_irq(con, true);
+#if CONSOLE_USART_LIN_AVAILABLE
+    // ...and detect breaks, which needs LIN mode and so one stop bit,
+    // and can't be combined with half-duplex
+    if (stopbits == USART_STOPBITS_1 && !con->loopback) {
+        USART_CR2(hw->rx_usart) |= USART_CR2_LINEN | USART_CR2_LBDL | USART_CR2_LBDIE;
+    } else {
+        USART_CR2(hw->rx_usart) &= ~(USART_CR2_LINEN | USART_CR2_LBDL | USART_CR2_LBDIE);
+    }
+#endif
+    nvic_enable_irq(hw->rx_usart_irq);
+    nvic_enable_irq(hw->rx_dma_irq);
+#if CONSOLE_FLOW_CONTROL_AVAILABLE
+    if (con == CONSOLE_PRIMARY) {
+        // Follow the handshake lines again now that both directions are running
+        uint32_t masked = cm_mask_interrupts(1);
+        console_rts_update();
+        console_cts_update();
+        cm_mask_interrupts(masked);
+        nvic_enable_irq(CONSOLE_CTS_NVIC_LINE);
+    }
 #endif
 
     // Re-enable the UART with the new settings
-    usart_enable(CONSOLE_TX_USART);
-#if CONSOLE_SPLIT_USART
-    usart_enable(CONSOLE_RX_USART);
-#endif
+    usart_enable(hw->tx_usart);
+    if (split) {
+        usart_enable(hw->rx_usart);
+    }
+}
 
+static void console_tx_buffer_clear(struct console* con) {
+    ring_reset(con->tx_ring);
+}
 
+size_t console_send_buffer_size(const struct console* con) {
+    return ring_size(con->tx_ring);
 }
 
-static bool console_tx_buffer_empty(void) {
-    return console_tx_head == console_tx_tail;
+RAMFUNC size_t console_send_buffer_space(const struct console* con) {
+    return ring_space(con->tx_ring);
 }
 
-static bool console_tx_buffer_full(void) {
-    return (uint16_t)(console_tx_tail - console_tx_head) == CONSOLE_TX_BUFFER_SIZE;
+/*
+ * Arrange for callback to be called from the TX drain path once at
+ * least min_space bytes are free. Returns true without arming anything
+ * if that much space is already free.
+ */
+bool console_notify_tx_space(struct console* con, size_t min_space,
+                             console_callback callback) {
+    bool available;
+    uint32_t masked = cm_mask_interrupts(1);
+    available = (console_send_buffer_space(con) >= min_space);
+    if (available) {
+        con->tx_notify_space = 0;
+    } else {
+        con->tx_notify_callback = callback;
+        con->tx_notify_space = min_space;
+    }
+    cm_mask_interrupts(masked);
+    return available;
 }
 
-static void console_tx_buffer_put(uint8_t data) {
-    console_tx_buffer[console_tx_tail % CONSOLE_TX_BUFFER_SIZE] = data;
-    console_tx_tail++;
+/* Called from the TX ISRs after bytes have been released */
+static RAMFUNC void console_tx_space_check(struct console* con) {
+    if (con->tx_notify_space != 0 && console_send_buffer_space(con) >= con->tx_notify_space) {
+        con->tx_notify_space = 0;
+        con->tx_notify_callback(con);
+    }
 }
 
-static uint8_t console_tx_buffer_get(void) {
-    uint8_t data = console_tx_buffer[console_tx_head % CONSOLE_TX_BUFFER_SIZE];
-    console_tx_head++;
-    return data;
+/*
+ * Catch the RX ring up with the DMA channel, first resynchronising it if
+ * the DMA has lapped the reader; false if RX is stopped.
+ */
+static RAMFUNC bool console_rx_sync(struct console* con) {
+    if (!(DMA_CCR(con->hw->rx_dma, con->hw->rx_dma_channel) & DMA_CCR_EN)) {
+        return false;
+    }
+
+    uint32_t position = console_rx_check_overrun(con, con->rx_consumed);
+    ring_commit(con->rx_ring, (uint16_t)((uint16_t)position - con->rx_ring->tail));
+    return true;
 }
 
-void console_tx_buffer_clear(void) {
-    console_tx_head = 0;
-    console_tx_tail = 0;
+static void console_rx_buffer_clear(struct console* con) {
+    dma_disable_channel(con->hw->rx_dma, con->hw->rx_dma_channel);
+    ring_reset(con->rx_ring);
+    con->rx_dma_halves = 0;
+    con->rx_consumed = 0;
+    con->rx_mark_tail = con->rx_mark_head;
 }
 
-size_t console_send_buffer_space(void) {
-    return CONSOLE_TX_BUFFER_SIZE - (uint16_t)(console_tx_tail - console_tx_head);
+#if CONSOLE_BREAK_AVAILABLE
+/*
+ * A break is queued behind the bytes that were in the TX ring when it
+ * was requested, marked by the ring's tail at that point. The drain
+ * path stops at the mark and waits for the USART to finish shifting
+ * out the last byte; the break then holds TX low until the timer runs
+ * out or the host ends it. Bytes queued after the request wait. Only
+ * the primary port has a break timer.
+ */
+enum console_break_state {
+    CONSOLE_BREAK_IDLE,
+    CONSOLE_BREAK_QUEUED,
+    CONSOLE_BREAK_ACTIVE,
+};
+
+/* Break timer resolution */
+#define CONSOLE_BREAK_TIMER_HZ 10000
+#define CONSOLE_BREAK_TICKS_PER_MS (CONSOLE_BREAK_TIMER_HZ / 1000)
+/* Longest single timer run; longer breaks take several */
+#define CONSOLE_BREAK_MAX_CHUNK 60000
+#define CONSOLE_BREAK_FOREVER UINT32_MAX
+
+static volatile enum console_break_state console_break_state = CONSOLE_BREAK_IDLE;
+static volatile uint16_t console_break_mark = 0;
+static volatile uint32_t console_break_remaining = 0;
+#endif
+
+/* Limit queued bytes to those that may go out ahead of a pending break */
+static RAMFUNC size_t console_tx_sendable(const struct console* con, size_t queued) {
+#if CONSOLE_BREAK_AVAILABLE
+    if (con != CONSOLE_PRIMARY) {
+        return queued;
+    } else if (console_break_state == CONSOLE_BREAK_ACTIVE) {
+        return 0;
+    } else if (console_break_state == CONSOLE_BREAK_QUEUED) {
+        size_t before = (uint16_t)(console_break_mark - con->tx_ring->head);
+        return (queued < before) ? queued : before;
+    }
+#else
+    (void)con;
+#endif
+    return queued;
 }
 
-static bool console_rx_buffer_empty(void) {
-    if (DMA_CCR(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL) & DMA_CCR_EN) {
-        uint16_t console_rx_tail = (CONSOLE_RX_BUFFER_SIZE - DMA_CNDTR(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL)) % CONSOLE_RX_BUFFER_SIZE;
-        return console_rx_tail == console_rx_head;
-    } else {
-        return true;
+#if CONSOLE_BREAK_AVAILABLE
+/*
+ * Once everything ahead of a queued break has left the ring, wait for
+ * the transmission complete flag before starting it.
+ */
+static RAMFUNC void console_break_check_queued(const struct console* con) {
+    if (con == CONSOLE_PRIMARY
+        && console_break_state == CONSOLE_BREAK_QUEUED
+        && con->tx_ring->head == console_break_mark) {
+        usart_reg_modify(&USART_CR1(con->hw->tx_usart), 0, USART_CR1_TCIE);
     }
 }
+#endif
 
-static uint8_t console_rx_buffer_get(void) {
-    uint8_t data = console_rx_buffer[console_rx_head];
-    console_rx_head = (console_rx_head + 1) % CONSOLE_RX_BUFFER_SIZE;
-    return data;
+#if CONSOLE_TX_DMA_AVAILABLE
+/*
+ * Start a DMA transfer for the largest contiguous run of queued bytes.
+ * Must only be called while no transfer is in progress.
+ */
+static RAMFUNC void console_tx_dma_start(struct console* con) {
+    const struct console_hw* hw = con->hw;
+    struct ring_span spans[2];
+    size_t len = console_tx_sendable(con, ring_peek(con->tx_ring, spans));
+    if (len == 0) {
+#if CONSOLE_BREAK_AVAILABLE
+        console_break_check_queued(con);
+#endif
+        return;
+    }
+
+    if (len > spans[0].len) {
+        len = spans[0].len;
+    }
+    con->tx_dma_len = (uint16_t)len;
+#if CONSOLE_BREAK_AVAILABLE
+    // TC stays set after a DMA transfer, so clear it for the break check
+    CONSOLE_USART_CLEAR_TC(hw->tx_usart);
+#endif
+    dma_reg_start(hw->tx_dma, hw->tx_dma_channel, (uint32_t)spans[0].data, (uint16_t)len);
 }
+#endif
 
-void console_rx_buffer_clear(void) {
-    console_rx_head = 0;
-    dma_disable_channel(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL);
+/* Start draining newly queued bytes */
+static RAMFUNC void console_tx_kick(struct console* con) {
+#if CONSOLE_TX_DMA_AVAILABLE
+    // Kick off a transfer unless the completion ISR will chain one
+    uint32_t masked = cm_mask_interrupts(1);
+    if (con->tx_dma_len == 0) {
+        console_tx_dma_start(con);
+    }
+    cm_mask_interrupts(masked);
+#else
+    if (!ring_empty(con->tx_ring)) {
+        usart_reg_set_tx_interrupt(con->hw->tx_usart, true);
+    }
+#endif
 }
 
-size_t console_send_buffered(const uint8_t* data, size_t num_bytes) {
-    size_t bytes_written = 0;
+#if CONSOLE_BREAK_AVAILABLE
+static void console_break_timer_setup(void) {
+    rcc_periph_clock_enable(CONSOLE_BREAK_TIMER_CLOCK);
+    rcc_periph_reset_pulse(CONSOLE_BREAK_TIMER_RST);
+
+    timer_set_prescaler(CONSOLE_BREAK_TIMER, CONSOLE_BREAK_TIMER_CLOCK_FREQ / CONSOLE_BREAK_TIMER_HZ - 1);
+    timer_one_shot_mode(CONSOLE_BREAK_TIMER);
+    // Only overflows raise the update interrupt, not the UG event below
+    timer_update_on_overflow(CONSOLE_BREAK_TIMER);
+    timer_enable_irq(CONSOLE_BREAK_TIMER, TIM_DIER_UIE);
+
+    nvic_set_priority(CONSOLE_BREAK_TIMER_NVIC_LINE, IRQ_PRIORITY_CONSOLE_BREAK);
+    nvic_enable_irq(CONSOLE_BREAK_TIMER_NVIC_LINE);
+}
 
-    while (!console_tx_buffer_full() && (bytes_written < num_bytes)) {
-        console_tx_buffer_put(data[bytes_written++]);
+/* Run the timer for the next stretch of the break */
+static void console_break_timer_start(void) {
+    uint32_t ticks = console_break_remaining;
+    if (ticks > CONSOLE_BREAK_MAX_CHUNK) {
+        ticks = CONSOLE_BREAK_MAX_CHUNK;
     }
 
-    if (!console_tx_buffer_empty()) {
-        usart_enable_tx_interrupt(CONSOLE_TX_USART);
+    timer_set_period(CONSOLE_BREAK_TIMER, ticks - 1);
+    timer_set_counter(CONSOLE_BREAK_TIMER, 0);
+    // Load the prescaler and period before counting
+    timer_generate_event(CONSOLE_BREAK_TIMER, TIM_EGR_UG);
+    timer_enable_counter(CONSOLE_BREAK_TIMER);
+}
+
+/* Called with interrupts masked or from the console ISRs */
+static void console_break_start(void) {
+    console_break_state = CONSOLE_BREAK_ACTIVE;
+    target_console_set_break(true);
+    if (console_break_remaining != CONSOLE_BREAK_FOREVER) {
+        console_break_timer_start();
     }
+}
 
-    return bytes_written;
+static void console_break_end(void) {
+    timer_disable_counter(CONSOLE_BREAK_TIMER);
+    timer_clear_flag(CONSOLE_BREAK_TIMER, TIM_SR_UIF);
+    if (console_break_state == CONSOLE_BREAK_ACTIVE) {
+        target_console_set_break(false);
+    }
+    usart_reg_modify(&USART_CR1(CONSOLE_TX_USART), USART_CR1_TCIE, 0);
+    console_break_state = CONSOLE_BREAK_IDLE;
 }
 
-size_t console_recv_buffered(uint8_t* data, size_t max_bytes) {
-    size_t bytes_read = 0;
-    if (max_bytes == 1) {
-        if (!console_rx_buffer_empty()) {
-            *data = console_rx_buffer_get();
-            bytes_read = 1;
+void CONSOLE_BREAK_TIMER_IRQ_NAME(void) {
+    if (!timer_get_flag(CONSOLE_BREAK_TIMER, TIM_SR_UIF)) {
+        return;
+    }
+    timer_clear_flag(CONSOLE_BREAK_TIMER, TIM_SR_UIF);
+
+    uint32_t elapsed = console_break_remaining;
+    if (elapsed > CONSOLE_BREAK_MAX_CHUNK) {
+        elapsed = CONSOLE_BREAK_MAX_CHUNK;
+    }
+    console_break_remaining -= elapsed;
+
+    if (console_break_remaining > 0) {
+        console_break_timer_start();
+    } else {
+        console_break_end();
+        console_tx_kick(CONSOLE_PRIMARY);
+    }
+}
+#endif
+
+/*
+ * Send a break of duration_ms milliseconds once the bytes already queued
+ * have gone out. CONSOLE_BREAK_UNTIL_CLEARED holds it until a request
+ * with a duration of 0, which ends or cancels the break. A request while
+ * a break is pending or in progress replaces its duration. Returns false
+ * if the port can't send breaks.
+ */
+bool console_send_break(struct console* con, uint16_t duration_ms) {
+#if CONSOLE_BREAK_AVAILABLE
+    if (con != CONSOLE_PRIMARY) {
+        return (duration_ms == 0);
+    }
+
+    uint32_t masked = cm_mask_interrupts(1);
+    if (duration_ms == 0) {
+        if (console_break_state != CONSOLE_BREAK_IDLE) {
+            console_break_end();
+            console_tx_kick(con);
         }
-    } else if (!console_rx_buffer_empty()) {
-        uint16_t console_rx_tail = (CONSOLE_RX_BUFFER_SIZE - DMA_CNDTR(CONSOLE_RX_DMA_CONTROLLER, CONSOLE_RX_DMA_CHANNEL)) % CONSOLE_RX_BUFFER_SIZE;
-        if (console_rx_head > console_rx_tail) {
-            while (console_rx_head < CONSOLE_RX_BUFFER_SIZE && bytes_read < max_bytes) {
-                data[bytes_read++] = console_rx_buffer[console_rx_head++];
-            }
-            if (console_rx_head == CONSOLE_RX_BUFFER_SIZE) {
-                console_rx_head = 0;
-            }
+    } else {
+        if (duration_ms == CONSOLE_BREAK_UNTIL_CLEARED) {
+            console_break_remaining = CONSOLE_BREAK_FOREVER;
+        } else {
+            console_break_remaining = (uint32_t)duration_ms * CONSOLE_BREAK_TICKS_PER_MS;
         }
 
-        if ((bytes_read < max_bytes) && (console_rx_head < console_rx_tail)) {
-            while (console_rx_head < console_rx_tail && bytes_read < max_bytes) {
-                data[bytes_read++] = console_rx_buffer[console_rx_head++];
+        if (console_break_state == CONSOLE_BREAK_ACTIVE) {
+            // Restart the timing from now with the new duration
+            timer_disable_counter(CONSOLE_BREAK_TIMER);
+            timer_clear_flag(CONSOLE_BREAK_TIMER, TIM_SR_UIF);
+            if (console_break_remaining != CONSOLE_BREAK_FOREVER) {
+                console_break_timer_start();
             }
-            if (console_rx_head == CONSOLE_RX_BUFFER_SIZE) {
-                console_rx_head = 0;
+        } else if (console_break_state == CONSOLE_BREAK_IDLE) {
+            console_break_mark = con->tx_ring->tail;
+            console_break_state = CONSOLE_BREAK_QUEUED;
+#if CONSOLE_TX_DMA_AVAILABLE
+            if (con->tx_dma_len == 0) {
+                console_break_check_queued(con);
             }
+#else
+            console_break_check_queued(con);
+#endif
         }
     }
+    cm_mask_interrupts(masked);
+    return true;
+#else
+    (void)con;
+    return (duration_ms == 0);
+#endif
+}
+
+RAMFUNC size_t console_send_buffered(struct console* con, const uint8_t* data, size_t num_bytes) {
+    size_t bytes_written = ring_write(con->tx_ring, data, num_bytes);
+    console_tx_kick(con);
+    return bytes_written;
+}
+
+RAMFUNC size_t console_send_reserve(struct console* con, struct ring_span spans[2]) {
+    return ring_reserve(con->tx_ring, spans);
+}
+
+/* Queue bytes written in place into spans from console_send_reserve() */
+RAMFUNC void console_send_commit(struct console* con, size_t num_bytes) {
+    ring_commit(con->tx_ring, num_bytes);
+    uint16_t used = (uint16_t)ring_used(con->tx_ring);
+    if (used > con->tx_high_water) {
+        con->tx_high_water = used;
+    }
+    console_tx_kick(con);
+}
 
+RAMFUNC size_t console_recv_peek(struct console* con, struct ring_span spans[2]) {
+    if (!console_rx_sync(con)) {
+        return ring_spans(con->rx_ring, con->rx_ring->head, 0, spans);
+    }
+    size_t available = ring_peek(con->rx_ring, spans);
+    if (available > con->rx_high_water) {
+        con->rx_high_water = (uint16_t)available;
+    }
+    return available;
+}
+
+/* Release bytes read in place from spans from console_recv_peek() */
+RAMFUNC void console_recv_consume(struct console* con, size_t num_bytes) {
+    uint32_t start = con->rx_consumed;
+    ring_consume(con->rx_ring, num_bytes);
+    con->rx_consumed = start + num_bytes;
+
+    // Catch the DMA overwriting the bytes while they were being copied
+    console_rx_check_overrun(con, start);
+    console_rx_flow_update(con);
+}
+
+RAMFUNC size_t console_recv_buffered(struct console* con, uint8_t* data, size_t max_bytes) {
+    if (!console_rx_sync(con)) {
+        return 0;
+    }
+
+    uint32_t start = con->rx_consumed;
+    size_t bytes_read = ring_read(con->rx_ring, data, max_bytes);
+    con->rx_consumed = start + bytes_read;
+
+    console_rx_check_overrun(con, start);
+    console_rx_flow_update(con);
     return bytes_read;
 }
 
-void console_send_blocking(uint8_t data) {
-    usart_send_blocking(CONSOLE_TX_USART, data);
+void console_send_blocking(struct console* con, uint8_t data) {
+    usart_send_blocking(con->hw->tx_usart, data);
+}
+
+uint8_t console_recv_blocking(struct console* con) {
+    return usart_recv_blocking(con->hw->rx_usart);
+}
+
+void console_take_high_water(struct console* con, uint16_t* tx_used, uint16_t* rx_used) {
+    uint32_t masked = cm_mask_interrupts(1);
+    *tx_used = con->tx_high_water;
+    *rx_used = con->rx_high_water;
+    con->tx_high_water = (uint16_t)ring_used(con->tx_ring);
+    con->rx_high_water = 0;
+    cm_mask_interrupts(masked);
+}
+
+bool console_set_loopback(struct console* con, bool enable) {
+    if (enable && con->hw->tx_usart != con->hw->rx_usart) {
+        return false;
+    }
+    con->loopback = enable;
+    return true;
+}
+
+void console_get_tx_isr_stats(struct console* con, struct console_isr_stats* stats) {
+    uint32_t masked = cm_mask_interrupts(1);
+    stats->calls = con->tx_isr_stats.calls;
+    stats->cycles = con->tx_isr_stats.cycles;
+    stats->bytes = con->tx_isr_stats.bytes;
+    cm_mask_interrupts(masked);
+}
+
+/* Position of the next byte to be read, counted from the start of RX */
+uint32_t console_recv_position(const struct console* con) {
+    return con->rx_consumed;
+}
+
+/* Start or stop recording RX timing marks, discarding any queued */
+void console_set_rx_marks(struct console* con, bool enable) {
+    uint32_t masked = cm_mask_interrupts(1);
+    con->rx_marks_enabled = enable;
+    con->rx_mark_tail = con->rx_mark_head;
+    con->rx_marks_lost = 0;
+    cm_mask_interrupts(masked);
+}
+
+bool console_peek_rx_mark(struct console* con, struct console_rx_mark* mark) {
+    uint8_t tail = con->rx_mark_tail;
+    if (tail == con->rx_mark_head) {
+        return false;
+    }
+    *mark = con->rx_marks[tail & (CONSOLE_RX_MARKS - 1)];
+    return true;
+}
+
+void console_drop_rx_mark(struct console* con) {
+    if (con->rx_mark_tail != con->rx_mark_head) {
+        con->rx_mark_tail++;
+    }
+}
+
+/* Return and clear the number of marks lost to a full queue */
+uint32_t console_take_rx_marks_lost(struct console* con) {
+    uint32_t masked = cm_mask_interrupts(1);
+    uint32_t lost = con->rx_marks_lost;
+    con->rx_marks_lost = 0;
+    cm_mask_interrupts(masked);
+    return lost;
 }
 
-uint8_t console_recv_blocking(void) {
-    return usart_recv_blocking(CONSOLE_RX_USART);
+RAMFUNC bool console_rx_poll_event(struct console* con) {
+#if CONSOLE_RX_EVENT_FLUSH
+    if (con->rx_event) {
+        con->rx_event = false;
+        return true;
+    }
+#else
+    (void)con;
+#endif
+    return false;
 }
 
-void CONSOLE_RX_USART_IRQ_NAME(void) {
+static RAMFUNC void console_rx_dma_isr(struct console* con) {
+    const struct console_hw* hw = con->hw;
+    uint32_t flags = dma_reg_get_flags(hw->rx_dma, hw->rx_dma_channel) & (DMA_HTIF | DMA_TCIF);
+    if (flags != 0) {
+        dma_reg_clear_flags(hw->rx_dma, hw->rx_dma_channel, flags);
+        uint32_t halves = ((flags & DMA_HTIF) != 0) + ((flags & DMA_TCIF) != 0);
+        con->rx_dma_halves += halves;
+        uint32_t written = con->rx_dma_halves * (ring_size(con->rx_ring) / 2);
+        console_rx_mark(con, CONSOLE_RX_MARK_DMA, written, 0);
+
+        uint32_t used = written - con->rx_consumed;
+        if (used > ring_size(con->rx_ring)) {
+            used = ring_size(con->rx_ring);
+        }
+        if (used > con->rx_high_water) {
+            con->rx_high_water = (uint16_t)used;
+        }
+#if CONSOLE_USART_ERRORS_STICKY
+        console_rx_error_irq_rearm(con);
+#endif
+#if CONSOLE_FLOW_CONTROL_AVAILABLE
+        if (con == CONSOLE_PRIMARY) {
+            console_rts_update();
+        }
+#endif
+        console_rx_signal_event(con);
+    }
+}
+
+/*
+ * Count the USART receive errors in status; the bytes themselves still
+ * go to the ring
+ */
+static RAMFUNC void console_rx_usart_errors(struct console* con, uint32_t status) {
+    bool overrun = (status & USART_SR_ORE) != 0;
+    bool framing = (status & USART_SR_FE) != 0;
+    bool parity = (status & USART_SR_PE) != 0;
+    if (!(overrun || framing || parity)) {
+        return;
+    }
+
+    con->rx_stats.overrun_errors += overrun;
+    con->rx_stats.framing_errors += framing;
+    con->rx_stats.parity_errors += parity;
+    console_line_event(con, (overrun ? CONSOLE_LINE_OVERRUN : 0)
+                            | (framing ? CONSOLE_LINE_FRAMING : 0)
+                            | (parity ? CONSOLE_LINE_PARITY : 0));
+
+#if CONSOLE_USART_ERRORS_STICKY
+    console_rx_error_irq(con, false);
+#else
+    CONSOLE_USART_CLEAR_ERRORS(con->hw->rx_usart);
+#endif
+}
+
+static RAMFUNC void console_rx_usart_isr(struct console* con) {
+    uint32_t usart = con->hw->rx_usart;
+    uint32_t status = usart_reg_status(usart);
+    console_rx_usart_errors(con, status);
+
+#if CONSOLE_USART_LIN_AVAILABLE
+    if (status & USART_SR_LBD) {
+        CONSOLE_USART_CLEAR_BREAK(usart);
+        console_line_event(con, CONSOLE_LINE_BREAK);
+    }
+#endif
+
+#if CONSOLE_RX_EVENT_FLUSH
+    if (status & USART_SR_IDLE) {
+        CONSOLE_USART_CLEAR_IDLE(usart);
+        console_rx_mark(con, CONSOLE_RX_MARK_IDLE, console_rx_dma_position(con), 0);
+#if CONSOLE_USART_ERRORS_STICKY
+        // Reading the data register also cleared any error flags
+        console_rx_error_irq(con, true);
+#endif
+#if CONSOLE_FLOW_CONTROL_AVAILABLE
+        if (con == CONSOLE_PRIMARY) {
+            console_rts_update();
+        }
+#endif
+        console_rx_signal_event(con);
+    }
+#endif
+}
+
+#if CONSOLE_TX_DMA_AVAILABLE
+static RAMFUNC void console_tx_dma_isr(struct console* con) {
+    const struct console_hw* hw = con->hw;
+    if (!(dma_reg_get_flags(hw->tx_dma, hw->tx_dma_channel) & DMA_TCIF)) {
+        return;
+    }
+
+    uint32_t start = cycle_counter_read();
+
+    dma_reg_clear_flags(hw->tx_dma, hw->tx_dma_channel, DMA_TCIF);
+    dma_reg_disable(hw->tx_dma, hw->tx_dma_channel);
+
+    // Release the transmitted bytes and chain the next chunk
+    uint16_t sent = con->tx_dma_len;
+    ring_consume(con->tx_ring, sent);
+    con->tx_dma_len = 0;
+    console_tx_dma_start(con);
+    console_tx_space_check(con);
+
+    con->tx_isr_stats.calls++;
+    con->tx_isr_stats.bytes += sent;
+    con->tx_isr_stats.cycles += cycle_counter_elapsed(start);
+}
+
+RAMFUNC void CONSOLE_TX_DMA_IRQ_NAME(void) {
+    PROFILE_BEGIN(PROFILE_DMA_ISR);
+    console_tx_dma_isr(CONSOLE_PRIMARY);
+#if CONSOLE_DMA_SHARED_IRQ
+    console_rx_dma_isr(CONSOLE_PRIMARY);
+#endif
+    PROFILE_END(PROFILE_DMA_ISR);
+}
+#endif
+
+#if CONSOLE_TX_USART_IRQ_USED
+static RAMFUNC void console_tx_usart_isr(struct console* con) {
+    uint32_t usart = con->hw->tx_usart;
+    (void)usart;
+#if CONSOLE_BREAK_AVAILABLE
+    if (con == CONSOLE_PRIMARY
+        && (USART_CR1(usart) & USART_CR1_TCIE)
+        && usart_reg_get_flag(usart, USART_SR_TC)) {
+        // The last byte ahead of the break has gone out
+        usart_reg_modify(&USART_CR1(usart), USART_CR1_TCIE, 0);
+        console_break_start();
+    }
+#endif
+
+#if !CONSOLE_TX_DMA_AVAILABLE
+    uint32_t start = cycle_counter_read();
+
+    if (usart_reg_tx_ready(usart)) {
+        uint8_t buffered_byte;
+#if CONSOLE_FLOW_CONTROL_AVAILABLE
+        if (!console_tx_allowed(con)) {
+            // Resumed from the CTS handler
+            usart_reg_set_tx_interrupt(usart, false);
+        } else
+#endif
+        if (console_tx_sendable(con, ring_used(con->tx_ring)) > 0
+            && ring_get(con->tx_ring, &buffered_byte)) {
+            usart_reg_send(usart, buffered_byte);
+            con->tx_isr_stats.bytes++;
+            console_tx_space_check(con);
+        } else {
+            usart_reg_set_tx_interrupt(usart, false);
+#if CONSOLE_BREAK_AVAILABLE
+            console_break_check_queued(con);
+#endif
+        }
+    }
+
+    con->tx_isr_stats.calls++;
+    con->tx_isr_stats.cycles += cycle_counter_elapsed(start);
+#endif
+}
+#endif
+
+/* Handle a USART that carries both directions of a port */
+static RAMFUNC void console_usart_isr(struct console* con) {
     /*
     if (usart_get_interrupt_source(CONSOLE_RX_USART, USART_SR_RXNE)) {
         uint8_t received_byte = (uint8_t)usart_recv(CONSOLE_RX_USART);
@@ -246,27 +1399,77 @@ void CONSOLE_RX_USART_IRQ_NAME(void) {
     }
     */
 
-#if !CONSOLE_SPLIT_USART
-    if (usart_get_interrupt_source(CONSOLE_TX_USART, USART_SR_TXE)) {
-        if (!console_tx_buffer_empty()) {
-            usart_word_t buffered_byte = console_tx_buffer_get();
-            usart_send(CONSOLE_TX_USART, buffered_byte);
-        } else {
-            usart_disable_tx_interrupt(CONSOLE_TX_USART);
-        }
+    console_rx_usart_isr(con);
+
+#if CONSOLE_TX_USART_IRQ_USED
+    if (con->hw->tx_usart == con->hw->rx_usart) {
+        console_tx_usart_isr(con);
     }
 #endif
 }
 
-#if CONSOLE_SPLIT_USART
-void CONSOLE_TX_USART_IRQ_NAME(void) {
-    if (usart_get_interrupt_source(CONSOLE_TX_USART, USART_SR_TXE)) {
-        if (!console_tx_buffer_empty()) {
-            usart_word_t buffered_byte = console_tx_buffer_get();
-            usart_send(CONSOLE_TX_USART, buffered_byte);
-        } else {
-            usart_disable_tx_interrupt(CONSOLE_TX_USART);
-        }
-    }
+RAMFUNC void CONSOLE_RX_USART_IRQ_NAME(void) {
+    PROFILE_BEGIN(PROFILE_USART_ISR);
+    console_usart_isr(CONSOLE_PRIMARY);
+    PROFILE_END(PROFILE_USART_ISR);
 }
+
+#if !(CONSOLE_TX_DMA_AVAILABLE && CONSOLE_DMA_SHARED_IRQ)
+RAMFUNC void CONSOLE_RX_DMA_IRQ_NAME(void) {
+    PROFILE_BEGIN(PROFILE_DMA_ISR);
+    console_rx_dma_isr(CONSOLE_PRIMARY);
+    PROFILE_END(PROFILE_DMA_ISR);
+}
+#endif
+
+#if CONSOLE_SPLIT_USART && CONSOLE_TX_USART_IRQ_USED
+RAMFUNC void CONSOLE_TX_USART_IRQ_NAME(void) {
+    PROFILE_BEGIN(PROFILE_USART_ISR);
+    console_tx_usart_isr(CONSOLE_PRIMARY);
+    PROFILE_END(PROFILE_USART_ISR);
+}
+#endif
+
+#if CONSOLE_NUM_PORTS > 1
+RAMFUNC void CONSOLE_PORT1_USART_IRQ_NAME(void) {
+    PROFILE_BEGIN(PROFILE_USART_ISR);
+    console_usart_isr(&console_ports[1]);
+    PROFILE_END(PROFILE_USART_ISR);
+}
+
+RAMFUNC void CONSOLE_PORT1_RX_DMA_IRQ_NAME(void) {
+    PROFILE_BEGIN(PROFILE_DMA_ISR);
+    console_rx_dma_isr(&console_ports[1]);
+    PROFILE_END(PROFILE_DMA_ISR);
+}
+
+#if CONSOLE_TX_DMA_AVAILABLE
+RAMFUNC void CONSOLE_PORT1_TX_DMA_IRQ_NAME(void) {
+    PROFILE_BEGIN(PROFILE_DMA_ISR);
+    console_tx_dma_isr(&console_ports[1]);
+    PROFILE_END(PROFILE_DMA_ISR);
+}
+#endif
+#endif
+
+#if CONSOLE_NUM_PORTS > 2
+RAMFUNC void CONSOLE_PORT2_USART_IRQ_NAME(void) {
+    PROFILE_BEGIN(PROFILE_USART_ISR);
+    console_usart_isr(&console_ports[2]);
+    PROFILE_END(PROFILE_USART_ISR);
+}
+
+RAMFUNC void CONSOLE_PORT2_RX_DMA_IRQ_NAME(void) {
+    PROFILE_BEGIN(PROFILE_DMA_ISR);
+    console_rx_dma_isr(&console_ports[2]);
+    PROFILE_END(PROFILE_DMA_ISR);
+}
+
+#if CONSOLE_TX_DMA_AVAILABLE
+RAMFUNC void CONSOLE_PORT2_TX_DMA_IRQ_NAME(void) {
+    PROFILE_BEGIN(PROFILE_DMA_ISR);
+    console_tx_dma_isr(&console_ports[2]);
+    PROFILE_END(PROFILE_DMA_ISR);
+}
+#endif
 #endif
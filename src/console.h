@@ -23,6 +23,7 @@
 #include <libopencm3/stm32/usart.h>
 
 #include "config.h"
+#include "ring.h"
 
 #if !CONSOLE_SPLIT_USART
 #define CONSOLE_TX_USART CONSOLE_USART
@@ -35,18 +36,282 @@
 #define CONSOLE_RX_USART_IRQ_NAME CONSOLE_USART_IRQ_NAME
 #define CONSOLE_TX_USART_NVIC_LINE CONSOLE_USART_NVIC_LINE
 #define CONSOLE_RX_USART_NVIC_LINE CONSOLE_USART_NVIC_LINE
+#define CONSOLE_TX_USART_CLOCK_FREQ CONSOLE_USART_CLOCK_FREQ
+#define CONSOLE_RX_USART_CLOCK_FREQ CONSOLE_USART_CLOCK_FREQ
 #endif
 
+/*
+ * Each console port is one USART, or a TX/RX pair of USARTs for the
+ * first port, with its own rings and DMA channels. The CONSOLE_* macros
+ * describe the first port, and CONSOLE_PORTn_* the extra ones, which
+ * are always a single USART with RX DMA. Handshaking, sending breaks
+ * and the modem inputs belong to the first port only.
+ */
+#ifndef CONSOLE_NUM_PORTS
+#define CONSOLE_NUM_PORTS 1
+#endif
+
+_Static_assert(CONSOLE_NUM_PORTS >= 1 && CONSOLE_NUM_PORTS <= 3,
+               "Between 1 and 3 console ports are supported");
+
+#ifndef CONSOLE_USART_TDR
+#define CONSOLE_USART_TDR(usart) USART_DR(usart)
+#endif
+#ifndef CONSOLE_USART_RDR
+#define CONSOLE_USART_RDR(usart) USART_DR(usart)
+#endif
+#ifndef CONSOLE_USART_STATUS
+#define CONSOLE_USART_STATUS(usart) USART_SR(usart)
+#endif
+
+/*
+ * Clear the USART idle flag. On F1 that takes a data register read, which
+ * is harmless here: the line has been quiet for a whole frame when IDLE
+ * sets, so the DMA has already taken the last byte and cleared RXNE, and
+ * the next byte can't complete before the handler is done.
+ */
+#ifndef CONSOLE_USART_CLEAR_IDLE
+#define CONSOLE_USART_CLEAR_IDLE(usart) \
+    do { (void)USART_SR(usart); (void)USART_DR(usart); } while (0)
+#endif
 
+/*
+ * Clear the USART receive error flags after counting them. Where that
+ * takes a data register read (F1), an error flag is set alongside RXNE
+ * for a byte the DMA has yet to take, so the read would steal it; the
+ * flags are left for the DMA's next read to clear instead.
+ */
+#ifndef CONSOLE_USART_CLEAR_ERRORS
+#define CONSOLE_USART_ERRORS_STICKY 1
+#else
+#define CONSOLE_USART_ERRORS_STICKY 0
+#endif
+
+/*
+ * Set if the RX USART supports LIN mode, which is used to detect breaks.
+ * LIN mode requires one stop bit, so breaks go unreported with two.
+ */
+#ifndef CONSOLE_USART_LIN_AVAILABLE
+#define CONSOLE_USART_LIN_AVAILABLE 0
+#endif
+
+#ifndef CONSOLE_USART_CLEAR_BREAK
+#define CONSOLE_USART_CLEAR_BREAK(usart) (USART_SR(usart) = ~USART_SR_LBD)
+#endif
+
+#ifndef CONSOLE_USART_CLEAR_TC
+#define CONSOLE_USART_CLEAR_TC(usart) (USART_SR(usart) = ~USART_SR_TC)
+#endif
+
+#ifndef CONSOLE_TX_DMA_AVAILABLE
+#define CONSOLE_TX_DMA_AVAILABLE 0
+#endif
+
+/* Set if the RX and TX DMA channels share one interrupt vector */
+#ifndef CONSOLE_DMA_SHARED_IRQ
+#define CONSOLE_DMA_SHARED_IRQ 0
+#endif
+
+/*
+ * Flush received data to the host as soon as the line goes idle or the
+ * RX DMA ring passes its midpoint, instead of waiting for the next frame.
+ */
+#ifndef CONSOLE_RX_EVENT_FLUSH
+#define CONSOLE_RX_EVENT_FLUSH CONSOLE_RX_DMA_AVAILABLE
+#endif
+
+struct console;
+
+typedef void (*console_callback)(struct console* con);
+
+/*
+ * RTS/CTS handshaking on GPIO pins. CTS is watched with an EXTI line and
+ * gates the TX DMA requests (or the TXE interrupt); RTS is driven from
+ * the RX ring fill level.
+ */
+#ifndef CONSOLE_FLOW_CONTROL_AVAILABLE
+#define CONSOLE_FLOW_CONTROL_AVAILABLE 0
+#endif
+
+/* Whether handshaking is enabled before the host asks for it */
+#ifndef CONSOLE_FLOW_CONTROL_DEFAULT
+#define CONSOLE_FLOW_CONTROL_DEFAULT 0
+#endif
+
+#if CONSOLE_FLOW_CONTROL_AVAILABLE
+/* Bytes the far end may still send after RTS is dropped */
+#ifndef CONSOLE_RTS_SLACK
+#define CONSOLE_RTS_SLACK 16
+#endif
+
+/*
+ * The fill level is only sampled at the DMA half/full points and when
+ * the line goes idle, which can be half a ring apart, so RTS is dropped
+ * early enough that half a ring plus the slack still fits.
+ */
+#ifndef CONSOLE_RTS_HIGH_WATERMARK
+#define CONSOLE_RTS_HIGH_WATERMARK (CONSOLE_RX_BUFFER_SIZE/2 - CONSOLE_RTS_SLACK)
+#endif
+
+#ifndef CONSOLE_RTS_LOW_WATERMARK
+#define CONSOLE_RTS_LOW_WATERMARK (CONSOLE_RX_BUFFER_SIZE/4)
+#endif
+
+_Static_assert(CONSOLE_RTS_LOW_WATERMARK < CONSOLE_RTS_HIGH_WATERMARK,
+               "RX ring too small for RTS hysteresis");
+#endif
+
+/*
+ * Timed breaks. The TX pin is switched to a GPIO output held low for the
+ * duration, which is measured with a one-shot hardware timer. The
+ * target supplies the timer and target_console_set_break.
+ */
+#ifndef CONSOLE_BREAK_AVAILABLE
+#define CONSOLE_BREAK_AVAILABLE 0
+#endif
+
+/* Break duration that lasts until a request with a duration of 0 */
+#define CONSOLE_BREAK_UNTIL_CLEARED 0xFFFF
+
+/* Set if the USARTs can oversample by 8 instead of 16 */
+#ifndef CONSOLE_USART_OVER8_AVAILABLE
+#define CONSOLE_USART_OVER8_AVAILABLE 0
+#endif
+
+/* Largest baud rate error accepted from the host, in tenths of a percent */
+#ifndef CONSOLE_BAUD_MAX_ERROR_PERMILLE
+#define CONSOLE_BAUD_MAX_ERROR_PERMILLE 20
+#endif
+
+/* Baud rate settings for one USART */
+struct console_usart_baud {
+    uint32_t rate;
+    uint16_t brr;
+    uint16_t error_permille;
+    bool over8;
+};
+
+struct console_baud_plan {
+    struct console_usart_baud tx;
+    struct console_usart_baud rx;
+};
+
+/*
+ * RX loss accounting. Overruns count the times the RX DMA lapped the
+ * reader, and dropped counts the bytes the host never received intact
+ * because of them. The error counters come from the USART itself.
+ */
+struct console_rx_stats {
+    uint32_t overruns;
+    uint32_t dropped;
+    uint32_t overrun_errors;
+    uint32_t framing_errors;
+    uint32_t parity_errors;
+};
+
+/*
+ * Line events, collected from the RX path until taken, and the modem
+ * status inputs. Overrun covers both USART overruns and bytes dropped
+ * because the RX DMA lapped the reader.
+ */
+#define CONSOLE_LINE_BREAK    (1 << 0)
+#define CONSOLE_LINE_FRAMING  (1 << 1)
+#define CONSOLE_LINE_PARITY   (1 << 2)
+#define CONSOLE_LINE_OVERRUN  (1 << 3)
+
+/*
+ * Timing marks in the RX stream, recorded by the RX ISRs while enabled
+ * for capture mode. Each one gives the time at which the bytes before
+ * position, counted from the start of RX, had been received: at a DMA
+ * half/full boundary, when the line went idle (one frame after the last
+ * byte), or when a line event was seen.
+ */
+#ifndef CONSOLE_RX_MARKS
+#define CONSOLE_RX_MARKS 16
+#endif
+
+_Static_assert((CONSOLE_RX_MARKS & (CONSOLE_RX_MARKS - 1)) == 0,
+               "The RX mark queue size must be a power of two");
+
+enum console_rx_mark_kind {
+    CONSOLE_RX_MARK_DMA,
+    CONSOLE_RX_MARK_IDLE,
+    CONSOLE_RX_MARK_LINE,
+};
+
+struct console_rx_mark {
+    uint32_t position;
+    uint32_t time_us;
+    uint8_t kind;
+    /* CONSOLE_LINE_* for line marks */
+    uint8_t events;
+};
+
+#define CONSOLE_MODEM_DCD     (1 << 0)
+#define CONSOLE_MODEM_DSR     (1 << 1)
+#define CONSOLE_MODEM_RI      (1 << 2)
+
+struct console_isr_stats {
+    uint32_t calls;
+    uint32_t cycles;
+    uint32_t bytes;
+};
+
+
+extern struct console* console_port(uint8_t index);
+extern uint8_t console_port_index(const struct console* con);
+
+extern bool console_plan_baudrate(const struct console* con, uint32_t baudrate,
+                                  struct console_baud_plan* plan);
+extern uint32_t console_baud_plan_rate(const struct console_baud_plan* plan);
 
 extern void console_setup(uint32_t baudrate);
-extern void console_reconfigure(uint32_t baudrate, uint32_t databits,
+extern void console_reconfigure(struct console* con, uint32_t baudrate, uint32_t databits,
                                 uint32_t stopbits, uint32_t parity);
 
-extern void console_send_blocking(uint8_t data);
-extern uint8_t console_recv_blocking(void);
-extern size_t console_send_buffered(const uint8_t* data, size_t num_bytes);
-extern size_t console_recv_buffered(uint8_t* data, size_t max_bytes);
-extern size_t console_send_buffer_space(void);
+extern void console_send_blocking(struct console* con, uint8_t data);
+extern uint8_t console_recv_blocking(struct console* con);
+extern size_t console_send_buffered(struct console* con, const uint8_t* data, size_t num_bytes);
+extern size_t console_recv_buffered(struct console* con, uint8_t* data, size_t max_bytes);
+extern size_t console_send_buffer_size(const struct console* con);
+extern size_t console_send_buffer_space(const struct console* con);
+extern bool console_notify_tx_space(struct console* con, size_t min_space,
+                                    console_callback callback);
+
+/*
+ * In-place access to the rings, as up to two spans where the free or
+ * queued region wraps around the end of the buffer.
+ */
+extern size_t console_send_reserve(struct console* con, struct ring_span spans[2]);
+extern void console_send_commit(struct console* con, size_t num_bytes);
+extern size_t console_recv_peek(struct console* con, struct ring_span spans[2]);
+extern void console_recv_consume(struct console* con, size_t num_bytes);
+
+extern uint32_t console_recv_position(const struct console* con);
+extern void console_set_rx_marks(struct console* con, bool enable);
+extern bool console_peek_rx_mark(struct console* con, struct console_rx_mark* mark);
+extern void console_drop_rx_mark(struct console* con);
+extern uint32_t console_take_rx_marks_lost(struct console* con);
+
+extern bool console_rx_poll_event(struct console* con);
+extern void console_set_rx_event_callback(struct console* con, console_callback callback);
+
+extern bool console_set_flow_control(struct console* con, bool enable);
+extern bool console_send_break(struct console* con, uint16_t duration_ms);
+
+extern void console_get_rx_stats(struct console* con, struct console_rx_stats* stats);
+extern uint16_t console_take_line_events(struct console* con);
+extern uint16_t console_get_modem_status(struct console* con);
+extern void console_get_tx_isr_stats(struct console* con, struct console_isr_stats* stats);
+
+/* Fullest each ring has been since the last call */
+extern void console_take_high_water(struct console* con, uint16_t* tx_used, uint16_t* rx_used);
+
+/*
+ * Connect a port's RX to its own TX pin inside the USART, using
+ * half-duplex mode, from the next console_reconfigure(). Not available
+ * on split USARTs. Break detection is off while looped back.
+ */
+extern bool console_set_loopback(struct console* con, bool enable);
 
 #endif
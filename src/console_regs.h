@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CONSOLE_REGS_H_INCLUDED
+#define CONSOLE_REGS_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/usart.h>
+
+#include "console.h"
+
+/*
+ * Inline register access for the console's interrupt handlers and data
+ * paths, in place of out-of-line libopencm3 calls. Setup code still goes
+ * through libopencm3. Time the handlers before and after changing them
+ * with a PROFILE=1 build and tools/cycleprof.
+ *
+ * The registers are picked at compile time by the target's config.h:
+ * the status and transmit data registers are USART_SR and USART_DR on
+ * the F1, and USART_ISR and USART_TDR on the F0, with the USART_SR_*
+ * flags mapped onto the USART_ISR_* ones. The DMA controllers match.
+ */
+
+static inline uint32_t usart_reg_status(uint32_t usart) {
+    return CONSOLE_USART_STATUS(usart);
+}
+
+static inline bool usart_reg_get_flag(uint32_t usart, uint32_t flag) {
+    return (CONSOLE_USART_STATUS(usart) & flag) != 0;
+}
+
+/* TXE is set and its interrupt enabled, as usart_get_interrupt_source */
+static inline bool usart_reg_tx_ready(uint32_t usart) {
+    return (USART_CR1(usart) & USART_CR1_TXEIE)
+        && (CONSOLE_USART_STATUS(usart) & USART_SR_TXE);
+}
+
+static inline void usart_reg_send(uint32_t usart, uint8_t data) {
+    CONSOLE_USART_TDR(usart) = data;
+}
+
+/*
+ * Clear and set bits in a USART control register. On a port with one
+ * USART, handlers at different priorities share CR1 and CR3 (the RX
+ * error interrupts, TCIE for breaks, TXEIE and DMAT for CTS), so the
+ * read-modify-write is done with interrupts masked, or a change made by
+ * a handler that preempted it would be lost.
+ */
+static inline void usart_reg_modify(volatile uint32_t* reg, uint32_t clear, uint32_t set) {
+    uint32_t masked = cm_mask_interrupts(1);
+    *reg = (*reg & ~clear) | set;
+    cm_mask_interrupts(masked);
+}
+
+static inline void usart_reg_set_tx_interrupt(uint32_t usart, bool enable) {
+    usart_reg_modify(&USART_CR1(usart), USART_CR1_TXEIE, enable ? USART_CR1_TXEIE : 0);
+}
+
+static inline void usart_reg_set_tx_dma(uint32_t usart, bool enable) {
+    usart_reg_modify(&USART_CR3(usart), USART_CR3_DMAT, enable ? USART_CR3_DMAT : 0);
+}
+
+/* DMA_*IF flags of one channel, shifted down to the channel 1 positions */
+static inline uint32_t dma_reg_get_flags(uint32_t dma, uint8_t channel) {
+    return DMA_ISR(dma) >> DMA_FLAG_OFFSET(channel);
+}
+
+static inline void dma_reg_clear_flags(uint32_t dma, uint8_t channel, uint32_t flags) {
+    DMA_IFCR(dma) = flags << DMA_FLAG_OFFSET(channel);
+}
+
+/* Transfer len bytes from or to address on a configured, disabled channel */
+static inline void dma_reg_start(uint32_t dma, uint8_t channel, uint32_t address, uint16_t len) {
+    DMA_CMAR(dma, channel) = address;
+    DMA_CNDTR(dma, channel) = len;
+    DMA_CCR(dma, channel) |= DMA_CCR_EN;
+}
+
+static inline void dma_reg_disable(uint32_t dma, uint8_t channel) {
+    DMA_CCR(dma, channel) &= ~DMA_CCR_EN;
+}
+
+static inline bool dma_reg_enabled(uint32_t dma, uint8_t channel) {
+    return (DMA_CCR(dma, channel) & DMA_CCR_EN) != 0;
+}
+
+#endif
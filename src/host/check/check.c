@@ -0,0 +1,552 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Interleaving checker for the state the console and CDC code share
+ * between interrupt handlers. It runs a scenario on the simulator like
+ * termlink-sim, with console.c, ring.c and USB/cdc.c built with
+ * -fsanitize=thread so that every load and store they make calls back
+ * here first. Only the accesses to static memory, which includes the
+ * simulated registers, are of interest.
+ *
+ * A survey run without preemption notes the priority levels each byte
+ * is read and written from once the device is configured. Accesses to
+ * peripheral registers and to bytes written at one level and used at
+ * another, made where an enabled interrupt could preempt, are the
+ * preemption points; preempting anywhere else would only have the same
+ * effect as at the next point.
+ *
+ * For every point of the run in turn, a forked copy brings the next
+ * preempting interrupt forward to that point, as if the code had been
+ * slower up to there, and runs the scenario to the end. A copy fails if
+ * an expectation fails, the simulator stops, or any test stream lost,
+ * duplicated or reordered a byte. With a bound above one, each copy
+ * goes on to preempt later points itself.
+ *
+ * A failing schedule is printed as its list of points, which -s runs
+ * again in the foreground with the scenario's report.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <link.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#include "../sim/sim.h"
+
+#define CHECK_HORIZON_DEFAULT_US 10000
+#define CHECK_MAX_BOUND 4
+#define CHECK_MAX_JOBS 64
+#define CHECK_MAX_REPORTS 10
+
+/* Exit statuses of a copy besides the scenario's own */
+#define CHECK_EXIT_QUIET 3
+#define CHECK_EXIT_STREAMS 4
+
+struct check_point {
+    uint64_t index;
+    uintptr_t pc;
+};
+
+/* Priority levels a byte was used from, one bit per level */
+struct check_levels {
+    uint32_t read;
+    uint32_t written;
+};
+
+struct check_job {
+    pid_t pid;
+    struct check_point point;
+};
+
+/* Counts shared by every copy */
+struct check_totals {
+    uint64_t explored;
+    uint64_t quiet;
+    uint64_t failed;
+};
+
+static struct {
+    const char* binary;
+    const char* scenario;
+    unsigned bound;
+    unsigned jobs;
+    uint64_t horizon;
+    int report_fd;
+
+    /* Points preempted on the way to this copy */
+    struct check_point path[CHECK_MAX_BOUND];
+    unsigned depth;
+
+    bool surveying;
+    struct check_levels* levels;
+
+    /* Replaying a schedule instead of exploring */
+    bool replay;
+    uint64_t schedule[CHECK_MAX_BOUND];
+    unsigned schedule_len;
+    unsigned schedule_next;
+
+    bool counting;
+    uint64_t points;
+    struct check_job running[CHECK_MAX_JOBS];
+    unsigned num_running;
+} check;
+
+static struct check_totals* totals;
+
+extern char __data_start[];
+extern char _end[];
+
+extern void __real_exit(int status) __attribute__((noreturn));
+
+/* Offset of an address in the executable, as addr2line wants it */
+static int check_base_callback(struct dl_phdr_info* info, size_t size, void* data) {
+    (void)size;
+    *(uintptr_t*)data = info->dlpi_addr;
+    return 1;
+}
+
+static uintptr_t check_offset(uintptr_t addr) {
+    uintptr_t base = 0;
+    dl_iterate_phdr(check_base_callback, &base);
+    return addr - base;
+}
+
+/*
+ * Describe code by function and line, innermost inlined function first.
+ * Without addr2line, the offset has to do.
+ */
+static void check_describe(uintptr_t addr, char* text, size_t size) {
+    char command[128];
+    snprintf(command, sizeof(command), "addr2line -f -i -s -e /proc/%d/exe 0x%lx 2>/dev/null",
+             (int)getpid(), (unsigned long)check_offset(addr));
+    snprintf(text, size, "0x%lx", (unsigned long)check_offset(addr));
+
+    FILE* pipe = popen(command, "r");
+    if (pipe == NULL) {
+        return;
+    }
+    char function[96];
+    char line[96];
+    size_t len = 0;
+    while (fgets(function, sizeof(function), pipe) && fgets(line, sizeof(line), pipe)) {
+        function[strcspn(function, "\n")] = '\0';
+        line[strcspn(line, "\n")] = '\0';
+        if (strcmp(function, "??") == 0) {
+            break;
+        }
+        len += snprintf(&text[len], (len < size) ? size - len : 0, "%s%s (%s)",
+                        (len == 0) ? "" : " in ", function, line);
+    }
+    pclose(pipe);
+}
+
+static void check_print_point(int fd, const struct check_point* point) {
+    char where[256];
+    check_describe(point->pc, where, sizeof(where));
+    dprintf(fd, "  point %llu: %s\n", (unsigned long long)point->index, where);
+}
+
+static const char* check_status_text(int status, char* text, size_t size) {
+    if (WIFSIGNALED(status)) {
+        snprintf(text, size, "killed by %s", strsignal(WTERMSIG(status)));
+    } else if (WEXITSTATUS(status) == 1) {
+        snprintf(text, size, "an expectation failed");
+    } else if (WEXITSTATUS(status) == 2) {
+        snprintf(text, size, "the simulator stopped");
+    } else if (WEXITSTATUS(status) == CHECK_EXIT_STREAMS) {
+        snprintf(text, size, "bytes were lost, duplicated or reordered");
+    } else {
+        snprintf(text, size, "exit status %d", WEXITSTATUS(status));
+    }
+    return text;
+}
+
+/* Report a copy that failed, up to a limit across all copies */
+static void check_report(const struct check_job* job, int status) {
+    uint64_t failed = __atomic_add_fetch(&totals->failed, 1, __ATOMIC_RELAXED);
+    if (failed > CHECK_MAX_REPORTS) {
+        return;
+    }
+
+    char reason[64];
+    dprintf(check.report_fd, "%s: FAILED: %s with preemption at\n", check.scenario,
+            check_status_text(status, reason, sizeof(reason)));
+    for (unsigned i = 0; i < check.depth; i++) {
+        check_print_point(check.report_fd, &check.path[i]);
+    }
+    check_print_point(check.report_fd, &job->point);
+
+    dprintf(check.report_fd, "  replay: %s -s ", check.binary);
+    for (unsigned i = 0; i < check.depth; i++) {
+        dprintf(check.report_fd, "%llu,", (unsigned long long)check.path[i].index);
+    }
+    dprintf(check.report_fd, "%llu %s\n", (unsigned long long)job->point.index, check.scenario);
+}
+
+/* Wait for a copy to finish and account for it */
+static void check_reap(void) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, 0)) < 0) {
+        if (errno != EINTR) {
+            sim_fatal("waitpid: %s", strerror(errno));
+        }
+    }
+
+    for (unsigned i = 0; i < check.num_running; i++) {
+        if (check.running[i].pid != pid) {
+            continue;
+        }
+        if (WIFEXITED(status) && WEXITSTATUS(status) == CHECK_EXIT_QUIET) {
+            __atomic_add_fetch(&totals->quiet, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_add_fetch(&totals->explored, 1, __ATOMIC_RELAXED);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                check_report(&check.running[i], status);
+            }
+        }
+        check.running[i] = check.running[--check.num_running];
+        return;
+    }
+}
+
+/* Take the preemption in the foreground, for a replayed schedule */
+static void check_replay_point(uint64_t index, uintptr_t pc) {
+    struct check_point point = { index, pc };
+    check_print_point(STDOUT_FILENO, &point);
+    int irq = sim_preempt(check.horizon);
+    if (irq < 0) {
+        printf("    no interrupt within the horizon\n");
+        return;
+    }
+    char handler[256];
+    check_describe((uintptr_t)sim_irq_handler(irq), handler, sizeof(handler));
+    printf("    preempted by %s\n", handler);
+}
+
+/* Fork a copy that is preempted here, while this one carries on without */
+static void check_fork(uint64_t index, uintptr_t pc) {
+    if (check.num_running == check.jobs) {
+        check_reap();
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        sim_fatal("fork: %s", strerror(errno));
+    } else if (pid > 0) {
+        struct check_job* job = &check.running[check.num_running++];
+        job->pid = pid;
+        job->point.index = index;
+        job->point.pc = pc;
+        return;
+    }
+
+    /* Deeper copies are forked one at a time, from here */
+    check.path[check.depth].index = index;
+    check.path[check.depth].pc = pc;
+    check.depth++;
+    check.num_running = 0;
+    check.jobs = 1;
+
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    close(null);
+
+    if (sim_preempt(check.horizon) < 0) {
+        _exit(CHECK_EXIT_QUIET);
+    }
+}
+
+/* Whether another priority level or the hardware uses the memory too */
+static bool check_shared(const volatile void* addr) {
+    uint32_t offset;
+    if (sim_block_at((uint32_t)(uintptr_t)addr, &offset) != NULL) {
+        return true;
+    }
+    const struct check_levels* levels = &check.levels[(const char*)addr - __data_start];
+    uint32_t used = levels->read | levels->written;
+    return levels->written != 0 && (used & (used - 1)) != 0;
+}
+
+static void check_point(const volatile void* addr, bool write, uintptr_t pc) {
+    /* Stack accesses are private to the code making them */
+    if ((const char*)addr < __data_start || (const char*)addr >= _end) {
+        return;
+    }
+    /* Set-up and enumeration aren't explored, only the scenario */
+    if (!check.counting) {
+        if (!sim_usbd_configured()) {
+            return;
+        }
+        check.counting = true;
+    }
+    if (check.surveying) {
+        struct check_levels* levels = &check.levels[(const char*)addr - __data_start];
+        if (write) {
+            levels->written |= 1U << (sim_priority() >> 4);
+        } else {
+            levels->read |= 1U << (sim_priority() >> 4);
+        }
+        return;
+    }
+    if (!sim_preemptible() || !check_shared(addr)) {
+        return;
+    }
+
+    uint64_t index = check.points++;
+    if (check.replay) {
+        if (check.schedule_next < check.schedule_len
+            && check.schedule[check.schedule_next] == index) {
+            check.schedule_next++;
+            check_replay_point(index, pc);
+        }
+    } else if (check.depth < check.bound) {
+        check_fork(index, pc);
+    }
+}
+
+/* Every byte sent on every stream arrived once and in order */
+static bool check_streams(void) {
+    for (uint8_t port = 0; port < CONSOLE_NUM_PORTS; port++) {
+        for (int dir = SIM_RX; dir <= SIM_TX; dir++) {
+            struct sim_stream_stats stats;
+            sim_stream_get_stats(port, dir, &stats);
+            if (stats.lost != 0 || stats.corrupt != 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * The scenario ends by calling exit(), with status 1 if an expectation
+ * failed; linked with --wrap=exit, so the copies still running and the
+ * streams can be checked first.
+ */
+void __wrap_exit(int status) {
+    while (check.num_running > 0) {
+        check_reap();
+    }
+    if (status == 0 && !check_streams()) {
+        printf("%s: bytes were lost, duplicated or reordered\n", check.scenario);
+        status = CHECK_EXIT_STREAMS;
+    }
+    if (check.replay && check.schedule_next < check.schedule_len) {
+        printf("%s: point %llu not reached; the run had %llu\n", check.scenario,
+               (unsigned long long)check.schedule[check.schedule_next],
+               (unsigned long long)check.points);
+    }
+    if (check.depth > 0 || check.replay || check.surveying) {
+        __real_exit(status);
+    }
+
+    if (status != 0) {
+        dprintf(check.report_fd, "%s: FAILED without preemption\n", check.scenario);
+    }
+    dprintf(check.report_fd, "%s: %llu points, %llu preempted, %llu with no interrupt in reach, %llu failed\n",
+           check.scenario, (unsigned long long)check.points,
+           (unsigned long long)totals->explored, (unsigned long long)totals->quiet,
+           (unsigned long long)totals->failed);
+    __real_exit((status != 0 || totals->failed != 0) ? 1 : 0);
+}
+
+/* Hooks called by the code built with -fsanitize=thread */
+#define CHECK_HOOK(name, write)                                         \
+    void name(void* addr) {                                             \
+        check_point(addr, write, (uintptr_t)__builtin_return_address(0)); \
+    }
+
+#define CHECK_ACCESS_HOOKS(size)                        \
+    CHECK_HOOK(__tsan_read##size, false)                \
+    CHECK_HOOK(__tsan_write##size, true)                \
+    CHECK_HOOK(__tsan_unaligned_read##size, false)      \
+    CHECK_HOOK(__tsan_unaligned_write##size, true)
+
+CHECK_ACCESS_HOOKS(1)
+CHECK_ACCESS_HOOKS(2)
+CHECK_ACCESS_HOOKS(4)
+CHECK_ACCESS_HOOKS(8)
+CHECK_ACCESS_HOOKS(16)
+
+void __tsan_read_range(void* addr, size_t size) {
+    (void)size;
+    check_point(addr, false, (uintptr_t)__builtin_return_address(0));
+}
+
+void __tsan_write_range(void* addr, size_t size) {
+    (void)size;
+    check_point(addr, true, (uintptr_t)__builtin_return_address(0));
+}
+
+void __tsan_init(void) {
+}
+
+void __tsan_func_entry(void* caller) {
+    (void)caller;
+}
+
+void __tsan_func_exit(void) {
+}
+
+void __tsan_atomic_thread_fence(int order) {
+    (void)order;
+}
+
+/*
+ * Run the scenario once without preemption in a copy, noting the levels
+ * each byte is used from. Returns false if it fails by itself.
+ */
+static bool check_survey(void) {
+    size_t size = (size_t)(_end - __data_start) * sizeof(struct check_levels);
+    check.levels = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (check.levels == MAP_FAILED) {
+        sim_fatal("mmap: %s", strerror(errno));
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        sim_fatal("fork: %s", strerror(errno));
+    } else if (pid == 0) {
+        check.surveying = true;
+        freopen("/dev/null", "w", stdout);
+        firmware_main();
+        sim_fatal("firmware returned from main()");
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            sim_fatal("waitpid: %s", strerror(errno));
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool check_parse_schedule(char* text) {
+    for (char* item = strtok(text, ","); item != NULL; item = strtok(NULL, ",")) {
+        char* end;
+        uint64_t index = strtoull(item, &end, 10);
+        if (*end != '\0' || check.schedule_len == CHECK_MAX_BOUND
+            || (check.schedule_len > 0 && index <= check.schedule[check.schedule_len - 1])) {
+            return false;
+        }
+        check.schedule[check.schedule_len++] = index;
+    }
+    return check.schedule_len > 0;
+}
+
+static int check_usage(void) {
+    fprintf(stderr,
+            "usage: %s [-p bound] [-j jobs] [-t horizon_us] [-s point,...] scenario.scn\n"
+            "  -p  preemptions per run, default 1\n"
+            "  -j  runs at once, default the number of CPUs\n"
+            "  -t  how far ahead an interrupt may be brought, default %u us\n"
+            "  -s  replay one schedule with the scenario's report\n",
+            check.binary, CHECK_HORIZON_DEFAULT_US);
+    return 2;
+}
+
+int main(int argc, char** argv) {
+    check.binary = argv[0];
+    check.bound = 1;
+    check.jobs = (unsigned)sysconf(_SC_NPROCESSORS_ONLN);
+    check.horizon = SIM_US(CHECK_HORIZON_DEFAULT_US);
+
+    int c;
+    while ((c = getopt(argc, argv, "p:j:t:s:")) != -1) {
+        switch (c) {
+            case 'p':
+                check.bound = (unsigned)atoi(optarg);
+                if (check.bound < 1 || check.bound > CHECK_MAX_BOUND) {
+                    return check_usage();
+                }
+                break;
+            case 'j':
+                check.jobs = (unsigned)atoi(optarg);
+                break;
+            case 't':
+                check.horizon = SIM_US(strtoull(optarg, NULL, 10));
+                break;
+            case 's':
+                if (!check_parse_schedule(optarg)) {
+                    return check_usage();
+                }
+                check.replay = true;
+                break;
+            default:
+                return check_usage();
+        }
+    }
+    if (optind + 1 != argc) {
+        return check_usage();
+    }
+    check.scenario = argv[optind];
+    if (check.jobs < 1 || check.jobs > CHECK_MAX_JOBS) {
+        check.jobs = (check.jobs < 1) ? 1 : CHECK_MAX_JOBS;
+    }
+
+    totals = mmap(NULL, sizeof(*totals), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (totals == MAP_FAILED) {
+        perror("mmap");
+        return 2;
+    }
+    check.report_fd = dup(STDOUT_FILENO);
+
+    sim_core_init();
+    sim_gpio_init();
+    sim_timer_init();
+    sim_dma_init();
+    sim_usart_init();
+    sim_host_init();
+    sim_farend_init();
+    if (!sim_script_load(check.scenario)) {
+        return 2;
+    }
+
+    if (!check_survey() && !check.replay) {
+        printf("%s: FAILED without preemption; run it on the simulator for the report\n",
+               check.scenario);
+        return 1;
+    }
+
+    /* The scenario's report is only printed on replay */
+    if (!check.replay) {
+        freopen("/dev/null", "w", stdout);
+    }
+
+    firmware_main();
+    sim_fatal("firmware returned from main()");
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOST_CONFIG_H_INCLUDED
+#define HOST_CONFIG_H_INCLUDED
+
+/*
+ * The host simulation runs the Blue Pill configuration, with one port
+ * unless told otherwise, on the simulated STM32F103 in host/sim.
+ */
+#ifndef CONSOLE_NUM_PORTS
+#define CONSOLE_NUM_PORTS 1
+#endif
+
+#include "../stm32f103/bluepill/config.h"
+
+/* The simulated USB device has no packet memory to double-buffer in */
+#undef USB_DOUBLE_BUFFERED_BULK
+#define USB_DOUBLE_BUFFERED_BULK 0
+
+/* Code placement means nothing on the host */
+#undef RAMFUNC_ENABLED
+#define RAMFUNC_ENABLED 0
+
+/* WFI lets simulated time run on to the next event */
+extern void sim_wait_for_interrupt(void);
+#define TARGET_WAIT_FOR_INTERRUPT() sim_wait_for_interrupt()
+
+#endif
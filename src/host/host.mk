@@ -0,0 +1,77 @@
+## Copyright (c) 2016, Devan Lai
+##
+## Permission to use, copy, modify, and/or distribute this software
+## for any purpose with or without fee is hereby granted, provided
+## that the above copyright notice and this permission notice
+## appear in all copies.
+##
+## THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+## WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+## WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+## AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+## CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+## LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+## NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+## CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+# Host-native build of the firmware, running on the simulated STM32F103
+# in host/sim. "make TARGET=HOST sim" runs every scenario script, and
+# "make TARGET=HOST check" explores the interrupt interleavings of the
+# scenarios in host/check, see host/check/check.c.
+
+HOST_CC      ?= cc
+HOST_BUILD   ?= host/build
+HOST_CFLAGS  ?= -O2 -g
+HOST_CFLAGS  += -std=gnu99 -Wall -Wextra -Wundef -Wno-unused-parameter \
+                -Wno-pointer-to-int-cast -Wno-int-to-pointer-cast
+SCENARIOS    ?= $(sort $(wildcard host/scenarios/*.scn))
+CHECK_SRCS   ?= console.c ring.c USB/cdc.c
+CHECK_SCENARIOS ?= $(sort $(wildcard host/check/*.scn))
+
+SRCS += $(wildcard host/sim/*.c)
+
+HOST_OBJS = $(patsubst %.c,$(HOST_BUILD)/%.o,$(sort $(SRCS)))
+HOST_BIN  = $(HOST_BUILD)/$(BINARY)-sim
+
+# The checker has its own main(), and the code it checks instrumented
+CHECK_BUILD = $(HOST_BUILD)/check
+CHECK_OBJS  = $(filter-out $(patsubst %.c,$(HOST_BUILD)/%.o,$(CHECK_SRCS) host/sim/main.c),$(HOST_OBJS)) \
+              $(patsubst %.c,$(CHECK_BUILD)/%.o,$(CHECK_SRCS)) $(HOST_BUILD)/host/check/check.o
+CHECK_BIN   = $(HOST_BUILD)/$(BINARY)-check
+
+.DEFAULT_GOAL := $(HOST_BIN)
+
+# The simulator owns main() and calls the firmware's
+$(HOST_BUILD)/termlink.o: HOST_RENAME_MAIN := -Dmain=firmware_main
+
+$(HOST_BIN): $(HOST_OBJS)
+	$(HOST_CC) $(HOST_LDFLAGS) -o $@ $^ $(HOST_LDLIBS)
+
+$(HOST_BUILD)/%.o: %.c
+	@mkdir -p $(dir $@)
+	$(HOST_CC) $(HOST_CFLAGS) -MD -Ihost/include $(DEFS) $(CPPFLAGS) $(HOST_CPPFLAGS) $(HOST_RENAME_MAIN) -c -o $@ $<
+
+$(CHECK_BIN): $(CHECK_OBJS)
+	$(HOST_CC) $(HOST_LDFLAGS) -Wl,--wrap=exit -o $@ $^ $(HOST_LDLIBS)
+
+# Only the memory access hooks are used, from check.c, not the runtime
+$(CHECK_BUILD)/%.o: %.c
+	@mkdir -p $(dir $@)
+	$(HOST_CC) $(HOST_CFLAGS) -fsanitize=thread -Wno-tsan -MD -Ihost/include $(DEFS) $(CPPFLAGS) $(HOST_CPPFLAGS) -c -o $@ $<
+
+sim: $(HOST_BIN)
+	@status=0; for scenario in $(SCENARIOS); do \
+		$(HOST_BIN) $$scenario || status=1; \
+	done; exit $$status
+
+check: $(CHECK_BIN)
+	@status=0; for scenario in $(CHECK_SCENARIOS); do \
+		$(CHECK_BIN) $(CHECK_FLAGS) $$scenario || status=1; \
+	done; exit $$status
+
+clean::
+	@rm -rf $(HOST_BUILD)
+
+.PHONY: sim check
+
+-include $(HOST_OBJS:.o=.d) $(CHECK_OBJS:.o=.d)
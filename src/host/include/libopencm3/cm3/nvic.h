@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBOPENCM3_CM3_NVIC_H
+#define LIBOPENCM3_CM3_NVIC_H
+
+#include <libopencm3/cm3/common.h>
+
+/* STM32F10x interrupt numbers */
+#define NVIC_SYSTICK_IRQ -1
+
+#define NVIC_EXTI0_IRQ 6
+#define NVIC_EXTI1_IRQ 7
+#define NVIC_EXTI2_IRQ 8
+#define NVIC_EXTI3_IRQ 9
+#define NVIC_EXTI4_IRQ 10
+#define NVIC_DMA1_CHANNEL1_IRQ 11
+#define NVIC_DMA1_CHANNEL2_IRQ 12
+#define NVIC_DMA1_CHANNEL3_IRQ 13
+#define NVIC_DMA1_CHANNEL4_IRQ 14
+#define NVIC_DMA1_CHANNEL5_IRQ 15
+#define NVIC_DMA1_CHANNEL6_IRQ 16
+#define NVIC_DMA1_CHANNEL7_IRQ 17
+#define NVIC_USB_HP_CAN_TX_IRQ 19
+#define NVIC_USB_LP_CAN_RX0_IRQ 20
+#define NVIC_EXTI9_5_IRQ 23
+#define NVIC_TIM2_IRQ 28
+#define NVIC_TIM3_IRQ 29
+#define NVIC_TIM4_IRQ 30
+#define NVIC_USART1_IRQ 37
+#define NVIC_USART2_IRQ 38
+#define NVIC_USART3_IRQ 39
+#define NVIC_EXTI15_10_IRQ 40
+
+#define NVIC_IRQ_COUNT 68
+
+extern void nvic_enable_irq(uint8_t irqn);
+extern void nvic_disable_irq(uint8_t irqn);
+extern uint8_t nvic_get_pending_irq(uint8_t irqn);
+extern void nvic_set_pending_irq(uint8_t irqn);
+extern void nvic_clear_pending_irq(uint8_t irqn);
+extern uint8_t nvic_get_irq_enabled(uint8_t irqn);
+extern void nvic_set_priority(uint8_t irqn, uint8_t priority);
+
+/* Handlers, which the firmware overrides by name */
+extern void sys_tick_handler(void);
+extern void exti0_isr(void);
+extern void exti1_isr(void);
+extern void exti2_isr(void);
+extern void exti3_isr(void);
+extern void exti4_isr(void);
+extern void dma1_channel1_isr(void);
+extern void dma1_channel2_isr(void);
+extern void dma1_channel3_isr(void);
+extern void dma1_channel4_isr(void);
+extern void dma1_channel5_isr(void);
+extern void dma1_channel6_isr(void);
+extern void dma1_channel7_isr(void);
+extern void usb_hp_can_tx_isr(void);
+extern void usb_lp_can_rx0_isr(void);
+extern void exti9_5_isr(void);
+extern void tim2_isr(void);
+extern void tim3_isr(void);
+extern void tim4_isr(void);
+extern void usart1_isr(void);
+extern void usart2_isr(void);
+extern void usart3_isr(void);
+extern void exti15_10_isr(void);
+
+#endif
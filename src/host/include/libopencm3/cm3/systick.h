@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBOPENCM3_CM3_SYSTICK_H
+#define LIBOPENCM3_CM3_SYSTICK_H
+
+#include <libopencm3/cm3/common.h>
+
+#define STK_CSR_CLKSOURCE_AHB_DIV8 (0 << 2)
+#define STK_CSR_CLKSOURCE_AHB      (1 << 2)
+
+#define STK_RVR_RELOAD 0x00FFFFFF
+
+extern void systick_set_reload(uint32_t value);
+extern uint32_t systick_get_reload(void);
+extern uint32_t systick_get_value(void);
+extern void systick_set_clocksource(uint8_t clocksource);
+extern void systick_interrupt_enable(void);
+extern void systick_interrupt_disable(void);
+extern void systick_counter_enable(void);
+extern void systick_counter_disable(void);
+extern uint8_t systick_get_countflag(void);
+extern void systick_clear(void);
+
+#endif
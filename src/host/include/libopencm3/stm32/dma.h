@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBOPENCM3_DMA_H
+#define LIBOPENCM3_DMA_H
+
+#include <libopencm3/cm3/common.h>
+
+#define DMA1 0x40020000U
+
+#define DMA_CHANNEL1 1
+#define DMA_CHANNEL2 2
+#define DMA_CHANNEL3 3
+#define DMA_CHANNEL4 4
+#define DMA_CHANNEL5 5
+#define DMA_CHANNEL6 6
+#define DMA_CHANNEL7 7
+
+#define DMA_ISR(dma)  MMIO32((dma) + 0x00)
+#define DMA_IFCR(dma) MMIO32((dma) + 0x04)
+#define DMA_CCR(dma, channel)   MMIO32((dma) + 0x08 + 0x14 * ((channel) - 1))
+#define DMA_CNDTR(dma, channel) MMIO32((dma) + 0x0C + 0x14 * ((channel) - 1))
+#define DMA_CPAR(dma, channel)  MMIO32((dma) + 0x10 + 0x14 * ((channel) - 1))
+#define DMA_CMAR(dma, channel)  MMIO32((dma) + 0x14 + 0x14 * ((channel) - 1))
+
+/* Interrupt flags, shifted into place for each channel */
+#define DMA_GIF  (1 << 0)
+#define DMA_TCIF (1 << 1)
+#define DMA_HTIF (1 << 2)
+#define DMA_TEIF (1 << 3)
+#define DMA_FLAG_OFFSET(channel) (4 * ((channel) - 1))
+
+#define DMA_CCR_MEM2MEM  (1 << 14)
+#define DMA_CCR_PL_LOW       (0 << 12)
+#define DMA_CCR_PL_MEDIUM    (1 << 12)
+#define DMA_CCR_PL_HIGH      (2 << 12)
+#define DMA_CCR_PL_VERY_HIGH (3 << 12)
+#define DMA_CCR_PL_MASK      (3 << 12)
+#define DMA_CCR_MSIZE_8BIT  (0 << 10)
+#define DMA_CCR_MSIZE_16BIT (1 << 10)
+#define DMA_CCR_MSIZE_32BIT (2 << 10)
+#define DMA_CCR_MSIZE_MASK  (3 << 10)
+#define DMA_CCR_PSIZE_8BIT  (0 << 8)
+#define DMA_CCR_PSIZE_16BIT (1 << 8)
+#define DMA_CCR_PSIZE_32BIT (2 << 8)
+#define DMA_CCR_PSIZE_MASK  (3 << 8)
+#define DMA_CCR_MINC (1 << 7)
+#define DMA_CCR_PINC (1 << 6)
+#define DMA_CCR_CIRC (1 << 5)
+#define DMA_CCR_DIR  (1 << 4)
+#define DMA_CCR_TEIE (1 << 3)
+#define DMA_CCR_HTIE (1 << 2)
+#define DMA_CCR_TCIE (1 << 1)
+#define DMA_CCR_EN   (1 << 0)
+
+extern void dma_channel_reset(uint32_t dma, uint8_t channel);
+extern void dma_clear_interrupt_flags(uint32_t dma, uint8_t channel, uint32_t interrupts);
+extern bool dma_get_interrupt_flag(uint32_t dma, uint8_t channel, uint32_t interrupts);
+extern void dma_set_priority(uint32_t dma, uint8_t channel, uint32_t prio);
+extern void dma_set_memory_size(uint32_t dma, uint8_t channel, uint32_t mem_size);
+extern void dma_set_peripheral_size(uint32_t dma, uint8_t channel, uint32_t peripheral_size);
+extern void dma_enable_memory_increment_mode(uint32_t dma, uint8_t channel);
+extern void dma_disable_memory_increment_mode(uint32_t dma, uint8_t channel);
+extern void dma_enable_circular_mode(uint32_t dma, uint8_t channel);
+extern void dma_set_read_from_peripheral(uint32_t dma, uint8_t channel);
+extern void dma_set_read_from_memory(uint32_t dma, uint8_t channel);
+extern void dma_enable_transfer_error_interrupt(uint32_t dma, uint8_t channel);
+extern void dma_disable_transfer_error_interrupt(uint32_t dma, uint8_t channel);
+extern void dma_enable_half_transfer_interrupt(uint32_t dma, uint8_t channel);
+extern void dma_disable_half_transfer_interrupt(uint32_t dma, uint8_t channel);
+extern void dma_enable_transfer_complete_interrupt(uint32_t dma, uint8_t channel);
+extern void dma_disable_transfer_complete_interrupt(uint32_t dma, uint8_t channel);
+extern void dma_enable_channel(uint32_t dma, uint8_t channel);
+extern void dma_disable_channel(uint32_t dma, uint8_t channel);
+extern void dma_set_peripheral_address(uint32_t dma, uint8_t channel, uint32_t address);
+extern void dma_set_memory_address(uint32_t dma, uint8_t channel, uint32_t address);
+extern void dma_set_number_of_data(uint32_t dma, uint8_t channel, uint16_t number);
+
+#endif
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBOPENCM3_EXTI_H
+#define LIBOPENCM3_EXTI_H
+
+#include <libopencm3/cm3/common.h>
+
+#define EXTI_BASE 0x40010400U
+#define EXTI_IMR   MMIO32(EXTI_BASE + 0x00)
+#define EXTI_EMR   MMIO32(EXTI_BASE + 0x04)
+#define EXTI_RTSR  MMIO32(EXTI_BASE + 0x08)
+#define EXTI_FTSR  MMIO32(EXTI_BASE + 0x0C)
+#define EXTI_SWIER MMIO32(EXTI_BASE + 0x10)
+#define EXTI_PR    MMIO32(EXTI_BASE + 0x14)
+
+#define EXTI0  (1 << 0)
+#define EXTI1  (1 << 1)
+#define EXTI2  (1 << 2)
+#define EXTI3  (1 << 3)
+#define EXTI4  (1 << 4)
+#define EXTI5  (1 << 5)
+#define EXTI6  (1 << 6)
+#define EXTI7  (1 << 7)
+#define EXTI8  (1 << 8)
+#define EXTI9  (1 << 9)
+#define EXTI10 (1 << 10)
+#define EXTI11 (1 << 11)
+#define EXTI12 (1 << 12)
+#define EXTI13 (1 << 13)
+#define EXTI14 (1 << 14)
+#define EXTI15 (1 << 15)
+
+enum exti_trigger_type {
+    EXTI_TRIGGER_RISING,
+    EXTI_TRIGGER_FALLING,
+    EXTI_TRIGGER_BOTH,
+};
+
+extern void exti_set_trigger(uint32_t extis, enum exti_trigger_type trig);
+extern void exti_enable_request(uint32_t extis);
+extern void exti_disable_request(uint32_t extis);
+extern void exti_reset_request(uint32_t extis);
+extern void exti_select_source(uint32_t exti, uint32_t gpioport);
+extern uint32_t exti_get_flag_status(uint32_t exti);
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBOPENCM3_GPIO_H
+#define LIBOPENCM3_GPIO_H
+
+#include <libopencm3/cm3/common.h>
+
+#define GPIOA 0x40010800U
+#define GPIOB 0x40010C00U
+#define GPIOC 0x40011000U
+
+#define GPIO_CRL(port)  MMIO32((port) + 0x00)
+#define GPIO_CRH(port)  MMIO32((port) + 0x04)
+#define GPIO_IDR(port)  MMIO32((port) + 0x08)
+#define GPIO_ODR(port)  MMIO32((port) + 0x0C)
+#define GPIO_BSRR(port) MMIO32((port) + 0x10)
+#define GPIO_BRR(port)  MMIO32((port) + 0x14)
+#define GPIO_LCKR(port) MMIO32((port) + 0x18)
+
+#define GPIO0  (1 << 0)
+#define GPIO1  (1 << 1)
+#define GPIO2  (1 << 2)
+#define GPIO3  (1 << 3)
+#define GPIO4  (1 << 4)
+#define GPIO5  (1 << 5)
+#define GPIO6  (1 << 6)
+#define GPIO7  (1 << 7)
+#define GPIO8  (1 << 8)
+#define GPIO9  (1 << 9)
+#define GPIO10 (1 << 10)
+#define GPIO11 (1 << 11)
+#define GPIO12 (1 << 12)
+#define GPIO13 (1 << 13)
+#define GPIO14 (1 << 14)
+#define GPIO15 (1 << 15)
+#define GPIO_ALL 0xFFFF
+
+#define GPIO_MODE_INPUT         0x00
+#define GPIO_MODE_OUTPUT_10_MHZ 0x01
+#define GPIO_MODE_OUTPUT_2_MHZ  0x02
+#define GPIO_MODE_OUTPUT_50_MHZ 0x03
+
+#define GPIO_CNF_INPUT_ANALOG          0x00
+#define GPIO_CNF_INPUT_FLOAT           0x01
+#define GPIO_CNF_INPUT_PULL_UPDOWN     0x02
+#define GPIO_CNF_OUTPUT_PUSHPULL       0x00
+#define GPIO_CNF_OUTPUT_OPENDRAIN      0x01
+#define GPIO_CNF_OUTPUT_ALTFN_PUSHPULL 0x02
+#define GPIO_CNF_OUTPUT_ALTFN_OPENDRAIN 0x03
+
+#define AFIO_BASE 0x40010000U
+#define AFIO_EVCR MMIO32(AFIO_BASE + 0x00)
+#define AFIO_MAPR MMIO32(AFIO_BASE + 0x04)
+#define AFIO_EXTICR(i) MMIO32(AFIO_BASE + 0x08 + (i) * 4)
+
+extern void gpio_set_mode(uint32_t gpioport, uint8_t mode, uint8_t cnf, uint16_t gpios);
+extern void gpio_set(uint32_t gpioport, uint16_t gpios);
+extern void gpio_clear(uint32_t gpioport, uint16_t gpios);
+extern uint16_t gpio_get(uint32_t gpioport, uint16_t gpios);
+extern void gpio_toggle(uint32_t gpioport, uint16_t gpios);
+
+#endif
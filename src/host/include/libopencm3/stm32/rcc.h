@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBOPENCM3_RCC_H
+#define LIBOPENCM3_RCC_H
+
+#include <libopencm3/cm3/common.h>
+
+enum rcc_periph_clken {
+    RCC_DMA1,
+    RCC_AFIO,
+    RCC_GPIOA,
+    RCC_GPIOB,
+    RCC_GPIOC,
+    RCC_TIM2,
+    RCC_TIM3,
+    RCC_TIM4,
+    RCC_USART1,
+    RCC_USART2,
+    RCC_USART3,
+    RCC_USB,
+};
+
+enum rcc_periph_rst {
+    RST_AFIO,
+    RST_GPIOA,
+    RST_GPIOB,
+    RST_GPIOC,
+    RST_TIM2,
+    RST_TIM3,
+    RST_TIM4,
+    RST_USART1,
+    RST_USART2,
+    RST_USART3,
+    RST_USB,
+};
+
+extern uint32_t rcc_ahb_frequency;
+extern uint32_t rcc_apb1_frequency;
+extern uint32_t rcc_apb2_frequency;
+
+extern void rcc_clock_setup_in_hse_8mhz_out_72mhz(void);
+extern void rcc_periph_clock_enable(enum rcc_periph_clken clken);
+extern void rcc_periph_clock_disable(enum rcc_periph_clken clken);
+extern void rcc_periph_reset_pulse(enum rcc_periph_rst rst);
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBOPENCM3_TIMER_H
+#define LIBOPENCM3_TIMER_H
+
+#include <libopencm3/cm3/common.h>
+
+#define TIM2 0x40000000U
+#define TIM3 0x40000400U
+#define TIM4 0x40000800U
+
+#define TIM_CR1(tim)   MMIO32((tim) + 0x00)
+#define TIM_CR2(tim)   MMIO32((tim) + 0x04)
+#define TIM_SMCR(tim)  MMIO32((tim) + 0x08)
+#define TIM_DIER(tim)  MMIO32((tim) + 0x0C)
+#define TIM_SR(tim)    MMIO32((tim) + 0x10)
+#define TIM_EGR(tim)   MMIO32((tim) + 0x14)
+#define TIM_CCMR1(tim) MMIO32((tim) + 0x18)
+#define TIM_CCMR2(tim) MMIO32((tim) + 0x1C)
+#define TIM_CCER(tim)  MMIO32((tim) + 0x20)
+#define TIM_CNT(tim)   MMIO32((tim) + 0x24)
+#define TIM_PSC(tim)   MMIO32((tim) + 0x28)
+#define TIM_ARR(tim)   MMIO32((tim) + 0x2C)
+#define TIM_CCR1(tim)  MMIO32((tim) + 0x34)
+#define TIM_CCR2(tim)  MMIO32((tim) + 0x38)
+#define TIM_CCR3(tim)  MMIO32((tim) + 0x3C)
+#define TIM_CCR4(tim)  MMIO32((tim) + 0x40)
+
+#define TIM_CR1_CKD_CK_INT     (0 << 8)
+#define TIM_CR1_CKD_CK_INT_MASK (3 << 8)
+#define TIM_CR1_ARPE           (1 << 7)
+#define TIM_CR1_CMS_EDGE       (0 << 5)
+#define TIM_CR1_CMS_MASK       (3 << 5)
+#define TIM_CR1_DIR_UP         (0 << 4)
+#define TIM_CR1_DIR_DOWN       (1 << 4)
+#define TIM_CR1_OPM            (1 << 3)
+#define TIM_CR1_URS            (1 << 2)
+#define TIM_CR1_UDIS           (1 << 1)
+#define TIM_CR1_CEN            (1 << 0)
+
+#define TIM_CR2_MMS_RESET  (0 << 4)
+#define TIM_CR2_MMS_ENABLE (1 << 4)
+#define TIM_CR2_MMS_UPDATE (2 << 4)
+#define TIM_CR2_MMS_MASK   (7 << 4)
+
+#define TIM_SMCR_TS_ITR0 (0 << 4)
+#define TIM_SMCR_TS_ITR1 (1 << 4)
+#define TIM_SMCR_TS_ITR2 (2 << 4)
+#define TIM_SMCR_TS_ITR3 (3 << 4)
+#define TIM_SMCR_TS_MASK (7 << 4)
+#define TIM_SMCR_SMS_OFF  0
+#define TIM_SMCR_SMS_ECM1 7
+#define TIM_SMCR_SMS_MASK 7
+
+#define TIM_DIER_CC4IE (1 << 4)
+#define TIM_DIER_CC3IE (1 << 3)
+#define TIM_DIER_CC2IE (1 << 2)
+#define TIM_DIER_CC1IE (1 << 1)
+#define TIM_DIER_UIE   (1 << 0)
+
+#define TIM_SR_CC4IF (1 << 4)
+#define TIM_SR_CC3IF (1 << 3)
+#define TIM_SR_CC2IF (1 << 2)
+#define TIM_SR_CC1IF (1 << 1)
+#define TIM_SR_UIF   (1 << 0)
+
+#define TIM_EGR_CC1G (1 << 1)
+#define TIM_EGR_UG   (1 << 0)
+
+enum tim_oc_id {
+    TIM_OC1 = 0,
+    TIM_OC2 = 2,
+    TIM_OC3 = 4,
+    TIM_OC4 = 6,
+};
+
+extern void timer_set_mode(uint32_t timer, uint32_t clock_div, uint32_t alignment,
+                           uint32_t direction);
+extern void timer_enable_counter(uint32_t timer);
+extern void timer_disable_counter(uint32_t timer);
+extern void timer_one_shot_mode(uint32_t timer);
+extern void timer_continuous_mode(uint32_t timer);
+extern void timer_update_on_any(uint32_t timer);
+extern void timer_update_on_overflow(uint32_t timer);
+extern void timer_set_prescaler(uint32_t timer, uint32_t value);
+extern void timer_set_period(uint32_t timer, uint32_t period);
+extern void timer_set_counter(uint32_t timer, uint32_t count);
+extern uint32_t timer_get_counter(uint32_t timer);
+extern void timer_generate_event(uint32_t timer, uint32_t event);
+extern void timer_set_master_mode(uint32_t timer, uint32_t mode);
+extern void timer_slave_set_mode(uint32_t timer, uint8_t mode);
+extern void timer_slave_set_trigger(uint32_t timer, uint8_t trigger);
+extern void timer_enable_irq(uint32_t timer, uint32_t irq);
+extern void timer_disable_irq(uint32_t timer, uint32_t irq);
+extern bool timer_get_flag(uint32_t timer, uint32_t flag);
+extern void timer_clear_flag(uint32_t timer, uint32_t flag);
+extern void timer_set_oc_value(uint32_t timer, enum tim_oc_id oc_id, uint32_t value);
+
+#endif
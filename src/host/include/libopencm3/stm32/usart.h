@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBOPENCM3_USART_H
+#define LIBOPENCM3_USART_H
+
+#include <libopencm3/cm3/common.h>
+
+#define USART1 0x40013800U
+#define USART2 0x40004400U
+#define USART3 0x40004800U
+
+#define USART_SR(usart)   MMIO32((usart) + 0x00)
+#define USART_DR(usart)   MMIO32((usart) + 0x04)
+#define USART_BRR(usart)  MMIO32((usart) + 0x08)
+#define USART_CR1(usart)  MMIO32((usart) + 0x0C)
+#define USART_CR2(usart)  MMIO32((usart) + 0x10)
+#define USART_CR3(usart)  MMIO32((usart) + 0x14)
+#define USART_GTPR(usart) MMIO32((usart) + 0x18)
+
+#define USART_SR_CTS  (1 << 9)
+#define USART_SR_LBD  (1 << 8)
+#define USART_SR_TXE  (1 << 7)
+#define USART_SR_TC   (1 << 6)
+#define USART_SR_RXNE (1 << 5)
+#define USART_SR_IDLE (1 << 4)
+#define USART_SR_ORE  (1 << 3)
+#define USART_SR_NE   (1 << 2)
+#define USART_SR_FE   (1 << 1)
+#define USART_SR_PE   (1 << 0)
+
+#define USART_DR_MASK 0x1FF
+
+#define USART_CR1_UE     (1 << 13)
+#define USART_CR1_M      (1 << 12)
+#define USART_CR1_WAKE   (1 << 11)
+#define USART_CR1_PCE    (1 << 10)
+#define USART_CR1_PS     (1 << 9)
+#define USART_CR1_PEIE   (1 << 8)
+#define USART_CR1_TXEIE  (1 << 7)
+#define USART_CR1_TCIE   (1 << 6)
+#define USART_CR1_RXNEIE (1 << 5)
+#define USART_CR1_IDLEIE (1 << 4)
+#define USART_CR1_TE     (1 << 3)
+#define USART_CR1_RE     (1 << 2)
+#define USART_CR1_RWU    (1 << 1)
+#define USART_CR1_SBK    (1 << 0)
+
+#define USART_CR2_LINEN  (1 << 14)
+#define USART_CR2_STOPBITS_MASK (3 << 12)
+#define USART_CR2_LBDIE  (1 << 6)
+#define USART_CR2_LBDL   (1 << 5)
+
+#define USART_CR3_CTSIE (1 << 10)
+#define USART_CR3_CTSE  (1 << 9)
+#define USART_CR3_RTSE  (1 << 8)
+#define USART_CR3_DMAT  (1 << 7)
+#define USART_CR3_DMAR  (1 << 6)
+#define USART_CR3_HDSEL (1 << 3)
+#define USART_CR3_EIE   (1 << 0)
+
+#define USART_STOPBITS_1   (0 << 12)
+#define USART_STOPBITS_0_5 (1 << 12)
+#define USART_STOPBITS_2   (2 << 12)
+#define USART_STOPBITS_1_5 (3 << 12)
+
+#define USART_PARITY_NONE 0
+#define USART_PARITY_EVEN USART_CR1_PCE
+#define USART_PARITY_ODD  (USART_CR1_PS | USART_CR1_PCE)
+
+#define USART_MODE_RX    USART_CR1_RE
+#define USART_MODE_TX    USART_CR1_TE
+#define USART_MODE_TX_RX (USART_CR1_RE | USART_CR1_TE)
+
+#define USART_FLOWCONTROL_NONE    0
+#define USART_FLOWCONTROL_RTS     USART_CR3_RTSE
+#define USART_FLOWCONTROL_CTS     USART_CR3_CTSE
+#define USART_FLOWCONTROL_RTS_CTS (USART_CR3_RTSE | USART_CR3_CTSE)
+
+extern void usart_set_baudrate(uint32_t usart, uint32_t baud);
+extern void usart_set_databits(uint32_t usart, uint32_t bits);
+extern void usart_set_stopbits(uint32_t usart, uint32_t stopbits);
+extern void usart_set_parity(uint32_t usart, uint32_t parity);
+extern void usart_set_mode(uint32_t usart, uint32_t mode);
+extern void usart_set_flow_control(uint32_t usart, uint32_t flowcontrol);
+extern void usart_enable(uint32_t usart);
+extern void usart_disable(uint32_t usart);
+extern void usart_send(uint32_t usart, uint16_t data);
+extern uint16_t usart_recv(uint32_t usart);
+extern void usart_wait_send_ready(uint32_t usart);
+extern void usart_wait_recv_ready(uint32_t usart);
+extern void usart_send_blocking(uint32_t usart, uint16_t data);
+extern uint16_t usart_recv_blocking(uint32_t usart);
+extern void usart_enable_rx_dma(uint32_t usart);
+extern void usart_disable_rx_dma(uint32_t usart);
+extern void usart_enable_tx_dma(uint32_t usart);
+extern void usart_disable_tx_dma(uint32_t usart);
+extern void usart_enable_rx_interrupt(uint32_t usart);
+extern void usart_disable_rx_interrupt(uint32_t usart);
+extern void usart_enable_tx_interrupt(uint32_t usart);
+extern void usart_disable_tx_interrupt(uint32_t usart);
+extern void usart_enable_error_interrupt(uint32_t usart);
+extern void usart_disable_error_interrupt(uint32_t usart);
+extern bool usart_get_flag(uint32_t usart, uint32_t flag);
+extern bool usart_get_interrupt_source(uint32_t usart, uint32_t flag);
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBOPENCM3_DFU_H
+#define LIBOPENCM3_DFU_H
+
+#include <libopencm3/usb/usbstd.h>
+
+enum dfu_req {
+    DFU_DETACH,
+    DFU_DNLOAD,
+    DFU_UPLOAD,
+    DFU_GETSTATUS,
+    DFU_CLRSTATUS,
+    DFU_GETSTATE,
+    DFU_ABORT,
+};
+
+#define DFU_FUNCTIONAL 0x21
+
+#define USB_DFU_CAN_DOWNLOAD          0x01
+#define USB_DFU_CAN_UPLOAD            0x02
+#define USB_DFU_MANIFEST_TOLERANT     0x04
+#define USB_DFU_WILL_DETACH           0x08
+
+struct usb_dfu_descriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bmAttributes;
+    uint16_t wDetachTimeout;
+    uint16_t wTransferSize;
+    uint16_t bcdDFUVersion;
+} __attribute__((packed));
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBOPENCM3_USBD_H
+#define LIBOPENCM3_USBD_H
+
+#include <libopencm3/usb/usbstd.h>
+
+enum usbd_request_return_codes {
+    USBD_REQ_NOTSUPP = 0,
+    USBD_REQ_HANDLED = 1,
+    USBD_REQ_NEXT_CALLBACK = 2,
+};
+
+typedef struct _usbd_driver usbd_driver;
+typedef struct _usbd_device usbd_device;
+
+typedef void (*usbd_control_complete_callback)(usbd_device* usbd_dev,
+                                               struct usb_setup_data* req);
+typedef int (*usbd_control_callback)(usbd_device* usbd_dev, struct usb_setup_data* req,
+                                     uint8_t** buf, uint16_t* len,
+                                     usbd_control_complete_callback* complete);
+typedef void (*usbd_set_config_callback)(usbd_device* usbd_dev, uint16_t wValue);
+typedef void (*usbd_set_altsetting_callback)(usbd_device* usbd_dev, uint16_t wIndex,
+                                             uint16_t wValue);
+typedef void (*usbd_endpoint_callback)(usbd_device* usbd_dev, uint8_t ep);
+
+extern usbd_device* usbd_init(const usbd_driver* driver,
+                              const struct usb_device_descriptor* dev,
+                              const struct usb_config_descriptor* conf,
+                              const char* const* strings, int num_strings,
+                              uint8_t* control_buffer, uint16_t control_buffer_size);
+
+extern void usbd_register_reset_callback(usbd_device* usbd_dev, void (*callback)(void));
+extern void usbd_register_suspend_callback(usbd_device* usbd_dev, void (*callback)(void));
+extern void usbd_register_resume_callback(usbd_device* usbd_dev, void (*callback)(void));
+extern void usbd_register_sof_callback(usbd_device* usbd_dev, void (*callback)(void));
+extern int usbd_register_control_callback(usbd_device* usbd_dev, uint8_t type,
+                                          uint8_t type_mask,
+                                          usbd_control_callback callback);
+extern int usbd_register_set_config_callback(usbd_device* usbd_dev,
+                                             usbd_set_config_callback callback);
+
+extern void usbd_poll(usbd_device* usbd_dev);
+extern void usbd_disconnect(usbd_device* usbd_dev, bool disconnected);
+
+extern void usbd_ep_setup(usbd_device* usbd_dev, uint8_t addr, uint8_t type,
+                          uint16_t max_size, usbd_endpoint_callback callback);
+extern uint16_t usbd_ep_write_packet(usbd_device* usbd_dev, uint8_t addr,
+                                     const void* buf, uint16_t len);
+extern uint16_t usbd_ep_read_packet(usbd_device* usbd_dev, uint8_t addr,
+                                    void* buf, uint16_t len);
+extern void usbd_ep_stall_set(usbd_device* usbd_dev, uint8_t addr, uint8_t stall);
+extern uint8_t usbd_ep_stall_get(usbd_device* usbd_dev, uint8_t addr);
+extern void usbd_ep_nak_set(usbd_device* usbd_dev, uint8_t addr, uint8_t nak);
+
+#endif
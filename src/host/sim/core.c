@@ -0,0 +1,515 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Simulated time and CPU: events, register accesses, the NVIC, PRIMASK
+ * and WFI.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/scb.h>
+
+#include "sim.h"
+
+uint64_t sim_now;
+
+#define SIM_MAX_EVENTS 64
+#define SIM_MAX_BLOCKS 24
+#define SIM_ACCESS_SLOTS 4
+
+static struct sim_event* events[SIM_MAX_EVENTS];
+static unsigned num_events;
+static struct sim_event* next_event;
+static bool next_event_stale = true;
+
+static struct sim_block* blocks[SIM_MAX_BLOCKS];
+static unsigned num_blocks;
+
+/* Registers handed out recently, with the values they held then */
+static struct {
+    struct sim_block* blk;
+    uint32_t offset;
+    uint32_t value;
+    bool fresh;
+} slots[SIM_ACCESS_SLOTS];
+static unsigned next_slot;
+
+static struct {
+    bool enabled;
+    bool pending;
+    bool active;
+    bool line;
+    uint8_t priority;
+    bool (*level)(void* arg);
+    void* arg;
+} irqs[SIM_NUM_IRQS];
+
+static uint32_t primask;
+static unsigned exec_priority = 0x100;
+static uint64_t sleep_cycles;
+
+void sim_fatal(const char* fmt, ...) {
+    va_list args;
+    fflush(stdout);
+    fprintf(stderr, "termlink-sim: %llu.%06llu: ",
+            (unsigned long long)(sim_now / SIM_CORE_HZ),
+            (unsigned long long)(sim_now % SIM_CORE_HZ / SIM_CYCLES_PER_US));
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+    exit(2);
+}
+
+void sim_event_init(struct sim_event* ev, void (*fire)(void* arg), void* arg) {
+    if (num_events == SIM_MAX_EVENTS) {
+        sim_fatal("too many events");
+    }
+    ev->time = 0;
+    ev->armed = false;
+    ev->fire = fire;
+    ev->arg = arg;
+    events[num_events++] = ev;
+}
+
+void sim_event_at(struct sim_event* ev, uint64_t time) {
+    if (time < sim_now) {
+        time = sim_now;
+    }
+    ev->time = time;
+    ev->armed = true;
+    if (next_event == ev) {
+        next_event_stale = true;
+    } else if (!next_event_stale && (next_event == NULL || time < next_event->time)) {
+        next_event = ev;
+    }
+}
+
+void sim_event_after(struct sim_event* ev, uint64_t delay) {
+    sim_event_at(ev, sim_now + delay);
+}
+
+void sim_event_cancel(struct sim_event* ev) {
+    ev->armed = false;
+    if (next_event == ev) {
+        next_event_stale = true;
+    }
+}
+
+/* Earliest armed event; ties go to the model registered first */
+static struct sim_event* sim_next_event(void) {
+    if (next_event_stale) {
+        next_event = NULL;
+        for (unsigned i = 0; i < num_events; i++) {
+            if (events[i]->armed && (next_event == NULL || events[i]->time < next_event->time)) {
+                next_event = events[i];
+            }
+        }
+        next_event_stale = false;
+    }
+    return next_event;
+}
+
+static void sim_run_event(struct sim_event* ev) {
+    if (ev->time > sim_now) {
+        sim_now = ev->time;
+    }
+    sim_event_cancel(ev);
+    ev->fire(ev->arg);
+}
+
+static int sim_irq_index(uint8_t irqn) {
+    if (irqn == (uint8_t)NVIC_SYSTICK_IRQ) {
+        return SIM_IRQ_SYSTICK;
+    } else if (irqn >= NVIC_IRQ_COUNT) {
+        sim_fatal("no such IRQ %u", irqn);
+    }
+    return irqn;
+}
+
+static void sim_unhandled_irq(int irq) {
+    sim_fatal("IRQ %d taken with no handler", irq);
+}
+
+#define SIM_DEFAULT_HANDLER(name, irq) \
+    void __attribute__((weak)) name(void) { sim_unhandled_irq(irq); }
+
+SIM_DEFAULT_HANDLER(sys_tick_handler, SIM_IRQ_SYSTICK)
+SIM_DEFAULT_HANDLER(exti0_isr, NVIC_EXTI0_IRQ)
+SIM_DEFAULT_HANDLER(exti1_isr, NVIC_EXTI1_IRQ)
+SIM_DEFAULT_HANDLER(exti2_isr, NVIC_EXTI2_IRQ)
+SIM_DEFAULT_HANDLER(exti3_isr, NVIC_EXTI3_IRQ)
+SIM_DEFAULT_HANDLER(exti4_isr, NVIC_EXTI4_IRQ)
+SIM_DEFAULT_HANDLER(dma1_channel1_isr, NVIC_DMA1_CHANNEL1_IRQ)
+SIM_DEFAULT_HANDLER(dma1_channel2_isr, NVIC_DMA1_CHANNEL2_IRQ)
+SIM_DEFAULT_HANDLER(dma1_channel3_isr, NVIC_DMA1_CHANNEL3_IRQ)
+SIM_DEFAULT_HANDLER(dma1_channel4_isr, NVIC_DMA1_CHANNEL4_IRQ)
+SIM_DEFAULT_HANDLER(dma1_channel5_isr, NVIC_DMA1_CHANNEL5_IRQ)
+SIM_DEFAULT_HANDLER(dma1_channel6_isr, NVIC_DMA1_CHANNEL6_IRQ)
+SIM_DEFAULT_HANDLER(dma1_channel7_isr, NVIC_DMA1_CHANNEL7_IRQ)
+SIM_DEFAULT_HANDLER(usb_hp_can_tx_isr, NVIC_USB_HP_CAN_TX_IRQ)
+SIM_DEFAULT_HANDLER(usb_lp_can_rx0_isr, NVIC_USB_LP_CAN_RX0_IRQ)
+SIM_DEFAULT_HANDLER(exti9_5_isr, NVIC_EXTI9_5_IRQ)
+SIM_DEFAULT_HANDLER(tim2_isr, NVIC_TIM2_IRQ)
+SIM_DEFAULT_HANDLER(tim3_isr, NVIC_TIM3_IRQ)
+SIM_DEFAULT_HANDLER(tim4_isr, NVIC_TIM4_IRQ)
+SIM_DEFAULT_HANDLER(usart1_isr, NVIC_USART1_IRQ)
+SIM_DEFAULT_HANDLER(usart2_isr, NVIC_USART2_IRQ)
+SIM_DEFAULT_HANDLER(usart3_isr, NVIC_USART3_IRQ)
+SIM_DEFAULT_HANDLER(exti15_10_isr, NVIC_EXTI15_10_IRQ)
+
+static void (*const vectors[SIM_NUM_IRQS])(void) = {
+    [SIM_IRQ_SYSTICK] = sys_tick_handler,
+    [NVIC_EXTI0_IRQ] = exti0_isr,
+    [NVIC_EXTI1_IRQ] = exti1_isr,
+    [NVIC_EXTI2_IRQ] = exti2_isr,
+    [NVIC_EXTI3_IRQ] = exti3_isr,
+    [NVIC_EXTI4_IRQ] = exti4_isr,
+    [NVIC_DMA1_CHANNEL1_IRQ] = dma1_channel1_isr,
+    [NVIC_DMA1_CHANNEL2_IRQ] = dma1_channel2_isr,
+    [NVIC_DMA1_CHANNEL3_IRQ] = dma1_channel3_isr,
+    [NVIC_DMA1_CHANNEL4_IRQ] = dma1_channel4_isr,
+    [NVIC_DMA1_CHANNEL5_IRQ] = dma1_channel5_isr,
+    [NVIC_DMA1_CHANNEL6_IRQ] = dma1_channel6_isr,
+    [NVIC_DMA1_CHANNEL7_IRQ] = dma1_channel7_isr,
+    [NVIC_USB_HP_CAN_TX_IRQ] = usb_hp_can_tx_isr,
+    [NVIC_USB_LP_CAN_RX0_IRQ] = usb_lp_can_rx0_isr,
+    [NVIC_EXTI9_5_IRQ] = exti9_5_isr,
+    [NVIC_TIM2_IRQ] = tim2_isr,
+    [NVIC_TIM3_IRQ] = tim3_isr,
+    [NVIC_TIM4_IRQ] = tim4_isr,
+    [NVIC_USART1_IRQ] = usart1_isr,
+    [NVIC_USART2_IRQ] = usart2_isr,
+    [NVIC_USART3_IRQ] = usart3_isr,
+    [NVIC_EXTI15_10_IRQ] = exti15_10_isr,
+};
+
+/* Highest priority pending interrupt that could preempt, or -1 */
+static int sim_irq_next(void) {
+    int best = -1;
+    for (int i = 0; i < SIM_NUM_IRQS; i++) {
+        if (irqs[i].pending && irqs[i].enabled
+            && irqs[i].priority < exec_priority
+            && (best < 0 || irqs[i].priority < irqs[best].priority)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+static void sim_irq_take(int irq) {
+    unsigned saved_priority = exec_priority;
+    irqs[irq].pending = false;
+    irqs[irq].active = true;
+    exec_priority = irqs[irq].priority;
+
+    sim_spend(SIM_IRQ_ENTRY_CYCLES);
+    vectors[irq]();
+    sim_sync();
+    sim_spend(SIM_IRQ_EXIT_CYCLES);
+
+    irqs[irq].active = false;
+    exec_priority = saved_priority;
+
+    /* A line still asserted on return pends the interrupt again */
+    if (irqs[irq].level != NULL) {
+        irqs[irq].line = irqs[irq].level(irqs[irq].arg);
+        if (irqs[irq].line) {
+            irqs[irq].pending = true;
+        }
+    }
+}
+
+static void sim_dispatch(void) {
+    while (!primask) {
+        int irq = sim_irq_next();
+        if (irq < 0) {
+            break;
+        }
+        sim_irq_take(irq);
+    }
+}
+
+void sim_irq_connect(int irq, bool (*level)(void* arg), void* arg) {
+    irqs[irq].level = level;
+    irqs[irq].arg = arg;
+}
+
+/*
+ * Sample a level-triggered line after a model changed its state. As on
+ * the NVIC, an active interrupt is only pended again by a new assertion.
+ */
+void sim_irq_update(int irq) {
+    bool line = irqs[irq].level(irqs[irq].arg);
+    if (line && (!irqs[irq].active || !irqs[irq].line)) {
+        irqs[irq].pending = true;
+    }
+    irqs[irq].line = line;
+}
+
+void sim_irq_pend(int irq) {
+    irqs[irq].pending = true;
+}
+
+void sim_spend(uint32_t cycles) {
+    uint64_t until = sim_now + cycles;
+    struct sim_event* ev;
+    while ((ev = sim_next_event()) != NULL && ev->time <= until) {
+        sim_run_event(ev);
+        sim_dispatch();
+    }
+    if (sim_now < until) {
+        sim_now = until;
+    }
+    sim_dispatch();
+}
+
+void sim_block_add(struct sim_block* blk) {
+    if (num_blocks == SIM_MAX_BLOCKS) {
+        sim_fatal("too many register blocks");
+    }
+    blocks[num_blocks++] = blk;
+}
+
+static struct sim_block* sim_block_find(uint32_t addr) {
+    static struct sim_block* last;
+    if (last != NULL && addr - last->base < last->size) {
+        return last;
+    }
+    for (unsigned i = 0; i < num_blocks; i++) {
+        if (addr - blocks[i]->base < blocks[i]->size) {
+            last = blocks[i];
+            return last;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * The firmware stores pointers into 32-bit DMA address registers, which
+ * keeps only the low half on a 64-bit host. Its RAM and the register
+ * storage are static, so they share their upper half with this.
+ */
+static uint32_t sim_anchor;
+
+void* sim_pointer(uint32_t addr) {
+    uintptr_t high = (uintptr_t)&sim_anchor & ~(uintptr_t)0xFFFFFFFFU;
+    return (void*)(high | addr);
+}
+
+struct sim_block* sim_block_at(uint32_t addr, uint32_t* offset) {
+    for (unsigned i = 0; i < num_blocks; i++) {
+        uint32_t storage = (uint32_t)(uintptr_t)blocks[i]->regs;
+        if (addr - storage < blocks[i]->size) {
+            *offset = addr - storage;
+            return blocks[i];
+        }
+    }
+    return NULL;
+}
+
+void sim_reg_set(struct sim_block* blk, uint32_t offset, uint32_t value) {
+    SIM_REG(blk, offset) = value;
+    for (unsigned i = 0; i < SIM_ACCESS_SLOTS; i++) {
+        if (slots[i].blk == blk && slots[i].offset == offset) {
+            slots[i].value = value;
+        }
+    }
+}
+
+void sim_sync(void) {
+    for (unsigned i = 0; i < SIM_ACCESS_SLOTS; i++) {
+        struct sim_block* blk = slots[i].blk;
+        if (blk == NULL) {
+            continue;
+        }
+        bool fresh = slots[i].fresh;
+        slots[i].fresh = false;
+        if (SIM_REG(blk, slots[i].offset) != slots[i].value) {
+            uint32_t old = slots[i].value;
+            slots[i].value = SIM_REG(blk, slots[i].offset);
+            if (blk->write != NULL) {
+                blk->write(blk, slots[i].offset, old);
+            }
+        } else if (fresh && blk->read != NULL) {
+            blk->read(blk, slots[i].offset);
+        }
+    }
+}
+
+volatile uint32_t* sim_mmio32(uint32_t addr) {
+    sim_sync();
+    struct sim_block* blk = sim_block_find(addr);
+    if (blk == NULL) {
+        sim_fatal("access to unmodelled register 0x%08x", addr);
+    }
+    uint32_t offset = (addr - blk->base) & ~3U;
+
+    /* Interrupts arriving now are taken before the access */
+    sim_spend(SIM_ACCESS_CYCLES);
+    if (blk->access != NULL) {
+        blk->access(blk, offset);
+    }
+
+    unsigned slot = next_slot;
+    for (unsigned i = 0; i < SIM_ACCESS_SLOTS; i++) {
+        if (slots[i].blk == blk && slots[i].offset == offset) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot == next_slot) {
+        next_slot = (next_slot + 1) % SIM_ACCESS_SLOTS;
+    }
+    slots[slot].blk = blk;
+    slots[slot].offset = offset;
+    slots[slot].value = SIM_REG(blk, offset);
+    slots[slot].fresh = true;
+    return &blk->regs[offset / 4];
+}
+
+void nvic_enable_irq(uint8_t irqn) {
+    sim_sync();
+    irqs[sim_irq_index(irqn)].enabled = true;
+    sim_dispatch();
+}
+
+void nvic_disable_irq(uint8_t irqn) {
+    irqs[sim_irq_index(irqn)].enabled = false;
+}
+
+uint8_t nvic_get_pending_irq(uint8_t irqn) {
+    return irqs[sim_irq_index(irqn)].pending;
+}
+
+void nvic_set_pending_irq(uint8_t irqn) {
+    sim_sync();
+    irqs[sim_irq_index(irqn)].pending = true;
+    sim_dispatch();
+}
+
+void nvic_clear_pending_irq(uint8_t irqn) {
+    irqs[sim_irq_index(irqn)].pending = false;
+}
+
+uint8_t nvic_get_irq_enabled(uint8_t irqn) {
+    return irqs[sim_irq_index(irqn)].enabled;
+}
+
+void nvic_set_priority(uint8_t irqn, uint8_t priority) {
+    /* The F1 implements the top four bits */
+    irqs[sim_irq_index(irqn)].priority = priority & 0xF0;
+}
+
+void cm_enable_interrupts(void) {
+    cm_mask_interrupts(0);
+}
+
+void cm_disable_interrupts(void) {
+    cm_mask_interrupts(1);
+}
+
+bool cm_is_masked_interrupts(void) {
+    return primask != 0;
+}
+
+uint32_t cm_mask_interrupts(uint32_t mask) {
+    sim_sync();
+    uint32_t old = primask;
+    primask = mask;
+    sim_dispatch();
+    return old;
+}
+
+/* An interrupt that would be taken with PRIMASK clear wakes the core */
+void sim_wait_for_interrupt(void) {
+    sim_sync();
+    uint64_t start = sim_now;
+    while (sim_irq_next() < 0) {
+        struct sim_event* ev = sim_next_event();
+        if (ev == NULL) {
+            sim_fatal("asleep with nothing left to wake the core");
+        }
+        sim_run_event(ev);
+    }
+    sleep_cycles += sim_now - start;
+    sim_dispatch();
+}
+
+uint64_t sim_sleep_cycles(void) {
+    return sleep_cycles;
+}
+
+/*
+ * Bring the next interrupt that would preempt the running code forward
+ * to now: run events until one is pending, looking no further ahead than
+ * horizon, and take it. Returns the IRQ taken, or -1 if none came up.
+ */
+int sim_preempt(uint64_t horizon) {
+    sim_sync();
+    if (primask) {
+        return -1;
+    }
+    uint64_t until = sim_now + horizon;
+    int irq;
+    while ((irq = sim_irq_next()) < 0) {
+        struct sim_event* ev = sim_next_event();
+        if (ev == NULL || ev->time > until) {
+            return -1;
+        }
+        sim_run_event(ev);
+    }
+    sim_dispatch();
+    return irq;
+}
+
+/* Whether any enabled interrupt could preempt the running code */
+bool sim_preemptible(void) {
+    if (primask) {
+        return false;
+    }
+    for (int i = 0; i < SIM_NUM_IRQS; i++) {
+        if (irqs[i].enabled && irqs[i].priority < exec_priority) {
+            return true;
+        }
+    }
+    return false;
+}
+
+unsigned sim_priority(void) {
+    return exec_priority;
+}
+
+void (*sim_irq_handler(int irq))(void) {
+    return vectors[irq];
+}
+
+void sim_core_init(void) {
+    irqs[SIM_IRQ_SYSTICK].enabled = true;
+}
+
+void scb_reset_system(void) {
+    sim_fatal("firmware reset the system");
+}
@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * DMA1, moving data between peripheral registers and RAM on the
+ * peripherals' request lines. Transfers take no time.
+ */
+
+#include <libopencm3/stm32/dma.h>
+
+#include "sim.h"
+
+#define DMA_NUM_CHANNELS 7
+
+#define DMA_OFFSET_ISR  0x00
+#define DMA_OFFSET_IFCR 0x04
+#define DMA_OFFSET_CCR(ch)   (0x08U + 0x14U * ((ch) - 1U))
+#define DMA_OFFSET_CNDTR(ch) (0x0CU + 0x14U * ((ch) - 1U))
+#define DMA_OFFSET_CPAR(ch)  (0x10U + 0x14U * ((ch) - 1U))
+#define DMA_OFFSET_CMAR(ch)  (0x14U + 0x14U * ((ch) - 1U))
+
+struct dma_channel {
+    uint8_t number;
+    bool (*request)(void* arg);
+    void* arg;
+    /* Latched when the channel is enabled */
+    uint32_t total;
+    uint32_t done;
+    bool kicking;
+    uint32_t maddr;
+    uint32_t paddr;
+};
+
+static struct sim_block dma;
+static uint32_t dma_regs[(DMA_OFFSET_CMAR(DMA_NUM_CHANNELS) + 4) / 4];
+static struct dma_channel channels[DMA_NUM_CHANNELS];
+static const int channel_irqs[DMA_NUM_CHANNELS] = {
+    NVIC_DMA1_CHANNEL1_IRQ, NVIC_DMA1_CHANNEL2_IRQ, NVIC_DMA1_CHANNEL3_IRQ,
+    NVIC_DMA1_CHANNEL4_IRQ, NVIC_DMA1_CHANNEL5_IRQ, NVIC_DMA1_CHANNEL6_IRQ,
+    NVIC_DMA1_CHANNEL7_IRQ,
+};
+
+#define REG(offset) dma_regs[(offset) / 4]
+
+static bool dma_level(void* arg) {
+    const struct dma_channel* c = arg;
+    uint32_t flags = REG(DMA_OFFSET_ISR) >> DMA_FLAG_OFFSET(c->number);
+    uint32_t ccr = REG(DMA_OFFSET_CCR(c->number));
+    return ((flags & DMA_TCIF) && (ccr & DMA_CCR_TCIE))
+           || ((flags & DMA_HTIF) && (ccr & DMA_CCR_HTIE))
+           || ((flags & DMA_TEIF) && (ccr & DMA_CCR_TEIE));
+}
+
+static void dma_set_flags(struct dma_channel* c, uint32_t flags) {
+    sim_reg_set(&dma, DMA_OFFSET_ISR,
+                REG(DMA_OFFSET_ISR) | ((flags | DMA_GIF) << DMA_FLAG_OFFSET(c->number)));
+    sim_irq_update(channel_irqs[c->number - 1]);
+}
+
+/* Size in bytes of the transfers on either side */
+static uint32_t dma_size(uint32_t ccr, uint32_t shift) {
+    return 1U << ((ccr >> shift) & 3);
+}
+
+static bool dma_transfer(struct dma_channel* c) {
+    uint32_t ccr = REG(DMA_OFFSET_CCR(c->number));
+    uint32_t offset;
+    struct sim_block* blk = sim_block_at(c->paddr, &offset);
+    if (blk == NULL) {
+        sim_fatal("DMA channel %u peripheral address 0x%08x is not a register",
+                  c->number, c->paddr);
+    }
+
+    uint32_t msize = dma_size(ccr, 10);
+    uint8_t* mem = sim_pointer(c->maddr + ((ccr & DMA_CCR_MINC) ? c->done * msize : 0));
+    if (ccr & DMA_CCR_DIR) {
+        uint32_t value = 0;
+        for (uint32_t i = 0; i < msize; i++) {
+            value |= (uint32_t)mem[i] << (8 * i);
+        }
+        if (blk->dma_write == NULL) {
+            sim_fatal("DMA channel %u writes to a register without DMA", c->number);
+        }
+        blk->dma_write(blk, offset, value);
+    } else {
+        if (blk->dma_read == NULL) {
+            sim_fatal("DMA channel %u reads from a register without DMA", c->number);
+        }
+        uint32_t value = blk->dma_read(blk, offset);
+        for (uint32_t i = 0; i < msize; i++) {
+            mem[i] = (uint8_t)(value >> (8 * i));
+        }
+    }
+
+    c->done++;
+    sim_reg_set(&dma, DMA_OFFSET_CNDTR(c->number), c->total - c->done);
+    if (c->done == c->total / 2) {
+        dma_set_flags(c, DMA_HTIF);
+    }
+    if (c->done == c->total) {
+        if (ccr & DMA_CCR_CIRC) {
+            c->done = 0;
+            sim_reg_set(&dma, DMA_OFFSET_CNDTR(c->number), c->total);
+        }
+        dma_set_flags(c, DMA_TCIF);
+    }
+    return true;
+}
+
+static bool dma_active(const struct dma_channel* c) {
+    return (REG(DMA_OFFSET_CCR(c->number)) & DMA_CCR_EN) && c->done < c->total;
+}
+
+/* Serve the channel's request until it drops; the peripheral may kick again meanwhile */
+void sim_dma_kick(uint8_t channel) {
+    struct dma_channel* c = &channels[channel - 1];
+    if (c->kicking) {
+        return;
+    }
+    c->kicking = true;
+    while (dma_active(c) && c->request != NULL && c->request(c->arg)) {
+        dma_transfer(c);
+    }
+    c->kicking = false;
+}
+
+void sim_dma_connect(uint8_t channel, bool (*request)(void* arg), void* arg) {
+    channels[channel - 1].request = request;
+    channels[channel - 1].arg = arg;
+}
+
+static void dma_write(struct sim_block* blk, uint32_t offset, uint32_t old) {
+    uint32_t value = SIM_REG(blk, offset);
+
+    if (offset == DMA_OFFSET_IFCR) {
+        uint32_t clear = value;
+        for (unsigned ch = 1; ch <= DMA_NUM_CHANNELS; ch++) {
+            /* Clearing the global flag clears the channel's others too */
+            if (value & (DMA_GIF << DMA_FLAG_OFFSET(ch))) {
+                clear |= 0xFU << DMA_FLAG_OFFSET(ch);
+            }
+        }
+        sim_reg_set(blk, DMA_OFFSET_ISR, REG(DMA_OFFSET_ISR) & ~clear);
+        sim_reg_set(blk, offset, 0);
+        for (unsigned ch = 1; ch <= DMA_NUM_CHANNELS; ch++) {
+            sim_irq_update(channel_irqs[ch - 1]);
+        }
+        return;
+    } else if (offset == DMA_OFFSET_ISR) {
+        sim_reg_set(blk, offset, old);
+        return;
+    } else if (offset < DMA_OFFSET_CCR(1)) {
+        return;
+    }
+
+    uint8_t ch = (uint8_t)((offset - DMA_OFFSET_CCR(1)) / 0x14 + 1);
+    struct dma_channel* c = &channels[ch - 1];
+    if (offset == DMA_OFFSET_CCR(ch)) {
+        if ((value & DMA_CCR_EN) && !(old & DMA_CCR_EN)) {
+            c->total = REG(DMA_OFFSET_CNDTR(ch)) & 0xFFFF;
+            c->done = 0;
+            c->maddr = REG(DMA_OFFSET_CMAR(ch));
+            c->paddr = REG(DMA_OFFSET_CPAR(ch));
+        }
+        sim_irq_update(channel_irqs[ch - 1]);
+        sim_dma_kick(ch);
+    } else if (REG(DMA_OFFSET_CCR(ch)) & DMA_CCR_EN) {
+        /* The address and count registers are read-only while enabled */
+        sim_reg_set(blk, offset, old);
+    }
+}
+
+void sim_dma_init(void) {
+    dma.base = DMA1;
+    dma.size = sizeof(dma_regs);
+    dma.regs = dma_regs;
+    dma.write = dma_write;
+    sim_block_add(&dma);
+    for (unsigned ch = 1; ch <= DMA_NUM_CHANNELS; ch++) {
+        channels[ch - 1].number = (uint8_t)ch;
+        sim_irq_connect(channel_irqs[ch - 1], dma_level, &channels[ch - 1]);
+    }
+}
+
+void dma_channel_reset(uint32_t dma_base, uint8_t channel) {
+    DMA_CCR(dma_base, channel) = 0;
+    DMA_CNDTR(dma_base, channel) = 0;
+    DMA_CPAR(dma_base, channel) = 0;
+    DMA_CMAR(dma_base, channel) = 0;
+    DMA_IFCR(dma_base) = 0xFU << DMA_FLAG_OFFSET(channel);
+}
+
+void dma_clear_interrupt_flags(uint32_t dma_base, uint8_t channel, uint32_t interrupts) {
+    DMA_IFCR(dma_base) = interrupts << DMA_FLAG_OFFSET(channel);
+}
+
+bool dma_get_interrupt_flag(uint32_t dma_base, uint8_t channel, uint32_t interrupts) {
+    uint32_t flags = interrupts << DMA_FLAG_OFFSET(channel);
+    return (DMA_ISR(dma_base) & flags) > 0;
+}
+
+void dma_set_priority(uint32_t dma_base, uint8_t channel, uint32_t prio) {
+    DMA_CCR(dma_base, channel) = (DMA_CCR(dma_base, channel) & ~DMA_CCR_PL_MASK) | prio;
+}
+
+void dma_set_memory_size(uint32_t dma_base, uint8_t channel, uint32_t mem_size) {
+    DMA_CCR(dma_base, channel) = (DMA_CCR(dma_base, channel) & ~DMA_CCR_MSIZE_MASK) | mem_size;
+}
+
+void dma_set_peripheral_size(uint32_t dma_base, uint8_t channel, uint32_t peripheral_size) {
+    DMA_CCR(dma_base, channel) = (DMA_CCR(dma_base, channel) & ~DMA_CCR_PSIZE_MASK)
+                                 | peripheral_size;
+}
+
+void dma_enable_memory_increment_mode(uint32_t dma_base, uint8_t channel) {
+    DMA_CCR(dma_base, channel) |= DMA_CCR_MINC;
+}
+
+void dma_disable_memory_increment_mode(uint32_t dma_base, uint8_t channel) {
+    DMA_CCR(dma_base, channel) &= ~DMA_CCR_MINC;
+}
+
+void dma_enable_circular_mode(uint32_t dma_base, uint8_t channel) {
+    DMA_CCR(dma_base, channel) |= DMA_CCR_CIRC;
+    DMA_CCR(dma_base, channel) &= ~DMA_CCR_MEM2MEM;
+}
+
+void dma_set_read_from_peripheral(uint32_t dma_base, uint8_t channel) {
+    DMA_CCR(dma_base, channel) &= ~DMA_CCR_DIR;
+}
+
+void dma_set_read_from_memory(uint32_t dma_base, uint8_t channel) {
+    DMA_CCR(dma_base, channel) |= DMA_CCR_DIR;
+}
+
+void dma_enable_transfer_error_interrupt(uint32_t dma_base, uint8_t channel) {
+    DMA_CCR(dma_base, channel) |= DMA_CCR_TEIE;
+}
+
+void dma_disable_transfer_error_interrupt(uint32_t dma_base, uint8_t channel) {
+    DMA_CCR(dma_base, channel) &= ~DMA_CCR_TEIE;
+}
+
+void dma_enable_half_transfer_interrupt(uint32_t dma_base, uint8_t channel) {
+    DMA_CCR(dma_base, channel) |= DMA_CCR_HTIE;
+}
+
+void dma_disable_half_transfer_interrupt(uint32_t dma_base, uint8_t channel) {
+    DMA_CCR(dma_base, channel) &= ~DMA_CCR_HTIE;
+}
+
+void dma_enable_transfer_complete_interrupt(uint32_t dma_base, uint8_t channel) {
+    DMA_CCR(dma_base, channel) |= DMA_CCR_TCIE;
+}
+
+void dma_disable_transfer_complete_interrupt(uint32_t dma_base, uint8_t channel) {
+    DMA_CCR(dma_base, channel) &= ~DMA_CCR_TCIE;
+}
+
+void dma_enable_channel(uint32_t dma_base, uint8_t channel) {
+    DMA_CCR(dma_base, channel) |= DMA_CCR_EN;
+}
+
+void dma_disable_channel(uint32_t dma_base, uint8_t channel) {
+    DMA_CCR(dma_base, channel) &= ~DMA_CCR_EN;
+}
+
+void dma_set_peripheral_address(uint32_t dma_base, uint8_t channel, uint32_t address) {
+    if (!(DMA_CCR(dma_base, channel) & DMA_CCR_EN)) {
+        DMA_CPAR(dma_base, channel) = address;
+    }
+}
+
+void dma_set_memory_address(uint32_t dma_base, uint8_t channel, uint32_t address) {
+    if (!(DMA_CCR(dma_base, channel) & DMA_CCR_EN)) {
+        DMA_CMAR(dma_base, channel) = address;
+    }
+}
+
+void dma_set_number_of_data(uint32_t dma_base, uint8_t channel, uint16_t number) {
+    DMA_CNDTR(dma_base, channel) = number;
+}
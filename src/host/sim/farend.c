@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The devices on the far side of the console ports' UARTs. Each sends
+ * its port's RX stream back to back at its own line format, and checks
+ * the TX stream it receives. With flow control on, the first port's far
+ * end holds off between frames while the console's RTS output is high.
+ */
+
+#include <libopencm3/stm32/gpio.h>
+
+#include "config.h"
+#include "console.h"
+
+#include "sim.h"
+
+struct farend {
+    struct sim_serial serial;
+    uint8_t port;
+    uint32_t baud;
+    uint8_t data_bits;
+    char parity;
+    uint8_t stop_halves;
+    bool flow_control;
+    bool sending;
+    uint64_t queued;
+    struct sim_frame frame;
+    struct sim_event frame_done;
+};
+
+static struct farend farends[CONSOLE_NUM_PORTS];
+
+static const uint32_t farend_usarts[] = {
+    CONSOLE_USART,
+#if CONSOLE_NUM_PORTS > 1
+    CONSOLE_PORT1_USART,
+#endif
+#if CONSOLE_NUM_PORTS > 2
+    CONSOLE_PORT2_USART,
+#endif
+};
+
+static uint8_t farend_field_bits(const struct farend* f) {
+    return (uint8_t)(f->data_bits + (f->parity != 'N'));
+}
+
+static bool farend_held_off(const struct farend* f) {
+#if CONSOLE_FLOW_CONTROL_AVAILABLE
+    if (f->flow_control && f->port == 0) {
+        return sim_gpio_level(CONSOLE_RTS_GPIO_PORT, CONSOLE_RTS_GPIO_PIN);
+    }
+#endif
+    return false;
+}
+
+static void farend_next(struct farend* f) {
+    if (f->sending || f->queued == 0 || farend_held_off(f)) {
+        return;
+    }
+    uint64_t cycles = sim_frame_cycles(f->baud, farend_field_bits(f), f->stop_halves);
+    uint8_t byte = sim_stream_next(f->port, SIM_RX, sim_now + cycles);
+    f->frame.field = sim_parity_field(byte, f->data_bits, f->parity);
+    f->frame.field_bits = farend_field_bits(f);
+    f->frame.stop_halves = f->stop_halves;
+    f->frame.baud = f->baud;
+    f->frame.brk = false;
+    f->queued--;
+    f->sending = true;
+    f->serial.peer->rx_begin(f->serial.peer);
+    sim_event_after(&f->frame_done, cycles);
+}
+
+static void farend_frame_done(void* arg) {
+    struct farend* f = arg;
+    f->sending = false;
+    f->serial.peer->rx_frame(f->serial.peer, &f->frame);
+    farend_next(f);
+}
+
+static void farend_rx_begin(struct sim_serial* self) {
+    (void)self;
+}
+
+/* Frames that don't decode still go to the stream, which counts them as corrupt */
+static void farend_rx_frame(struct sim_serial* self, const struct sim_frame* frame) {
+    struct farend* f = (struct farend*)self;
+    uint16_t field;
+    sim_frame_receive(frame, f->baud, farend_field_bits(f), &field);
+    sim_stream_received(f->port, SIM_TX, (uint8_t)field);
+}
+
+static void farend_lines_changed(void* arg) {
+    (void)arg;
+    for (uint8_t port = 0; port < CONSOLE_NUM_PORTS; port++) {
+        farend_next(&farends[port]);
+    }
+}
+
+void sim_farend_init(void) {
+    for (uint8_t port = 0; port < CONSOLE_NUM_PORTS; port++) {
+        struct farend* f = &farends[port];
+        f->port = port;
+        f->serial.rx_begin = farend_rx_begin;
+        f->serial.rx_frame = farend_rx_frame;
+        f->serial.peer = sim_usart_serial(farend_usarts[port]);
+        f->serial.peer->peer = &f->serial;
+        sim_event_init(&f->frame_done, farend_frame_done, f);
+        sim_farend_set_format(port, DEFAULT_BAUDRATE, 8, 'N', 2);
+    }
+    sim_gpio_listen(farend_lines_changed, NULL);
+}
+
+/* Takes effect from the next frame */
+void sim_farend_set_format(uint8_t port, uint32_t baud, uint8_t data_bits,
+                           char parity, uint8_t stop_halves) {
+    struct farend* f = &farends[port];
+    f->baud = baud;
+    f->data_bits = data_bits;
+    f->parity = parity;
+    f->stop_halves = stop_halves;
+}
+
+void sim_farend_send(uint8_t port, uint64_t bytes) {
+    farends[port].queued += bytes;
+    farend_next(&farends[port]);
+}
+
+void sim_farend_set_flow_control(uint8_t port, bool enable) {
+    farends[port].flow_control = enable;
+    farend_next(&farends[port]);
+}
+
+bool sim_farend_idle(void) {
+    for (uint8_t port = 0; port < CONSOLE_NUM_PORTS; port++) {
+        if (farends[port].sending || farends[port].queued > 0) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,357 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * GPIO ports, the AFIO EXTI mux, EXTI and the clock tree. Pins read back
+ * their output or pull level unless driven from outside, and edges on
+ * them are seen by EXTI.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <libopencm3/stm32/desig.h>
+#include <libopencm3/stm32/exti.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/rcc.h>
+
+#include "sim.h"
+
+#define GPIO_NUM_PORTS 3
+
+#define GPIO_OFFSET_CRL  0x00
+#define GPIO_OFFSET_CRH  0x04
+#define GPIO_OFFSET_IDR  0x08
+#define GPIO_OFFSET_ODR  0x0C
+#define GPIO_OFFSET_BSRR 0x10
+#define GPIO_OFFSET_BRR  0x14
+
+#define EXTI_OFFSET_IMR   0x00
+#define EXTI_OFFSET_RTSR  0x08
+#define EXTI_OFFSET_FTSR  0x0C
+#define EXTI_OFFSET_PR    0x14
+
+/* Reserved bit presented in PR, so clearing the only pending line shows */
+#define EXTI_PR_PRESENT 0x80000000U
+
+struct gpio_model {
+    struct sim_block blk;
+    uint32_t regs[7];
+    uint16_t levels;
+    uint16_t driven;
+    uint16_t driven_levels;
+    uint8_t index;
+};
+
+static struct gpio_model ports[GPIO_NUM_PORTS];
+static const uint32_t port_bases[GPIO_NUM_PORTS] = { GPIOA, GPIOB, GPIOC };
+
+static struct sim_block afio;
+static uint32_t afio_regs[6];
+static struct sim_block exti;
+static uint32_t exti_regs[6];
+
+uint32_t rcc_ahb_frequency = 8000000;
+uint32_t rcc_apb1_frequency = 8000000;
+uint32_t rcc_apb2_frequency = 8000000;
+
+static struct gpio_model* gpio_model(uint32_t port) {
+    for (unsigned i = 0; i < GPIO_NUM_PORTS; i++) {
+        if (port_bases[i] == port) {
+            return &ports[i];
+        }
+    }
+    sim_fatal("no such GPIO port 0x%08x", port);
+}
+
+/* MODE and CNF of a pin, from CRL or CRH */
+static uint8_t gpio_config(const struct gpio_model* m, unsigned pin) {
+    uint32_t cr = m->regs[(pin < 8 ? GPIO_OFFSET_CRL : GPIO_OFFSET_CRH) / 4];
+    return (cr >> ((pin % 8) * 4)) & 0xF;
+}
+
+static uint16_t gpio_levels(const struct gpio_model* m) {
+    uint16_t odr = (uint16_t)m->regs[GPIO_OFFSET_ODR / 4];
+    uint16_t levels = 0;
+    for (unsigned pin = 0; pin < 16; pin++) {
+        uint8_t config = gpio_config(m, pin);
+        bool output = (config & 0x3) != GPIO_MODE_INPUT;
+        bool pulled = (config >> 2) == GPIO_CNF_INPUT_PULL_UPDOWN;
+        if ((m->driven & (1 << pin)) && !output) {
+            levels |= m->driven_levels & (1 << pin);
+        } else if (output || pulled) {
+            levels |= odr & (1 << pin);
+        }
+    }
+    return levels;
+}
+
+static bool exti_level(void* arg) {
+    uint32_t lines = (uint32_t)(uintptr_t)arg;
+    return (exti_regs[EXTI_OFFSET_PR / 4] & exti_regs[EXTI_OFFSET_IMR / 4] & lines & 0xFFFF) != 0;
+}
+
+static const struct {
+    int irq;
+    uint32_t lines;
+} exti_irqs[] = {
+    { NVIC_EXTI0_IRQ, EXTI0 },
+    { NVIC_EXTI1_IRQ, EXTI1 },
+    { NVIC_EXTI2_IRQ, EXTI2 },
+    { NVIC_EXTI3_IRQ, EXTI3 },
+    { NVIC_EXTI4_IRQ, EXTI4 },
+    { NVIC_EXTI9_5_IRQ, 0x03E0 },
+    { NVIC_EXTI15_10_IRQ, 0xFC00 },
+};
+
+static void exti_update(void) {
+    for (unsigned i = 0; i < sizeof(exti_irqs) / sizeof(exti_irqs[0]); i++) {
+        sim_irq_update(exti_irqs[i].irq);
+    }
+}
+
+static void (*gpio_listener)(void* arg);
+static void* gpio_listener_arg;
+
+void sim_gpio_listen(void (*changed)(void* arg), void* arg) {
+    gpio_listener = changed;
+    gpio_listener_arg = arg;
+}
+
+/* Recompute the pin levels, latching EXTI edges on the selected port */
+static void gpio_refresh(struct gpio_model* m) {
+    uint16_t levels = gpio_levels(m);
+    uint16_t rising = levels & ~m->levels;
+    uint16_t falling = m->levels & ~levels;
+    m->levels = levels;
+    m->regs[GPIO_OFFSET_IDR / 4] = levels;
+    if ((rising | falling) == 0) {
+        return;
+    }
+
+    uint32_t pending = 0;
+    for (unsigned line = 0; line < 16; line++) {
+        uint32_t source = (afio_regs[2 + line / 4] >> ((line % 4) * 4)) & 0xF;
+        if (source != m->index) {
+            continue;
+        }
+        if (((rising >> line) & 1) && (exti_regs[EXTI_OFFSET_RTSR / 4] & (1U << line))) {
+            pending |= 1U << line;
+        }
+        if (((falling >> line) & 1) && (exti_regs[EXTI_OFFSET_FTSR / 4] & (1U << line))) {
+            pending |= 1U << line;
+        }
+    }
+    if (pending) {
+        sim_reg_set(&exti, EXTI_OFFSET_PR, exti_regs[EXTI_OFFSET_PR / 4] | pending);
+        exti_update();
+    }
+    if (gpio_listener != NULL) {
+        gpio_listener(gpio_listener_arg);
+    }
+}
+
+static void gpio_write(struct sim_block* blk, uint32_t offset, uint32_t old) {
+    struct gpio_model* m = blk->model;
+    uint32_t value = SIM_REG(blk, offset);
+    (void)old;
+
+    switch (offset) {
+        case GPIO_OFFSET_BSRR:
+            sim_reg_set(blk, GPIO_OFFSET_ODR,
+                        (m->regs[GPIO_OFFSET_ODR / 4] & ~(value >> 16)) | (value & 0xFFFF));
+            sim_reg_set(blk, offset, 0);
+            break;
+        case GPIO_OFFSET_BRR:
+            sim_reg_set(blk, GPIO_OFFSET_ODR, m->regs[GPIO_OFFSET_ODR / 4] & ~(value & 0xFFFF));
+            sim_reg_set(blk, offset, 0);
+            break;
+        case GPIO_OFFSET_IDR:
+            sim_reg_set(blk, offset, m->levels);
+            break;
+        default:
+            break;
+    }
+    gpio_refresh(m);
+}
+
+bool sim_gpio_level(uint32_t port, uint16_t pin) {
+    return (gpio_model(port)->levels & pin) != 0;
+}
+
+/* Drive input pins from outside, or release them with a negative level */
+void sim_gpio_drive(uint32_t port, uint16_t pins, int level) {
+    struct gpio_model* m = gpio_model(port);
+    if (level < 0) {
+        m->driven &= ~pins;
+    } else {
+        m->driven |= pins;
+        m->driven_levels = level ? (m->driven_levels | pins) : (m->driven_levels & ~pins);
+    }
+    gpio_refresh(m);
+}
+
+static void afio_write(struct sim_block* blk, uint32_t offset, uint32_t old) {
+    (void)blk;
+    (void)offset;
+    (void)old;
+}
+
+static void exti_write(struct sim_block* blk, uint32_t offset, uint32_t old) {
+    if (offset == EXTI_OFFSET_PR) {
+        /* Pending bits are cleared by writing ones */
+        sim_reg_set(blk, offset, (old & ~SIM_REG(blk, offset)) | EXTI_PR_PRESENT);
+    }
+    exti_update();
+}
+
+void sim_gpio_init(void) {
+    for (unsigned i = 0; i < GPIO_NUM_PORTS; i++) {
+        struct gpio_model* m = &ports[i];
+        m->index = (uint8_t)i;
+        m->regs[GPIO_OFFSET_CRL / 4] = 0x44444444;
+        m->regs[GPIO_OFFSET_CRH / 4] = 0x44444444;
+        m->blk.base = port_bases[i];
+        m->blk.size = sizeof(m->regs);
+        m->blk.regs = m->regs;
+        m->blk.model = m;
+        m->blk.write = gpio_write;
+        sim_block_add(&m->blk);
+    }
+
+    afio.base = AFIO_BASE;
+    afio.size = sizeof(afio_regs);
+    afio.regs = afio_regs;
+    afio.write = afio_write;
+    sim_block_add(&afio);
+
+    exti.base = EXTI_BASE;
+    exti.size = sizeof(exti_regs);
+    exti.regs = exti_regs;
+    exti.write = exti_write;
+    exti_regs[EXTI_OFFSET_PR / 4] = EXTI_PR_PRESENT;
+    sim_block_add(&exti);
+    for (unsigned i = 0; i < sizeof(exti_irqs) / sizeof(exti_irqs[0]); i++) {
+        sim_irq_connect(exti_irqs[i].irq, exti_level, (void*)(uintptr_t)exti_irqs[i].lines);
+    }
+}
+
+void gpio_set_mode(uint32_t gpioport, uint8_t mode, uint8_t cnf, uint16_t gpios) {
+    uint32_t crl = GPIO_CRL(gpioport);
+    uint32_t crh = GPIO_CRH(gpioport);
+    for (unsigned i = 0; i < 16; i++) {
+        if (!(gpios & (1 << i))) {
+            continue;
+        }
+        uint32_t shift = (i % 8) * 4;
+        uint32_t bits = (uint32_t)((cnf << 2) | mode) << shift;
+        if (i < 8) {
+            crl = (crl & ~(0xFU << shift)) | bits;
+        } else {
+            crh = (crh & ~(0xFU << shift)) | bits;
+        }
+    }
+    GPIO_CRL(gpioport) = crl;
+    GPIO_CRH(gpioport) = crh;
+}
+
+void gpio_set(uint32_t gpioport, uint16_t gpios) {
+    GPIO_BSRR(gpioport) = gpios;
+}
+
+void gpio_clear(uint32_t gpioport, uint16_t gpios) {
+    GPIO_BSRR(gpioport) = (uint32_t)gpios << 16;
+}
+
+uint16_t gpio_get(uint32_t gpioport, uint16_t gpios) {
+    return (uint16_t)(GPIO_IDR(gpioport) & gpios);
+}
+
+void gpio_toggle(uint32_t gpioport, uint16_t gpios) {
+    uint32_t port = GPIO_ODR(gpioport);
+    GPIO_BSRR(gpioport) = ((port & gpios) << 16) | (~port & gpios);
+}
+
+void exti_set_trigger(uint32_t extis, enum exti_trigger_type trig) {
+    switch (trig) {
+        case EXTI_TRIGGER_RISING:
+            EXTI_RTSR |= extis;
+            EXTI_FTSR &= ~extis;
+            break;
+        case EXTI_TRIGGER_FALLING:
+            EXTI_RTSR &= ~extis;
+            EXTI_FTSR |= extis;
+            break;
+        case EXTI_TRIGGER_BOTH:
+            EXTI_RTSR |= extis;
+            EXTI_FTSR |= extis;
+            break;
+    }
+}
+
+void exti_enable_request(uint32_t extis) {
+    EXTI_IMR |= extis;
+    EXTI_EMR |= extis;
+}
+
+void exti_disable_request(uint32_t extis) {
+    EXTI_IMR &= ~extis;
+    EXTI_EMR &= ~extis;
+}
+
+void exti_reset_request(uint32_t extis) {
+    EXTI_PR = extis;
+}
+
+void exti_select_source(uint32_t exti_lines, uint32_t gpioport) {
+    uint32_t source = gpio_model(gpioport)->index;
+    for (unsigned line = 0; line < 16; line++) {
+        if (exti_lines & (1U << line)) {
+            uint32_t shift = (line % 4) * 4;
+            AFIO_EXTICR(line / 4) = (AFIO_EXTICR(line / 4) & ~(0xFU << shift))
+                                    | (source << shift);
+        }
+    }
+}
+
+uint32_t exti_get_flag_status(uint32_t exti_lines) {
+    return EXTI_PR & exti_lines & 0xFFFFF;
+}
+
+void rcc_clock_setup_in_hse_8mhz_out_72mhz(void) {
+    rcc_ahb_frequency = 72000000;
+    rcc_apb1_frequency = 36000000;
+    rcc_apb2_frequency = 72000000;
+}
+
+/* Clocks are always running; registers work without them */
+void rcc_periph_clock_enable(enum rcc_periph_clken clken) {
+    (void)clken;
+}
+
+void rcc_periph_clock_disable(enum rcc_periph_clken clken) {
+    (void)clken;
+}
+
+void rcc_periph_reset_pulse(enum rcc_periph_rst rst) {
+    (void)rst;
+}
+
+void desig_get_unique_id_as_string(char* string, unsigned int string_len) {
+    snprintf(string, string_len, "%s", "SIM0000000000000000000000");
+}
@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The USB host: enumeration, 1 ms frames and a full-speed bus shared by
+ * the control, bulk and interrupt transfers of every port. Transactions
+ * take their time on the wire; one that would run into the next SOF
+ * waits for the next frame. Bulk endpoints are served round-robin, like
+ * a host controller with a transfer queued on each, and the interrupt
+ * endpoints are polled once per frame.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libopencm3/usb/cdc.h>
+
+#include "USB/composite_usb_conf.h"
+#include "USB/cdc.h"
+
+#include "sim.h"
+
+#define HOST_FRAME_CYCLES SIM_US(1000)
+#define HOST_BIT_CYCLES (SIM_CORE_HZ / 12000000U)
+/* Token, data and handshake packets around the payload, with gaps */
+#define HOST_PACKET_OVERHEAD 13
+#define HOST_PACKET_CYCLES(len) ((uint64_t)((len) + HOST_PACKET_OVERHEAD) * 8 * HOST_BIT_CYCLES)
+/* Time kept free at the end of the frame for the next SOF */
+#define HOST_SOF_CYCLES HOST_PACKET_CYCLES(0)
+
+#define HOST_MAX_CONTROL 16
+
+struct host_control {
+    uint64_t not_before;
+    struct usb_setup_data req;
+    uint8_t data[16];
+    /* Instead of a request, run this */
+    void (*action)(void);
+};
+
+enum host_transaction {
+    HOST_IDLE,
+    HOST_CONTROL,
+    HOST_IN,
+    HOST_OUT,
+};
+
+struct host_port {
+    bool reading;
+    uint64_t notify_frame;
+    uint8_t* out_data;
+    size_t out_size;
+    size_t out_head;
+    size_t out_tail;
+};
+
+static struct {
+    bool attached;
+    bool control_waiting;
+    uint64_t frame_start;
+    struct host_control control[HOST_MAX_CONTROL];
+    unsigned control_head;
+    unsigned control_count;
+    enum host_transaction current;
+    uint8_t current_ep;
+    uint8_t current_port;
+    uint16_t current_len;
+    unsigned next_candidate;
+    struct host_port ports[CDC_NUM_PORTS];
+    struct sim_host_stats stats;
+    struct sim_event attach;
+    struct sim_event sof;
+    struct sim_event done;
+    struct sim_event kick;
+} host;
+
+static void host_bus_try(void);
+
+static void host_queue(const struct host_control* entry) {
+    if (host.control_count == HOST_MAX_CONTROL) {
+        sim_fatal("too many queued control requests");
+    }
+    host.control[(host.control_head + host.control_count) % HOST_MAX_CONTROL] = *entry;
+    host.control_count++;
+    sim_event_at(&host.kick, entry->not_before);
+}
+
+static void host_queue_request(uint64_t not_before, uint8_t type, uint8_t request,
+                               uint16_t value, uint16_t index,
+                               const void* data, uint16_t len) {
+    struct host_control entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.not_before = not_before;
+    entry.req.bmRequestType = type;
+    entry.req.bRequest = request;
+    entry.req.wValue = value;
+    entry.req.wIndex = index;
+    entry.req.wLength = len;
+    if (len > 0) {
+        memcpy(entry.data, data, len);
+    }
+    host_queue(&entry);
+}
+
+static void host_control_done(bool ok, const uint8_t* data, uint16_t len) {
+    const struct host_control* entry = &host.control[host.control_head];
+    (void)data;
+    (void)len;
+    host.stats.control_transfers++;
+    if (!ok) {
+        host.stats.stalls++;
+        fprintf(stderr, "termlink-sim: request 0x%02x/0x%02x wValue 0x%04x stalled\n",
+                entry->req.bmRequestType, entry->req.bRequest, entry->req.wValue);
+    }
+    host.control_head = (host.control_head + 1) % HOST_MAX_CONTROL;
+    host.control_count--;
+    host.control_waiting = false;
+    sim_event_after(&host.kick, 0);
+}
+
+static bool host_out_pending(const struct host_port* p) {
+    return p->out_head != p->out_tail;
+}
+
+/* The next bulk or interrupt transaction the device is ready for, round-robin */
+static bool host_pick(uint8_t* ep, uint8_t* port, enum host_transaction* kind) {
+    unsigned count = CDC_NUM_PORTS * 3;
+    for (unsigned i = 0; i < count; i++) {
+        unsigned candidate = (host.next_candidate + i) % count;
+        uint8_t p = (uint8_t)(candidate / 3);
+        struct host_port* hp = &host.ports[p];
+        uint8_t addr;
+        bool ready;
+        switch (candidate % 3) {
+            case 0:
+                addr = ENDP_CDC_DATA_OUT(p);
+                ready = host_out_pending(hp) && sim_usbd_out_ready(addr);
+                *kind = HOST_OUT;
+                break;
+            case 1:
+                addr = ENDP_CDC_DATA_IN(p);
+                ready = hp->reading && sim_usbd_in_ready(addr);
+                *kind = HOST_IN;
+                break;
+            default:
+                addr = ENDP_CDC_COMM_IN(p);
+                ready = hp->notify_frame != host.stats.frames && sim_usbd_in_ready(addr);
+                *kind = HOST_IN;
+                break;
+        }
+        if (ready) {
+            host.next_candidate = (candidate + 1) % count;
+            *ep = addr;
+            *port = p;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void host_start(enum host_transaction kind, uint64_t cycles) {
+    host.current = kind;
+    sim_event_after(&host.done, cycles);
+}
+
+static void host_bus_try(void) {
+    if (!host.attached || host.current != HOST_IDLE) {
+        return;
+    }
+    uint64_t frame_left = host.frame_start + HOST_FRAME_CYCLES - HOST_SOF_CYCLES;
+    frame_left = (frame_left > sim_now) ? frame_left - sim_now : 0;
+
+    while (host.control_count > 0 && !host.control_waiting) {
+        struct host_control* entry = &host.control[host.control_head];
+        if (entry->not_before > sim_now) {
+            sim_event_at(&host.kick, entry->not_before);
+            break;
+        } else if (entry->action != NULL) {
+            host.control_head = (host.control_head + 1) % HOST_MAX_CONTROL;
+            host.control_count--;
+            entry->action();
+            continue;
+        }
+        uint64_t cycles = HOST_PACKET_CYCLES(8) + HOST_PACKET_CYCLES(entry->req.wLength)
+                          + HOST_PACKET_CYCLES(0);
+        if (cycles <= frame_left) {
+            host_start(HOST_CONTROL, cycles);
+        }
+        return;
+    }
+
+    if (!sim_usbd_configured()) {
+        return;
+    }
+
+    uint8_t ep;
+    uint8_t port;
+    enum host_transaction kind;
+    if (!host_pick(&ep, &port, &kind)) {
+        return;
+    }
+    struct host_port* hp = &host.ports[port];
+    uint16_t len;
+    if (kind == HOST_OUT) {
+        size_t pending = hp->out_tail - hp->out_head;
+        len = sim_usbd_max_packet(ep);
+        if (pending < len) {
+            len = (uint16_t)pending;
+        }
+    } else {
+        len = sim_usbd_in_len(ep);
+    }
+    uint64_t cycles = HOST_PACKET_CYCLES(len);
+    if (cycles > frame_left) {
+        /* Undo the round-robin step, so this goes first next frame */
+        host.next_candidate = (host.next_candidate + CDC_NUM_PORTS * 3 - 1) % (CDC_NUM_PORTS * 3);
+        return;
+    }
+    host.current_ep = ep;
+    host.current_port = port;
+    host.current_len = len;
+    if (ep == ENDP_CDC_COMM_IN(port)) {
+        hp->notify_frame = host.stats.frames;
+    }
+    host_start(kind, cycles);
+}
+
+static void host_done(void* arg) {
+    (void)arg;
+    enum host_transaction kind = host.current;
+    struct host_port* hp = &host.ports[host.current_port];
+    host.current = HOST_IDLE;
+
+    if (kind == HOST_CONTROL) {
+        struct host_control* entry = &host.control[host.control_head];
+        host.control_waiting = true;
+        sim_usbd_control(&entry->req, entry->data, host_control_done);
+    } else if (kind == HOST_IN) {
+        uint8_t buf[64];
+        uint16_t len = sim_usbd_in_take(host.current_ep, buf);
+        host.stats.in_packets++;
+        if (host.current_ep == ENDP_CDC_DATA_IN(host.current_port)) {
+            for (uint16_t i = 0; i < len; i++) {
+                sim_stream_received(host.current_port, SIM_RX, buf[i]);
+            }
+        }
+    } else if (kind == HOST_OUT) {
+        /* The endpoint may have been set to NAK since the token went out */
+        if (sim_usbd_out_ready(host.current_ep)) {
+            sim_usbd_out_put(host.current_ep, &hp->out_data[hp->out_head], host.current_len);
+            hp->out_head += host.current_len;
+            host.stats.out_packets++;
+        }
+    }
+    host_bus_try();
+}
+
+static void host_sof(void* arg) {
+    (void)arg;
+    host.frame_start = sim_now;
+    host.stats.frames++;
+    sim_usbd_sof();
+    sim_event_after(&host.sof, HOST_FRAME_CYCLES);
+    host_bus_try();
+}
+
+static void host_kick_event(void* arg) {
+    (void)arg;
+    host_bus_try();
+}
+
+static void host_start_script(void) {
+    sim_script_start();
+}
+
+/* Reset the bus and enumerate, then hand over to the scenario */
+static void host_attach_event(void* arg) {
+    (void)arg;
+    host.attached = true;
+    sim_usbd_bus_reset();
+    host_sof(NULL);
+
+    uint8_t out = USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_DEVICE;
+    host_queue_request(sim_now + SIM_MS(4), out, USB_REQ_SET_ADDRESS, 1, 0, NULL, 0);
+    host_queue_request(sim_now + SIM_MS(5), out, USB_REQ_SET_CONFIGURATION, 1, 0, NULL, 0);
+    for (uint8_t port = 0; port < CDC_NUM_PORTS; port++) {
+        /* What opening the tty does: assert DTR and RTS, then set the coding */
+        host_queue_request(sim_now + SIM_MS(6),
+                           USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+                           USB_CDC_REQ_SET_CONTROL_LINE_STATE, 0x3, INTF_CDC_COMM(port),
+                           NULL, 0);
+        sim_host_set_coding(port, DEFAULT_BAUDRATE, 8, 'N', 2);
+    }
+
+    struct host_control start;
+    memset(&start, 0, sizeof(start));
+    start.not_before = sim_now + SIM_MS(9);
+    start.action = host_start_script;
+    host_queue(&start);
+}
+
+void sim_host_init(void) {
+    sim_event_init(&host.attach, host_attach_event, NULL);
+    sim_event_init(&host.sof, host_sof, NULL);
+    sim_event_init(&host.done, host_done, NULL);
+    sim_event_init(&host.kick, host_kick_event, NULL);
+    for (uint8_t port = 0; port < CDC_NUM_PORTS; port++) {
+        host.ports[port].reading = true;
+    }
+}
+
+void sim_host_attach(void) {
+    sim_event_after(&host.attach, SIM_MS(1));
+}
+
+void sim_host_kick(void) {
+    if (host.attached && host.current == HOST_IDLE) {
+        sim_event_after(&host.kick, 0);
+    }
+}
+
+void sim_host_set_coding(uint8_t port, uint32_t baud, uint8_t data_bits,
+                         char parity, uint8_t stop_halves) {
+    struct usb_cdc_line_coding coding;
+    coding.dwDTERate = baud;
+    coding.bCharFormat = (stop_halves == 4) ? USB_CDC_2_STOP_BITS
+                         : (stop_halves == 3) ? USB_CDC_1_5_STOP_BITS : USB_CDC_1_STOP_BITS;
+    coding.bParityType = (parity == 'E') ? USB_CDC_EVEN_PARITY
+                         : (parity == 'O') ? USB_CDC_ODD_PARITY : USB_CDC_NO_PARITY;
+    coding.bDataBits = data_bits;
+    host_queue_request(sim_now,
+                       USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+                       USB_CDC_REQ_SET_LINE_CODING, 0, INTF_CDC_COMM(port),
+                       &coding, sizeof(coding));
+}
+
+void sim_host_request(uint8_t port, uint8_t bRequest, uint16_t wValue) {
+    host_queue_request(sim_now, USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE,
+                       bRequest, wValue, INTF_CDC_COMM(port), NULL, 0);
+}
+
+/* Queue bytes of the port's TX stream, as if written to the tty now */
+void sim_host_write(uint8_t port, uint64_t bytes) {
+    struct host_port* hp = &host.ports[port];
+    if (hp->out_head == hp->out_tail) {
+        hp->out_head = hp->out_tail = 0;
+    }
+    if (hp->out_tail + bytes > hp->out_size) {
+        hp->out_size = hp->out_tail + bytes;
+        hp->out_data = realloc(hp->out_data, hp->out_size);
+        if (hp->out_data == NULL) {
+            sim_fatal("out of memory");
+        }
+    }
+    for (uint64_t i = 0; i < bytes; i++) {
+        hp->out_data[hp->out_tail++] = sim_stream_next(port, SIM_TX, sim_now);
+    }
+    sim_host_kick();
+}
+
+void sim_host_set_reader(uint8_t port, bool reading) {
+    host.ports[port].reading = reading;
+    sim_host_kick();
+}
+
+bool sim_host_idle(void) {
+    if (host.control_count > 0) {
+        return false;
+    }
+    for (uint8_t port = 0; port < CDC_NUM_PORTS; port++) {
+        if (host_out_pending(&host.ports[port])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void sim_host_get_stats(struct sim_host_stats* stats) {
+    *stats = host.stats;
+}
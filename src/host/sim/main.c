@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Entry point of the simulator: sets up the models, loads the scenario
+ * and runs the firmware's main().
+ */
+
+#include <stdio.h>
+
+#include "sim.h"
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s scenario.scn\n", argv[0]);
+        return 2;
+    }
+
+    sim_core_init();
+    sim_gpio_init();
+    sim_timer_init();
+    sim_dma_init();
+    sim_usart_init();
+    sim_host_init();
+    sim_farend_init();
+    if (!sim_script_load(argv[1])) {
+        return 2;
+    }
+
+    firmware_main();
+    sim_fatal("firmware returned from main()");
+}
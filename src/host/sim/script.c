@@ -0,0 +1,597 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Scenario scripts: one command per line, run in order once the host
+ * has enumerated the device and opened its ports. '#' starts a comment.
+ *
+ *   port N                      commands below apply to port N
+ *   coding BAUD [FORMAT]        host sets the line coding, e.g. 8N1, 7E2
+ *   device BAUD [FORMAT]        far end changes its line format
+ *   flow on|off                 RTS/CTS on both sides
+ *   latency MS                  host sets the latency timer
+ *   rx BYTES [every T [times K]]  far end sends, once or repeatedly
+ *   tx BYTES [every T [times K]]  host writes, once or repeatedly
+ *   reader on|off               host reads the data IN endpoint or not
+ *   wait T                      let T pass, e.g. 500us, 20ms, 2s
+ *   settle [T]                  wait for repeats to finish and everything
+ *                               sent to arrive, or for T (50ms) without
+ *                               progress
+ *   expect METRIC OP VALUE      check a metric with <, <=, >, >=, == or !=
+ *
+ * Metrics are rx.X and tx.X for X in sent, delivered, lost, corrupt,
+ * p50, p90, p99 and max (latencies in us), rx_ring.peak and tx_ring.peak
+ * in bytes, the console's overruns, dropped, framing_errors,
+ * parity_errors and overrun_errors, usb.stalls, and cpu in percent.
+ *
+ * At the end, the script settles and prints a report. The exit status
+ * is 1 if an expectation failed.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "console.h"
+#include "USB/cdc.h"
+
+#include "sim.h"
+
+#define SCRIPT_MAX_COMMANDS 256
+#define SCRIPT_MAX_LINE 256
+#define SCRIPT_SETTLE_POLL SIM_US(100)
+#define SCRIPT_SETTLE_DEFAULT SIM_MS(50)
+
+enum script_op {
+    SCRIPT_PORT,
+    SCRIPT_CODING,
+    SCRIPT_DEVICE,
+    SCRIPT_FLOW,
+    SCRIPT_LATENCY,
+    SCRIPT_RX,
+    SCRIPT_TX,
+    SCRIPT_READER,
+    SCRIPT_WAIT,
+    SCRIPT_SETTLE,
+    SCRIPT_EXPECT,
+};
+
+struct script_command {
+    enum script_op op;
+    unsigned line;
+    uint8_t port;
+    uint64_t count;
+    uint64_t period;
+    uint64_t times;
+    uint32_t baud;
+    uint8_t data_bits;
+    char parity;
+    uint8_t stop_halves;
+    bool on;
+    char metric[32];
+    char compare[3];
+    double value;
+    /* Repeats still to come, for rx and tx with every */
+    uint64_t remaining;
+    struct sim_event repeat;
+};
+
+static struct {
+    const char* path;
+    struct script_command commands[SCRIPT_MAX_COMMANDS];
+    unsigned num_commands;
+    unsigned next;
+    unsigned repeating;
+    bool settling;
+    uint64_t settle_quiet;
+    unsigned failed;
+    struct timespec wall_start;
+    uint16_t tx_peak[CONSOLE_NUM_PORTS];
+    uint16_t rx_peak[CONSOLE_NUM_PORTS];
+    struct sim_event step;
+} script;
+
+static const uint16_t script_tx_sizes[] = {
+    CONSOLE_TX_BUFFER_SIZE,
+#if CONSOLE_NUM_PORTS > 1
+    CONSOLE_PORT1_TX_BUFFER_SIZE,
+#endif
+#if CONSOLE_NUM_PORTS > 2
+    CONSOLE_PORT2_TX_BUFFER_SIZE,
+#endif
+};
+
+static const uint16_t script_rx_sizes[] = {
+    CONSOLE_RX_BUFFER_SIZE,
+#if CONSOLE_NUM_PORTS > 1
+    CONSOLE_PORT1_RX_BUFFER_SIZE,
+#endif
+#if CONSOLE_NUM_PORTS > 2
+    CONSOLE_PORT2_RX_BUFFER_SIZE,
+#endif
+};
+
+static bool script_error(unsigned line, const char* what) {
+    fprintf(stderr, "%s:%u: %s\n", script.path, line, what);
+    return false;
+}
+
+static bool script_parse_time(const char* text, uint64_t* cycles) {
+    char* end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) {
+        return false;
+    }
+    if (strcmp(end, "us") == 0) {
+        *cycles = (uint64_t)(value * SIM_CYCLES_PER_US);
+    } else if (strcmp(end, "ms") == 0) {
+        *cycles = (uint64_t)(value * SIM_CYCLES_PER_US * 1000);
+    } else if (strcmp(end, "s") == 0) {
+        *cycles = (uint64_t)(value * SIM_CORE_HZ);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool script_parse_count(const char* text, uint64_t* count) {
+    char* end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 0);
+    if (end == text || errno != 0) {
+        return false;
+    }
+    if (*end == 'k' || *end == 'K') {
+        value *= 1024;
+        end++;
+    }
+    *count = value;
+    return *end == '\0';
+}
+
+/* "8N1": data bits, parity and stop bits, with 1.5 written as 15 */
+static bool script_parse_format(const char* text, struct script_command* cmd) {
+    cmd->data_bits = 8;
+    cmd->parity = 'N';
+    cmd->stop_halves = 2;
+    if (text == NULL) {
+        return true;
+    }
+    if (strlen(text) < 3 || text[0] < '5' || text[0] > '9'
+        || strchr("NEO", text[1]) == NULL) {
+        return false;
+    }
+    cmd->data_bits = (uint8_t)(text[0] - '0');
+    cmd->parity = text[1];
+    if (strcmp(&text[2], "1") == 0) {
+        cmd->stop_halves = 2;
+    } else if (strcmp(&text[2], "15") == 0) {
+        cmd->stop_halves = 3;
+    } else if (strcmp(&text[2], "2") == 0) {
+        cmd->stop_halves = 4;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool script_parse_on(const char* text, bool* on) {
+    if (text != NULL && strcmp(text, "on") == 0) {
+        *on = true;
+    } else if (text != NULL && strcmp(text, "off") == 0) {
+        *on = false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool script_parse_line(char* text, unsigned line, uint8_t* port) {
+    char* words[8];
+    unsigned num_words = 0;
+    char* hash = strchr(text, '#');
+    if (hash != NULL) {
+        *hash = '\0';
+    }
+    for (char* word = strtok(text, " \t\r\n"); word != NULL; word = strtok(NULL, " \t\r\n")) {
+        if (num_words == sizeof(words) / sizeof(words[0])) {
+            return script_error(line, "too many words");
+        }
+        words[num_words++] = word;
+    }
+    if (num_words == 0) {
+        return true;
+    }
+    for (unsigned i = num_words; i < sizeof(words) / sizeof(words[0]); i++) {
+        words[i] = NULL;
+    }
+    if (script.num_commands == SCRIPT_MAX_COMMANDS) {
+        return script_error(line, "too many commands");
+    }
+
+    struct script_command* cmd = &script.commands[script.num_commands];
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->line = line;
+    cmd->port = *port;
+    cmd->times = 1;
+
+    const char* name = words[0];
+    bool ok;
+    if (strcmp(name, "port") == 0) {
+        uint64_t value;
+        ok = num_words == 2 && script_parse_count(words[1], &value) && value < CONSOLE_NUM_PORTS;
+        cmd->op = SCRIPT_PORT;
+        cmd->port = (uint8_t)value;
+        *port = cmd->port;
+    } else if (strcmp(name, "coding") == 0 || strcmp(name, "device") == 0) {
+        uint64_t baud;
+        ok = (num_words == 2 || num_words == 3) && script_parse_count(words[1], &baud)
+             && baud > 0 && baud <= 10000000 && script_parse_format(words[2], cmd);
+        cmd->op = (name[0] == 'c') ? SCRIPT_CODING : SCRIPT_DEVICE;
+        cmd->baud = (uint32_t)baud;
+    } else if (strcmp(name, "flow") == 0 || strcmp(name, "reader") == 0) {
+        ok = num_words == 2 && script_parse_on(words[1], &cmd->on);
+        cmd->op = (name[0] == 'f') ? SCRIPT_FLOW : SCRIPT_READER;
+    } else if (strcmp(name, "latency") == 0) {
+        ok = num_words == 2 && script_parse_count(words[1], &cmd->count)
+             && cmd->count <= UINT16_MAX;
+        cmd->op = SCRIPT_LATENCY;
+    } else if (strcmp(name, "rx") == 0 || strcmp(name, "tx") == 0) {
+        ok = script_parse_count(words[1], &cmd->count);
+        if (ok && num_words >= 4) {
+            ok = strcmp(words[2], "every") == 0 && script_parse_time(words[3], &cmd->period)
+                 && cmd->period > 0;
+            cmd->times = UINT64_MAX;
+            if (ok && num_words == 6) {
+                ok = strcmp(words[4], "times") == 0 && script_parse_count(words[5], &cmd->times)
+                     && cmd->times > 0;
+            } else if (num_words != 4) {
+                ok = false;
+            }
+        } else if (num_words != 2) {
+            ok = false;
+        }
+        cmd->op = (name[0] == 'r') ? SCRIPT_RX : SCRIPT_TX;
+    } else if (strcmp(name, "wait") == 0) {
+        ok = num_words == 2 && script_parse_time(words[1], &cmd->period);
+        cmd->op = SCRIPT_WAIT;
+    } else if (strcmp(name, "settle") == 0) {
+        cmd->period = SCRIPT_SETTLE_DEFAULT;
+        ok = num_words == 1 || (num_words == 2 && script_parse_time(words[1], &cmd->period));
+        cmd->op = SCRIPT_SETTLE;
+    } else if (strcmp(name, "expect") == 0) {
+        char* end = NULL;
+        ok = num_words == 4 && strlen(words[1]) < sizeof(cmd->metric)
+             && strlen(words[2]) < sizeof(cmd->compare);
+        if (ok) {
+            strcpy(cmd->metric, words[1]);
+            strcpy(cmd->compare, words[2]);
+            cmd->value = strtod(words[3], &end);
+            ok = *end == '\0';
+        }
+        cmd->op = SCRIPT_EXPECT;
+    } else {
+        return script_error(line, "unknown command");
+    }
+
+    if (!ok) {
+        return script_error(line, "bad arguments");
+    }
+    script.num_commands++;
+    return true;
+}
+
+bool sim_script_load(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+    script.path = path;
+
+    char text[SCRIPT_MAX_LINE];
+    unsigned line = 0;
+    uint8_t port = 0;
+    bool ok = true;
+    while (ok && fgets(text, sizeof(text), file) != NULL) {
+        ok = script_parse_line(text, ++line, &port);
+    }
+    fclose(file);
+    return ok;
+}
+
+static void script_take_peaks(void) {
+    for (uint8_t port = 0; port < CONSOLE_NUM_PORTS; port++) {
+        uint16_t tx_used;
+        uint16_t rx_used;
+        console_take_high_water(console_port(port), &tx_used, &rx_used);
+        if (tx_used > script.tx_peak[port]) {
+            script.tx_peak[port] = tx_used;
+        }
+        if (rx_used > script.rx_peak[port]) {
+            script.rx_peak[port] = rx_used;
+        }
+    }
+}
+
+static double script_cpu_percent(void) {
+    return sim_now ? 100.0 * (double)(sim_now - sim_sleep_cycles()) / (double)sim_now : 0.0;
+}
+
+static bool script_stream_metric(const char* name, uint8_t port, double* value) {
+    struct sim_stream_stats stats;
+    enum sim_direction dir;
+    if (strncmp(name, "rx.", 3) == 0) {
+        dir = SIM_RX;
+    } else if (strncmp(name, "tx.", 3) == 0) {
+        dir = SIM_TX;
+    } else {
+        return false;
+    }
+    sim_stream_get_stats(port, dir, &stats);
+
+    name += 3;
+    if (strcmp(name, "sent") == 0) {
+        *value = (double)stats.sent;
+    } else if (strcmp(name, "delivered") == 0) {
+        *value = (double)stats.delivered;
+    } else if (strcmp(name, "lost") == 0) {
+        *value = (double)stats.lost;
+    } else if (strcmp(name, "corrupt") == 0) {
+        *value = (double)stats.corrupt;
+    } else if (strcmp(name, "p50") == 0) {
+        *value = stats.latency_p50;
+    } else if (strcmp(name, "p90") == 0) {
+        *value = stats.latency_p90;
+    } else if (strcmp(name, "p99") == 0) {
+        *value = stats.latency_p99;
+    } else if (strcmp(name, "max") == 0) {
+        *value = stats.latency_max;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool script_metric(const char* name, uint8_t port, double* value) {
+    struct console_rx_stats rx_stats;
+    struct sim_host_stats host_stats;
+    console_get_rx_stats(console_port(port), &rx_stats);
+    sim_host_get_stats(&host_stats);
+    script_take_peaks();
+
+    if (script_stream_metric(name, port, value)) {
+        return true;
+    } else if (strcmp(name, "rx_ring.peak") == 0) {
+        *value = script.rx_peak[port];
+    } else if (strcmp(name, "tx_ring.peak") == 0) {
+        *value = script.tx_peak[port];
+    } else if (strcmp(name, "overruns") == 0) {
+        *value = rx_stats.overruns;
+    } else if (strcmp(name, "dropped") == 0) {
+        *value = rx_stats.dropped;
+    } else if (strcmp(name, "framing_errors") == 0) {
+        *value = rx_stats.framing_errors;
+    } else if (strcmp(name, "parity_errors") == 0) {
+        *value = rx_stats.parity_errors;
+    } else if (strcmp(name, "overrun_errors") == 0) {
+        *value = rx_stats.overrun_errors;
+    } else if (strcmp(name, "usb.stalls") == 0) {
+        *value = (double)host_stats.stalls;
+    } else if (strcmp(name, "cpu") == 0) {
+        *value = script_cpu_percent();
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static void script_expect(const struct script_command* cmd) {
+    double value;
+    if (!script_metric(cmd->metric, cmd->port, &value)) {
+        sim_fatal("%s:%u: unknown metric %s", script.path, cmd->line, cmd->metric);
+    }
+
+    bool ok;
+    if (strcmp(cmd->compare, "<") == 0) {
+        ok = value < cmd->value;
+    } else if (strcmp(cmd->compare, "<=") == 0) {
+        ok = value <= cmd->value;
+    } else if (strcmp(cmd->compare, ">") == 0) {
+        ok = value > cmd->value;
+    } else if (strcmp(cmd->compare, ">=") == 0) {
+        ok = value >= cmd->value;
+    } else if (strcmp(cmd->compare, "==") == 0) {
+        ok = value == cmd->value;
+    } else if (strcmp(cmd->compare, "!=") == 0) {
+        ok = value != cmd->value;
+    } else {
+        sim_fatal("%s:%u: unknown comparison %s", script.path, cmd->line, cmd->compare);
+    }
+
+    if (!ok) {
+        printf("%s:%u: FAILED: port %u %s is %g, expected %s %g\n", script.path, cmd->line,
+               cmd->port, cmd->metric, value, cmd->compare, cmd->value);
+        script.failed++;
+    }
+}
+
+static void script_print_stream(uint8_t port, enum sim_direction dir) {
+    struct sim_stream_stats stats;
+    sim_stream_get_stats(port, dir, &stats);
+    if (stats.sent == 0) {
+        return;
+    }
+    uint64_t span = stats.last_delivered - stats.first_sent;
+    double rate = span ? (double)stats.delivered * SIM_CORE_HZ / (double)span / 1000.0 : 0.0;
+    printf("  %u %s %10llu %10llu %8llu %8llu %9.1f %7u %7u %7u %7u\n",
+           port, (dir == SIM_RX) ? "rx" : "tx",
+           (unsigned long long)stats.sent, (unsigned long long)stats.delivered,
+           (unsigned long long)stats.lost, (unsigned long long)stats.corrupt, rate,
+           stats.latency_p50, stats.latency_p90, stats.latency_p99, stats.latency_max);
+}
+
+static void script_report(void) {
+    struct timespec wall_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    double wall = (double)(wall_end.tv_sec - script.wall_start.tv_sec)
+                  + (double)(wall_end.tv_nsec - script.wall_start.tv_nsec) / 1e9;
+    struct sim_host_stats host_stats;
+    sim_host_get_stats(&host_stats);
+    script_take_peaks();
+
+    printf("%s\n", script.path);
+    printf("  port      sent  delivered     lost  corrupt    kB/s     p50     p90     p99     max (us)\n");
+    for (uint8_t port = 0; port < CONSOLE_NUM_PORTS; port++) {
+        script_print_stream(port, SIM_RX);
+        script_print_stream(port, SIM_TX);
+    }
+    for (uint8_t port = 0; port < CONSOLE_NUM_PORTS; port++) {
+        struct console_rx_stats stats;
+        console_get_rx_stats(console_port(port), &stats);
+        printf("  port %u: rx ring peak %u/%u, tx ring peak %u/%u, overruns %lu (%lu bytes), "
+               "errors framing %lu parity %lu overrun %lu\n",
+               port, script.rx_peak[port], script_rx_sizes[port],
+               script.tx_peak[port], script_tx_sizes[port],
+               (unsigned long)stats.overruns, (unsigned long)stats.dropped,
+               (unsigned long)stats.framing_errors, (unsigned long)stats.parity_errors,
+               (unsigned long)stats.overrun_errors);
+    }
+    printf("  usb: %llu frames, %llu IN and %llu OUT packets, %llu control transfers, %llu stalled\n",
+           (unsigned long long)host_stats.frames, (unsigned long long)host_stats.in_packets,
+           (unsigned long long)host_stats.out_packets,
+           (unsigned long long)host_stats.control_transfers,
+           (unsigned long long)host_stats.stalls);
+    printf("  cpu: %.1f%% busy; %.3f s simulated in %.3f s\n", script_cpu_percent(),
+           (double)sim_now / SIM_CORE_HZ, wall);
+    printf("  %s\n", script.failed ? "FAILED" : "ok");
+    fflush(stdout);
+}
+
+static bool script_quiet(void) {
+    return sim_farend_idle() && sim_host_idle() && sim_stream_settled();
+}
+
+static void script_send(const struct script_command* cmd) {
+    if (cmd->op == SCRIPT_RX) {
+        sim_farend_send(cmd->port, cmd->count);
+    } else {
+        sim_host_write(cmd->port, cmd->count);
+    }
+}
+
+static void script_repeat(void* arg) {
+    struct script_command* cmd = arg;
+    script_send(cmd);
+    if (--cmd->remaining > 0) {
+        sim_event_after(&cmd->repeat, cmd->period);
+    } else {
+        script.repeating--;
+    }
+}
+
+static void script_run(struct script_command* cmd) {
+    switch (cmd->op) {
+        case SCRIPT_PORT:
+            break;
+        case SCRIPT_CODING:
+            sim_host_set_coding(cmd->port, cmd->baud, cmd->data_bits, cmd->parity,
+                                cmd->stop_halves);
+            break;
+        case SCRIPT_DEVICE:
+            sim_farend_set_format(cmd->port, cmd->baud, cmd->data_bits, cmd->parity,
+                                  cmd->stop_halves);
+            break;
+        case SCRIPT_FLOW:
+            sim_host_request(cmd->port, CDC_VENDOR_REQ_SET_FLOW_CONTROL,
+                             cmd->on ? CDC_FLOW_CONTROL_RTS_CTS : CDC_FLOW_CONTROL_NONE);
+            sim_farend_set_flow_control(cmd->port, cmd->on);
+            break;
+        case SCRIPT_LATENCY:
+            sim_host_request(cmd->port, CDC_VENDOR_REQ_SET_LATENCY_TIMER, (uint16_t)cmd->count);
+            break;
+        case SCRIPT_RX:
+        case SCRIPT_TX:
+            script_send(cmd);
+            if (cmd->times > 1) {
+                cmd->remaining = cmd->times - 1;
+                script.repeating++;
+                sim_event_init(&cmd->repeat, script_repeat, cmd);
+                sim_event_after(&cmd->repeat, cmd->period);
+            }
+            break;
+        case SCRIPT_READER:
+            sim_host_set_reader(cmd->port, cmd->on);
+            break;
+        case SCRIPT_EXPECT:
+            script_expect(cmd);
+            break;
+        case SCRIPT_WAIT:
+        case SCRIPT_SETTLE:
+            break;
+    }
+}
+
+/* Run commands until one has to wait, or report at the end */
+static void script_step(void* arg) {
+    (void)arg;
+    if (script.settling) {
+        bool progressing = sim_now - sim_stream_last_activity() < script.settle_quiet;
+        if (script.repeating > 0 || (!script_quiet() && progressing)) {
+            sim_event_after(&script.step, SCRIPT_SETTLE_POLL);
+            return;
+        }
+        script.settling = false;
+    }
+
+    while (script.next < script.num_commands) {
+        struct script_command* cmd = &script.commands[script.next++];
+        script_run(cmd);
+        if (cmd->op == SCRIPT_WAIT) {
+            sim_event_after(&script.step, cmd->period);
+            return;
+        } else if (cmd->op == SCRIPT_SETTLE) {
+            script.settling = true;
+            script.settle_quiet = cmd->period;
+            sim_event_after(&script.step, 0);
+            return;
+        }
+    }
+
+    if (script.next == script.num_commands) {
+        /* A final settle, so the report covers everything sent */
+        script.next++;
+        script.settling = true;
+        script.settle_quiet = SCRIPT_SETTLE_DEFAULT;
+        sim_event_after(&script.step, 0);
+        return;
+    }
+
+    script_report();
+    exit(script.failed ? 1 : 0);
+}
+
+void sim_script_start(void) {
+    clock_gettime(CLOCK_MONOTONIC, &script.wall_start);
+    sim_event_init(&script.step, script_step, NULL);
+    sim_event_after(&script.step, 0);
+}
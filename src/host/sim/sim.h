@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SIM_H_INCLUDED
+#define SIM_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/usb/usbstd.h>
+
+/*
+ * Simulated STM32F103 for the host build (TARGET=HOST).
+ *
+ * The firmware runs natively, with its main() called by the simulator.
+ * Simulated time is counted in core clock cycles and only moves when the
+ * firmware touches a peripheral register, takes or leaves an interrupt,
+ * copies a USB packet or sleeps in WFI; the code in between is free, so
+ * CPU time is underestimated and latencies are lower bounds. Interrupts
+ * are taken on register accesses, in NVIC priority order.
+ *
+ * Peripheral registers are plain words behind sim_mmio32(). The models
+ * see a CPU write when the register no longer holds the value it had
+ * when it was last handed out, and a read when it does; this is checked
+ * on the next access, so both take effect before anything else happens.
+ * Registers whose writes may repeat the value read back, such as the
+ * USART's DR, present a value with a reserved bit set to tell them apart.
+ */
+
+#define SIM_CORE_HZ 72000000U
+#define SIM_CYCLES_PER_US (SIM_CORE_HZ / 1000000U)
+#define SIM_US(us) ((uint64_t)(us) * SIM_CYCLES_PER_US)
+#define SIM_MS(ms) (SIM_US(ms) * 1000U)
+
+/* CPU costs, in core cycles */
+#define SIM_ACCESS_CYCLES    3
+#define SIM_IRQ_ENTRY_CYCLES 12
+#define SIM_IRQ_EXIT_CYCLES  10
+#define SIM_COPY_CYCLES_PER_BYTE 2
+
+extern uint64_t sim_now;
+
+/* Pending work for a model at a point in simulated time */
+struct sim_event {
+    uint64_t time;
+    bool armed;
+    void (*fire)(void* arg);
+    void* arg;
+};
+
+extern void sim_event_init(struct sim_event* ev, void (*fire)(void* arg), void* arg);
+extern void sim_event_at(struct sim_event* ev, uint64_t time);
+extern void sim_event_after(struct sim_event* ev, uint64_t delay);
+extern void sim_event_cancel(struct sim_event* ev);
+
+/* Spend CPU time, running events and taking interrupts on the way */
+extern void sim_spend(uint32_t cycles);
+/* Hand CPU writes to the registers accessed since the last check to the models */
+extern void sim_sync(void);
+
+extern void sim_fatal(const char* fmt, ...) __attribute__((noreturn, format(printf, 1, 2)));
+extern void sim_core_init(void);
+extern int firmware_main(void);
+extern void sim_wait_for_interrupt(void);
+extern uint64_t sim_sleep_cycles(void);
+
+/* A peripheral's registers */
+struct sim_block {
+    uint32_t base;
+    uint32_t size;
+    uint32_t* regs;
+    void* model;
+    /* Before the CPU reads or writes a register; may refresh it */
+    void (*access)(struct sim_block* blk, uint32_t offset);
+    /* After the CPU changed a register, with its previous value */
+    void (*write)(struct sim_block* blk, uint32_t offset, uint32_t old);
+    /* After the CPU accessed a register without changing it */
+    void (*read)(struct sim_block* blk, uint32_t offset);
+    /* Accesses by DMA, which see the data without the CPU side effects */
+    uint32_t (*dma_read)(struct sim_block* blk, uint32_t offset);
+    void (*dma_write)(struct sim_block* blk, uint32_t offset, uint32_t value);
+};
+
+#define SIM_REG(blk, offset) ((blk)->regs[(offset) / 4])
+
+extern void sim_block_add(struct sim_block* blk);
+/* Change a register from the model side, without it looking like a CPU write */
+extern void sim_reg_set(struct sim_block* blk, uint32_t offset, uint32_t value);
+/* Resolve a 32-bit DMA address into a register block or memory */
+extern struct sim_block* sim_block_at(uint32_t addr, uint32_t* offset);
+extern void* sim_pointer(uint32_t addr);
+
+/* Interrupt lines; SysTick takes the slot after the peripheral IRQs */
+#define SIM_IRQ_SYSTICK NVIC_IRQ_COUNT
+#define SIM_NUM_IRQS (NVIC_IRQ_COUNT + 1)
+
+extern void sim_irq_connect(int irq, bool (*level)(void* arg), void* arg);
+extern void sim_irq_update(int irq);
+extern void sim_irq_pend(int irq);
+extern void (*sim_irq_handler(int irq))(void);
+
+/* For the interleaving checker: take the next preempting interrupt early */
+extern bool sim_preemptible(void);
+/* Execution priority of the running code; 0x100 in thread mode */
+extern unsigned sim_priority(void);
+extern int sim_preempt(uint64_t horizon);
+
+/* DMA request lines, with the F1's fixed peripheral-to-channel mapping */
+extern void sim_dma_init(void);
+extern void sim_dma_connect(uint8_t channel, bool (*request)(void* arg), void* arg);
+extern void sim_dma_kick(uint8_t channel);
+
+/* A frame on a serial line: the data and parity bits, LSB first */
+struct sim_frame {
+    uint16_t field;
+    uint8_t field_bits;
+    uint8_t stop_halves;
+    uint32_t baud;
+    bool brk;
+};
+
+/* One end of a serial line; frames start and end at the receiver */
+struct sim_serial {
+    void (*rx_begin)(struct sim_serial* self);
+    void (*rx_frame)(struct sim_serial* self, const struct sim_frame* frame);
+    struct sim_serial* peer;
+};
+
+extern uint64_t sim_frame_cycles(uint32_t baud, uint8_t field_bits, uint8_t stop_halves);
+extern bool sim_frame_receive(const struct sim_frame* frame, uint32_t baud,
+                              uint8_t field_bits, uint16_t* field);
+extern uint16_t sim_parity_field(uint16_t data, uint8_t data_bits, char parity);
+extern bool sim_parity_ok(uint16_t field, uint8_t field_bits, char parity);
+
+extern void sim_usart_init(void);
+extern struct sim_serial* sim_usart_serial(uint32_t usart);
+
+extern void sim_timer_init(void);
+extern void sim_gpio_init(void);
+extern bool sim_gpio_level(uint32_t port, uint16_t pin);
+extern void sim_gpio_drive(uint32_t port, uint16_t pins, int level);
+extern void sim_gpio_listen(void (*changed)(void* arg), void* arg);
+
+/* The device controller behind the usbd API */
+extern bool sim_usbd_configured(void);
+extern bool sim_usbd_in_ready(uint8_t ep);
+extern uint16_t sim_usbd_in_len(uint8_t ep);
+extern uint16_t sim_usbd_in_take(uint8_t ep, uint8_t* buf);
+extern bool sim_usbd_out_ready(uint8_t ep);
+extern void sim_usbd_out_put(uint8_t ep, const uint8_t* buf, uint16_t len);
+extern uint16_t sim_usbd_max_packet(uint8_t addr);
+extern bool sim_usbd_control_busy(void);
+extern void sim_usbd_control(const struct usb_setup_data* req, const uint8_t* data,
+                             void (*done)(bool ok, const uint8_t* data, uint16_t len));
+extern void sim_usbd_bus_reset(void);
+extern void sim_usbd_sof(void);
+
+/* The USB host: enumeration, frames and the bulk transfers */
+struct sim_host_stats {
+    uint64_t frames;
+    uint64_t in_packets;
+    uint64_t out_packets;
+    uint64_t control_transfers;
+    uint64_t stalls;
+};
+
+extern void sim_host_init(void);
+extern void sim_host_attach(void);
+extern void sim_host_kick(void);
+extern void sim_host_set_coding(uint8_t port, uint32_t baud, uint8_t data_bits,
+                                char parity, uint8_t stop_halves);
+extern void sim_host_request(uint8_t port, uint8_t bRequest, uint16_t wValue);
+extern void sim_host_write(uint8_t port, uint64_t bytes);
+extern void sim_host_set_reader(uint8_t port, bool reading);
+extern bool sim_host_idle(void);
+extern void sim_host_get_stats(struct sim_host_stats* stats);
+
+/* The device on the far side of each console port's UART */
+extern void sim_farend_init(void);
+extern void sim_farend_set_format(uint8_t port, uint32_t baud, uint8_t data_bits,
+                                  char parity, uint8_t stop_halves);
+extern void sim_farend_send(uint8_t port, uint64_t bytes);
+extern void sim_farend_set_flow_control(uint8_t port, bool enable);
+extern bool sim_farend_idle(void);
+
+/*
+ * Test data streams, one per port and direction, with a self-locating
+ * byte pattern so the receiver can tell what was lost on the way.
+ */
+struct sim_stream_stats {
+    uint64_t sent;
+    uint64_t delivered;
+    uint64_t lost;
+    uint64_t corrupt;
+    uint64_t first_sent;
+    uint64_t last_delivered;
+    uint32_t latency_p50;
+    uint32_t latency_p90;
+    uint32_t latency_p99;
+    uint32_t latency_max;
+};
+
+enum sim_direction {
+    SIM_RX,     /* far end to host, through the console's RX */
+    SIM_TX,     /* host to far end, through the console's TX */
+};
+
+/* The next byte to send, which counts as sent at origin */
+extern uint8_t sim_stream_next(uint8_t port, enum sim_direction dir, uint64_t origin);
+extern void sim_stream_received(uint8_t port, enum sim_direction dir, uint8_t byte);
+extern bool sim_stream_settled(void);
+extern uint64_t sim_stream_pending(uint8_t port, enum sim_direction dir);
+extern void sim_stream_get_stats(uint8_t port, enum sim_direction dir,
+                                 struct sim_stream_stats* stats);
+extern uint64_t sim_stream_last_activity(void);
+
+/* Scenario scripts */
+extern bool sim_script_load(const char* path);
+extern void sim_script_start(void);
+
+#endif
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Test data streams. Byte i of a stream belongs to group i / 3, which
+ * is spelled out in 7-bit pieces after a marker byte:
+ *
+ *   0x80 | (group >> 14)    (group >> 7) & 0x7F    group & 0x7F
+ *
+ * so a receiver that lost or mangled bytes finds its place again at the
+ * next group, and knows exactly which bytes went missing. Latencies are
+ * from the time a byte was handed to the sender to its arrival.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+#include "sim.h"
+
+#define STREAM_GROUP_BYTES 3
+#define STREAM_UNPLACED_MAX 8
+
+struct stream {
+    uint64_t sent;
+    uint64_t next;
+    uint64_t delivered;
+    uint64_t corrupt;
+    uint64_t first_sent;
+    uint64_t last_delivered;
+    uint64_t* origins;
+    size_t origins_size;
+    uint32_t* latencies;
+    size_t latencies_size;
+    bool sorted;
+    /* Bytes received since losing track, until the next group places them */
+    uint8_t unplaced[STREAM_UNPLACED_MAX];
+    unsigned unplaced_count;
+};
+
+static struct stream streams[CONSOLE_NUM_PORTS][2];
+static uint64_t last_activity;
+
+static void* stream_grow(void* data, size_t* size, size_t element, uint64_t needed) {
+    if (needed <= *size) {
+        return data;
+    }
+    size_t grown = (*size < 1024) ? 1024 : *size * 2;
+    while (grown < needed) {
+        grown *= 2;
+    }
+    data = realloc(data, grown * element);
+    if (data == NULL) {
+        sim_fatal("out of memory");
+    }
+    *size = grown;
+    return data;
+}
+
+static uint8_t stream_byte(uint64_t index) {
+    uint32_t group = (uint32_t)(index / STREAM_GROUP_BYTES);
+    switch (index % STREAM_GROUP_BYTES) {
+        case 0: return (uint8_t)(0x80 | ((group >> 14) & 0x7F));
+        case 1: return (uint8_t)((group >> 7) & 0x7F);
+        default: return (uint8_t)(group & 0x7F);
+    }
+}
+
+static struct stream* stream_get(uint8_t port, enum sim_direction dir) {
+    if (port >= CONSOLE_NUM_PORTS) {
+        sim_fatal("no port %u", port);
+    }
+    return &streams[port][dir];
+}
+
+uint8_t sim_stream_next(uint8_t port, enum sim_direction dir, uint64_t origin) {
+    struct stream* s = stream_get(port, dir);
+    s->origins = stream_grow(s->origins, &s->origins_size, sizeof(uint64_t), s->sent + 1);
+    s->origins[s->sent] = origin;
+    if (s->sent == 0) {
+        s->first_sent = origin;
+    }
+    last_activity = sim_now;
+    return stream_byte(s->sent++);
+}
+
+static void stream_deliver(struct stream* s, uint64_t index) {
+    s->latencies = stream_grow(s->latencies, &s->latencies_size, sizeof(uint32_t),
+                               s->delivered + 1);
+    uint64_t origin = s->origins[index];
+    s->latencies[s->delivered++] = (uint32_t)((sim_now > origin) ? sim_now - origin : 0);
+    s->sorted = false;
+    s->last_delivered = sim_now;
+    s->next = index + 1;
+}
+
+/*
+ * Look for a complete group among the unplaced bytes that lies ahead of
+ * where the stream was. The bytes before it are placed against the end
+ * of the previous group where they match, and are corrupt otherwise.
+ */
+static void stream_take(struct stream* s, uint8_t byte);
+
+static void stream_resync(struct stream* s) {
+    for (unsigned h = 0; h + STREAM_GROUP_BYTES <= s->unplaced_count; h++) {
+        const uint8_t* group = &s->unplaced[h];
+        if (!(group[0] & 0x80) || (group[1] & 0x80) || (group[2] & 0x80)) {
+            continue;
+        }
+        uint64_t index = STREAM_GROUP_BYTES * (((uint64_t)(group[0] & 0x7F) << 14)
+                                              | ((uint64_t)group[1] << 7) | group[2]);
+        if (index < s->next || index + STREAM_GROUP_BYTES > s->sent) {
+            continue;
+        }
+        for (unsigned j = 0; j < h; j++) {
+            uint64_t placed = index - (h - j);
+            if (index >= h - j && placed >= s->next && stream_byte(placed) == s->unplaced[j]) {
+                stream_deliver(s, placed);
+            } else {
+                s->corrupt++;
+            }
+        }
+        for (unsigned j = 0; j < STREAM_GROUP_BYTES; j++) {
+            stream_deliver(s, index + j);
+        }
+        unsigned rest = s->unplaced_count - h - STREAM_GROUP_BYTES;
+        uint8_t tail[STREAM_UNPLACED_MAX];
+        memcpy(tail, &s->unplaced[h + STREAM_GROUP_BYTES], rest);
+        s->unplaced_count = 0;
+        for (unsigned j = 0; j < rest; j++) {
+            stream_take(s, tail[j]);
+        }
+        return;
+    }
+    if (s->unplaced_count == STREAM_UNPLACED_MAX) {
+        s->corrupt++;
+        memmove(s->unplaced, &s->unplaced[1], --s->unplaced_count);
+    }
+}
+
+static void stream_take(struct stream* s, uint8_t byte) {
+    if (s->unplaced_count == 0 && s->next < s->sent && byte == stream_byte(s->next)) {
+        stream_deliver(s, s->next);
+        return;
+    }
+    s->unplaced[s->unplaced_count++] = byte;
+    stream_resync(s);
+}
+
+void sim_stream_received(uint8_t port, enum sim_direction dir, uint8_t byte) {
+    last_activity = sim_now;
+    stream_take(stream_get(port, dir), byte);
+}
+
+/* Bytes sent that haven't arrived, or been passed over as lost */
+uint64_t sim_stream_pending(uint8_t port, enum sim_direction dir) {
+    const struct stream* s = stream_get(port, dir);
+    return s->sent - s->next;
+}
+
+bool sim_stream_settled(void) {
+    for (uint8_t port = 0; port < CONSOLE_NUM_PORTS; port++) {
+        if (sim_stream_pending(port, SIM_RX) > 0 || sim_stream_pending(port, SIM_TX) > 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint64_t sim_stream_last_activity(void) {
+    return last_activity;
+}
+
+static int stream_compare(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t stream_percentile(const struct stream* s, unsigned percent) {
+    if (s->delivered == 0) {
+        return 0;
+    }
+    uint64_t rank = (s->delivered * percent + 99) / 100;
+    return (uint32_t)(s->latencies[(rank > 0) ? rank - 1 : 0] / SIM_CYCLES_PER_US);
+}
+
+/* Bytes still unplaced count as corrupt, and anything else missing as lost */
+void sim_stream_get_stats(uint8_t port, enum sim_direction dir,
+                          struct sim_stream_stats* stats) {
+    struct stream* s = stream_get(port, dir);
+    if (!s->sorted) {
+        qsort(s->latencies, s->delivered, sizeof(uint32_t), stream_compare);
+        s->sorted = true;
+    }
+    memset(stats, 0, sizeof(*stats));
+    stats->sent = s->sent;
+    stats->delivered = s->delivered;
+    stats->lost = s->sent - s->delivered;
+    stats->corrupt = s->corrupt + s->unplaced_count;
+    stats->first_sent = s->first_sent;
+    stats->last_delivered = s->last_delivered;
+    stats->latency_p50 = stream_percentile(s, 50);
+    stats->latency_p90 = stream_percentile(s, 90);
+    stats->latency_p99 = stream_percentile(s, 99);
+    stats->latency_max = stream_percentile(s, 100);
+}
@@ -0,0 +1,427 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * General-purpose timers TIM2-TIM4, counting up from the 72 MHz timer
+ * clock or, in external clock mode 1, on another timer's trigger output.
+ * Only the features the firmware uses are modelled: the update event,
+ * one-pulse mode, compare channel 1 and master/slave chaining. Also the
+ * SysTick and DWT cycle counters, which have no register block here.
+ */
+
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/cm3/systick.h>
+#include <libopencm3/stm32/timer.h>
+
+#include "sim.h"
+
+#define TIM_NUM 3
+
+#define TIM_OFFSET_CR1  0x00
+#define TIM_OFFSET_CR2  0x04
+#define TIM_OFFSET_SMCR 0x08
+#define TIM_OFFSET_DIER 0x0C
+#define TIM_OFFSET_SR   0x10
+#define TIM_OFFSET_EGR  0x14
+#define TIM_OFFSET_CNT  0x24
+#define TIM_OFFSET_PSC  0x28
+#define TIM_OFFSET_ARR  0x2C
+#define TIM_OFFSET_CCR1 0x34
+
+struct timer_model {
+    struct sim_block blk;
+    uint32_t regs[0x50 / 4];
+    int irq;
+    uint8_t index;
+    /* The counter was at base_cnt at base_time, counting every psc + 1 cycles */
+    uint64_t base_time;
+    uint32_t base_cnt;
+    uint32_t psc;
+    struct sim_event overflow;
+    struct sim_event compare;
+};
+
+static struct timer_model timers[TIM_NUM];
+static const uint32_t timer_bases[TIM_NUM] = { TIM2, TIM3, TIM4 };
+static const int timer_irqs[TIM_NUM] = { NVIC_TIM2_IRQ, NVIC_TIM3_IRQ, NVIC_TIM4_IRQ };
+
+/* ITR0-3 of each timer, as indices into timers[] or -1 (TIM1 is absent) */
+static const int timer_itr[TIM_NUM][4] = {
+    { -1, -1, 1, 2 },   /* TIM2: TIM1, TIM8, TIM3, TIM4 */
+    { -1, 0, -1, 2 },   /* TIM3: TIM1, TIM2, TIM5, TIM4 */
+    { -1, 0, 1, -1 },   /* TIM4: TIM1, TIM2, TIM3, TIM8 */
+};
+
+#define REG(m, offset) ((m)->regs[(offset) / 4])
+
+static bool timer_running(const struct timer_model* m) {
+    return (REG(m, TIM_OFFSET_CR1) & TIM_CR1_CEN) != 0;
+}
+
+static bool timer_external(const struct timer_model* m) {
+    return (REG(m, TIM_OFFSET_SMCR) & TIM_SMCR_SMS_MASK) == TIM_SMCR_SMS_ECM1;
+}
+
+static bool timer_level(void* arg) {
+    const struct timer_model* m = arg;
+    return (REG(m, TIM_OFFSET_SR) & REG(m, TIM_OFFSET_DIER)
+            & (TIM_SR_UIF | TIM_SR_CC1IF)) != 0;
+}
+
+static void timer_set_flags(struct timer_model* m, uint32_t flags) {
+    sim_reg_set(&m->blk, TIM_OFFSET_SR, REG(m, TIM_OFFSET_SR) | flags);
+    sim_irq_update(m->irq);
+}
+
+/* Bring base_cnt up to now, keeping the prescaler phase */
+static void timer_advance(struct timer_model* m) {
+    if (!timer_running(m) || timer_external(m)) {
+        m->base_time = sim_now;
+        return;
+    }
+    uint64_t ticks = (sim_now - m->base_time) / (m->psc + 1);
+    m->base_cnt = (uint32_t)((m->base_cnt + ticks) & 0xFFFF);
+    m->base_time += ticks * (m->psc + 1);
+    REG(m, TIM_OFFSET_CNT) = m->base_cnt;
+}
+
+/* Time of the tick that takes the counter to target, counting from base */
+static uint64_t timer_time_of(const struct timer_model* m, uint32_t target) {
+    uint32_t ticks = (target - m->base_cnt) & 0xFFFF;
+    if (ticks == 0) {
+        ticks = 0x10000;
+    }
+    return m->base_time + (uint64_t)ticks * (m->psc + 1);
+}
+
+static void timer_schedule(struct timer_model* m) {
+    sim_event_cancel(&m->overflow);
+    sim_event_cancel(&m->compare);
+    if (!timer_running(m) || timer_external(m)) {
+        return;
+    }
+    uint32_t arr = REG(m, TIM_OFFSET_ARR) & 0xFFFF;
+    uint32_t ccr = REG(m, TIM_OFFSET_CCR1) & 0xFFFF;
+    /* Past ARR, the counter runs on to 0xFFFF and wraps without an update */
+    sim_event_at(&m->overflow, timer_time_of(m, m->base_cnt <= arr ? arr + 1 : 0));
+    if (ccr <= arr) {
+        sim_event_at(&m->compare, timer_time_of(m, ccr));
+    }
+}
+
+static void timer_trigger(struct timer_model* master);
+
+/* Update event: reload, flag and pass it on to slaves */
+static void timer_update(struct timer_model* m, bool flag) {
+    m->psc = REG(m, TIM_OFFSET_PSC) & 0xFFFF;
+    if (flag) {
+        timer_set_flags(m, TIM_SR_UIF);
+    }
+    if ((REG(m, TIM_OFFSET_CR2) & TIM_CR2_MMS_MASK) == TIM_CR2_MMS_UPDATE) {
+        timer_trigger(m);
+    }
+}
+
+static void timer_overflow(struct timer_model* m) {
+    uint32_t arr = REG(m, TIM_OFFSET_ARR) & 0xFFFF;
+    bool update = m->base_cnt <= arr || timer_external(m);
+    m->base_cnt = 0;
+    REG(m, TIM_OFFSET_CNT) = 0;
+    if (!update) {
+        return;
+    }
+    if (REG(m, TIM_OFFSET_CR1) & TIM_CR1_OPM) {
+        sim_reg_set(&m->blk, TIM_OFFSET_CR1, REG(m, TIM_OFFSET_CR1) & ~TIM_CR1_CEN);
+    }
+    timer_update(m, true);
+}
+
+static void timer_overflow_event(void* arg) {
+    struct timer_model* m = arg;
+    m->base_time = sim_now;
+    timer_overflow(m);
+    timer_schedule(m);
+}
+
+static void timer_compare_event(void* arg) {
+    struct timer_model* m = arg;
+    timer_advance(m);
+    timer_set_flags(m, TIM_SR_CC1IF);
+    timer_schedule(m);
+}
+
+/* TRGO of master: a clock edge for every slave in external clock mode */
+static void timer_trigger(struct timer_model* master) {
+    for (unsigned i = 0; i < TIM_NUM; i++) {
+        struct timer_model* m = &timers[i];
+        unsigned ts = (REG(m, TIM_OFFSET_SMCR) & TIM_SMCR_TS_MASK) >> 4;
+        if (!timer_external(m) || !timer_running(m) || ts > 3
+            || timer_itr[i][ts] != master->index) {
+            continue;
+        }
+        uint32_t cnt = REG(m, TIM_OFFSET_CNT) & 0xFFFF;
+        if (cnt == (REG(m, TIM_OFFSET_ARR) & 0xFFFF)) {
+            timer_overflow(m);
+        } else {
+            m->base_cnt = (cnt + 1) & 0xFFFF;
+            REG(m, TIM_OFFSET_CNT) = m->base_cnt;
+            if (m->base_cnt == (REG(m, TIM_OFFSET_CCR1) & 0xFFFF)) {
+                timer_set_flags(m, TIM_SR_CC1IF);
+            }
+        }
+    }
+}
+
+static void timer_access(struct sim_block* blk, uint32_t offset) {
+    if (offset == TIM_OFFSET_CNT) {
+        timer_advance(blk->model);
+    }
+}
+
+static void timer_write(struct sim_block* blk, uint32_t offset, uint32_t old) {
+    struct timer_model* m = blk->model;
+    uint32_t value = SIM_REG(blk, offset);
+
+    switch (offset) {
+        case TIM_OFFSET_CR1:
+            if ((old ^ value) & TIM_CR1_CEN) {
+                if (value & TIM_CR1_CEN) {
+                    m->base_cnt = REG(m, TIM_OFFSET_CNT) & 0xFFFF;
+                    m->base_time = sim_now;
+                } else {
+                    /* Freeze the count as of the old running state */
+                    REG(m, TIM_OFFSET_CR1) = old;
+                    timer_advance(m);
+                    REG(m, TIM_OFFSET_CR1) = value;
+                }
+            }
+            break;
+        case TIM_OFFSET_CNT:
+            m->base_cnt = value & 0xFFFF;
+            m->base_time = sim_now;
+            break;
+        case TIM_OFFSET_SR:
+            /* Flags are cleared by writing zeros */
+            sim_reg_set(blk, offset, old & value);
+            break;
+        case TIM_OFFSET_EGR:
+            if (value & TIM_EGR_UG) {
+                m->base_cnt = 0;
+                m->base_time = sim_now;
+                REG(m, TIM_OFFSET_CNT) = 0;
+                timer_update(m, !(REG(m, TIM_OFFSET_CR1) & TIM_CR1_URS));
+            }
+            if (value & TIM_EGR_CC1G) {
+                timer_set_flags(m, TIM_SR_CC1IF);
+            }
+            sim_reg_set(blk, offset, 0);
+            break;
+        default:
+            break;
+    }
+    timer_advance(m);
+    timer_schedule(m);
+    sim_irq_update(m->irq);
+}
+
+void sim_timer_init(void) {
+    for (unsigned i = 0; i < TIM_NUM; i++) {
+        struct timer_model* m = &timers[i];
+        m->index = (uint8_t)i;
+        m->irq = timer_irqs[i];
+        REG(m, TIM_OFFSET_ARR) = 0xFFFF;
+        m->blk.base = timer_bases[i];
+        m->blk.size = sizeof(m->regs);
+        m->blk.regs = m->regs;
+        m->blk.model = m;
+        m->blk.access = timer_access;
+        m->blk.write = timer_write;
+        sim_block_add(&m->blk);
+        sim_event_init(&m->overflow, timer_overflow_event, m);
+        sim_event_init(&m->compare, timer_compare_event, m);
+        sim_irq_connect(m->irq, timer_level, m);
+    }
+}
+
+void timer_set_mode(uint32_t timer, uint32_t clock_div, uint32_t alignment,
+                    uint32_t direction) {
+    uint32_t cr1 = TIM_CR1(timer);
+    cr1 &= ~(TIM_CR1_CKD_CK_INT_MASK | TIM_CR1_CMS_MASK | TIM_CR1_DIR_DOWN);
+    cr1 |= clock_div | alignment | direction;
+    TIM_CR1(timer) = cr1;
+}
+
+void timer_enable_counter(uint32_t timer) {
+    TIM_CR1(timer) |= TIM_CR1_CEN;
+}
+
+void timer_disable_counter(uint32_t timer) {
+    TIM_CR1(timer) &= ~TIM_CR1_CEN;
+}
+
+void timer_one_shot_mode(uint32_t timer) {
+    TIM_CR1(timer) |= TIM_CR1_OPM;
+}
+
+void timer_continuous_mode(uint32_t timer) {
+    TIM_CR1(timer) &= ~TIM_CR1_OPM;
+}
+
+void timer_update_on_any(uint32_t timer) {
+    TIM_CR1(timer) &= ~TIM_CR1_URS;
+}
+
+void timer_update_on_overflow(uint32_t timer) {
+    TIM_CR1(timer) |= TIM_CR1_URS;
+}
+
+void timer_set_prescaler(uint32_t timer, uint32_t value) {
+    TIM_PSC(timer) = value;
+}
+
+void timer_set_period(uint32_t timer, uint32_t period) {
+    TIM_ARR(timer) = period;
+}
+
+void timer_set_counter(uint32_t timer, uint32_t count) {
+    TIM_CNT(timer) = count;
+}
+
+uint32_t timer_get_counter(uint32_t timer) {
+    return TIM_CNT(timer);
+}
+
+void timer_generate_event(uint32_t timer, uint32_t event) {
+    TIM_EGR(timer) |= event;
+}
+
+void timer_set_master_mode(uint32_t timer, uint32_t mode) {
+    TIM_CR2(timer) = (TIM_CR2(timer) & ~TIM_CR2_MMS_MASK) | mode;
+}
+
+void timer_slave_set_mode(uint32_t timer, uint8_t mode) {
+    TIM_SMCR(timer) = (TIM_SMCR(timer) & ~TIM_SMCR_SMS_MASK) | mode;
+}
+
+void timer_slave_set_trigger(uint32_t timer, uint8_t trigger) {
+    TIM_SMCR(timer) = (TIM_SMCR(timer) & ~TIM_SMCR_TS_MASK) | trigger;
+}
+
+void timer_enable_irq(uint32_t timer, uint32_t irq) {
+    TIM_DIER(timer) |= irq;
+}
+
+void timer_disable_irq(uint32_t timer, uint32_t irq) {
+    TIM_DIER(timer) &= ~irq;
+}
+
+bool timer_get_flag(uint32_t timer, uint32_t flag) {
+    return (TIM_SR(timer) & flag) != 0;
+}
+
+void timer_clear_flag(uint32_t timer, uint32_t flag) {
+    TIM_SR(timer) = ~flag;
+}
+
+void timer_set_oc_value(uint32_t timer, enum tim_oc_id oc_id, uint32_t value) {
+    switch (oc_id) {
+        case TIM_OC1: TIM_CCR1(timer) = value; break;
+        case TIM_OC2: TIM_CCR2(timer) = value; break;
+        case TIM_OC3: TIM_CCR3(timer) = value; break;
+        case TIM_OC4: TIM_CCR4(timer) = value; break;
+    }
+}
+
+/*
+ * SysTick, counting down from the reload value on the core clock or
+ * HCLK/8. Only the counter is modelled; the firmware no longer takes
+ * its interrupt.
+ */
+static struct {
+    uint32_t reload;
+    bool enabled;
+    bool div8;
+    uint64_t base_time;
+} systick;
+
+static uint32_t systick_ticks(void) {
+    uint64_t cycles = sim_now - systick.base_time;
+    return (uint32_t)((systick.div8 ? cycles / 8 : cycles) % ((uint64_t)systick.reload + 1));
+}
+
+void systick_set_reload(uint32_t value) {
+    sim_spend(SIM_ACCESS_CYCLES);
+    systick.reload = value & STK_RVR_RELOAD;
+}
+
+uint32_t systick_get_reload(void) {
+    sim_spend(SIM_ACCESS_CYCLES);
+    return systick.reload;
+}
+
+uint32_t systick_get_value(void) {
+    sim_spend(SIM_ACCESS_CYCLES);
+    if (!systick.enabled) {
+        return 0;
+    }
+    uint32_t ticks = systick_ticks();
+    return ticks == 0 ? 0 : systick.reload + 1 - ticks;
+}
+
+void systick_set_clocksource(uint8_t clocksource) {
+    sim_spend(SIM_ACCESS_CYCLES);
+    systick.div8 = (clocksource == STK_CSR_CLKSOURCE_AHB_DIV8);
+}
+
+void systick_interrupt_enable(void) {
+    sim_fatal("the SysTick interrupt is not modelled");
+}
+
+void systick_interrupt_disable(void) {
+    sim_spend(SIM_ACCESS_CYCLES);
+}
+
+void systick_counter_enable(void) {
+    sim_spend(SIM_ACCESS_CYCLES);
+    systick.enabled = true;
+    systick.base_time = sim_now;
+}
+
+void systick_counter_disable(void) {
+    sim_spend(SIM_ACCESS_CYCLES);
+    systick.enabled = false;
+}
+
+uint8_t systick_get_countflag(void) {
+    sim_spend(SIM_ACCESS_CYCLES);
+    return systick.enabled && sim_now - systick.base_time > systick.reload;
+}
+
+void systick_clear(void) {
+    sim_spend(SIM_ACCESS_CYCLES);
+    systick.base_time = sim_now;
+}
+
+bool dwt_enable_cycle_counter(void) {
+    return true;
+}
+
+uint32_t dwt_read_cycle_counter(void) {
+    sim_spend(SIM_ACCESS_CYCLES);
+    return (uint32_t)sim_now;
+}
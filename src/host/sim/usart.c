@@ -0,0 +1,509 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * USART1-3 with the F1's status flags, clear sequences and frame timing.
+ * Each USART is one end of a serial line; frames take the time set by
+ * BRR and the format, and reach the other end when their stop bits do.
+ */
+
+#include <stddef.h>
+
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/usart.h>
+
+#include "sim.h"
+
+#define USART_NUM 3
+
+#define USART_OFFSET_SR  0x00
+#define USART_OFFSET_DR  0x04
+#define USART_OFFSET_BRR 0x08
+#define USART_OFFSET_CR1 0x0C
+#define USART_OFFSET_CR2 0x10
+#define USART_OFFSET_CR3 0x14
+
+/* Reserved bit presented in DR, so every CPU write to it shows */
+#define USART_DR_PRESENT 0x80000000U
+
+/* Status bits cleared by writing zero; the rest are read-only */
+#define USART_SR_RC_W0 (USART_SR_CTS | USART_SR_LBD | USART_SR_TC | USART_SR_RXNE)
+#define USART_SR_ERRORS (USART_SR_IDLE | USART_SR_ORE | USART_SR_NE | USART_SR_FE | USART_SR_PE)
+
+/* Largest baud rate mismatch a receiver still samples correctly, in percent */
+#define SIM_BAUD_TOLERANCE 3
+
+struct usart_model {
+    struct sim_serial serial;
+    struct sim_block blk;
+    uint32_t regs[7];
+    uint32_t base;
+    int irq;
+    uint8_t tx_dma;
+    uint8_t rx_dma;
+    uint16_t rdr;
+    uint16_t tdr;
+    bool shifting;
+    bool clear_armed;
+    struct sim_frame frame;
+    struct sim_event tx_done;
+    struct sim_event idle;
+};
+
+static struct usart_model usarts[USART_NUM];
+
+static const struct {
+    uint32_t base;
+    int irq;
+    uint8_t tx_dma;
+    uint8_t rx_dma;
+} usart_hw[USART_NUM] = {
+    { USART1, NVIC_USART1_IRQ, 4, 5 },
+    { USART2, NVIC_USART2_IRQ, 7, 6 },
+    { USART3, NVIC_USART3_IRQ, 2, 3 },
+};
+
+#define REG(m, offset) ((m)->regs[(offset) / 4])
+
+uint64_t sim_frame_cycles(uint32_t baud, uint8_t field_bits, uint8_t stop_halves) {
+    return ((uint64_t)SIM_CORE_HZ * (2 * (1 + field_bits) + stop_halves)) / (2 * (uint64_t)baud);
+}
+
+uint16_t sim_parity_field(uint16_t data, uint8_t data_bits, char parity) {
+    data &= (uint16_t)((1U << data_bits) - 1);
+    if (parity == 'N') {
+        return data;
+    }
+    unsigned ones = (unsigned)__builtin_popcount(data);
+    bool bit = (parity == 'E') ? (ones & 1) : !(ones & 1);
+    return (uint16_t)(data | (bit << data_bits));
+}
+
+bool sim_parity_ok(uint16_t field, uint8_t field_bits, char parity) {
+    if (parity == 'N') {
+        return true;
+    }
+    unsigned ones = (unsigned)__builtin_popcount(field & ((1U << field_bits) - 1));
+    return (parity == 'E') ? !(ones & 1) : (ones & 1);
+}
+
+/*
+ * Sample a frame with a receiver's settings; returns false on a framing
+ * error. Mismatched rates or sizes put the stop bit sample somewhere in
+ * the frame, which is counted as a framing error with garbled data.
+ */
+bool sim_frame_receive(const struct sim_frame* frame, uint32_t baud,
+                       uint8_t field_bits, uint16_t* field) {
+    if (frame->brk) {
+        *field = 0;
+        return false;
+    }
+    uint64_t diff = (frame->baud > baud) ? frame->baud - baud : baud - frame->baud;
+    if (diff * 100 > (uint64_t)baud * SIM_BAUD_TOLERANCE || frame->field_bits != field_bits) {
+        *field = (uint16_t)((frame->field * 0x9E37U) & ((1U << field_bits) - 1));
+        return false;
+    }
+    *field = frame->field;
+    return true;
+}
+
+static uint32_t usart_pclk(const struct usart_model* m) {
+    return (m->base == USART1) ? rcc_apb2_frequency : rcc_apb1_frequency;
+}
+
+static uint8_t usart_field_bits(const struct usart_model* m) {
+    return (REG(m, USART_OFFSET_CR1) & USART_CR1_M) ? 9 : 8;
+}
+
+static uint8_t usart_stop_halves(const struct usart_model* m) {
+    static const uint8_t halves[4] = { 2, 1, 4, 3 };
+    return halves[(REG(m, USART_OFFSET_CR2) & USART_CR2_STOPBITS_MASK) >> 12];
+}
+
+static char usart_parity(const struct usart_model* m) {
+    uint32_t cr1 = REG(m, USART_OFFSET_CR1);
+    if (!(cr1 & USART_CR1_PCE)) {
+        return 'N';
+    }
+    return (cr1 & USART_CR1_PS) ? 'O' : 'E';
+}
+
+static uint32_t usart_baud(const struct usart_model* m) {
+    uint32_t brr = REG(m, USART_OFFSET_BRR) & 0xFFFF;
+    return brr ? usart_pclk(m) / brr : 1;
+}
+
+/* One frame in core cycles, from BRR without rounding through the baud rate */
+static uint64_t usart_frame_cycles(const struct usart_model* m) {
+    uint64_t bit = (uint64_t)(REG(m, USART_OFFSET_BRR) & 0xFFFF) * SIM_CORE_HZ;
+    return bit * (2 * (1 + usart_field_bits(m)) + usart_stop_halves(m))
+           / (2 * (uint64_t)usart_pclk(m));
+}
+
+static bool usart_enabled(const struct usart_model* m, uint32_t mode) {
+    uint32_t cr1 = REG(m, USART_OFFSET_CR1);
+    return (cr1 & USART_CR1_UE) && (cr1 & mode);
+}
+
+static bool usart_level(void* arg) {
+    const struct usart_model* m = arg;
+    uint32_t sr = REG(m, USART_OFFSET_SR);
+    uint32_t cr1 = REG(m, USART_OFFSET_CR1);
+    uint32_t cr2 = REG(m, USART_OFFSET_CR2);
+    uint32_t cr3 = REG(m, USART_OFFSET_CR3);
+    return ((cr1 & USART_CR1_TXEIE) && (sr & USART_SR_TXE))
+           || ((cr1 & USART_CR1_TCIE) && (sr & USART_SR_TC))
+           || ((cr1 & USART_CR1_RXNEIE) && (sr & (USART_SR_RXNE | USART_SR_ORE)))
+           || ((cr1 & USART_CR1_IDLEIE) && (sr & USART_SR_IDLE))
+           || ((cr1 & USART_CR1_PEIE) && (sr & USART_SR_PE))
+           || ((cr2 & USART_CR2_LBDIE) && (sr & USART_SR_LBD))
+           || ((cr3 & USART_CR3_EIE) && (cr3 & USART_CR3_DMAR)
+               && (sr & (USART_SR_FE | USART_SR_ORE | USART_SR_NE)));
+}
+
+static void usart_set_sr(struct usart_model* m, uint32_t set, uint32_t clear) {
+    sim_reg_set(&m->blk, USART_OFFSET_SR, (REG(m, USART_OFFSET_SR) & ~clear) | set);
+    sim_irq_update(m->irq);
+}
+
+static bool usart_tx_request(void* arg) {
+    const struct usart_model* m = arg;
+    return (REG(m, USART_OFFSET_CR3) & USART_CR3_DMAT)
+           && (REG(m, USART_OFFSET_SR) & USART_SR_TXE)
+           && usart_enabled(m, USART_CR1_TE);
+}
+
+static bool usart_rx_request(void* arg) {
+    const struct usart_model* m = arg;
+    return (REG(m, USART_OFFSET_CR3) & USART_CR3_DMAR)
+           && (REG(m, USART_OFFSET_SR) & USART_SR_RXNE);
+}
+
+static struct sim_serial* usart_tx_target(struct usart_model* m) {
+    /* Half-duplex mode shares the TX pin with the receiver */
+    return (REG(m, USART_OFFSET_CR3) & USART_CR3_HDSEL) ? &m->serial : m->serial.peer;
+}
+
+/* Move the TDR into the shift register and start the frame */
+static void usart_tx_start(struct usart_model* m) {
+    uint8_t field_bits = usart_field_bits(m);
+    char parity = usart_parity(m);
+    uint16_t data = m->tdr;
+    m->frame.field = (parity == 'N') ? (uint16_t)(data & ((1U << field_bits) - 1))
+                                     : sim_parity_field(data, field_bits - 1, parity);
+    m->frame.field_bits = field_bits;
+    m->frame.stop_halves = usart_stop_halves(m);
+    m->frame.baud = usart_baud(m);
+    m->frame.brk = false;
+    m->shifting = true;
+
+    struct sim_serial* target = usart_tx_target(m);
+    if (target != NULL) {
+        target->rx_begin(target);
+    }
+    sim_event_after(&m->tx_done, usart_frame_cycles(m));
+    usart_set_sr(m, USART_SR_TXE, USART_SR_TC);
+    sim_dma_kick(m->tx_dma);
+}
+
+static void usart_tx_done(void* arg) {
+    struct usart_model* m = arg;
+    struct sim_serial* target = usart_tx_target(m);
+    m->shifting = false;
+    if (target != NULL) {
+        target->rx_frame(target, &m->frame);
+    }
+    if (!(REG(m, USART_OFFSET_SR) & USART_SR_TXE) && usart_enabled(m, USART_CR1_TE)) {
+        usart_tx_start(m);
+    } else {
+        usart_set_sr(m, USART_SR_TC, 0);
+    }
+}
+
+static void usart_tx_write(struct usart_model* m, uint32_t value) {
+    if (!usart_enabled(m, USART_CR1_TE)) {
+        return;
+    }
+    m->tdr = (uint16_t)(value & USART_DR_MASK);
+    usart_set_sr(m, 0, USART_SR_TXE | USART_SR_TC);
+    if (!m->shifting) {
+        usart_tx_start(m);
+    }
+}
+
+/* Reading DR takes the byte, and completes the clear sequence for the errors */
+static uint16_t usart_rx_read(struct usart_model* m) {
+    uint32_t clear = USART_SR_RXNE;
+    if (m->clear_armed) {
+        clear |= USART_SR_ERRORS;
+        m->clear_armed = false;
+    }
+    usart_set_sr(m, 0, clear);
+    return m->rdr;
+}
+
+static void usart_rx_begin(struct sim_serial* self) {
+    struct usart_model* m = (struct usart_model*)self;
+    sim_event_cancel(&m->idle);
+}
+
+static void usart_rx_frame(struct sim_serial* self, const struct sim_frame* frame) {
+    struct usart_model* m = (struct usart_model*)self;
+    if (!usart_enabled(m, USART_CR1_RE)) {
+        return;
+    }
+
+    uint8_t field_bits = usart_field_bits(m);
+    uint16_t field;
+    uint32_t flags = 0;
+    if (!sim_frame_receive(frame, usart_baud(m), field_bits, &field)) {
+        flags |= USART_SR_FE;
+        if (frame->brk && (REG(m, USART_OFFSET_CR2) & USART_CR2_LINEN)) {
+            flags |= USART_SR_LBD;
+        }
+    }
+    if (!sim_parity_ok(field, field_bits, usart_parity(m))) {
+        flags |= USART_SR_PE;
+    }
+
+    if (REG(m, USART_OFFSET_SR) & USART_SR_RXNE) {
+        /* The byte in DR is kept and this one is lost */
+        flags = USART_SR_ORE;
+    } else {
+        m->rdr = field;
+        flags |= USART_SR_RXNE;
+    }
+    usart_set_sr(m, flags, 0);
+    sim_event_after(&m->idle, usart_frame_cycles(m));
+    sim_dma_kick(m->rx_dma);
+}
+
+static void usart_idle(void* arg) {
+    struct usart_model* m = arg;
+    if (usart_enabled(m, USART_CR1_RE)) {
+        usart_set_sr(m, USART_SR_IDLE, 0);
+    }
+}
+
+static void usart_access(struct sim_block* blk, uint32_t offset) {
+    struct usart_model* m = blk->model;
+    if (offset == USART_OFFSET_SR) {
+        m->clear_armed = true;
+    } else if (offset == USART_OFFSET_DR) {
+        sim_reg_set(blk, offset, m->rdr | USART_DR_PRESENT);
+    }
+}
+
+static void usart_read(struct sim_block* blk, uint32_t offset) {
+    if (offset == USART_OFFSET_DR) {
+        usart_rx_read(blk->model);
+    }
+}
+
+static void usart_write(struct sim_block* blk, uint32_t offset, uint32_t old) {
+    struct usart_model* m = blk->model;
+    uint32_t value = SIM_REG(blk, offset);
+
+    switch (offset) {
+        case USART_OFFSET_SR:
+            sim_reg_set(blk, offset, old & (value | ~USART_SR_RC_W0));
+            break;
+        case USART_OFFSET_DR:
+            sim_reg_set(blk, offset, old);
+            usart_tx_write(m, value);
+            break;
+        case USART_OFFSET_CR1:
+            if ((value & USART_CR1_UE) && !(old & USART_CR1_UE)) {
+                m->clear_armed = false;
+            }
+            break;
+        default:
+            break;
+    }
+    sim_irq_update(m->irq);
+    sim_dma_kick(m->tx_dma);
+    sim_dma_kick(m->rx_dma);
+}
+
+static uint32_t usart_dma_read(struct sim_block* blk, uint32_t offset) {
+    if (offset != USART_OFFSET_DR) {
+        sim_fatal("DMA read from USART register 0x%02x", offset);
+    }
+    return usart_rx_read(blk->model);
+}
+
+static void usart_dma_write(struct sim_block* blk, uint32_t offset, uint32_t value) {
+    if (offset != USART_OFFSET_DR) {
+        sim_fatal("DMA write to USART register 0x%02x", offset);
+    }
+    usart_tx_write(blk->model, value);
+}
+
+void sim_usart_init(void) {
+    for (unsigned i = 0; i < USART_NUM; i++) {
+        struct usart_model* m = &usarts[i];
+        m->base = usart_hw[i].base;
+        m->irq = usart_hw[i].irq;
+        m->tx_dma = usart_hw[i].tx_dma;
+        m->rx_dma = usart_hw[i].rx_dma;
+        REG(m, USART_OFFSET_SR) = USART_SR_TXE | USART_SR_TC;
+        m->serial.rx_begin = usart_rx_begin;
+        m->serial.rx_frame = usart_rx_frame;
+        m->blk.base = m->base;
+        m->blk.size = sizeof(m->regs);
+        m->blk.regs = m->regs;
+        m->blk.model = m;
+        m->blk.access = usart_access;
+        m->blk.read = usart_read;
+        m->blk.write = usart_write;
+        m->blk.dma_read = usart_dma_read;
+        m->blk.dma_write = usart_dma_write;
+        sim_block_add(&m->blk);
+        sim_event_init(&m->tx_done, usart_tx_done, m);
+        sim_event_init(&m->idle, usart_idle, m);
+        sim_irq_connect(m->irq, usart_level, m);
+        sim_dma_connect(m->tx_dma, usart_tx_request, m);
+        sim_dma_connect(m->rx_dma, usart_rx_request, m);
+    }
+}
+
+struct sim_serial* sim_usart_serial(uint32_t usart) {
+    for (unsigned i = 0; i < USART_NUM; i++) {
+        if (usarts[i].base == usart) {
+            return &usarts[i].serial;
+        }
+    }
+    sim_fatal("no such USART 0x%08x", usart);
+}
+
+void usart_set_baudrate(uint32_t usart, uint32_t baud) {
+    uint32_t clock = (usart == USART1) ? rcc_apb2_frequency : rcc_apb1_frequency;
+    USART_BRR(usart) = ((2 * clock) + baud) / (2 * baud);
+}
+
+void usart_set_databits(uint32_t usart, uint32_t bits) {
+    if (bits == 8) {
+        USART_CR1(usart) &= ~USART_CR1_M;
+    } else {
+        USART_CR1(usart) |= USART_CR1_M;
+    }
+}
+
+void usart_set_stopbits(uint32_t usart, uint32_t stopbits) {
+    USART_CR2(usart) = (USART_CR2(usart) & ~USART_CR2_STOPBITS_MASK) | stopbits;
+}
+
+void usart_set_parity(uint32_t usart, uint32_t parity) {
+    USART_CR1(usart) = (USART_CR1(usart) & ~(USART_CR1_PS | USART_CR1_PCE)) | parity;
+}
+
+void usart_set_mode(uint32_t usart, uint32_t mode) {
+    USART_CR1(usart) = (USART_CR1(usart) & ~(USART_CR1_RE | USART_CR1_TE)) | mode;
+}
+
+void usart_set_flow_control(uint32_t usart, uint32_t flowcontrol) {
+    USART_CR3(usart) = (USART_CR3(usart) & ~(USART_CR3_RTSE | USART_CR3_CTSE)) | flowcontrol;
+}
+
+void usart_enable(uint32_t usart) {
+    USART_CR1(usart) |= USART_CR1_UE;
+}
+
+void usart_disable(uint32_t usart) {
+    USART_CR1(usart) &= ~USART_CR1_UE;
+}
+
+void usart_send(uint32_t usart, uint16_t data) {
+    USART_DR(usart) = (data & USART_DR_MASK);
+}
+
+uint16_t usart_recv(uint32_t usart) {
+    return USART_DR(usart) & USART_DR_MASK;
+}
+
+void usart_wait_send_ready(uint32_t usart) {
+    while ((USART_SR(usart) & USART_SR_TXE) == 0);
+}
+
+void usart_wait_recv_ready(uint32_t usart) {
+    while ((USART_SR(usart) & USART_SR_RXNE) == 0);
+}
+
+void usart_send_blocking(uint32_t usart, uint16_t data) {
+    usart_wait_send_ready(usart);
+    usart_send(usart, data);
+}
+
+uint16_t usart_recv_blocking(uint32_t usart) {
+    usart_wait_recv_ready(usart);
+    return usart_recv(usart);
+}
+
+void usart_enable_rx_dma(uint32_t usart) {
+    USART_CR3(usart) |= USART_CR3_DMAR;
+}
+
+void usart_disable_rx_dma(uint32_t usart) {
+    USART_CR3(usart) &= ~USART_CR3_DMAR;
+}
+
+void usart_enable_tx_dma(uint32_t usart) {
+    USART_CR3(usart) |= USART_CR3_DMAT;
+}
+
+void usart_disable_tx_dma(uint32_t usart) {
+    USART_CR3(usart) &= ~USART_CR3_DMAT;
+}
+
+void usart_enable_rx_interrupt(uint32_t usart) {
+    USART_CR1(usart) |= USART_CR1_RXNEIE;
+}
+
+void usart_disable_rx_interrupt(uint32_t usart) {
+    USART_CR1(usart) &= ~USART_CR1_RXNEIE;
+}
+
+void usart_enable_tx_interrupt(uint32_t usart) {
+    USART_CR1(usart) |= USART_CR1_TXEIE;
+}
+
+void usart_disable_tx_interrupt(uint32_t usart) {
+    USART_CR1(usart) &= ~USART_CR1_TXEIE;
+}
+
+void usart_enable_error_interrupt(uint32_t usart) {
+    USART_CR3(usart) |= USART_CR3_EIE;
+}
+
+void usart_disable_error_interrupt(uint32_t usart) {
+    USART_CR3(usart) &= ~USART_CR3_EIE;
+}
+
+bool usart_get_flag(uint32_t usart, uint32_t flag) {
+    return ((USART_SR(usart) & flag) != 0);
+}
+
+bool usart_get_interrupt_source(uint32_t usart, uint32_t flag) {
+    uint32_t flag_set = (USART_SR(usart) & flag);
+    if ((flag >= USART_SR_IDLE) && (flag <= USART_SR_TXE)) {
+        return ((flag_set & USART_CR1(usart)) != 0);
+    } else if (flag == USART_SR_ORE) {
+        return flag_set && (USART_CR1(usart) & USART_CR1_RXNEIE);
+    }
+    return false;
+}
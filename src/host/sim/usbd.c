@@ -0,0 +1,455 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The libopencm3 device stack over a model of the F1's USB peripheral.
+ * Endpoint buffers and status follow st_usbfs: an endpoint is VALID for
+ * the host to use or NAKs, and completed transactions set CTR, which is
+ * serviced one endpoint at a time from usbd_poll(). Control transfers are
+ * handled whole, as one transaction on endpoint 0, and only the standard
+ * requests the host model sends are implemented.
+ */
+
+#include <string.h>
+
+#include <libopencm3/stm32/st_usbfs.h>
+#include <libopencm3/usb/usbd.h>
+
+#include "sim.h"
+
+#define USBD_NUM_ENDPOINTS 8
+#define USBD_MAX_PACKET 64
+#define USBD_MAX_CONTROL_CALLBACKS 4
+#define USBD_MAX_SET_CONFIG_CALLBACKS 4
+
+/* PMA copies go through 16-bit accesses, plus the endpoint register updates */
+#define USBD_PACKET_CYCLES(len) (4 * SIM_ACCESS_CYCLES + (len) * SIM_COPY_CYCLES_PER_BYTE)
+
+struct usbd_endpoint {
+    uint16_t max_size[2];
+    usbd_endpoint_callback callback[2];
+    bool stalled[2];
+
+    /* IN: a packet queued for the host */
+    bool tx_valid;
+    bool tx_ctr;
+    uint16_t tx_len;
+    uint8_t tx_buf[USBD_MAX_PACKET];
+
+    /* OUT: VALID when the buffer is free for the host to fill */
+    bool rx_valid;
+    bool rx_ctr;
+    bool rx_force_nak;
+    uint16_t rx_len;
+    uint8_t rx_buf[USBD_MAX_PACKET];
+};
+
+struct _usbd_driver {
+    int unused;
+};
+
+const struct _usbd_driver st_usbfs_v1_usb_driver = { 0 };
+
+struct _usbd_device {
+    const struct usb_device_descriptor* desc;
+    const struct usb_config_descriptor* config;
+    uint8_t* control_buffer;
+    uint16_t control_buffer_size;
+    uint16_t current_config;
+
+    void (*reset_callback)(void);
+    void (*suspend_callback)(void);
+    void (*resume_callback)(void);
+    void (*sof_callback)(void);
+    struct {
+        uint8_t type;
+        uint8_t type_mask;
+        usbd_control_callback callback;
+    } control[USBD_MAX_CONTROL_CALLBACKS];
+    usbd_set_config_callback set_config[USBD_MAX_SET_CONFIG_CALLBACKS];
+};
+
+static struct _usbd_device device;
+static struct usbd_endpoint endpoints[USBD_NUM_ENDPOINTS];
+
+static bool reset_pending;
+static bool sof_pending;
+
+static struct {
+    bool pending;
+    struct usb_setup_data req;
+    uint8_t data[256];
+    void (*done)(bool ok, const uint8_t* data, uint16_t len);
+} control;
+
+enum { EP_OUT = 0, EP_IN = 1 };
+
+#define EP_NUM(addr) ((addr) & 0x7F)
+#define EP_DIR(addr) (((addr) & 0x80) ? EP_IN : EP_OUT)
+
+static bool usbd_level(void* arg) {
+    (void)arg;
+    if (reset_pending || control.pending || (sof_pending && device.sof_callback != NULL)) {
+        return true;
+    }
+    for (unsigned i = 0; i < USBD_NUM_ENDPOINTS; i++) {
+        if (endpoints[i].tx_ctr || endpoints[i].rx_ctr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void usbd_update(void) {
+    sim_irq_update(NVIC_USB_LP_CAN_RX0_IRQ);
+}
+
+usbd_device* usbd_init(const usbd_driver* driver,
+                       const struct usb_device_descriptor* dev,
+                       const struct usb_config_descriptor* conf,
+                       const char* const* strings, int num_strings,
+                       uint8_t* control_buffer, uint16_t control_buffer_size) {
+    (void)driver;
+    (void)strings;
+    (void)num_strings;
+    memset(&device, 0, sizeof(device));
+    device.desc = dev;
+    device.config = conf;
+    device.control_buffer = control_buffer;
+    device.control_buffer_size = control_buffer_size;
+    sim_irq_connect(NVIC_USB_LP_CAN_RX0_IRQ, usbd_level, NULL);
+    sim_host_attach();
+    return &device;
+}
+
+void usbd_register_reset_callback(usbd_device* usbd_dev, void (*callback)(void)) {
+    usbd_dev->reset_callback = callback;
+}
+
+void usbd_register_suspend_callback(usbd_device* usbd_dev, void (*callback)(void)) {
+    usbd_dev->suspend_callback = callback;
+}
+
+void usbd_register_resume_callback(usbd_device* usbd_dev, void (*callback)(void)) {
+    usbd_dev->resume_callback = callback;
+}
+
+void usbd_register_sof_callback(usbd_device* usbd_dev, void (*callback)(void)) {
+    usbd_dev->sof_callback = callback;
+}
+
+int usbd_register_control_callback(usbd_device* usbd_dev, uint8_t type,
+                                   uint8_t type_mask, usbd_control_callback callback) {
+    for (unsigned i = 0; i < USBD_MAX_CONTROL_CALLBACKS; i++) {
+        if (usbd_dev->control[i].callback == NULL) {
+            usbd_dev->control[i].type = type;
+            usbd_dev->control[i].type_mask = type_mask;
+            usbd_dev->control[i].callback = callback;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int usbd_register_set_config_callback(usbd_device* usbd_dev,
+                                      usbd_set_config_callback callback) {
+    for (unsigned i = 0; i < USBD_MAX_SET_CONFIG_CALLBACKS; i++) {
+        if (usbd_dev->set_config[i] == callback) {
+            return 0;
+        } else if (usbd_dev->set_config[i] == NULL) {
+            usbd_dev->set_config[i] = callback;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void usbd_disconnect(usbd_device* usbd_dev, bool disconnected) {
+    (void)usbd_dev;
+    (void)disconnected;
+}
+
+void usbd_ep_setup(usbd_device* usbd_dev, uint8_t addr, uint8_t type,
+                   uint16_t max_size, usbd_endpoint_callback callback) {
+    (void)usbd_dev;
+    (void)type;
+    struct usbd_endpoint* ep = &endpoints[EP_NUM(addr)];
+    uint8_t dir = EP_DIR(addr);
+    sim_spend(4 * SIM_ACCESS_CYCLES);
+    ep->max_size[dir] = (max_size > USBD_MAX_PACKET) ? USBD_MAX_PACKET : max_size;
+    ep->callback[dir] = callback;
+    ep->stalled[dir] = false;
+    if (dir == EP_IN) {
+        ep->tx_valid = false;
+        ep->tx_ctr = false;
+    } else {
+        ep->rx_valid = true;
+        ep->rx_ctr = false;
+        ep->rx_force_nak = false;
+        sim_host_kick();
+    }
+}
+
+uint16_t usbd_ep_write_packet(usbd_device* usbd_dev, uint8_t addr,
+                              const void* buf, uint16_t len) {
+    (void)usbd_dev;
+    struct usbd_endpoint* ep = &endpoints[EP_NUM(addr)];
+    sim_spend(SIM_ACCESS_CYCLES);
+    if (ep->tx_valid) {
+        return 0;
+    }
+    if (len > ep->max_size[EP_IN]) {
+        sim_fatal("%u byte packet for %u byte endpoint 0x%02x", len, ep->max_size[EP_IN], addr);
+    }
+    sim_spend(USBD_PACKET_CYCLES(len));
+    memcpy(ep->tx_buf, buf, len);
+    ep->tx_len = len;
+    ep->tx_valid = true;
+    sim_host_kick();
+    return len;
+}
+
+uint16_t usbd_ep_read_packet(usbd_device* usbd_dev, uint8_t addr, void* buf, uint16_t len) {
+    (void)usbd_dev;
+    struct usbd_endpoint* ep = &endpoints[EP_NUM(addr)];
+    sim_spend(SIM_ACCESS_CYCLES);
+    if (ep->rx_valid) {
+        return 0;
+    }
+    uint16_t count = (len < ep->rx_len) ? len : ep->rx_len;
+    sim_spend(USBD_PACKET_CYCLES(count));
+    memcpy(buf, ep->rx_buf, count);
+    ep->rx_ctr = false;
+    if (!ep->rx_force_nak) {
+        ep->rx_valid = true;
+        sim_host_kick();
+    }
+    usbd_update();
+    return count;
+}
+
+void usbd_ep_stall_set(usbd_device* usbd_dev, uint8_t addr, uint8_t stall) {
+    (void)usbd_dev;
+    sim_spend(SIM_ACCESS_CYCLES);
+    endpoints[EP_NUM(addr)].stalled[EP_DIR(addr)] = stall;
+}
+
+uint8_t usbd_ep_stall_get(usbd_device* usbd_dev, uint8_t addr) {
+    (void)usbd_dev;
+    sim_spend(SIM_ACCESS_CYCLES);
+    return endpoints[EP_NUM(addr)].stalled[EP_DIR(addr)];
+}
+
+void usbd_ep_nak_set(usbd_device* usbd_dev, uint8_t addr, uint8_t nak) {
+    (void)usbd_dev;
+    /* As in st_usbfs, forcing NAK only applies to OUT endpoints */
+    if (addr & 0x80) {
+        return;
+    }
+    struct usbd_endpoint* ep = &endpoints[EP_NUM(addr)];
+    sim_spend(SIM_ACCESS_CYCLES);
+    ep->rx_force_nak = nak;
+    ep->rx_valid = !nak;
+    if (!nak) {
+        sim_host_kick();
+    }
+}
+
+static void usbd_reset(void) {
+    memset(&endpoints, 0, sizeof(endpoints));
+    device.current_config = 0;
+    if (device.reset_callback != NULL) {
+        device.reset_callback();
+    }
+}
+
+static int usbd_standard_request(struct usb_setup_data* req) {
+    if ((req->bmRequestType & (USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT))
+        != (USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_DEVICE)) {
+        return USBD_REQ_NOTSUPP;
+    }
+
+    switch (req->bRequest) {
+        case USB_REQ_SET_ADDRESS:
+            return USBD_REQ_HANDLED;
+        case USB_REQ_SET_CONFIGURATION:
+            if (req->wValue != 0 && req->wValue != device.config->bConfigurationValue) {
+                return USBD_REQ_NOTSUPP;
+            }
+            device.current_config = req->wValue;
+            if (req->wValue > 0) {
+                /* Endpoints and class handlers are set up again by the callbacks */
+                memset(&endpoints[1], 0, sizeof(endpoints) - sizeof(endpoints[0]));
+                if (device.set_config[0] != NULL) {
+                    for (unsigned i = 0; i < USBD_MAX_CONTROL_CALLBACKS; i++) {
+                        device.control[i].callback = NULL;
+                    }
+                    for (unsigned i = 0; i < USBD_MAX_SET_CONFIG_CALLBACKS; i++) {
+                        if (device.set_config[i] != NULL) {
+                            device.set_config[i](&device, req->wValue);
+                        }
+                    }
+                }
+            }
+            return USBD_REQ_HANDLED;
+        default:
+            return USBD_REQ_NOTSUPP;
+    }
+}
+
+static void usbd_control_transfer(void) {
+    struct usb_setup_data req = control.req;
+    uint8_t* buf = device.control_buffer;
+    uint16_t len = req.wLength;
+    usbd_control_complete_callback complete = NULL;
+
+    if (len > device.control_buffer_size) {
+        len = device.control_buffer_size;
+    }
+    if (!(req.bmRequestType & USB_REQ_TYPE_IN)) {
+        memcpy(buf, control.data, len);
+    }
+    sim_spend(USBD_PACKET_CYCLES(sizeof(req) + len));
+
+    int result = USBD_REQ_NEXT_CALLBACK;
+    for (unsigned i = 0; i < USBD_MAX_CONTROL_CALLBACKS; i++) {
+        if (device.control[i].callback == NULL
+            || (req.bmRequestType & device.control[i].type_mask) != device.control[i].type) {
+            continue;
+        }
+        result = device.control[i].callback(&device, &req, &buf, &len, &complete);
+        if (result == USBD_REQ_HANDLED || result == USBD_REQ_NOTSUPP) {
+            break;
+        }
+    }
+    if (result == USBD_REQ_NEXT_CALLBACK) {
+        result = usbd_standard_request(&req);
+    }
+
+    bool ok = (result == USBD_REQ_HANDLED);
+    if (ok && complete != NULL) {
+        complete(&device, &req);
+    }
+    control.pending = false;
+    control.done(ok, buf, (req.bmRequestType & USB_REQ_TYPE_IN) ? len : 0);
+}
+
+void usbd_poll(usbd_device* usbd_dev) {
+    (void)usbd_dev;
+    sim_spend(2 * SIM_ACCESS_CYCLES);
+
+    if (reset_pending) {
+        reset_pending = false;
+        usbd_reset();
+        usbd_update();
+        return;
+    }
+
+    if (control.pending) {
+        usbd_control_transfer();
+    } else {
+        for (unsigned i = 0; i < USBD_NUM_ENDPOINTS; i++) {
+            struct usbd_endpoint* ep = &endpoints[i];
+            if (ep->rx_ctr) {
+                if (ep->callback[EP_OUT] != NULL) {
+                    ep->callback[EP_OUT](&device, (uint8_t)i);
+                } else {
+                    ep->rx_ctr = false;
+                }
+                break;
+            } else if (ep->tx_ctr) {
+                ep->tx_ctr = false;
+                if (ep->callback[EP_IN] != NULL) {
+                    ep->callback[EP_IN](&device, (uint8_t)i);
+                }
+                break;
+            }
+        }
+    }
+
+    if (sof_pending) {
+        sof_pending = false;
+        if (device.sof_callback != NULL) {
+            device.sof_callback();
+        }
+    }
+    usbd_update();
+}
+
+bool sim_usbd_configured(void) {
+    return device.current_config != 0;
+}
+
+bool sim_usbd_in_ready(uint8_t ep) {
+    return endpoints[EP_NUM(ep)].tx_valid;
+}
+
+uint16_t sim_usbd_in_len(uint8_t ep) {
+    return endpoints[EP_NUM(ep)].tx_len;
+}
+
+uint16_t sim_usbd_in_take(uint8_t ep, uint8_t* buf) {
+    struct usbd_endpoint* e = &endpoints[EP_NUM(ep)];
+    memcpy(buf, e->tx_buf, e->tx_len);
+    e->tx_valid = false;
+    e->tx_ctr = true;
+    usbd_update();
+    return e->tx_len;
+}
+
+bool sim_usbd_out_ready(uint8_t ep) {
+    return endpoints[EP_NUM(ep)].rx_valid;
+}
+
+void sim_usbd_out_put(uint8_t ep, const uint8_t* buf, uint16_t len) {
+    struct usbd_endpoint* e = &endpoints[EP_NUM(ep)];
+    memcpy(e->rx_buf, buf, len);
+    e->rx_len = len;
+    e->rx_valid = false;
+    e->rx_ctr = true;
+    usbd_update();
+}
+
+uint16_t sim_usbd_max_packet(uint8_t addr) {
+    return endpoints[EP_NUM(addr)].max_size[EP_DIR(addr)];
+}
+
+bool sim_usbd_control_busy(void) {
+    return control.pending;
+}
+
+void sim_usbd_control(const struct usb_setup_data* req, const uint8_t* data,
+                      void (*done)(bool ok, const uint8_t* data, uint16_t len)) {
+    control.req = *req;
+    if (!(req->bmRequestType & USB_REQ_TYPE_IN) && req->wLength > 0) {
+        memcpy(control.data, data, req->wLength);
+    }
+    control.done = done;
+    control.pending = true;
+    usbd_update();
+}
+
+void sim_usbd_bus_reset(void) {
+    reset_pending = true;
+    usbd_update();
+}
+
+void sim_usbd_sof(void) {
+    sof_pending = true;
+    usbd_update();
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IRQ_PRIORITY_H_INCLUDED
+#define IRQ_PRIORITY_H_INCLUDED
+
+#include "config.h"
+
+/*
+ * NVIC priority plan; lower values preempt higher ones. Only the top two
+ * bits are implemented on the Cortex-M0, so levels are multiples of 0x40.
+ *
+ * - Console DMA handlers only advance ring indices and chain transfers,
+ *   so they run first to keep the UART streaming. The CTS edge handler
+ *   shares their level, since it pauses and resumes the TX DMA requests,
+ *   and so does the break timer, which restarts them.
+ * - USB preempts the USARTs so that setup packets and bulk completions
+ *   are handled in bounded time however busy the UART is.
+ * - USART handlers (line idle, TXE when there is no TX DMA) come last,
+ *   along with the timebase, whose handler only serves the compare
+ *   channel deadline and runs its callback.
+ */
+#ifndef IRQ_PRIORITY_CONSOLE_DMA
+#define IRQ_PRIORITY_CONSOLE_DMA   (0 << 6)
+#endif
+
+#ifndef IRQ_PRIORITY_CONSOLE_CTS
+#define IRQ_PRIORITY_CONSOLE_CTS   IRQ_PRIORITY_CONSOLE_DMA
+#endif
+
+#ifndef IRQ_PRIORITY_CONSOLE_BREAK
+#define IRQ_PRIORITY_CONSOLE_BREAK IRQ_PRIORITY_CONSOLE_DMA
+#endif
+
+#ifndef IRQ_PRIORITY_USB
+#define IRQ_PRIORITY_USB           (1 << 6)
+#endif
+
+#ifndef IRQ_PRIORITY_CONSOLE_USART
+#define IRQ_PRIORITY_CONSOLE_USART (2 << 6)
+#endif
+
+#ifndef IRQ_PRIORITY_TICK
+#define IRQ_PRIORITY_TICK          (2 << 6)
+#endif
+
+#endif
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/stm32/rcc.h>
+
+#include "profile.h"
+
+#if PROFILE_ENABLED
+
+_Static_assert(sizeof(struct profile_report) == 8 + 16 + 4 * PROFILE_HISTOGRAM_BUCKETS,
+               "The profile report is sent as is, so must not be padded");
+
+/*
+ * Each point is only recorded from one priority level, so updates need
+ * no locking; only readers, which may be preempted mid-copy, do.
+ */
+static struct profile_stats profile_stats[PROFILE_NUM_POINTS];
+
+static uint8_t profile_bucket(uint32_t cycles) {
+    uint8_t bucket = 0;
+    while (cycles > 1 && bucket < PROFILE_HISTOGRAM_BUCKETS - 1) {
+        cycles >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+void profile_record(enum profile_point point, uint32_t cycles) {
+    struct profile_stats* stats = &profile_stats[point];
+    stats->calls++;
+    stats->total_cycles += cycles;
+    if (cycles > stats->max_cycles) {
+        stats->max_cycles = cycles;
+    }
+    stats->histogram[profile_bucket(cycles)]++;
+}
+
+bool profile_get(uint16_t point, struct profile_report* report) {
+    if (point >= PROFILE_NUM_POINTS) {
+        return false;
+    }
+
+    report->clock_hz = rcc_ahb_frequency;
+    report->num_points = PROFILE_NUM_POINTS;
+    uint32_t masked = cm_mask_interrupts(1);
+    memcpy(&report->stats, &profile_stats[point], sizeof(report->stats));
+    cm_mask_interrupts(masked);
+    return true;
+}
+
+void profile_reset(void) {
+    uint32_t masked = cm_mask_interrupts(1);
+    memset(profile_stats, 0, sizeof(profile_stats));
+    cm_mask_interrupts(masked);
+}
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PROFILE_H_INCLUDED
+#define PROFILE_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "tick.h"
+
+/*
+ * Cycle profiling of the hot paths, built in with `make PROFILE=1`.
+ * Otherwise the probes compile to nothing.
+ *
+ * Each point counts calls and records the total, the longest, and a
+ * log2 histogram of their lengths in CPU cycles. Lengths include time
+ * spent in any handler that preempted the measured code.
+ */
+#ifndef PROFILE_ENABLED
+#define PROFILE_ENABLED 0
+#endif
+
+enum profile_point {
+    PROFILE_USART_ISR,
+    PROFILE_DMA_ISR,
+    PROFILE_SOF,
+    PROFILE_IN_TRANSFER,
+    PROFILE_BULK_OUT,
+    PROFILE_BULK_IN,
+    PROFILE_MAIN_LOOP,
+    PROFILE_NUM_POINTS
+};
+
+/*
+ * Bucket i counts calls taking from 2^i up to 2^(i+1) - 1 cycles; the
+ * first also counts calls taking 0 cycles and the last longer ones.
+ */
+#define PROFILE_HISTOGRAM_BUCKETS 16
+
+struct profile_stats {
+    uint32_t calls;
+    uint32_t max_cycles;
+    uint64_t total_cycles;
+    uint32_t histogram[PROFILE_HISTOGRAM_BUCKETS];
+};
+
+/* Reply to the profile vendor request, little-endian */
+struct profile_report {
+    uint32_t clock_hz;
+    uint32_t num_points;
+    struct profile_stats stats;
+};
+
+#if PROFILE_ENABLED
+extern void profile_record(enum profile_point point, uint32_t cycles);
+extern bool profile_get(uint16_t point, struct profile_report* report);
+extern void profile_reset(void);
+
+#define PROFILE_BEGIN(point) uint32_t profile_start_##point = cycle_counter_read()
+#define PROFILE_END(point) profile_record(point, cycle_counter_elapsed(profile_start_##point))
+#else
+#define PROFILE_BEGIN(point) do { } while (0)
+#define PROFILE_END(point) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef RAMFUNC_H_INCLUDED
+#define RAMFUNC_H_INCLUDED
+
+#include "config.h"
+
+/*
+ * Hot and cold code placement. On the STM32F103 at 72 MHz, every flash
+ * fetch that misses the prefetch buffer pays two wait states, so the code
+ * run for each byte or packet - the USART, DMA and USB endpoint handlers
+ * and the ring helpers they use - is marked RAMFUNC and goes in the
+ * .ramfunc section, which sections.ld loads into RAM with .data. Setup,
+ * control requests, descriptors and DFU stay in flash.
+ *
+ * Calls between RAM and flash are out of range of a BL, so the linker
+ * adds a veneer to each; keep the marked paths calling each other rather
+ * than into flash where it matters. `make ram` reports the RAM cost.
+ */
+#ifndef RAMFUNC_ENABLED
+#define RAMFUNC_ENABLED 0
+#endif
+
+#if RAMFUNC_ENABLED
+#define RAMFUNC __attribute__ ((section (".ramfunc")))
+#else
+#define RAMFUNC
+#endif
+
+#endif
@@ -49,7 +49,7 @@ int _write(int file, char *ptr, int len) {
     }
 
     if (usart == CONSOLE_TX_USART) {
-        sent = console_send_buffered((uint8_t*)ptr, (size_t)len);
+        sent = console_send_buffered(console_port(0), (uint8_t*)ptr, (size_t)len);
         return sent;
     }
 
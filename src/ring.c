@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "ring.h"
+#include "ramfunc.h"
+
+RAMFUNC size_t ring_write(struct ring* ring, const uint8_t* data, size_t len) {
+    struct ring_span spans[2];
+    size_t space = ring_reserve(ring, spans);
+    if (len > space) {
+        len = space;
+    }
+
+    size_t first = (len < spans[0].len) ? len : spans[0].len;
+    ring_copy(spans[0].data, data, first);
+    ring_copy(spans[1].data, &data[first], len - first);
+
+    ring_commit(ring, len);
+    return len;
+}
+
+RAMFUNC size_t ring_read(struct ring* ring, uint8_t* data, size_t max_len) {
+    struct ring_span spans[2];
+    size_t len = ring_peek(ring, spans);
+    if (len > max_len) {
+        len = max_len;
+    }
+
+    size_t first = (len < spans[0].len) ? len : spans[0].len;
+    ring_copy(data, spans[0].data, first);
+    ring_copy(&data[first], spans[1].data, len - first);
+
+    ring_consume(ring, len);
+    return len;
+}
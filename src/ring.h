@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef RING_H_INCLUDED
+#define RING_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Lock-free single-producer/single-consumer byte ring.
+ *
+ * The head and tail are free-running 16-bit counters that are masked on
+ * access, so the size must be a power of two no larger than 32768. The
+ * tail is only written by the producer and the head only by the
+ * consumer, so each side may run in a different interrupt context (or
+ * be a DMA channel) without locking.
+ *
+ * Bulk access goes through spans: the producer reserves free space,
+ * writes it in place and commits it; the consumer peeks at queued data
+ * and consumes it. A region that wraps around the end of the buffer is
+ * returned as two spans.
+ */
+struct ring {
+    uint8_t* buffer;
+    uint16_t mask;
+    volatile uint16_t head;
+    volatile uint16_t tail;
+};
+
+/* A contiguous region of a ring */
+struct ring_span {
+    uint8_t* data;
+    size_t len;
+};
+
+#define RING_IS_POW_OF_TWO(X) (((X) != 0) && (((X) & ((X)-1)) == 0))
+
+/* Define a statically allocated ring, checking its size at compile time */
+#define RING_DEFINE(name, size)                                         \
+    _Static_assert(RING_IS_POW_OF_TWO(size),                            \
+                   "Ring size must be a power of two");                 \
+    _Static_assert((size) <= UINT16_MAX/2 + 1,                          \
+                   "Ring size too big for 16-bit indices");             \
+    static uint8_t name##_storage[size];                                \
+    static struct ring name = { name##_storage, (size) - 1, 0, 0 }
+
+/*
+ * Cortex-M0 and M3 cores don't reorder memory accesses as seen by their
+ * own interrupt handlers, so a compiler barrier is enough to order the
+ * buffer accesses against reading the other side's index. Publishing an
+ * index uses DMB so that DMA masters also see the buffer contents first.
+ */
+#define ring_compiler_barrier() __asm__ volatile ("" ::: "memory")
+
+#if defined(__ARM_ARCH)
+#define ring_release_barrier() __asm__ volatile ("dmb" ::: "memory")
+#else
+#define ring_release_barrier() __atomic_thread_fence(__ATOMIC_RELEASE)
+#endif
+
+static inline size_t ring_size(const struct ring* ring) {
+    return (size_t)ring->mask + 1;
+}
+
+static inline size_t ring_used(const struct ring* ring) {
+    return (uint16_t)(ring->tail - ring->head);
+}
+
+static inline size_t ring_space(const struct ring* ring) {
+    return ring_size(ring) - ring_used(ring);
+}
+
+static inline bool ring_empty(const struct ring* ring) {
+    return ring->head == ring->tail;
+}
+
+/* Discard all data; only safe while neither side is active */
+static inline void ring_reset(struct ring* ring) {
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+/* Split count bytes starting at index into spans at the end of the buffer */
+static inline size_t ring_spans(const struct ring* ring, uint16_t index,
+                                uint16_t count, struct ring_span spans[2]) {
+    uint16_t offset = index & ring->mask;
+    uint16_t first = (uint16_t)(ring_size(ring) - offset);
+    if (first > count) {
+        first = count;
+    }
+
+    spans[0].data = &ring->buffer[offset];
+    spans[0].len = first;
+    spans[1].data = &ring->buffer[0];
+    spans[1].len = count - first;
+    return count;
+}
+
+/* Producer: get the free space, to be filled in place */
+static inline size_t ring_reserve(struct ring* ring, struct ring_span spans[2]) {
+    uint16_t tail = ring->tail;
+    uint16_t space = (uint16_t)(ring_size(ring) - (uint16_t)(tail - ring->head));
+    ring_compiler_barrier();
+    return ring_spans(ring, tail, space, spans);
+}
+
+/* Producer: publish len bytes written into reserved space */
+static inline void ring_commit(struct ring* ring, size_t len) {
+    ring_release_barrier();
+    ring->tail = (uint16_t)(ring->tail + len);
+}
+
+/* Consumer: get the queued data, to be read in place */
+static inline size_t ring_peek(const struct ring* ring, struct ring_span spans[2]) {
+    uint16_t head = ring->head;
+    uint16_t used = (uint16_t)(ring->tail - head);
+    ring_compiler_barrier();
+    return ring_spans(ring, head, used, spans);
+}
+
+/* Consumer: release len bytes that have been read */
+static inline void ring_consume(struct ring* ring, size_t len) {
+    ring_release_barrier();
+    ring->head = (uint16_t)(ring->head + len);
+}
+
+/*
+ * Consumer: drop all queued data by moving the tail back to the head.
+ * This writes the producer's index, so it's only for a consumer that
+ * also commits on the producer's behalf, as the console does for its
+ * RX DMA channel.
+ */
+static inline void ring_reset_to_head(struct ring* ring) {
+    ring->tail = ring->head;
+}
+
+static inline bool ring_put(struct ring* ring, uint8_t data) {
+    uint16_t tail = ring->tail;
+    if ((uint16_t)(tail - ring->head) > ring->mask) {
+        return false;
+    }
+    ring->buffer[tail & ring->mask] = data;
+    ring_commit(ring, 1);
+    return true;
+}
+
+static inline bool ring_get(struct ring* ring, uint8_t* data) {
+    uint16_t head = ring->head;
+    if (head == ring->tail) {
+        return false;
+    }
+    ring_compiler_barrier();
+    *data = ring->buffer[head & ring->mask];
+    ring_consume(ring, 1);
+    return true;
+}
+
+/*
+ * Copy into or out of a span. This is a plain byte loop rather than
+ * memcpy so that it inlines into RAMFUNC code; libc's memcpy stays in
+ * flash, behind a long-call veneer.
+ */
+static inline void ring_copy(uint8_t* dst, const uint8_t* src, size_t len) {
+    while (len--) {
+        *dst++ = *src++;
+    }
+}
+
+/* Copy data in and out through the spans; return the number of bytes copied */
+extern size_t ring_write(struct ring* ring, const uint8_t* data, size_t len);
+extern size_t ring_read(struct ring* ring, uint8_t* data, size_t max_len);
+
+#endif
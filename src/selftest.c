@@ -0,0 +1,359 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+
+#include <libopencm3/stm32/usart.h>
+
+#include "config.h"
+#include "console.h"
+#include "selftest.h"
+#include "tick.h"
+
+_Static_assert(sizeof(struct selftest_report) == 4 + 11 * 4 + 2 * 2,
+               "The self-test report is sent as is, so must not be padded");
+
+/* Errored bytes in a row that mean the checker has slipped */
+#define SELFTEST_SLIP_BYTES 8
+
+/* Minimum wait for the last bytes after the TX ring drains */
+#define SELFTEST_DRAIN_US 5000
+
+/* Rates a sweep steps through after its start rate */
+static const uint32_t selftest_sweep_rates[] = {
+    1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400,
+    460800, 921600, 1000000, 1500000, 2000000, 2250000, 3000000,
+    4000000, 4500000, 6000000,
+};
+
+enum selftest_phase {
+    SELFTEST_PHASE_RUN,
+    SELFTEST_PHASE_DRAIN,
+};
+
+static struct {
+    struct console* console;
+    uint8_t state;
+    uint8_t mode;
+    uint8_t num_steps;
+    uint8_t step;
+    uint32_t duration_us;
+    uint32_t rates[SELFTEST_MAX_STEPS];
+    struct selftest_result results[SELFTEST_MAX_STEPS];
+
+    /* The step in progress */
+    uint8_t phase;
+    uint32_t step_start;
+    uint32_t drain_start;
+    uint32_t drain_us;
+    bool tx_drained;
+    bool rx_seen;
+    uint32_t rx_first;
+    struct console_rx_stats base_stats;
+
+    /* Generator and checker; the last 15 bits of the pattern */
+    uint16_t tx_prbs;
+    uint16_t rx_prbs;
+    uint8_t rx_lock_bytes;
+    uint8_t slip_bytes;
+    uint32_t slip_checked;
+    uint32_t slip_bit_errors;
+} selftest;
+
+static uint8_t selftest_reverse(uint8_t b) {
+    b = (uint8_t)((b & 0xF0) >> 4 | (b & 0x0F) << 4);
+    b = (uint8_t)((b & 0xCC) >> 2 | (b & 0x33) << 2);
+    b = (uint8_t)((b & 0xAA) >> 1 | (b & 0x55) << 1);
+    return b;
+}
+
+/*
+ * The next 8 bits of the pattern. Each new bit is the XOR of the bits
+ * 15 and 14 before it, so the next 8 only depend on bits already in the
+ * state and can be worked out together. The state holds the newest bit
+ * in bit 0, but the USART sends the oldest first, so the byte is
+ * reversed on the way out.
+ */
+static uint8_t selftest_prbs_next(uint16_t* state) {
+    uint16_t s = *state;
+    uint8_t bits = (uint8_t)((s >> 7) ^ (s >> 6));
+    *state = (uint16_t)(((s << 8) | bits) & 0x7FFF);
+    return selftest_reverse(bits);
+}
+
+static uint8_t selftest_popcount(uint8_t b) {
+    b = (uint8_t)(b - ((b >> 1) & 0x55));
+    b = (uint8_t)((b & 0x33) + ((b >> 2) & 0x33));
+    return (uint8_t)((b + (b >> 4)) & 0x0F);
+}
+
+static void selftest_check_byte(struct selftest_result* result, uint8_t received) {
+    if (selftest.rx_lock_bytes < 2) {
+        // The pattern's state is just its last 15 bits
+        selftest.rx_prbs = (uint16_t)(((selftest.rx_prbs << 8) | selftest_reverse(received))
+                                      & 0x7FFF);
+        selftest.rx_lock_bytes++;
+        return;
+    }
+
+    uint8_t errors = selftest_popcount(selftest_prbs_next(&selftest.rx_prbs) ^ received);
+    if (errors == 0) {
+        // Errors before a good byte were real, not a slip
+        result->checked_bytes += selftest.slip_checked + 1;
+        result->bit_errors += selftest.slip_bit_errors;
+        result->byte_errors += selftest.slip_checked;
+        selftest.slip_checked = 0;
+        selftest.slip_bit_errors = 0;
+        selftest.slip_bytes = 0;
+        return;
+    }
+
+    selftest.slip_checked++;
+    selftest.slip_bit_errors += errors;
+    if (++selftest.slip_bytes >= SELFTEST_SLIP_BYTES) {
+        result->resyncs++;
+        selftest.slip_checked = 0;
+        selftest.slip_bit_errors = 0;
+        selftest.slip_bytes = 0;
+        selftest.rx_lock_bytes = 0;
+    }
+}
+
+/* Count errors left pending at the end of a step */
+static void selftest_check_flush(struct selftest_result* result) {
+    result->checked_bytes += selftest.slip_checked;
+    result->bit_errors += selftest.slip_bit_errors;
+    result->byte_errors += selftest.slip_checked;
+    selftest.slip_checked = 0;
+    selftest.slip_bit_errors = 0;
+    selftest.slip_bytes = 0;
+}
+
+static void selftest_generate(struct selftest_result* result) {
+    struct ring_span spans[2];
+    size_t space = console_send_reserve(selftest.console, spans);
+    if (space == 0) {
+        return;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        for (size_t j = 0; j < spans[i].len; j++) {
+            spans[i].data[j] = selftest_prbs_next(&selftest.tx_prbs);
+        }
+    }
+    console_send_commit(selftest.console, space);
+    result->tx_bytes += space;
+}
+
+static void selftest_receive(struct selftest_result* result, uint32_t now) {
+    struct ring_span spans[2];
+    size_t available = console_recv_peek(selftest.console, spans);
+    if (available == 0) {
+        return;
+    }
+
+    if (!selftest.rx_seen) {
+        selftest.rx_seen = true;
+        selftest.rx_first = now;
+    }
+    result->rx_us = now - selftest.rx_first;
+    result->rx_bytes += available;
+
+    if (selftest.mode & SELFTEST_RX) {
+        for (int i = 0; i < 2; i++) {
+            for (size_t j = 0; j < spans[i].len; j++) {
+                selftest_check_byte(result, spans[i].data[j]);
+            }
+        }
+    }
+    console_recv_consume(selftest.console, available);
+}
+
+static void selftest_start_step(void) {
+    struct console* con = selftest.console;
+    struct selftest_result* result = &selftest.results[selftest.step];
+    memset(result, 0, sizeof(*result));
+
+    struct console_baud_plan plan;
+    uint32_t rate = selftest.rates[selftest.step];
+    console_plan_baudrate(con, rate, &plan);
+    result->baudrate = console_baud_plan_rate(&plan);
+    console_reconfigure(con, rate, 8, USART_STOPBITS_1, USART_PARITY_NONE);
+
+    // Wait at least four frames for the last bytes too
+    selftest.drain_us = SELFTEST_DRAIN_US + 40000000U / result->baudrate;
+
+    uint16_t tx_used;
+    uint16_t rx_used;
+    console_take_high_water(con, &tx_used, &rx_used);
+    console_get_rx_stats(con, &selftest.base_stats);
+
+    selftest.tx_prbs = 0x7FFF;
+    selftest.rx_lock_bytes = 0;
+    selftest.slip_bytes = 0;
+    selftest.slip_checked = 0;
+    selftest.slip_bit_errors = 0;
+    selftest.rx_seen = false;
+    selftest.tx_drained = false;
+    selftest.phase = SELFTEST_PHASE_RUN;
+    selftest.step_start = get_micros();
+}
+
+static void selftest_finish_step(void) {
+    struct console* con = selftest.console;
+    struct selftest_result* result = &selftest.results[selftest.step];
+    selftest_check_flush(result);
+
+    console_take_high_water(con, &result->tx_high_water, &result->rx_high_water);
+
+    struct console_rx_stats stats;
+    console_get_rx_stats(con, &stats);
+    result->overruns = (stats.overruns - selftest.base_stats.overruns)
+                       + (stats.dropped - selftest.base_stats.dropped)
+                       + (stats.overrun_errors - selftest.base_stats.overrun_errors);
+    result->line_errors = (stats.framing_errors - selftest.base_stats.framing_errors)
+                          + (stats.parity_errors - selftest.base_stats.parity_errors);
+
+    selftest.step++;
+}
+
+/*
+ * Start testing a port, which the caller must have taken over from
+ * the host. Fails if the mode or start rate can't be used.
+ */
+bool selftest_start(struct console* con, const struct selftest_params* params) {
+    uint8_t mode = params->mode;
+    bool loop = (mode & (SELFTEST_TX | SELFTEST_RX)) == (SELFTEST_TX | SELFTEST_RX);
+    if (selftest.state == SELFTEST_RUNNING
+        || (mode & ~(SELFTEST_TX | SELFTEST_RX | SELFTEST_INTERNAL)) != 0
+        || (mode & (SELFTEST_TX | SELFTEST_RX)) == 0
+        || ((mode & SELFTEST_INTERNAL) && !loop)
+        || params->duration_ms == 0) {
+        return false;
+    }
+
+    struct console_baud_plan plan;
+    if (!console_plan_baudrate(con, params->baudrate, &plan)) {
+        return false;
+    }
+
+    if (!console_set_loopback(con, (mode & SELFTEST_INTERNAL) != 0)) {
+        return false;
+    }
+
+    selftest.rates[0] = params->baudrate;
+    selftest.num_steps = 1;
+    for (size_t i = 0; i < sizeof(selftest_sweep_rates) / sizeof(selftest_sweep_rates[0]); i++) {
+        uint32_t rate = selftest_sweep_rates[i];
+        if (selftest.num_steps >= SELFTEST_MAX_STEPS || rate > params->max_baudrate) {
+            break;
+        }
+        if (rate > params->baudrate && console_plan_baudrate(con, rate, &plan)) {
+            selftest.rates[selftest.num_steps++] = rate;
+        }
+    }
+
+    selftest.console = con;
+    selftest.mode = mode;
+    selftest.duration_us = params->duration_ms * 1000U;
+    selftest.step = 0;
+    selftest.state = SELFTEST_RUNNING;
+    selftest_start_step();
+    return true;
+}
+
+/* End the test early, keeping the results so far */
+void selftest_stop(void) {
+    if (selftest.state == SELFTEST_RUNNING) {
+        selftest_finish_step();
+        selftest.state = SELFTEST_DONE;
+        console_set_loopback(selftest.console, false);
+    }
+}
+
+bool selftest_running(const struct console* con) {
+    return selftest.state == SELFTEST_RUNNING && selftest.console == con;
+}
+
+/*
+ * Keep the test's data moving; returns false once it has finished. The
+ * caller then owns the port again and should restore its settings.
+ */
+bool selftest_update(void) {
+    if (selftest.state != SELFTEST_RUNNING) {
+        return false;
+    }
+
+    struct console* con = selftest.console;
+    struct selftest_result* result = &selftest.results[selftest.step];
+    uint32_t now = get_micros();
+
+    if (selftest.phase == SELFTEST_PHASE_RUN) {
+        if (selftest.mode & SELFTEST_TX) {
+            selftest_generate(result);
+        }
+        if ((uint32_t)(now - selftest.step_start) >= selftest.duration_us) {
+            selftest.phase = SELFTEST_PHASE_DRAIN;
+        }
+    }
+
+    selftest_receive(result, now);
+
+    if (selftest.phase == SELFTEST_PHASE_DRAIN) {
+        if (!selftest.tx_drained) {
+            if (console_send_buffer_space(con) == console_send_buffer_size(con)) {
+                selftest.tx_drained = true;
+                selftest.drain_start = now;
+                result->tx_us = now - selftest.step_start;
+            }
+        } else if ((uint32_t)(now - selftest.drain_start) >= selftest.drain_us) {
+            selftest_finish_step();
+            if (selftest.step < selftest.num_steps) {
+                selftest_start_step();
+            } else {
+                selftest.state = SELFTEST_DONE;
+                console_set_loopback(con, false);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/*
+ * The state, and the result of the given step so far once it has
+ * started. Fails for steps past the end of the test.
+ */
+bool selftest_get_report(uint8_t step, struct selftest_report* report) {
+    if (step > 0 && step >= selftest.num_steps) {
+        return false;
+    }
+
+    memset(report, 0, sizeof(*report));
+    report->state = selftest.state;
+    report->mode = selftest.mode;
+    report->num_steps = selftest.num_steps;
+    report->steps_done = selftest.step;
+
+    uint8_t started = selftest.step + (selftest.state == SELFTEST_RUNNING ? 1 : 0);
+    if (step < started) {
+        memcpy(&report->result, &selftest.results[step], sizeof(report->result));
+    }
+    return true;
+}
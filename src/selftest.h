@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SELFTEST_H_INCLUDED
+#define SELFTEST_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Link self-test: sends a PRBS-15 pattern (x^15 + x^14 + 1, sent in bit
+ * order on the wire) through a console port's TX ring and checks what
+ * comes back through its RX ring, using the same DMA paths as the
+ * bridge. Either half can run alone, to test against another device.
+ *
+ * Each step runs at one baud rate for a fixed time, stops sending, then
+ * waits for the last bytes to come back. A sweep steps through the
+ * standard rates from the start rate up to a maximum.
+ *
+ * The checker locks onto the incoming pattern after two bytes and then
+ * predicts it. A run of errored bytes means it has slipped, for example
+ * because bytes were dropped, so it relocks; the errors in that run are
+ * counted as a resync instead of bit errors.
+ */
+
+/* Send the pattern */
+#define SELFTEST_TX       (1 << 0)
+/* Check received data against the pattern */
+#define SELFTEST_RX       (1 << 1)
+/* Loop TX back to RX inside the USART; needs both of the above */
+#define SELFTEST_INTERNAL (1 << 2)
+
+#ifndef SELFTEST_MAX_STEPS
+#define SELFTEST_MAX_STEPS 12
+#endif
+
+enum selftest_state {
+    SELFTEST_IDLE = 0,
+    SELFTEST_RUNNING = 1,
+    SELFTEST_DONE = 2,
+};
+
+/* Sent by the host, little-endian */
+struct selftest_params {
+    uint32_t baudrate;
+    /* Sweep up to this rate; 0 or below baudrate to hold one rate */
+    uint32_t max_baudrate;
+    uint16_t duration_ms;
+    uint8_t mode;
+    uint8_t reserved;
+} __attribute__ ((packed));
+
+struct selftest_result {
+    /* The rate actually produced */
+    uint32_t baudrate;
+    /* Bytes queued, and from the start until the TX ring drained */
+    uint32_t tx_bytes;
+    uint32_t tx_us;
+    /* Bytes received, and from the first to the last */
+    uint32_t rx_bytes;
+    uint32_t rx_us;
+    /* Bytes compared against the pattern, and the errors in them */
+    uint32_t checked_bytes;
+    uint32_t bit_errors;
+    uint32_t byte_errors;
+    uint32_t resyncs;
+    /* RX ring overruns, dropped bytes and USART overrun errors */
+    uint32_t overruns;
+    /* Framing and parity errors */
+    uint32_t line_errors;
+    uint16_t tx_high_water;
+    uint16_t rx_high_water;
+};
+
+/* Reply to the self-test status request, little-endian */
+struct selftest_report {
+    uint8_t state;
+    uint8_t mode;
+    uint8_t num_steps;
+    uint8_t steps_done;
+    struct selftest_result result;
+};
+
+struct console;
+
+extern bool selftest_start(struct console* con, const struct selftest_params* params);
+extern void selftest_stop(void);
+extern bool selftest_update(void);
+extern bool selftest_running(const struct console* con);
+extern bool selftest_get_report(uint8_t step, struct selftest_report* report);
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <libopencm3/stm32/st_usbfs.h>
+
+#include "USB/usb_pma.h"
+#include "ramfunc.h"
+
+/*
+ * On the STM32F042, packet memory is mapped directly, but must be
+ * accessed a half-word at a time.
+ */
+#define PMA_HALFWORD(offset) MMIO16(USB_PMA_BASE + (offset))
+
+RAMFUNC uint16_t usb_pma_read16(uint16_t offset) {
+    return PMA_HALFWORD(offset);
+}
+
+RAMFUNC void usb_pma_write16(uint16_t offset, uint16_t value) {
+    PMA_HALFWORD(offset) = value;
+}
+
+RAMFUNC void usb_pma_copy_to(uint16_t offset, const uint8_t* src, uint16_t len) {
+    volatile uint16_t* dst = &PMA_HALFWORD(offset);
+    uint16_t i;
+    for (i=0; i+1 < len; i += 2) {
+        *dst++ = (uint16_t)src[i] | ((uint16_t)src[i+1] << 8);
+    }
+    if (len & 1) {
+        *dst = src[len-1];
+    }
+}
+
+RAMFUNC void usb_pma_copy_from(uint8_t* dst, uint16_t offset, uint16_t len) {
+    const volatile uint16_t* src = &PMA_HALFWORD(offset);
+    uint16_t i;
+    for (i=0; i+1 < len; i += 2) {
+        uint16_t value = *src++;
+        dst[i] = value & 0xFF;
+        dst[i+1] = value >> 8;
+    }
+    if (len & 1) {
+        dst[len-1] = (uint8_t)*src;
+    }
+}
@@ -25,18 +25,57 @@
 
 #define CONSOLE_USART USART2
 #define CONSOLE_SPLIT_USART 0
-#define CONSOLE_TX_BUFFER_SIZE 128
+#define CONSOLE_TX_BUFFER_SIZE 256
 #define CONSOLE_RX_BUFFER_SIZE 128
 
 #define CONSOLE_USART_GPIO_PORT GPIOA
 #define CONSOLE_USART_GPIO_PINS (GPIO2|GPIO3)
+#define CONSOLE_USART_GPIO_TX   GPIO2
 #define CONSOLE_USART_GPIO_AF   GPIO_AF1
 #define CONSOLE_USART_MODE USART_MODE_TX_RX
 #define CONSOLE_USART_CLOCK RCC_USART2
+#define CONSOLE_USART_CLOCK_FREQ rcc_apb1_frequency
+#define CONSOLE_USART_OVER8_AVAILABLE 1
 
 #define CONSOLE_USART_IRQ_NAME  usart2_isr
 #define CONSOLE_USART_NVIC_LINE NVIC_USART2_IRQ
 
+/* USART2 RX and TX DMA channels share a single interrupt vector */
+#define CONSOLE_DMA_SHARED_IRQ 1
+#define CONSOLE_RX_DMA_AVAILABLE 1
+#define CONSOLE_RX_DMA_CONTROLLER DMA1
+#define CONSOLE_RX_DMA_CLOCK RCC_DMA
+#define CONSOLE_RX_DMA_CHANNEL DMA_CHANNEL5
+#define CONSOLE_RX_DMA_NVIC_LINE NVIC_DMA1_CHANNEL4_7_DMA2_CHANNEL3_5_IRQ
+#define CONSOLE_RX_DMA_IRQ_NAME dma1_channel4_7_dma2_channel3_5_isr
+
+#define CONSOLE_TX_DMA_AVAILABLE 1
+#define CONSOLE_TX_DMA_CONTROLLER DMA1
+#define CONSOLE_TX_DMA_CLOCK RCC_DMA
+#define CONSOLE_TX_DMA_CHANNEL DMA_CHANNEL4
+#define CONSOLE_TX_DMA_NVIC_LINE NVIC_DMA1_CHANNEL4_7_DMA2_CHANNEL3_5_IRQ
+#define CONSOLE_TX_DMA_IRQ_NAME dma1_channel4_7_dma2_channel3_5_isr
+
+/* USART2's CTS/RTS pins (PA0/PA1) drive LEDs on this board */
+#define CONSOLE_FLOW_CONTROL_AVAILABLE 0
+
+/* Break timing */
+#define CONSOLE_BREAK_AVAILABLE 1
+#define CONSOLE_BREAK_TIMER TIM3
+#define CONSOLE_BREAK_TIMER_CLOCK RCC_TIM3
+#define CONSOLE_BREAK_TIMER_RST RST_TIM3
+#define CONSOLE_BREAK_TIMER_CLOCK_FREQ rcc_apb1_frequency
+#define CONSOLE_BREAK_TIMER_NVIC_LINE NVIC_TIM3_IRQ
+#define CONSOLE_BREAK_TIMER_IRQ_NAME tim3_isr
+
+/* Microsecond timebase on the 32-bit TIM2 */
+#define TICK_TIMER TIM2
+#define TICK_TIMER_CLOCK RCC_TIM2
+#define TICK_TIMER_RST RST_TIM2
+#define TICK_TIMER_CLOCK_FREQ rcc_apb1_frequency
+#define TICK_TIMER_NVIC_LINE NVIC_TIM2_IRQ
+#define TICK_TIMER_IRQ_NAME tim2_isr
+
 #include <libopencm3/stm32/usart.h>
 /* Workaround for non-commonalized STM32F0 USART code */
 #ifndef USART_STOPBITS_1
@@ -55,9 +94,57 @@
 #define USART_SR_TXE USART_ISR_TXE
 #endif
 
+#ifndef USART_SR_TC
+#define USART_SR_TC USART_ISR_TC
+#endif
+
+#ifndef USART_SR_IDLE
+#define USART_SR_IDLE USART_ISR_IDLE
+#endif
+
+#ifndef USART_SR_ORE
+#define USART_SR_ORE USART_ISR_ORE
+#endif
+
+#ifndef USART_SR_FE
+#define USART_SR_FE USART_ISR_FE
+#endif
+
+#ifndef USART_SR_PE
+#define USART_SR_PE USART_ISR_PE
+#endif
+
+/* Separate transmit and receive data registers, and ISR for SR */
+#define CONSOLE_USART_TDR(usart) USART_TDR(usart)
+#define CONSOLE_USART_RDR(usart) USART_RDR(usart)
+#define CONSOLE_USART_STATUS(usart) USART_ISR(usart)
+#define CONSOLE_USART_CLEAR_IDLE(usart) (USART_ICR(usart) = USART_ICR_IDLECF)
+#define CONSOLE_USART_CLEAR_TC(usart) (USART_ICR(usart) = USART_ICR_TCCF)
+#define CONSOLE_USART_CLEAR_ERRORS(usart) \
+    (USART_ICR(usart) = USART_ICR_ORECF | USART_ICR_FECF | USART_ICR_PECF | USART_ICR_NCF)
+
 #define DFU_AVAILABLE 1
 
 /* Word size for usart_recv and usart_send */
 typedef uint8_t usart_word_t;
 
+/* USB packet memory size in bytes */
+#define USB_PMA_SIZE 1024
+#define USB_DOUBLE_BUFFERED_BULK 1
+
+/* There's room in packet memory for the raw bulk pipe as well */
+#define USB_RAW_AVAILABLE 1
+
+#define USB_INTERRUPT_DRIVEN 1
+#define USB_NVIC_LINE NVIC_USB_IRQ
+#define USB_IRQ_NAME usb_isr
+
+/*
+ * Flash has one wait state at 48 MHz and there's little RAM to spare, so
+ * the hot paths stay in flash unless built with RAMFUNC=1; see ramfunc.h
+ */
+#ifndef RAMFUNC_ENABLED
+#define RAMFUNC_ENABLED 0
+#endif
+
 #endif
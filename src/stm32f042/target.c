@@ -73,6 +73,16 @@ void target_console_init(void) {
     gpio_set_af(CONSOLE_USART_GPIO_PORT, CONSOLE_USART_GPIO_AF, CONSOLE_USART_GPIO_PINS);
 }
 
+/* Hold TX low for a break, or hand it back to the USART */
+void target_console_set_break(bool active) {
+    if (active) {
+        gpio_clear(CONSOLE_USART_GPIO_PORT, CONSOLE_USART_GPIO_TX);
+        gpio_mode_setup(CONSOLE_USART_GPIO_PORT, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, CONSOLE_USART_GPIO_TX);
+    } else {
+        gpio_mode_setup(CONSOLE_USART_GPIO_PORT, GPIO_MODE_AF, GPIO_PUPD_NONE, CONSOLE_USART_GPIO_TX);
+    }
+}
+
 void led_bit(uint8_t position, bool state) {
     uint32_t gpio = 0xFFFFFFFFU;
     if (position == 0) {
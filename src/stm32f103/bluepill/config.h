@@ -26,7 +26,7 @@
 #define CONSOLE_SPLIT_USART 0
 #define CONSOLE_USART USART1
 
-#define CONSOLE_TX_BUFFER_SIZE 128
+#define CONSOLE_TX_BUFFER_SIZE 512
 #define CONSOLE_RX_BUFFER_SIZE 4096
 
 #define CONSOLE_USART_GPIO_PORT GPIOA
@@ -35,7 +35,11 @@
 
 #define CONSOLE_USART_MODE USART_MODE_TX_RX
 
+/* Breaks are detected with the USART's LIN mode */
+#define CONSOLE_USART_LIN_AVAILABLE 1
+
 #define CONSOLE_USART_CLOCK RCC_USART1
+#define CONSOLE_USART_CLOCK_FREQ rcc_apb2_frequency
 
 #define CONSOLE_USART_IRQ_NAME  usart1_isr
 #define CONSOLE_USART_NVIC_LINE NVIC_USART1_IRQ
@@ -47,9 +51,126 @@
 #define CONSOLE_RX_DMA_NVIC_LINE NVIC_DMA1_CHANNEL5_IRQ
 #define CONSOLE_RX_DMA_IRQ_NAME dma1_channel5_isr
 
+#define CONSOLE_TX_DMA_AVAILABLE 1
+#define CONSOLE_TX_DMA_CONTROLLER DMA1
+#define CONSOLE_TX_DMA_CLOCK RCC_DMA1
+#define CONSOLE_TX_DMA_CHANNEL DMA_CHANNEL4
+#define CONSOLE_TX_DMA_NVIC_LINE NVIC_DMA1_CHANNEL4_IRQ
+#define CONSOLE_TX_DMA_IRQ_NAME dma1_channel4_isr
+
+/* USART1's own CTS/RTS pins are taken by USB, so handshake on PB13/PB14 */
+#define CONSOLE_FLOW_CONTROL_AVAILABLE 1
+#define CONSOLE_CTS_GPIO_PORT GPIOB
+#define CONSOLE_CTS_GPIO_PIN  GPIO13
+#define CONSOLE_CTS_GPIO_CLOCK RCC_GPIOB
+#define CONSOLE_CTS_EXTI      EXTI13
+#define CONSOLE_CTS_NVIC_LINE NVIC_EXTI15_10_IRQ
+#define CONSOLE_CTS_IRQ_NAME  exti15_10_isr
+#define CONSOLE_RTS_GPIO_PORT GPIOB
+#define CONSOLE_RTS_GPIO_PIN  GPIO14
+#define CONSOLE_RTS_GPIO_CLOCK RCC_GPIOB
+
+/* Modem status inputs, active low */
+#define CONSOLE_DCD_GPIO_PORT GPIOB
+#define CONSOLE_DCD_GPIO_PIN  GPIO12
+#define CONSOLE_DSR_GPIO_PORT GPIOB
+#define CONSOLE_DSR_GPIO_PIN  GPIO15
+#define CONSOLE_RI_GPIO_PORT  GPIOA
+#define CONSOLE_RI_GPIO_PIN   GPIO8
+
+/* Break timing; TIM3 runs at twice the APB1 clock */
+#define CONSOLE_BREAK_AVAILABLE 1
+#define CONSOLE_BREAK_TIMER TIM3
+#define CONSOLE_BREAK_TIMER_CLOCK RCC_TIM3
+#define CONSOLE_BREAK_TIMER_RST RST_TIM3
+#define CONSOLE_BREAK_TIMER_CLOCK_FREQ (2 * rcc_apb1_frequency)
+#define CONSOLE_BREAK_TIMER_NVIC_LINE NVIC_TIM3_IRQ
+#define CONSOLE_BREAK_TIMER_IRQ_NAME tim3_isr
+
+/* Microsecond timebase; TIM2 counts microseconds and TIM4 its overflows */
+#define TICK_TIMER TIM2
+#define TICK_TIMER_CLOCK RCC_TIM2
+#define TICK_TIMER_RST RST_TIM2
+#define TICK_TIMER_CLOCK_FREQ (2 * rcc_apb1_frequency)
+#define TICK_TIMER_NVIC_LINE NVIC_TIM2_IRQ
+#define TICK_TIMER_IRQ_NAME tim2_isr
+#define TICK_TIMER_HIGH TIM4
+#define TICK_TIMER_HIGH_CLOCK RCC_TIM4
+#define TICK_TIMER_HIGH_RST RST_TIM4
+#define TICK_TIMER_HIGH_TRIGGER TIM_SMCR_TS_ITR1
+
+/*
+ * The spare USARTs can be extra CDC-ACM ports: USART2 on PA2/PA3, USART3
+ * on PB10/PB11. They cost the first port its double-buffered endpoints
+ * (see below), so they're only built with `make PORTS=2` or `PORTS=3`.
+ */
+#ifndef CONSOLE_NUM_PORTS
+#define CONSOLE_NUM_PORTS 1
+#endif
+
+#define CONSOLE_PORT1_USART USART2
+#define CONSOLE_PORT1_USART_CLOCK RCC_USART2
+#define CONSOLE_PORT1_USART_CLOCK_FREQ rcc_apb1_frequency
+#define CONSOLE_PORT1_USART_GPIO_PORT GPIOA
+#define CONSOLE_PORT1_USART_GPIO_TX   GPIO2
+#define CONSOLE_PORT1_USART_GPIO_RX   GPIO3
+#define CONSOLE_PORT1_USART_IRQ_NAME  usart2_isr
+#define CONSOLE_PORT1_USART_NVIC_LINE NVIC_USART2_IRQ
+#define CONSOLE_PORT1_DMA_CONTROLLER DMA1
+#define CONSOLE_PORT1_DMA_CLOCK RCC_DMA1
+#define CONSOLE_PORT1_RX_DMA_CHANNEL DMA_CHANNEL6
+#define CONSOLE_PORT1_RX_DMA_NVIC_LINE NVIC_DMA1_CHANNEL6_IRQ
+#define CONSOLE_PORT1_RX_DMA_IRQ_NAME dma1_channel6_isr
+#define CONSOLE_PORT1_TX_DMA_CHANNEL DMA_CHANNEL7
+#define CONSOLE_PORT1_TX_DMA_NVIC_LINE NVIC_DMA1_CHANNEL7_IRQ
+#define CONSOLE_PORT1_TX_DMA_IRQ_NAME dma1_channel7_isr
+#define CONSOLE_PORT1_TX_BUFFER_SIZE 256
+#define CONSOLE_PORT1_RX_BUFFER_SIZE 512
+
+#define CONSOLE_PORT2_USART USART3
+#define CONSOLE_PORT2_USART_CLOCK RCC_USART3
+#define CONSOLE_PORT2_USART_CLOCK_FREQ rcc_apb1_frequency
+#define CONSOLE_PORT2_USART_GPIO_PORT GPIOB
+#define CONSOLE_PORT2_USART_GPIO_TX   GPIO10
+#define CONSOLE_PORT2_USART_GPIO_RX   GPIO11
+#define CONSOLE_PORT2_USART_IRQ_NAME  usart3_isr
+#define CONSOLE_PORT2_USART_NVIC_LINE NVIC_USART3_IRQ
+#define CONSOLE_PORT2_DMA_CONTROLLER DMA1
+#define CONSOLE_PORT2_DMA_CLOCK RCC_DMA1
+#define CONSOLE_PORT2_RX_DMA_CHANNEL DMA_CHANNEL3
+#define CONSOLE_PORT2_RX_DMA_NVIC_LINE NVIC_DMA1_CHANNEL3_IRQ
+#define CONSOLE_PORT2_RX_DMA_IRQ_NAME dma1_channel3_isr
+#define CONSOLE_PORT2_TX_DMA_CHANNEL DMA_CHANNEL2
+#define CONSOLE_PORT2_TX_DMA_NVIC_LINE NVIC_DMA1_CHANNEL2_IRQ
+#define CONSOLE_PORT2_TX_DMA_IRQ_NAME dma1_channel2_isr
+#define CONSOLE_PORT2_TX_BUFFER_SIZE 256
+#define CONSOLE_PORT2_RX_BUFFER_SIZE 512
+
 /* Word size for usart_recv and usart_send */
 typedef uint16_t usart_word_t;
 
 #define LED_OPEN_DRAIN         1
 
+/* USB packet memory size in bytes */
+#define USB_PMA_SIZE 512
+
+/*
+ * Three ports don't fit in packet memory with double-buffered 64-byte
+ * bulk endpoints, so the extra ports get single-buffered 32-byte ones.
+ */
+#define USB_DOUBLE_BUFFERED_BULK (CONSOLE_NUM_PORTS == 1)
+#define USB_CDC_AUX_PACKET_SIZE 32
+
+#define USB_INTERRUPT_DRIVEN 1
+#define USB_NVIC_LINE NVIC_USB_LP_CAN_RX0_IRQ
+#define USB_IRQ_NAME usb_lp_can_rx0_isr
+
+/*
+ * Run the per-byte and per-packet paths from RAM, clear of the two flash
+ * wait states at 72 MHz; see ramfunc.h
+ */
+#ifndef RAMFUNC_ENABLED
+#define RAMFUNC_ENABLED 1
+#endif
+
 #endif
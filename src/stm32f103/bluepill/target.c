@@ -53,6 +53,61 @@ void target_console_init(void){
                   GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, CONSOLE_USART_GPIO_TX);
     gpio_set_mode(CONSOLE_USART_GPIO_PORT, GPIO_MODE_INPUT,
                   GPIO_CNF_INPUT_FLOAT, CONSOLE_USART_GPIO_RX);
+
+#if CONSOLE_NUM_PORTS > 1
+    rcc_periph_clock_enable(CONSOLE_PORT1_USART_CLOCK);
+    gpio_set_mode(CONSOLE_PORT1_USART_GPIO_PORT, GPIO_MODE_OUTPUT_50_MHZ,
+                  GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, CONSOLE_PORT1_USART_GPIO_TX);
+    gpio_set_mode(CONSOLE_PORT1_USART_GPIO_PORT, GPIO_MODE_INPUT,
+                  GPIO_CNF_INPUT_FLOAT, CONSOLE_PORT1_USART_GPIO_RX);
+#endif
+
+#if CONSOLE_NUM_PORTS > 2
+    rcc_periph_clock_enable(RCC_GPIOB);
+    rcc_periph_clock_enable(CONSOLE_PORT2_USART_CLOCK);
+    gpio_set_mode(CONSOLE_PORT2_USART_GPIO_PORT, GPIO_MODE_OUTPUT_50_MHZ,
+                  GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, CONSOLE_PORT2_USART_GPIO_TX);
+    gpio_set_mode(CONSOLE_PORT2_USART_GPIO_PORT, GPIO_MODE_INPUT,
+                  GPIO_CNF_INPUT_FLOAT, CONSOLE_PORT2_USART_GPIO_RX);
+#endif
+
+#if CONSOLE_FLOW_CONTROL_AVAILABLE
+    /* RTS starts high (not ready); CTS is pulled low so an unconnected
+       CTS line doesn't block TX. The EXTI mux needs AFIO. */
+    rcc_periph_clock_enable(RCC_AFIO);
+    rcc_periph_clock_enable(CONSOLE_RTS_GPIO_CLOCK);
+    rcc_periph_clock_enable(CONSOLE_CTS_GPIO_CLOCK);
+    gpio_set(CONSOLE_RTS_GPIO_PORT, CONSOLE_RTS_GPIO_PIN);
+    gpio_set_mode(CONSOLE_RTS_GPIO_PORT, GPIO_MODE_OUTPUT_2_MHZ,
+                  GPIO_CNF_OUTPUT_PUSHPULL, CONSOLE_RTS_GPIO_PIN);
+    gpio_clear(CONSOLE_CTS_GPIO_PORT, CONSOLE_CTS_GPIO_PIN);
+    gpio_set_mode(CONSOLE_CTS_GPIO_PORT, GPIO_MODE_INPUT,
+                  GPIO_CNF_INPUT_PULL_UPDOWN, CONSOLE_CTS_GPIO_PIN);
+#endif
+
+    /* Modem status inputs are pulled up to read as inactive when open */
+    rcc_periph_clock_enable(RCC_GPIOB);
+    gpio_set(CONSOLE_DCD_GPIO_PORT, CONSOLE_DCD_GPIO_PIN);
+    gpio_set_mode(CONSOLE_DCD_GPIO_PORT, GPIO_MODE_INPUT,
+                  GPIO_CNF_INPUT_PULL_UPDOWN, CONSOLE_DCD_GPIO_PIN);
+    gpio_set(CONSOLE_DSR_GPIO_PORT, CONSOLE_DSR_GPIO_PIN);
+    gpio_set_mode(CONSOLE_DSR_GPIO_PORT, GPIO_MODE_INPUT,
+                  GPIO_CNF_INPUT_PULL_UPDOWN, CONSOLE_DSR_GPIO_PIN);
+    gpio_set(CONSOLE_RI_GPIO_PORT, CONSOLE_RI_GPIO_PIN);
+    gpio_set_mode(CONSOLE_RI_GPIO_PORT, GPIO_MODE_INPUT,
+                  GPIO_CNF_INPUT_PULL_UPDOWN, CONSOLE_RI_GPIO_PIN);
+}
+
+/* Hold TX low for a break, or hand it back to the USART */
+void target_console_set_break(bool active) {
+    if (active) {
+        gpio_clear(CONSOLE_USART_GPIO_PORT, CONSOLE_USART_GPIO_TX);
+        gpio_set_mode(CONSOLE_USART_GPIO_PORT, GPIO_MODE_OUTPUT_50_MHZ,
+                      GPIO_CNF_OUTPUT_PUSHPULL, CONSOLE_USART_GPIO_TX);
+    } else {
+        gpio_set_mode(CONSOLE_USART_GPIO_PORT, GPIO_MODE_OUTPUT_50_MHZ,
+                      GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, CONSOLE_USART_GPIO_TX);
+    }
 }
 
 void led_bit(uint8_t position, bool state) {
@@ -27,7 +27,7 @@
 #define CONSOLE_TX_USART USART1
 #define CONSOLE_RX_USART USART3
 
-#define CONSOLE_TX_BUFFER_SIZE 128
+#define CONSOLE_TX_BUFFER_SIZE 512
 #define CONSOLE_RX_BUFFER_SIZE 128
 
 #define CONSOLE_TX_USART_GPIO_PORT GPIOB
@@ -37,9 +37,16 @@
 
 #define CONSOLE_USART_MODE USART_MODE_TX_RX
 
+/* Breaks are detected with the USART's LIN mode */
+#define CONSOLE_USART_LIN_AVAILABLE 1
+
 #define CONSOLE_TX_USART_CLOCK RCC_USART1
 #define CONSOLE_RX_USART_CLOCK RCC_USART3
 
+/* USART1 is on APB2, USART3 on APB1 */
+#define CONSOLE_TX_USART_CLOCK_FREQ rcc_apb2_frequency
+#define CONSOLE_RX_USART_CLOCK_FREQ rcc_apb1_frequency
+
 #define CONSOLE_TX_USART_IRQ_NAME  usart1_isr
 #define CONSOLE_TX_USART_NVIC_LINE NVIC_USART1_IRQ
 #define CONSOLE_RX_USART_IRQ_NAME  usart3_isr
@@ -51,9 +58,57 @@
 #define CONSOLE_RX_DMA_CHANNEL DMA_CHANNEL3
 #define CONSOLE_RX_DMA_NVIC_LINE NVIC_DMA1_CHANNEL3_IRQ
 #define CONSOLE_RX_DMA_IRQ_NAME dma1_channel3_isr
+
+#define CONSOLE_TX_DMA_AVAILABLE 1
+#define CONSOLE_TX_DMA_CONTROLLER DMA1
+#define CONSOLE_TX_DMA_CLOCK RCC_DMA1
+#define CONSOLE_TX_DMA_CHANNEL DMA_CHANNEL4
+#define CONSOLE_TX_DMA_NVIC_LINE NVIC_DMA1_CHANNEL4_IRQ
+#define CONSOLE_TX_DMA_IRQ_NAME dma1_channel4_isr
+
+/* No spare pins on the dongle header for RTS/CTS */
+#define CONSOLE_FLOW_CONTROL_AVAILABLE 0
+
+/* Break timing; TIM3 runs at twice the APB1 clock */
+#define CONSOLE_BREAK_AVAILABLE 1
+#define CONSOLE_BREAK_TIMER TIM3
+#define CONSOLE_BREAK_TIMER_CLOCK RCC_TIM3
+#define CONSOLE_BREAK_TIMER_RST RST_TIM3
+#define CONSOLE_BREAK_TIMER_CLOCK_FREQ (2 * rcc_apb1_frequency)
+#define CONSOLE_BREAK_TIMER_NVIC_LINE NVIC_TIM3_IRQ
+#define CONSOLE_BREAK_TIMER_IRQ_NAME tim3_isr
+
+/* Microsecond timebase; TIM2 counts microseconds and TIM4 its overflows */
+#define TICK_TIMER TIM2
+#define TICK_TIMER_CLOCK RCC_TIM2
+#define TICK_TIMER_RST RST_TIM2
+#define TICK_TIMER_CLOCK_FREQ (2 * rcc_apb1_frequency)
+#define TICK_TIMER_NVIC_LINE NVIC_TIM2_IRQ
+#define TICK_TIMER_IRQ_NAME tim2_isr
+#define TICK_TIMER_HIGH TIM4
+#define TICK_TIMER_HIGH_CLOCK RCC_TIM4
+#define TICK_TIMER_HIGH_RST RST_TIM4
+#define TICK_TIMER_HIGH_TRIGGER TIM_SMCR_TS_ITR1
+
 /* Word size for usart_recv and usart_send */
 typedef uint16_t usart_word_t;
 
 #define LED_OPEN_DRAIN         0
 
+/* USB packet memory size in bytes */
+#define USB_PMA_SIZE 512
+#define USB_DOUBLE_BUFFERED_BULK 1
+
+#define USB_INTERRUPT_DRIVEN 1
+#define USB_NVIC_LINE NVIC_USB_LP_CAN_RX0_IRQ
+#define USB_IRQ_NAME usb_lp_can_rx0_isr
+
+/*
+ * Run the per-byte and per-packet paths from RAM, clear of the two flash
+ * wait states at 72 MHz; see ramfunc.h
+ */
+#ifndef RAMFUNC_ENABLED
+#define RAMFUNC_ENABLED 1
+#endif
+
 #endif
@@ -60,6 +60,18 @@ void target_console_init(void){
     gpio_primary_remap(AFIO_MAPR_SWJ_CFG_FULL_SWJ, AFIO_MAPR_USART1_REMAP);
 }
 
+/* Hold TX low for a break, or hand it back to the USART */
+void target_console_set_break(bool active) {
+    if (active) {
+        gpio_clear(CONSOLE_TX_USART_GPIO_PORT, CONSOLE_USART_GPIO_TX);
+        gpio_set_mode(CONSOLE_TX_USART_GPIO_PORT, GPIO_MODE_OUTPUT_50_MHZ,
+                      GPIO_CNF_OUTPUT_PUSHPULL, CONSOLE_USART_GPIO_TX);
+    } else {
+        gpio_set_mode(CONSOLE_TX_USART_GPIO_PORT, GPIO_MODE_OUTPUT_50_MHZ,
+                      GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, CONSOLE_USART_GPIO_TX);
+    }
+}
+
 void led_bit(uint8_t position, bool state) {
     uint32_t gpio = 0xFFFFFFFFU;
     if (position == 0) {
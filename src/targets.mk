@@ -50,6 +50,12 @@ ifeq ($(TARGET),BLUEPILL-DFUBOOT)
 	DEFS               += -DDFU_AVAILABLE=1
 	DFU_VID_PID        := 1209:db42
 endif
+ifeq ($(TARGET),HOST)
+	TARGET_COMMON_DIR	:= ./host
+	TARGET_SPEC_DIR		:= ./stm32f103/bluepill
+	ARCH				= HOST
+	DEFS               += -DDFU_AVAILABLE=0 -DSTM32F1
+endif
 ifndef ARCH
 $(error Unknown target $(TARGET))
 endif
@@ -19,57 +19,87 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/nvic.h>
 #include <libopencm3/stm32/desig.h>
 #include <libopencm3/stm32/iwdg.h>
 
 #include "config.h"
 #include "target.h"
+#include "irq_priority.h"
 
 #include "USB/composite_usb_conf.h"
 #include "USB/cdc.h"
 #include "USB/dfu.h"
+#include "USB/raw.h"
 
 #include "DFU/DFU.h"
 
 #include "tick.h"
 #include "retarget.h"
 #include "console.h"
+#include "profile.h"
 
-static inline uint32_t millis(void) {
-    return get_ticks();
-}
-
+/* Busy-wait, across timebase wraps */
 static inline void wait_ms(uint32_t duration_ms) {
-    uint32_t now = millis();
-    uint32_t end = now + duration_ms;
-    if (end < now) {
-        end = 0xFFFFFFFFU - end;
-        while (millis() >= now) {
-            __asm__("NOP");
-        }
-    }
-
-    while (millis() < end) {
+    uint32_t start = get_ticks();
+    while ((uint32_t)(get_ticks() - start) < duration_ms) {
         __asm__("NOP");
     }
 }
 
-static uint32_t usb_timer = 0;
+#ifndef TARGET_WAIT_FOR_INTERRUPT
+#define TARGET_WAIT_FOR_INTERRUPT() __asm__ volatile ("wfi")
+#endif
+
+/* How long the activity LED stays lit after USB traffic */
+#define USB_ACTIVITY_LED_US 20000
+
+static volatile uint32_t usb_activity_time = 0;
+static volatile bool usb_active = false;
 
 static void on_usb_activity(void) {
-    usb_timer = 1000;
+    usb_activity_time = get_micros();
+    usb_active = true;
 }
 
-static bool do_reset_to_dfu = false;
+static volatile bool do_reset_to_dfu = false;
 static void on_dfu_request(void) {
     do_reset_to_dfu = true;
 }
 
+static usbd_device* usb_device = NULL;
+
+/* Handle USB events and move data between the USB endpoints and console */
+static void usb_service(void) {
+    usbd_poll(usb_device);
+
+    if (cdc_uart_app_update()) {
+        on_usb_activity();
+    }
+#if USB_RAW_AVAILABLE
+    raw_update();
+#endif
+}
+
+#if USB_INTERRUPT_DRIVEN
+void USB_IRQ_NAME(void) {
+    usb_service();
+}
+
+/* Flush console RX data from the USB handler as soon as it arrives */
+static void on_console_rx_event(struct console* con) {
+    (void)con;
+    nvic_set_pending_irq(USB_NVIC_LINE);
+}
+#endif
+
 int main(void) {
     DFU_maybe_jump_to_bootloader();
 
     clock_setup();
-    tick_setup(1000);
+    tick_setup();
+    cycle_counter_setup();
     gpio_setup();
     led_num(0);
 
@@ -92,14 +122,26 @@ int main(void) {
         dfu_setup(usbd_dev, &on_dfu_request);
     }
 
+#if USB_RAW_AVAILABLE
+    raw_setup(usbd_dev, &on_usb_activity);
+#endif
+
+    usb_device = usbd_dev;
+#if USB_INTERRUPT_DRIVEN
+    for (uint8_t port = 0; port < CONSOLE_NUM_PORTS; port++) {
+        console_set_rx_event_callback(console_port(port), &on_console_rx_event);
+    }
+    nvic_set_priority(USB_NVIC_LINE, IRQ_PRIORITY_USB);
+    nvic_enable_irq(USB_NVIC_LINE);
+#endif
+
     tick_start();
 
     while (1) {
-        usbd_poll(usbd_dev);
-
-        if (cdc_uart_app_update()) {
-            on_usb_activity();
-        }
+        PROFILE_BEGIN(PROFILE_MAIN_LOOP);
+#if !USB_INTERRUPT_DRIVEN
+        usb_service();
+#endif
 
         if (do_reset_to_dfu) {
             /* Blink 3 times to indicate reset */
@@ -116,12 +158,27 @@ int main(void) {
             DFU_reset_and_jump_to_bootloader();
         }
 
-        if (usb_timer > 0) {
-            usb_timer--;
+        if (usb_active && (uint32_t)(get_micros() - usb_activity_time) < USB_ACTIVITY_LED_US) {
             led_bit(0, 1);
         } else {
+            usb_active = false;
             led_bit(0, 0);
         }
+        PROFILE_END(PROFILE_MAIN_LOOP);
+
+#if USB_INTERRUPT_DRIVEN
+        // Sleep until an interrupt, with a deadline to wake us when the
+        // LED is due to go out. Interrupts are masked so that a DFU
+        // request raised after the check still wakes the core from WFI.
+        cm_disable_interrupts();
+        if (usb_active) {
+            tick_set_deadline(usb_activity_time + USB_ACTIVITY_LED_US, NULL);
+        }
+        if (!do_reset_to_dfu) {
+            TARGET_WAIT_FOR_INTERRUPT();
+        }
+        cm_enable_interrupts();
+#endif
     }
 
     return 0;
@@ -16,39 +16,220 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <libopencm3/cm3/systick.h>
 #include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
 #include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/cortex.h>
+#ifdef STM32F0
+#include <libopencm3/cm3/systick.h>
+#else
+#include <libopencm3/cm3/dwt.h>
+#endif
 
+#include "config.h"
+#include "irq_priority.h"
+#include "ramfunc.h"
 #include "tick.h"
 
-volatile uint32_t __ticks = 0;
+/*
+ * The timebase is a free-running timer counting microseconds, with no
+ * periodic interrupt. On parts without a 32-bit timer, a second timer
+ * counts the first one's overflows to make up the high half. The only
+ * interrupt is the compare channel used for deadlines.
+ */
+#ifdef TICK_TIMER_HIGH
+#define TICK_TIMER_MAX 0xFFFFU
+#else
+#define TICK_TIMER_MAX 0xFFFFFFFFU
+#endif
+
+/*
+ * Millisecond count, extended from the microsecond timebase whenever it
+ * is read rather than by a wrap interrupt, along with the timebase value
+ * it was last brought up to in whole milliseconds.
+ */
+static uint32_t tick_ms = 0;
+static uint32_t tick_ms_micros = 0;
 
-void sys_tick_handler(void)
-{
-    __ticks++;
+static volatile bool tick_deadline_armed = false;
+static volatile uint32_t tick_deadline;
+static volatile tick_deadline_callback tick_deadline_cb = NULL;
+
+static void tick_timer_reset(uint32_t timer, uint32_t period) {
+    timer_set_mode(timer, TIM_CR1_CKD_CK_INT, TIM_CR1_CMS_EDGE, TIM_CR1_DIR_UP);
+    timer_continuous_mode(timer);
+    timer_set_period(timer, period);
+    timer_update_on_overflow(timer);
 }
 
-bool tick_setup(uint32_t tick_freq_hz) {
-    bool success = false;
+void tick_setup(void) {
+    rcc_periph_clock_enable(TICK_TIMER_CLOCK);
+    rcc_periph_reset_pulse(TICK_TIMER_RST);
 
-    if (systick_set_frequency(tick_freq_hz, rcc_ahb_frequency)) {
-        systick_clear();
-        systick_interrupt_enable();
-        success = true;
-    }
+    tick_timer_reset(TICK_TIMER, TICK_TIMER_MAX);
+    timer_set_prescaler(TICK_TIMER, TICK_TIMER_CLOCK_FREQ / 1000000 - 1);
+    // Load the prescaler before counting
+    timer_generate_event(TICK_TIMER, TIM_EGR_UG);
+
+#ifdef TICK_TIMER_HIGH
+    rcc_periph_clock_enable(TICK_TIMER_HIGH_CLOCK);
+    rcc_periph_reset_pulse(TICK_TIMER_HIGH_RST);
 
-    return success;
+    // Count the low timer's overflows through its trigger output
+    timer_set_master_mode(TICK_TIMER, TIM_CR2_MMS_UPDATE);
+    tick_timer_reset(TICK_TIMER_HIGH, 0xFFFF);
+    timer_slave_set_trigger(TICK_TIMER_HIGH, TICK_TIMER_HIGH_TRIGGER);
+    timer_slave_set_mode(TICK_TIMER_HIGH, TIM_SMCR_SMS_ECM1);
+    timer_set_counter(TICK_TIMER_HIGH, 0);
+#endif
+
+    timer_set_counter(TICK_TIMER, 0);
+    timer_clear_flag(TICK_TIMER, TIM_SR_UIF | TIM_SR_CC1IF);
+    tick_ms = 0;
+    tick_ms_micros = 0;
+
+    nvic_set_priority(TICK_TIMER_NVIC_LINE, IRQ_PRIORITY_TICK);
+    nvic_enable_irq(TICK_TIMER_NVIC_LINE);
 }
 
 void tick_start(void) {
-    systick_counter_enable();
+#ifdef TICK_TIMER_HIGH
+    timer_enable_counter(TICK_TIMER_HIGH);
+#endif
+    timer_enable_counter(TICK_TIMER);
 }
 
 void tick_stop(void) {
-    systick_counter_disable();
+    timer_disable_counter(TICK_TIMER);
+#ifdef TICK_TIMER_HIGH
+    timer_disable_counter(TICK_TIMER_HIGH);
+#endif
 }
 
+/*
+ * Microseconds since the timebase started; wraps every 71 minutes.
+ * Safe to call from any context.
+ *
+ * With cascaded timers, the high half is read on either side of the low
+ * half and the read is retried if it changed. The high timer also counts
+ * a couple of timer clocks after the low one wraps, so a low half of 0
+ * may not have been carried yet; that lasts less than a microsecond, so
+ * it is waited out too.
+ */
+RAMFUNC uint32_t get_micros(void) {
+#ifdef TICK_TIMER_HIGH
+    uint32_t high;
+    uint32_t low;
+    do {
+        high = timer_get_counter(TICK_TIMER_HIGH);
+        low = timer_get_counter(TICK_TIMER);
+    } while ((low == 0 && (TIM_CR1(TICK_TIMER) & TIM_CR1_CEN))
+             || high != timer_get_counter(TICK_TIMER_HIGH));
+    return (high << 16) | low;
+#else
+    return timer_get_counter(TICK_TIMER);
+#endif
+}
+
+/*
+ * Milliseconds since the timebase started; wraps every 49 days. Each
+ * read adds the whole milliseconds elapsed since the last one, which
+ * takes a 32-bit divide and stays right as long as reads are less than
+ * 71 minutes apart. Safe to call from any context.
+ */
 uint32_t get_ticks(void) {
-    return __ticks;
+    uint32_t masked = cm_mask_interrupts(1);
+    uint32_t elapsed_ms = (get_micros() - tick_ms_micros) / 1000;
+    tick_ms += elapsed_ms;
+    tick_ms_micros += elapsed_ms * 1000;
+    uint32_t ticks = tick_ms;
+    cm_mask_interrupts(masked);
+    return ticks;
+}
+
+static bool tick_reached(uint32_t deadline_us) {
+    return (int32_t)(get_micros() - deadline_us) >= 0;
+}
+
+/*
+ * Arm the compare channel to call callback, which may be NULL to only
+ * wake the core, from the tick interrupt once get_micros() reaches
+ * deadline_us. Replaces any pending deadline; one in the past fires
+ * straight away. The deadline must be within 35 minutes.
+ */
+void tick_set_deadline(uint32_t deadline_us, tick_deadline_callback callback) {
+    timer_disable_irq(TICK_TIMER, TIM_DIER_CC1IE);
+    tick_deadline = deadline_us;
+    tick_deadline_cb = callback;
+    tick_deadline_armed = true;
+
+    timer_set_oc_value(TICK_TIMER, TIM_OC1, deadline_us & TICK_TIMER_MAX);
+    timer_clear_flag(TICK_TIMER, TIM_SR_CC1IF);
+    timer_enable_irq(TICK_TIMER, TIM_DIER_CC1IE);
+
+    // The counter may have passed the compare value before it was armed
+    if (tick_reached(deadline_us)) {
+        timer_generate_event(TICK_TIMER, TIM_EGR_CC1G);
+    }
+}
+
+void tick_cancel_deadline(void) {
+    timer_disable_irq(TICK_TIMER, TIM_DIER_CC1IE);
+    tick_deadline_armed = false;
+}
+
+void TICK_TIMER_IRQ_NAME(void) {
+    if (timer_get_flag(TICK_TIMER, TIM_SR_CC1IF)) {
+        timer_clear_flag(TICK_TIMER, TIM_SR_CC1IF);
+        // A 16-bit compare also matches each time the low half passes the
+        // deadline's low bits on the way, so check the whole time
+        if (tick_deadline_armed && tick_reached(tick_deadline)) {
+            timer_disable_irq(TICK_TIMER, TIM_DIER_CC1IE);
+            tick_deadline_armed = false;
+            tick_deadline_callback callback = tick_deadline_cb;
+            if (callback) {
+                callback();
+            }
+        }
+    }
+}
+
+#ifdef STM32F0
+/*
+ * The Cortex-M0 has no DWT cycle counter, so fall back on SysTick, which
+ * the timebase leaves free. It runs without its interrupt as a 24-bit
+ * down counter at the core clock rate, so intervals are only measured
+ * correctly if they are shorter than 2^24 cycles.
+ */
+void cycle_counter_setup(void) {
+    systick_set_clocksource(STK_CSR_CLKSOURCE_AHB);
+    systick_set_reload(0x00FFFFFF);
+    systick_clear();
+    systick_counter_enable();
+}
+
+uint32_t cycle_counter_read(void) {
+    return systick_get_value();
+}
+
+uint32_t cycle_counter_elapsed(uint32_t start) {
+    uint32_t now = systick_get_value();
+    if (now <= start) {
+        return start - now;
+    } else {
+        return start + (systick_get_reload() + 1) - now;
+    }
+}
+#else
+void cycle_counter_setup(void) {
+    dwt_enable_cycle_counter();
+}
+
+uint32_t cycle_counter_read(void) {
+    return dwt_read_cycle_counter();
+}
+
+uint32_t cycle_counter_elapsed(uint32_t start) {
+    return dwt_read_cycle_counter() - start;
 }
+#endif
@@ -19,12 +19,27 @@
 #ifndef TICK_H_INCLUDED
 #define TICK_H_INCLUDED
 
-extern bool tick_setup(uint32_t tick_freq_hz);
+extern void tick_setup(void);
 extern void tick_start(void);
 extern void tick_stop(void);
 
-extern volatile uint32_t __ticks;
-
+/*
+ * Free-running timebase. Both counts wrap, so compare times by their
+ * unsigned difference, as in (get_micros() - start) >= timeout. The
+ * millisecond count only keeps up if it's read at least every 71
+ * minutes, as a polling loop does.
+ */
 extern uint32_t get_ticks(void);
+extern uint32_t get_micros(void);
+
+/* One-shot deadline on the timebase's compare channel */
+typedef void (*tick_deadline_callback)(void);
+extern void tick_set_deadline(uint32_t deadline_us, tick_deadline_callback callback);
+extern void tick_cancel_deadline(void);
+
+/* CPU cycle counter for timing short code paths, such as ISRs */
+extern void cycle_counter_setup(void);
+extern uint32_t cycle_counter_read(void);
+extern uint32_t cycle_counter_elapsed(uint32_t start);
 
 #endif
@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Decoder for termlink's framed capture stream (see src/capture.h).
+ * Reads the stream from a file, a CDC-ACM tty or stdin and prints one
+ * line per record with the device timestamp:
+ *
+ *         1.204518 +      0.000000  RX    "AT\r\n"
+ *         1.204865 +      0.000347  IDLE
+ *         1.251002 +      0.046137  RX    "OK\r\n"
+ *
+ * Times are relative to the first record, followed by the time since the
+ * previous record.
+ *
+ * The 32-bit device timestamps are unwrapped into a continuous time line,
+ * which assumes no gap between records is longer than 71 minutes.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+#define HEADER_SIZE 5
+
+struct decoder {
+    bool hex;
+    bool synced;
+    bool have_time;
+    uint32_t last_raw;
+    uint64_t time_us;
+    uint64_t first_us;
+    uint64_t prev_us;
+};
+
+/* Unwrap a device timestamp against the previous one */
+static uint64_t unwrap(struct decoder* d, uint32_t raw) {
+    if (!d->have_time) {
+        d->time_us = raw;
+        d->first_us = raw;
+        d->prev_us = raw;
+        d->have_time = true;
+    } else {
+        /* Signed difference, so records slightly out of order step back */
+        d->time_us += (int32_t)(raw - d->last_raw);
+    }
+    d->last_raw = raw;
+    return d->time_us;
+}
+
+static void print_time(struct decoder* d, uint32_t raw) {
+    uint64_t t = unwrap(d, raw);
+    int64_t delta = (int64_t)(t - d->prev_us);
+    int64_t rel = (int64_t)(t - d->first_us);
+    printf("%c%7lld.%06lld %c%7lld.%06lld  ",
+           rel < 0 ? '-' : ' ', llabs(rel) / 1000000, llabs(rel) % 1000000,
+           delta < 0 ? '-' : '+', llabs(delta) / 1000000, llabs(delta) % 1000000);
+    d->prev_us = t;
+}
+
+static void print_data(const struct decoder* d, const uint8_t* data, size_t len) {
+    if (d->hex) {
+        for (size_t i = 0; i < len; i++) {
+            printf("%s%02x", i ? " " : "", data[i]);
+        }
+        return;
+    }
+
+    putchar('"');
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = data[i];
+        switch (c) {
+            case '\r': fputs("\\r", stdout); break;
+            case '\n': fputs("\\n", stdout); break;
+            case '\t': fputs("\\t", stdout); break;
+            case '"':  fputs("\\\"", stdout); break;
+            case '\\': fputs("\\\\", stdout); break;
+            default:
+                if (c >= 0x20 && c < 0x7F) {
+                    putchar(c);
+                } else {
+                    printf("\\x%02x", c);
+                }
+        }
+    }
+    putchar('"');
+}
+
+static void print_line_events(uint8_t events) {
+    static const char* names[] = { "break", "framing", "parity", "overrun" };
+    bool first = true;
+    for (unsigned i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (events & (1 << i)) {
+            printf("%s%s", first ? "" : ",", names[i]);
+            first = false;
+        }
+    }
+}
+
+/* Size of the record at buf, or 0 if more bytes are needed; -1 if invalid */
+static long record_size(const uint8_t* buf, size_t len) {
+    if (len < 1) {
+        return 0;
+    }
+    switch (buf[0]) {
+        case CAPTURE_REC_SYNC: return HEADER_SIZE + 4;
+        case CAPTURE_REC_IDLE: return HEADER_SIZE;
+        case CAPTURE_REC_LINE: return HEADER_SIZE + 1;
+        case CAPTURE_REC_LOST: return HEADER_SIZE + 1;
+        case CAPTURE_REC_RUN:
+            return (len < HEADER_SIZE + 1) ? 0 : HEADER_SIZE + 1 + buf[HEADER_SIZE];
+        default: return -1;
+    }
+}
+
+static void decode_record(struct decoder* d, const uint8_t* rec) {
+    uint32_t raw = (uint32_t)rec[1] | (uint32_t)rec[2] << 8
+                   | (uint32_t)rec[3] << 16 | (uint32_t)rec[4] << 24;
+    const uint8_t* payload = &rec[HEADER_SIZE];
+
+    print_time(d, raw);
+    switch (rec[0]) {
+        case CAPTURE_REC_SYNC:
+            printf("SYNC  version %u", payload[3]);
+            if (memcmp(payload, "TLC", 3) != 0 || payload[3] != CAPTURE_VERSION) {
+                printf(" (unexpected)");
+            }
+            break;
+        case CAPTURE_REC_RUN:
+            printf("RX    ");
+            print_data(d, &payload[1], payload[0]);
+            break;
+        case CAPTURE_REC_IDLE:
+            printf("IDLE");
+            break;
+        case CAPTURE_REC_LINE:
+            printf("LINE  ");
+            print_line_events(payload[0]);
+            break;
+        case CAPTURE_REC_LOST:
+            printf("LOST  %u%s timing marks; nearby times may be off",
+                   payload[0], payload[0] == 0xFF ? "+" : "");
+            break;
+    }
+    putchar('\n');
+}
+
+/*
+ * Decode everything complete in buf; returns the bytes used. Until the
+ * first SYNC record, bytes are skipped, so capturing can start with
+ * stale raw data still in the tty's buffer.
+ */
+static size_t decode(struct decoder* d, const uint8_t* buf, size_t len) {
+    size_t used = 0;
+    while (used < len) {
+        if (!d->synced) {
+            if (len - used < HEADER_SIZE + 4) {
+                break;
+            }
+            if (buf[used] == CAPTURE_REC_SYNC
+                && memcmp(&buf[used + HEADER_SIZE], "TLC", 3) == 0) {
+                d->synced = true;
+            } else {
+                used++;
+                continue;
+            }
+        }
+
+        long size = record_size(&buf[used], len - used);
+        if (size < 0) {
+            fprintf(stderr, "bad record type 0x%02x; resynchronising\n", buf[used]);
+            d->synced = false;
+            used++;
+            continue;
+        } else if (size == 0 || (size_t)size > len - used) {
+            break;
+        }
+        decode_record(d, &buf[used]);
+        used += size;
+    }
+    fflush(stdout);
+    return used;
+}
+
+/* Put a tty into raw mode, so the stream isn't mangled */
+static void make_raw(int fd) {
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        tio.c_cc[VMIN] = 1;
+        tio.c_cc[VTIME] = 0;
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+}
+
+int main(int argc, char** argv) {
+    struct decoder d;
+    memset(&d, 0, sizeof(d));
+
+    int c;
+    while ((c = getopt(argc, argv, "x")) != -1) {
+        switch (c) {
+            case 'x':
+                d.hex = true;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-x] [file|tty]\n"
+                                "  -x  print data as hex\n", argv[0]);
+                return 2;
+        }
+    }
+
+    int fd = STDIN_FILENO;
+    if (optind < argc) {
+        fd = open(argv[optind], O_RDONLY | O_NOCTTY);
+        if (fd < 0) {
+            perror(argv[optind]);
+            return 1;
+        }
+    }
+    if (isatty(fd)) {
+        make_raw(fd);
+    }
+
+    uint8_t buf[4096];
+    size_t len = 0;
+    while (true) {
+        ssize_t got = read(fd, &buf[len], sizeof(buf) - len);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        } else if (got <= 0) {
+            break;
+        }
+        len += got;
+
+        size_t used = decode(&d, buf, len);
+        memmove(buf, &buf[used], len - used);
+        len -= used;
+    }
+
+    return 0;
+}
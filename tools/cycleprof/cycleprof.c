@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Reads termlink's cycle profiles over USB and prints them as a table.
+ * The firmware must be built with `make PROFILE=1`.
+ *
+ *   cycleprof            profile since boot or the last reset
+ *   cycleprof -w 10      reset, wait 10 seconds, then print
+ *   cycleprof -H         also print each point's histogram
+ *
+ * The median and 99th percentile come from the log2 histogram, so they
+ * are the upper bound of the bucket they fall in.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libusb.h>
+
+/* Keep in sync with src/USB/cdc_defs.h and src/profile.h */
+#define CDC_VENDOR_REQ_GET_PROFILE   0x22
+#define CDC_VENDOR_REQ_RESET_PROFILE 0x23
+
+#define PROFILE_HISTOGRAM_BUCKETS 16
+#define PROFILE_REPORT_SIZE (8 + 16 + 4 * PROFILE_HISTOGRAM_BUCKETS)
+
+static const char* point_names[] = {
+    "USART ISR",
+    "DMA ISR",
+    "SOF",
+    "IN transfer",
+    "bulk OUT",
+    "bulk IN",
+    "main loop",
+};
+
+#define NUM_POINT_NAMES (sizeof(point_names) / sizeof(point_names[0]))
+
+#define REQ_OUT (LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE)
+#define REQ_IN  (LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE)
+
+#define CONTROL_TIMEOUT_MS 1000
+
+struct report {
+    uint32_t clock_hz;
+    uint32_t num_points;
+    uint32_t calls;
+    uint32_t max_cycles;
+    uint64_t total_cycles;
+    uint32_t histogram[PROFILE_HISTOGRAM_BUCKETS];
+};
+
+static uint32_t get_u32(const uint8_t* buf) {
+    return (uint32_t)buf[0] | (uint32_t)buf[1] << 8
+           | (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24;
+}
+
+static void die_usb(const char* what, int rc) {
+    fprintf(stderr, "%s: %s\n", what, libusb_strerror(rc));
+    exit(1);
+}
+
+/* Returns false if the device has no such point */
+static bool read_point(libusb_device_handle* handle, uint16_t intf, uint16_t point,
+                       struct report* report) {
+    uint8_t buf[PROFILE_REPORT_SIZE];
+    int rc = libusb_control_transfer(handle, REQ_IN, CDC_VENDOR_REQ_GET_PROFILE, point, intf,
+                                     buf, sizeof(buf), CONTROL_TIMEOUT_MS);
+    if (rc == LIBUSB_ERROR_PIPE) {
+        return false;
+    } else if (rc < 0) {
+        die_usb("profile request", rc);
+    } else if (rc != sizeof(buf)) {
+        fprintf(stderr, "short profile reply (%d bytes)\n", rc);
+        exit(1);
+    }
+
+    report->clock_hz = get_u32(&buf[0]);
+    report->num_points = get_u32(&buf[4]);
+    report->calls = get_u32(&buf[8]);
+    report->max_cycles = get_u32(&buf[12]);
+    report->total_cycles = get_u32(&buf[16]) | (uint64_t)get_u32(&buf[20]) << 32;
+    for (int i = 0; i < PROFILE_HISTOGRAM_BUCKETS; i++) {
+        report->histogram[i] = get_u32(&buf[24 + 4 * i]);
+    }
+    return true;
+}
+
+/* Upper bound of the bucket holding the given fraction of calls */
+static uint64_t percentile(const struct report* report, double fraction) {
+    uint64_t target = (uint64_t)(report->calls * fraction);
+    uint64_t seen = 0;
+    for (int i = 0; i < PROFILE_HISTOGRAM_BUCKETS; i++) {
+        seen += report->histogram[i];
+        if (seen > target) {
+            return (i == PROFILE_HISTOGRAM_BUCKETS - 1) ? report->max_cycles
+                                                        : (2ULL << i) - 1;
+        }
+    }
+    return report->max_cycles;
+}
+
+static double cycles_to_us(const struct report* report, double cycles) {
+    return report->clock_hz ? cycles * 1e6 / report->clock_hz : 0.0;
+}
+
+static void print_histogram(const struct report* report) {
+    uint32_t peak = 0;
+    for (int i = 0; i < PROFILE_HISTOGRAM_BUCKETS; i++) {
+        if (report->histogram[i] > peak) {
+            peak = report->histogram[i];
+        }
+    }
+    for (int i = 0; i < PROFILE_HISTOGRAM_BUCKETS; i++) {
+        if (report->histogram[i] == 0) {
+            continue;
+        }
+        int bar = (int)((40ULL * report->histogram[i] + peak - 1) / peak);
+        if (i == PROFILE_HISTOGRAM_BUCKETS - 1) {
+            printf("    %6u+       %10u  %.*s\n", 1u << i, report->histogram[i],
+                   bar, "########################################");
+        } else {
+            printf("    %6u-%-6u %10u  %.*s\n", i ? 1u << i : 0, (2u << i) - 1,
+                   report->histogram[i], bar, "########################################");
+        }
+    }
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -d vid:pid   device to open (default 1209:0001)\n"
+            "  -i intf      CDC control interface to ask (default 0)\n"
+            "  -w seconds   reset the profile, wait, then print it\n"
+            "  -r           reset the profile after printing it\n"
+            "  -H           print histograms\n", argv0);
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    uint16_t vid = 0x1209;
+    uint16_t pid = 0x0001;
+    uint16_t intf = 0;
+    unsigned wait_seconds = 0;
+    bool reset_after = false;
+    bool histograms = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "d:i:w:rH")) != -1) {
+        switch (c) {
+            case 'd': {
+                unsigned v, p;
+                if (sscanf(optarg, "%x:%x", &v, &p) != 2) {
+                    usage(argv[0]);
+                }
+                vid = v;
+                pid = p;
+                break;
+            }
+            case 'i': intf = strtoul(optarg, NULL, 0); break;
+            case 'w': wait_seconds = strtoul(optarg, NULL, 0); break;
+            case 'r': reset_after = true; break;
+            case 'H': histograms = true; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+    }
+
+    int rc = libusb_init(NULL);
+    if (rc < 0) {
+        die_usb("libusb_init", rc);
+    }
+    libusb_device_handle* handle = libusb_open_device_with_vid_pid(NULL, vid, pid);
+    if (handle == NULL) {
+        fprintf(stderr, "no device %04x:%04x\n", vid, pid);
+        return 1;
+    }
+
+    if (wait_seconds > 0) {
+        rc = libusb_control_transfer(handle, REQ_OUT, CDC_VENDOR_REQ_RESET_PROFILE, 0, intf,
+                                     NULL, 0, CONTROL_TIMEOUT_MS);
+        if (rc < 0) {
+            die_usb("profile reset", rc);
+        }
+        sleep(wait_seconds);
+    }
+
+    struct report report;
+    if (!read_point(handle, intf, 0, &report)) {
+        fprintf(stderr, "no profile; is the firmware built with PROFILE=1?\n");
+        return 1;
+    }
+
+    printf("core clock %.1f MHz\n\n", report.clock_hz / 1e6);
+    printf("%-12s %10s %9s %9s %9s %9s %9s %9s\n", "point", "calls", "mean",
+           "p50", "p99", "max", "mean us", "max us");
+    uint32_t num_points = report.num_points;
+    for (uint32_t point = 0; point < num_points; point++) {
+        if (point > 0 && !read_point(handle, intf, point, &report)) {
+            break;
+        }
+
+        char unnamed[16];
+        const char* name;
+        if (point < NUM_POINT_NAMES) {
+            name = point_names[point];
+        } else {
+            snprintf(unnamed, sizeof(unnamed), "point %u", point);
+            name = unnamed;
+        }
+
+        double mean = report.calls ? (double)report.total_cycles / report.calls : 0.0;
+        printf("%-12s %10u %9.0f %9llu %9llu %9u %9.2f %9.2f\n", name, report.calls, mean,
+               (unsigned long long)percentile(&report, 0.5),
+               (unsigned long long)percentile(&report, 0.99), report.max_cycles,
+               cycles_to_us(&report, mean), cycles_to_us(&report, report.max_cycles));
+        if (histograms && report.calls > 0) {
+            print_histogram(&report);
+        }
+    }
+
+    if (reset_after) {
+        rc = libusb_control_transfer(handle, REQ_OUT, CDC_VENDOR_REQ_RESET_PROFILE, 0, intf,
+                                     NULL, 0, CONTROL_TIMEOUT_MS);
+        if (rc < 0) {
+            die_usb("profile reset", rc);
+        }
+    }
+
+    libusb_close(handle);
+    libusb_exit(NULL);
+    return 0;
+}
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Runs termlink's link self-test on one port and prints a line per baud
+ * rate. The port is taken away from the host for the test's duration.
+ *
+ *   linktest                     internal loopback at 115200 baud
+ *   linktest -b 9600 -m 3000000  sweep from 9600 up to 3 Mbaud
+ *   linktest -x                  external loopback; wire TX to RX
+ *   linktest -t                  only send, for another device to check
+ *
+ * Error rates count bit errors in bytes that were checked, so dropped
+ * bytes show up as resyncs and overruns rather than bit errors.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libusb.h>
+
+/* Keep in sync with src/USB/cdc_defs.h and src/selftest.h */
+#define CDC_VENDOR_REQ_SET_SELFTEST 0x24
+#define CDC_VENDOR_REQ_GET_SELFTEST 0x25
+
+#define SELFTEST_TX       (1 << 0)
+#define SELFTEST_RX       (1 << 1)
+#define SELFTEST_INTERNAL (1 << 2)
+
+#define SELFTEST_RUNNING 1
+
+#define SELFTEST_PARAMS_SIZE 12
+#define SELFTEST_REPORT_SIZE (4 + 11 * 4 + 2 * 2)
+
+#define REQ_OUT (LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE)
+#define REQ_IN  (LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE)
+
+#define CONTROL_TIMEOUT_MS 1000
+#define POLL_INTERVAL_US 100000
+
+struct report {
+    uint8_t state;
+    uint8_t mode;
+    uint8_t num_steps;
+    uint8_t steps_done;
+    uint32_t baudrate;
+    uint32_t tx_bytes;
+    uint32_t tx_us;
+    uint32_t rx_bytes;
+    uint32_t rx_us;
+    uint32_t checked_bytes;
+    uint32_t bit_errors;
+    uint32_t byte_errors;
+    uint32_t resyncs;
+    uint32_t overruns;
+    uint32_t line_errors;
+    uint16_t tx_high_water;
+    uint16_t rx_high_water;
+};
+
+static uint32_t get_u32(const uint8_t* buf) {
+    return (uint32_t)buf[0] | (uint32_t)buf[1] << 8
+           | (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24;
+}
+
+static uint16_t get_u16(const uint8_t* buf) {
+    return (uint16_t)(buf[0] | buf[1] << 8);
+}
+
+static void put_u32(uint8_t* buf, uint32_t value) {
+    buf[0] = (uint8_t)value;
+    buf[1] = (uint8_t)(value >> 8);
+    buf[2] = (uint8_t)(value >> 16);
+    buf[3] = (uint8_t)(value >> 24);
+}
+
+static void die_usb(const char* what, int rc) {
+    fprintf(stderr, "%s: %s\n", what, libusb_strerror(rc));
+    exit(1);
+}
+
+static void read_step(libusb_device_handle* handle, uint16_t intf, uint8_t step,
+                      struct report* report) {
+    uint8_t buf[SELFTEST_REPORT_SIZE];
+    int rc = libusb_control_transfer(handle, REQ_IN, CDC_VENDOR_REQ_GET_SELFTEST, step, intf,
+                                     buf, sizeof(buf), CONTROL_TIMEOUT_MS);
+    if (rc < 0) {
+        die_usb("self-test status", rc);
+    } else if (rc != sizeof(buf)) {
+        fprintf(stderr, "short self-test reply (%d bytes)\n", rc);
+        exit(1);
+    }
+
+    report->state = buf[0];
+    report->mode = buf[1];
+    report->num_steps = buf[2];
+    report->steps_done = buf[3];
+    const uint8_t* p = &buf[4];
+    uint32_t* fields[] = {
+        &report->baudrate, &report->tx_bytes, &report->tx_us, &report->rx_bytes,
+        &report->rx_us, &report->checked_bytes, &report->bit_errors,
+        &report->byte_errors, &report->resyncs, &report->overruns, &report->line_errors,
+    };
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++, p += 4) {
+        *fields[i] = get_u32(p);
+    }
+    report->tx_high_water = get_u16(p);
+    report->rx_high_water = get_u16(p + 2);
+}
+
+static void set_selftest(libusb_device_handle* handle, uint16_t intf, uint32_t baudrate,
+                         uint32_t max_baudrate, uint16_t duration_ms, uint8_t mode) {
+    uint8_t buf[SELFTEST_PARAMS_SIZE];
+    put_u32(&buf[0], baudrate);
+    put_u32(&buf[4], max_baudrate);
+    buf[8] = (uint8_t)duration_ms;
+    buf[9] = (uint8_t)(duration_ms >> 8);
+    buf[10] = mode;
+    buf[11] = 0;
+
+    int rc = libusb_control_transfer(handle, REQ_OUT, CDC_VENDOR_REQ_SET_SELFTEST, 0, intf,
+                                     buf, sizeof(buf), CONTROL_TIMEOUT_MS);
+    if (rc == LIBUSB_ERROR_PIPE && mode != 0) {
+        fprintf(stderr, "self-test refused; the port may be busy, or the mode or rate"
+                        " unsupported\n");
+        exit(1);
+    } else if (rc < 0) {
+        die_usb("self-test request", rc);
+    }
+}
+
+static double rate(uint32_t bytes, uint32_t us) {
+    return us ? bytes * 1e6 / us : 0.0;
+}
+
+static void print_step(const struct report* r) {
+    double ber = r->checked_bytes ? (double)r->bit_errors / (8.0 * r->checked_bytes) : 0.0;
+    printf("%8u %9u %9.0f %9u %9.0f %9.2e %7u %7u %6u %5u/%-5u\n", r->baudrate,
+           r->tx_bytes, rate(r->tx_bytes, r->tx_us), r->rx_bytes, rate(r->rx_bytes, r->rx_us),
+           ber, r->resyncs, r->overruns, r->line_errors, r->tx_high_water, r->rx_high_water);
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -d vid:pid   device to open (default 1209:0001)\n"
+            "  -i intf      CDC control interface of the port (default 0)\n"
+            "  -b baud      rate of the first step (default 115200)\n"
+            "  -m baud      sweep up to this rate\n"
+            "  -s ms        length of each step (default 1000)\n"
+            "  -x           external loopback; TX must be wired to RX\n"
+            "  -t           only send the pattern\n"
+            "  -r           only check received data\n", argv0);
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    uint16_t vid = 0x1209;
+    uint16_t pid = 0x0001;
+    uint16_t intf = 0;
+    uint32_t baudrate = 115200;
+    uint32_t max_baudrate = 0;
+    uint16_t duration_ms = 1000;
+    uint8_t mode = SELFTEST_TX | SELFTEST_RX | SELFTEST_INTERNAL;
+
+    int c;
+    while ((c = getopt(argc, argv, "d:i:b:m:s:xtr")) != -1) {
+        switch (c) {
+            case 'd': {
+                unsigned v, p;
+                if (sscanf(optarg, "%x:%x", &v, &p) != 2) {
+                    usage(argv[0]);
+                }
+                vid = v;
+                pid = p;
+                break;
+            }
+            case 'i': intf = strtoul(optarg, NULL, 0); break;
+            case 'b': baudrate = strtoul(optarg, NULL, 0); break;
+            case 'm': max_baudrate = strtoul(optarg, NULL, 0); break;
+            case 's': duration_ms = strtoul(optarg, NULL, 0); break;
+            case 'x': mode = SELFTEST_TX | SELFTEST_RX; break;
+            case 't': mode = SELFTEST_TX; break;
+            case 'r': mode = SELFTEST_RX; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || duration_ms == 0) {
+        usage(argv[0]);
+    }
+
+    int rc = libusb_init(NULL);
+    if (rc < 0) {
+        die_usb("libusb_init", rc);
+    }
+    libusb_device_handle* handle = libusb_open_device_with_vid_pid(NULL, vid, pid);
+    if (handle == NULL) {
+        fprintf(stderr, "no device %04x:%04x\n", vid, pid);
+        return 1;
+    }
+
+    set_selftest(handle, intf, baudrate, max_baudrate, duration_ms, mode);
+
+    printf("%8s %9s %9s %9s %9s %9s %7s %7s %6s %11s\n", "baud", "tx bytes", "tx B/s",
+           "rx bytes", "rx B/s", "BER", "resyncs", "overrun", "line", "high water");
+
+    struct report report;
+    unsigned printed = 0;
+    do {
+        usleep(POLL_INTERVAL_US);
+        read_step(handle, intf, 0, &report);
+        unsigned done = report.steps_done;
+        for (; printed < done; printed++) {
+            struct report step;
+            read_step(handle, intf, (uint8_t)printed, &step);
+            print_step(&step);
+            fflush(stdout);
+        }
+    } while (report.state == SELFTEST_RUNNING);
+
+    libusb_close(handle);
+    libusb_exit(NULL);
+    return 0;
+}
@@ -0,0 +1,477 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Throughput and latency benchmark for termlink's raw bulk interface,
+ * using libusb with a queue of asynchronous transfers in each direction
+ * so that the bus never idles waiting for the host.
+ *
+ *   rx       count bytes the bridge receives on its UART
+ *   tx       send a byte pattern out of the UART as fast as possible
+ *   loop     both at once, checking the pattern comes back intact
+ *   latency  round-trip time of single bytes
+ *
+ * loop and latency need the UART's TX and RX pins wired together.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libusb.h>
+
+/* Keep in sync with src/USB/raw.h */
+#define RAW_INTERFACE_SUBCLASS 0x54
+#define RAW_INTERFACE_PROTOCOL 0x01
+
+#define RAW_REQ_SET_OPEN          0x01
+#define RAW_OPEN                  (1 << 0)
+#define RAW_OPEN_FLUSH            (1 << 1)
+#define RAW_REQ_SET_LINE_CODING   0x03
+#define RAW_REQ_SET_LATENCY_TIMER 0x09
+#define RAW_REQ_GET_RX_STATS      0x20
+#define RAW_REQ_GET_STATS         0x21
+
+#define REQ_OUT (LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE)
+#define REQ_IN  (LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE)
+
+#define CONTROL_TIMEOUT_MS 1000
+#define MAX_QUEUE_DEPTH 64
+
+/* Period of the test pattern; prime so it never lines up with packets */
+#define PATTERN_PERIOD 251
+
+struct options {
+    uint16_t vid;
+    uint16_t pid;
+    uint32_t baudrate;
+    unsigned seconds;
+    unsigned queue_depth;
+    unsigned transfer_size;
+    unsigned samples;
+    uint16_t latency_timer;
+};
+
+struct bench {
+    libusb_device_handle* handle;
+    uint8_t interface;
+    uint8_t ep_in;
+    uint8_t ep_out;
+
+    bool stop;
+    bool verify;
+    int pending;
+
+    uint64_t in_bytes;
+    uint64_t out_bytes;
+    uint8_t tx_next;
+    uint8_t rx_next;
+    bool rx_synced;
+    uint64_t mismatches;
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void die_usb(const char* what, int rc) {
+    fprintf(stderr, "%s: %s\n", what, libusb_strerror(rc));
+    exit(1);
+}
+
+/* Find the interface with the raw bulk pipe in the active configuration */
+static bool find_raw_interface(libusb_device_handle* handle, struct bench* b) {
+    struct libusb_config_descriptor* config;
+    int rc = libusb_get_active_config_descriptor(libusb_get_device(handle), &config);
+    if (rc < 0) {
+        die_usb("libusb_get_active_config_descriptor", rc);
+    }
+
+    bool found = false;
+    for (int i = 0; i < config->bNumInterfaces && !found; i++) {
+        const struct libusb_interface_descriptor* intf = &config->interface[i].altsetting[0];
+        if (intf->bInterfaceClass != LIBUSB_CLASS_VENDOR_SPEC
+            || intf->bInterfaceSubClass != RAW_INTERFACE_SUBCLASS
+            || intf->bInterfaceProtocol != RAW_INTERFACE_PROTOCOL) {
+            continue;
+        }
+        b->interface = intf->bInterfaceNumber;
+        for (int e = 0; e < intf->bNumEndpoints; e++) {
+            uint8_t addr = intf->endpoint[e].bEndpointAddress;
+            if (addr & LIBUSB_ENDPOINT_IN) {
+                b->ep_in = addr;
+            } else {
+                b->ep_out = addr;
+            }
+        }
+        found = true;
+    }
+
+    libusb_free_config_descriptor(config);
+    return found;
+}
+
+static void vendor_out(struct bench* b, uint8_t request, uint16_t value,
+                       uint8_t* data, uint16_t len) {
+    int rc = libusb_control_transfer(b->handle, REQ_OUT, request, value, b->interface,
+                                     data, len, CONTROL_TIMEOUT_MS);
+    if (rc < 0) {
+        die_usb("vendor request", rc);
+    }
+}
+
+static void read_counters(struct bench* b, uint8_t request, uint32_t* counters, int count) {
+    uint8_t buf[4 * 8];
+    int rc = libusb_control_transfer(b->handle, REQ_IN, request, 0, b->interface,
+                                     buf, 4 * count, CONTROL_TIMEOUT_MS);
+    if (rc < 0) {
+        die_usb("vendor request", rc);
+    }
+    for (int i = 0; i < count; i++) {
+        counters[i] = (i * 4 + 3 < rc)
+                      ? (uint32_t)buf[i*4] | (uint32_t)buf[i*4+1] << 8
+                        | (uint32_t)buf[i*4+2] << 16 | (uint32_t)buf[i*4+3] << 24
+                      : 0;
+    }
+}
+
+static void set_line_coding(struct bench* b, uint32_t baudrate) {
+    /* struct usb_cdc_line_coding: 8N1 */
+    uint8_t coding[7] = {
+        baudrate & 0xFF, (baudrate >> 8) & 0xFF,
+        (baudrate >> 16) & 0xFF, (baudrate >> 24) & 0xFF,
+        0, 0, 8
+    };
+    vendor_out(b, RAW_REQ_SET_LINE_CODING, 0, coding, sizeof(coding));
+}
+
+static void fill_pattern(struct bench* b, uint8_t* buf, int len) {
+    for (int i = 0; i < len; i++) {
+        buf[i] = b->tx_next;
+        b->tx_next = (b->tx_next + 1) % PATTERN_PERIOD;
+    }
+}
+
+static void check_pattern(struct bench* b, const uint8_t* buf, int len) {
+    for (int i = 0; i < len; i++) {
+        if (b->rx_synced && buf[i] != b->rx_next) {
+            b->mismatches++;
+        }
+        b->rx_synced = true;
+        b->rx_next = (buf[i] + 1) % PATTERN_PERIOD;
+    }
+}
+
+static void LIBUSB_CALL on_transfer(struct libusb_transfer* xfer) {
+    struct bench* b = xfer->user_data;
+    bool in = (xfer->endpoint & LIBUSB_ENDPOINT_IN) != 0;
+
+    if (xfer->status == LIBUSB_TRANSFER_COMPLETED
+        || xfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+        if (in) {
+            b->in_bytes += xfer->actual_length;
+            if (b->verify) {
+                check_pattern(b, xfer->buffer, xfer->actual_length);
+            }
+        } else {
+            b->out_bytes += xfer->actual_length;
+            fill_pattern(b, xfer->buffer, xfer->length);
+        }
+    } else if (xfer->status != LIBUSB_TRANSFER_CANCELLED) {
+        fprintf(stderr, "%s transfer failed: %s\n", in ? "IN" : "OUT",
+                libusb_error_name(xfer->status));
+        b->stop = true;
+    }
+
+    if (!b->stop && libusb_submit_transfer(xfer) == 0) {
+        return;
+    }
+
+    b->pending--;
+}
+
+static void submit_queue(struct bench* b, uint8_t ep, struct libusb_transfer** xfers,
+                         const struct options* opts) {
+    for (unsigned i = 0; i < opts->queue_depth; i++) {
+        uint8_t* buf = malloc(opts->transfer_size);
+        xfers[i] = libusb_alloc_transfer(0);
+        if (buf == NULL || xfers[i] == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        /* IN transfers time out so that partial data is still counted */
+        libusb_fill_bulk_transfer(xfers[i], b->handle, ep, buf, opts->transfer_size,
+                                  on_transfer, b, (ep & LIBUSB_ENDPOINT_IN) ? 100 : 0);
+        if (!(ep & LIBUSB_ENDPOINT_IN)) {
+            fill_pattern(b, buf, opts->transfer_size);
+        }
+        int rc = libusb_submit_transfer(xfers[i]);
+        if (rc < 0) {
+            die_usb("libusb_submit_transfer", rc);
+        }
+        b->pending++;
+    }
+}
+
+static void run_stream(struct bench* b, const struct options* opts, bool do_in, bool do_out) {
+    struct libusb_transfer* in_xfers[MAX_QUEUE_DEPTH];
+    struct libusb_transfer* out_xfers[MAX_QUEUE_DEPTH];
+
+    if (do_in) {
+        submit_queue(b, b->ep_in, in_xfers, opts);
+    }
+    if (do_out) {
+        submit_queue(b, b->ep_out, out_xfers, opts);
+    }
+
+    double start = now_seconds();
+    double last = start;
+    uint64_t last_in = 0, last_out = 0;
+    while (!b->stop) {
+        struct timeval tv = {0, 100000};
+        libusb_handle_events_timeout(NULL, &tv);
+
+        double now = now_seconds();
+        if (now - last >= 1.0) {
+            printf("%6.1fs  in %8.1f KiB/s  out %8.1f KiB/s\n", now - start,
+                   (b->in_bytes - last_in) / (now - last) / 1024.0,
+                   (b->out_bytes - last_out) / (now - last) / 1024.0);
+            last = now;
+            last_in = b->in_bytes;
+            last_out = b->out_bytes;
+        }
+        if (now - start >= opts->seconds) {
+            b->stop = true;
+        }
+    }
+    double elapsed = now_seconds() - start;
+
+    for (unsigned i = 0; i < opts->queue_depth; i++) {
+        if (do_in) {
+            libusb_cancel_transfer(in_xfers[i]);
+        }
+        if (do_out) {
+            libusb_cancel_transfer(out_xfers[i]);
+        }
+    }
+    while (b->pending > 0) {
+        libusb_handle_events(NULL);
+    }
+    for (unsigned i = 0; i < opts->queue_depth; i++) {
+        if (do_in) {
+            free(in_xfers[i]->buffer);
+            libusb_free_transfer(in_xfers[i]);
+        }
+        if (do_out) {
+            free(out_xfers[i]->buffer);
+            libusb_free_transfer(out_xfers[i]);
+        }
+    }
+
+    printf("total    in %8.1f KiB/s  out %8.1f KiB/s over %.1fs\n",
+           b->in_bytes / elapsed / 1024.0, b->out_bytes / elapsed / 1024.0, elapsed);
+    if (opts->baudrate != 0) {
+        /* 10 bits per byte with 8N1 */
+        printf("line rate %.1f KiB/s\n", opts->baudrate / 10.0 / 1024.0);
+    }
+    if (b->verify) {
+        printf("pattern mismatches: %llu\n", (unsigned long long)b->mismatches);
+    }
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* Drain anything left over from earlier runs */
+static void drain_in(struct bench* b) {
+    uint8_t buf[64];
+    int got;
+    while (libusb_bulk_transfer(b->handle, b->ep_in, buf, sizeof(buf), &got, 50) == 0 && got > 0) {
+    }
+}
+
+static void run_latency(struct bench* b, const struct options* opts) {
+    double* samples = calloc(opts->samples, sizeof(double));
+    if (samples == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    drain_in(b);
+
+    unsigned count = 0;
+    for (unsigned i = 0; i < opts->samples; i++) {
+        uint8_t out = (uint8_t)i;
+        uint8_t in[64];
+        int got = 0;
+
+        double start = now_seconds();
+        int rc = libusb_bulk_transfer(b->handle, b->ep_out, &out, 1, &got, 1000);
+        if (rc < 0) {
+            die_usb("OUT transfer", rc);
+        }
+
+        bool echoed = false;
+        while (!echoed) {
+            rc = libusb_bulk_transfer(b->handle, b->ep_in, in, sizeof(in), &got, 1000);
+            if (rc == LIBUSB_ERROR_TIMEOUT) {
+                fprintf(stderr, "no echo for byte %u; is TX wired to RX?\n", i);
+                break;
+            } else if (rc < 0) {
+                die_usb("IN transfer", rc);
+            }
+            echoed = (got > 0 && in[got - 1] == out);
+        }
+        if (echoed) {
+            samples[count++] = (now_seconds() - start) * 1e6;
+        }
+    }
+
+    if (count > 0) {
+        qsort(samples, count, sizeof(double), compare_doubles);
+        double sum = 0;
+        for (unsigned i = 0; i < count; i++) {
+            sum += samples[i];
+        }
+        printf("round trip over %u samples (us): min %.0f  median %.0f  mean %.0f"
+               "  p99 %.0f  max %.0f\n", count, samples[0], samples[count / 2],
+               sum / count, samples[(count * 99) / 100], samples[count - 1]);
+    }
+    free(samples);
+}
+
+static void print_stats(struct bench* b) {
+    uint32_t raw[5], rx[5];
+    read_counters(b, RAW_REQ_GET_STATS, raw, 5);
+    read_counters(b, RAW_REQ_GET_RX_STATS, rx, 5);
+    printf("device: in %u bytes / %u packets, out %u bytes / %u packets, %u OUT stalls\n",
+           raw[0], raw[1], raw[2], raw[3], raw[4]);
+    printf("uart: %u overruns (%u bytes dropped), %u overrun, %u framing, %u parity errors\n",
+           rx[0], rx[1], rx[2], rx[3], rx[4]);
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s [options] rx|tx|loop|latency\n"
+            "  -d vid:pid   device to open (default 1209:0001)\n"
+            "  -b baud      set the UART baud rate, 8N1\n"
+            "  -t seconds   streaming test length (default 5)\n"
+            "  -q depth     transfers queued per direction (default 16)\n"
+            "  -s bytes     size of each transfer (default 4096)\n"
+            "  -n samples   latency samples (default 1000)\n"
+            "  -l ms        device latency timer (default 0)\n", argv0);
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    struct options opts = {
+        .vid = 0x1209,
+        .pid = 0x0001,
+        .baudrate = 0,
+        .seconds = 5,
+        .queue_depth = 16,
+        .transfer_size = 4096,
+        .samples = 1000,
+        .latency_timer = 0,
+    };
+
+    int c;
+    while ((c = getopt(argc, argv, "d:b:t:q:s:n:l:")) != -1) {
+        switch (c) {
+            case 'd': {
+                unsigned vid, pid;
+                if (sscanf(optarg, "%x:%x", &vid, &pid) != 2) {
+                    usage(argv[0]);
+                }
+                opts.vid = vid;
+                opts.pid = pid;
+                break;
+            }
+            case 'b': opts.baudrate = strtoul(optarg, NULL, 0); break;
+            case 't': opts.seconds = strtoul(optarg, NULL, 0); break;
+            case 'q': opts.queue_depth = strtoul(optarg, NULL, 0); break;
+            case 's': opts.transfer_size = strtoul(optarg, NULL, 0); break;
+            case 'n': opts.samples = strtoul(optarg, NULL, 0); break;
+            case 'l': opts.latency_timer = strtoul(optarg, NULL, 0); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || opts.queue_depth == 0 || opts.queue_depth > MAX_QUEUE_DEPTH
+        || opts.transfer_size == 0) {
+        usage(argv[0]);
+    }
+    const char* mode = argv[optind];
+
+    int rc = libusb_init(NULL);
+    if (rc < 0) {
+        die_usb("libusb_init", rc);
+    }
+
+    struct bench b;
+    memset(&b, 0, sizeof(b));
+    b.handle = libusb_open_device_with_vid_pid(NULL, opts.vid, opts.pid);
+    if (b.handle == NULL) {
+        fprintf(stderr, "no device %04x:%04x\n", opts.vid, opts.pid);
+        return 1;
+    }
+    if (!find_raw_interface(b.handle, &b)) {
+        fprintf(stderr, "device has no raw bulk interface\n");
+        return 1;
+    }
+    libusb_set_auto_detach_kernel_driver(b.handle, 1);
+    rc = libusb_claim_interface(b.handle, b.interface);
+    if (rc < 0) {
+        die_usb("libusb_claim_interface", rc);
+    }
+
+    vendor_out(&b, RAW_REQ_SET_OPEN, RAW_OPEN | RAW_OPEN_FLUSH, NULL, 0);
+    vendor_out(&b, RAW_REQ_SET_LATENCY_TIMER, opts.latency_timer, NULL, 0);
+    if (opts.baudrate != 0) {
+        set_line_coding(&b, opts.baudrate);
+    }
+
+    if (strcmp(mode, "rx") == 0) {
+        run_stream(&b, &opts, true, false);
+    } else if (strcmp(mode, "tx") == 0) {
+        run_stream(&b, &opts, false, true);
+    } else if (strcmp(mode, "loop") == 0) {
+        b.verify = true;
+        run_stream(&b, &opts, true, true);
+    } else if (strcmp(mode, "latency") == 0) {
+        run_latency(&b, &opts);
+    } else {
+        usage(argv[0]);
+    }
+
+    print_stats(&b);
+
+    vendor_out(&b, RAW_REQ_SET_OPEN, 0, NULL, 0);
+    libusb_release_interface(b.handle, b.interface);
+    libusb_close(b.handle);
+    libusb_exit(NULL);
+    return 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2016, Devan Lai
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Host microbenchmark comparing the byte-at-a-time console ring buffers
+ * that console.c used to have against the span-based ring in ring.c.
+ * Each round moves one 64-byte USB packet into a ring and back out; RX
+ * rounds include a memcpy() standing in for the DMA channel.
+ *
+ * Cycle counts come from the host's timestamp counter, so they are only
+ * meaningful relative to each other, not as Cortex-M cycle counts.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#include "ring.h"
+
+#define PACKET_SIZE 64
+#define TX_BUFFER_SIZE 512
+#define RX_BUFFER_SIZE 4096
+#define ROUNDS 2000000
+
+static uint64_t read_cycles(void) {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+/* The old TX ring: unmasked 16-bit head/tail, one byte at a time */
+static volatile uint8_t old_tx_buffer[TX_BUFFER_SIZE];
+static volatile uint16_t old_tx_head = 0;
+static volatile uint16_t old_tx_tail = 0;
+
+static size_t old_send_buffered(const uint8_t* data, size_t num_bytes) {
+    size_t bytes_written = 0;
+    while (((uint16_t)(old_tx_tail - old_tx_head) != TX_BUFFER_SIZE) && (bytes_written < num_bytes)) {
+        old_tx_buffer[old_tx_tail % TX_BUFFER_SIZE] = data[bytes_written++];
+        old_tx_tail++;
+    }
+    return bytes_written;
+}
+
+static uint8_t old_tx_get(void) {
+    uint8_t data = old_tx_buffer[old_tx_head % TX_BUFFER_SIZE];
+    old_tx_head++;
+    return data;
+}
+
+/* The old RX ring: wrapped head chasing a DMA-driven tail */
+static volatile uint8_t old_rx_buffer[RX_BUFFER_SIZE];
+static uint16_t old_rx_head = 0;
+static volatile uint16_t old_rx_tail = 0;
+
+static size_t old_recv_buffered(uint8_t* data, size_t max_bytes) {
+    size_t bytes_read = 0;
+    uint16_t tail = old_rx_tail;
+    if (old_rx_head > tail) {
+        while (old_rx_head < RX_BUFFER_SIZE && bytes_read < max_bytes) {
+            data[bytes_read++] = old_rx_buffer[old_rx_head++];
+        }
+        if (old_rx_head == RX_BUFFER_SIZE) {
+            old_rx_head = 0;
+        }
+    }
+
+    if ((bytes_read < max_bytes) && (old_rx_head < tail)) {
+        while (old_rx_head < tail && bytes_read < max_bytes) {
+            data[bytes_read++] = old_rx_buffer[old_rx_head++];
+        }
+        if (old_rx_head == RX_BUFFER_SIZE) {
+            old_rx_head = 0;
+        }
+    }
+    return bytes_read;
+}
+
+/*
+ * Stand-in for the DMA channel writing into the old RX ring. Packets
+ * evenly divide the ring, so they never wrap.
+ */
+static void old_rx_dma_write(const uint8_t* data, size_t len) {
+    memcpy((uint8_t*)&old_rx_buffer[old_rx_tail], data, len);
+    old_rx_tail = (old_rx_tail + len) % RX_BUFFER_SIZE;
+}
+
+RING_DEFINE(tx_ring, TX_BUFFER_SIZE);
+RING_DEFINE(rx_ring, RX_BUFFER_SIZE);
+
+static uint8_t packet[PACKET_SIZE];
+static uint8_t output[PACKET_SIZE];
+static volatile uint32_t sink;
+
+static void report(const char* name, uint64_t cycles) {
+    double per_byte = (double)cycles / ((double)ROUNDS * PACKET_SIZE);
+    printf("%-36s %8.3f %s/byte\n", name, per_byte,
+#ifdef HAVE_RDTSC
+           "cycles"
+#else
+           "ns"
+#endif
+           );
+}
+
+int main(void) {
+    uint32_t i, j;
+    uint64_t start;
+
+    for (i=0; i < PACKET_SIZE; i++) {
+        packet[i] = (uint8_t)(i * 7 + 1);
+    }
+
+    /* TX: USB packet in, drained a byte at a time by the TXE ISR */
+    start = read_cycles();
+    for (i=0; i < ROUNDS; i++) {
+        old_send_buffered(packet, PACKET_SIZE);
+        for (j=0; j < PACKET_SIZE; j++) {
+            sink += old_tx_get();
+        }
+    }
+    report("old TX put/get per byte", read_cycles() - start);
+
+    start = read_cycles();
+    for (i=0; i < ROUNDS; i++) {
+        ring_write(&tx_ring, packet, PACKET_SIZE);
+        for (j=0; j < PACKET_SIZE; j++) {
+            uint8_t data = 0;
+            ring_get(&tx_ring, &data);
+            sink += data;
+        }
+    }
+    report("ring TX write/get per byte", read_cycles() - start);
+
+    /* TX: USB packet in, drained as spans by DMA */
+    start = read_cycles();
+    for (i=0; i < ROUNDS; i++) {
+        struct ring_span spans[2];
+        ring_reserve(&tx_ring, spans);
+        size_t first = (spans[0].len < PACKET_SIZE) ? spans[0].len : PACKET_SIZE;
+        memcpy(spans[0].data, packet, first);
+        memcpy(spans[1].data, &packet[first], PACKET_SIZE - first);
+        ring_commit(&tx_ring, PACKET_SIZE);
+
+        size_t queued = ring_peek(&tx_ring, spans);
+        sink += spans[0].data[0];
+        ring_consume(&tx_ring, queued);
+    }
+    report("ring TX reserve/commit, DMA drain", read_cycles() - start);
+
+    /* RX: DMA fills the ring, one USB packet out */
+    start = read_cycles();
+    for (i=0; i < ROUNDS; i++) {
+        old_rx_dma_write(packet, PACKET_SIZE);
+        sink += old_recv_buffered(output, PACKET_SIZE);
+    }
+    report("old RX recv_buffered", read_cycles() - start);
+
+    start = read_cycles();
+    for (i=0; i < ROUNDS; i++) {
+        struct ring_span spans[2];
+        ring_reserve(&rx_ring, spans);
+        memcpy(spans[0].data, packet, PACKET_SIZE);
+        ring_commit(&rx_ring, PACKET_SIZE);
+        sink += ring_read(&rx_ring, output, PACKET_SIZE);
+    }
+    report("ring RX read", read_cycles() - start);
+
+    start = read_cycles();
+    for (i=0; i < ROUNDS; i++) {
+        struct ring_span spans[2];
+        ring_reserve(&rx_ring, spans);
+        memcpy(spans[0].data, packet, PACKET_SIZE);
+        ring_commit(&rx_ring, PACKET_SIZE);
+        size_t len = ring_peek(&rx_ring, spans);
+        sink += spans[0].data[0];
+        ring_consume(&rx_ring, len);
+    }
+    report("ring RX peek/consume (zero-copy)", read_cycles() - start);
+
+    return (sink == 0xFFFFFFFF) ? EXIT_FAILURE : EXIT_SUCCESS;
+}